@@ -50,7 +50,7 @@ List *listDup(List *orig) {
   copy->dup = orig->dup;
   copy->free = orig->free;
   copy->match = orig->match;
-  iter = (orig, AL_START_HEAD);
+  iter = listGetIterator(orig, AL_START_HEAD);
   while ((node = listNext(iter)) != NULL) {
     void *value;
     if (copy->dup) {
@@ -73,7 +73,7 @@ List *listDup(List *orig) {
   return copy;
 }
 
-ListNode *listNode(ListIter *iter) {
+ListNode *listNext(ListIter *iter) {
   ListNode *current = iter->next;
   if (current != NULL) {
     if (iter->direction == AL_START_HEAD)
@@ -94,7 +94,7 @@ void listRewindTail(List *list, ListIter *iter) {
   iter->direction = AL_START_TAIL;
 }
 
-void listReleaseIterator(ListIter *iter) { z_free(iter); }
+void listReleaseIterator(ListIter *iter) { zfree(iter); }
 
 ListIter *listGetIterator(List *list, int direction) {
   ListIter *iter;
@@ -117,7 +117,7 @@ void listDelNode(List *list, ListNode *node) {
   else
     list->tail = node->prev;
   if (list->free) list->free(node->value);
-  z_free(node);
+  zfree(node);
   list->len--;
 }
 
@@ -128,13 +128,11 @@ void listRelease(List *l) {
   len = l->len;
   while (len--) {
     next = current->next;
-    if (l->free) {
-      l->free(current->next);
-      z_free(current);
-      current = next;
-    }
+    if (l->free) l->free(current->value);
+    zfree(current);
+    current = next;
   }
-  z_free(l);
+  zfree(l);
 }
 
 List *listCreate(void) {
@@ -180,6 +178,7 @@ List *listAddNodeTail(List *list, void *value) {
     list->tail->next = node;
     list->tail = node;
   }
+  list->len++;
   return list;
 }
 
@@ -0,0 +1,637 @@
+#include "ae.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "zmalloc.h"
+
+/* Both backends are edge triggered: the kernel reports a readiness change
+ * once, and the loop remembers it in fe->ready until the handler hits
+ * EAGAIN and calls aeFileEventDrained(). An fd stays on eventLoop->pending
+ * while it is ready for an event somebody listens to, so installing a
+ * write handler on a writable socket fires without a syscall.
+ *
+ * Only handlers registered with AE_DRAINS make that promise. After any
+ * other handler ran, the loop polls its fd to learn whether it is still
+ * ready, so an accept handler stopping after a fixed number of accepts
+ * neither keeps the loop spinning nor loses the connections left. */
+
+static void aeQueueReady(aeEventLoop *eventLoop, int fd) {
+    aeFileEvent *fe = &eventLoop->events[fd];
+    if (fe->queued || !(fe->ready & fe->mask)) return;
+    fe->queued = 1;
+    eventLoop->pending[eventLoop->npending++] = fd;
+}
+
+static void aeSetReady(aeEventLoop *eventLoop, int fd, int mask) {
+    if (eventLoop->events[fd].mask == AE_NONE) return;
+    eventLoop->events[fd].ready |= mask;
+    aeQueueReady(eventLoop, fd);
+}
+
+static void aeProbeReady(aeEventLoop *eventLoop, int fd, int mask) {
+    aeFileEvent *fe = &eventLoop->events[fd];
+    struct pollfd pfd;
+    int still = AE_NONE;
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (mask & AE_READABLE) pfd.events |= POLLIN;
+    if (mask & AE_WRITABLE) pfd.events |= POLLOUT;
+    eventLoop->apicalls++;
+    if (poll(&pfd, 1, 0) != 1) pfd.revents = 0;
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) still |= AE_READABLE;
+    if (pfd.revents & (POLLOUT | POLLERR | POLLHUP)) still |= AE_WRITABLE;
+    fe->ready = (fe->ready & ~mask) | (still & mask);
+}
+
+/* Moves the pending fds to the fired array, dropping the ones that are
+ * no longer ready or no longer watched. */
+static int aeCollectReady(aeEventLoop *eventLoop) {
+    int j, kept = 0, numevents = 0;
+    for (j = 0; j < eventLoop->npending; j++) {
+        int fd = eventLoop->pending[j];
+        aeFileEvent *fe = &eventLoop->events[fd];
+        int mask = fe->ready & fe->mask;
+        if (mask == AE_NONE) {
+            fe->queued = 0;
+            continue;
+        }
+        eventLoop->pending[kept++] = fd;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    eventLoop->npending = kept;
+    return numevents;
+}
+
+/* A backend, picked by aeCreateEventLoop(). With io_uring compiled in,
+ * the kernel may still refuse it (disabled by sysctl or seccomp, or
+ * lacking a feature), and the loop then runs on epoll. */
+typedef struct aeApi {
+    char *name;
+    int (*create)(aeEventLoop *eventLoop);
+    int (*resize)(aeEventLoop *eventLoop, int setsize);
+    void (*free)(aeEventLoop *eventLoop);
+    int (*addEvent)(aeEventLoop *eventLoop, int fd, int mask);
+    void (*delEvent)(aeEventLoop *eventLoop, int fd, int delmask);
+    int (*poll)(aeEventLoop *eventLoop, struct timeval *tvp);
+} aeApi;
+
+#ifdef HAVE_IO_URING
+#include "ae_iouring.c"
+#endif
+#include "ae_epoll.c"
+
+static const aeApi *aeApis[] = {
+#ifdef HAVE_IO_URING
+    &aeUringApi,
+#endif
+    &aeEpollApi
+};
+
+aeEventLoop *aeCreateEventLoop(int setsize) {
+    aeEventLoop *eventLoop;
+    int i;
+    if ((eventLoop = zmalloc(sizeof(*eventLoop))) == NULL) goto err;
+    eventLoop->events = zmalloc(sizeof(aeFileEvent) * setsize);
+    eventLoop->fired = zmalloc(sizeof(aeFiredEvent) * setsize);
+    eventLoop->pending = zmalloc(sizeof(int) * setsize);
+    eventLoop->timeEventHeap =
+            zmalloc(sizeof(aeTimeEvent *) * AE_TIME_EVENTS_INITIAL_SIZE);
+    eventLoop->timeEventTable =
+            zmalloc(sizeof(aeTimeEvent *) * AE_TIME_EVENTS_INITIAL_SIZE);
+    if (eventLoop->events == NULL || eventLoop->fired == NULL ||
+        eventLoop->pending == NULL || eventLoop->timeEventHeap == NULL ||
+        eventLoop->timeEventTable == NULL)
+        goto err;
+    eventLoop->setsize = setsize;
+    eventLoop->lastTime = time(NULL);
+    eventLoop->timeEventNextId = 0;
+    eventLoop->timeEvents = 0;
+    eventLoop->timeEventTableSize = AE_TIME_EVENTS_INITIAL_SIZE;
+    memset(eventLoop->timeEventTable, 0,
+           sizeof(aeTimeEvent *) * AE_TIME_EVENTS_INITIAL_SIZE);
+    eventLoop->stop = 0;
+    eventLoop->maxfd = -1;
+    eventLoop->beforeSleep = NULL;
+    eventLoop->npending = 0;
+    eventLoop->apicalls = 0;
+    for (i = 0; i < setsize; i++) {
+        eventLoop->events[i].mask = AE_NONE;
+        eventLoop->events[i].ready = AE_NONE;
+        eventLoop->events[i].queued = 0;
+    }
+    for (i = 0; i < (int) (sizeof(aeApis) / sizeof(aeApis[0])); i++) {
+        if (aeApis[i]->create(eventLoop) == 0) {
+            eventLoop->api = aeApis[i];
+            return eventLoop;
+        }
+    }
+    goto err;
+err:
+    if (eventLoop) {
+        zfree(eventLoop->events);
+        zfree(eventLoop->fired);
+        zfree(eventLoop->pending);
+        zfree(eventLoop->timeEventHeap);
+        zfree(eventLoop->timeEventTable);
+        zfree(eventLoop);
+    }
+    return NULL;
+}
+
+int aeGetSetSize(aeEventLoop *eventLoop) {
+    return eventLoop->setsize;
+}
+
+int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
+    int i;
+    if (setsize == eventLoop->setsize) return AE_OK;
+    if (eventLoop->maxfd >= setsize) return AE_ERR;
+    if (eventLoop->api->resize(eventLoop, setsize) == -1) return AE_ERR;
+    eventLoop->events = zre_alloc(eventLoop->events, sizeof(aeFileEvent) * setsize);
+    eventLoop->fired = zre_alloc(eventLoop->fired, sizeof(aeFiredEvent) * setsize);
+    eventLoop->pending = zre_alloc(eventLoop->pending, sizeof(int) * setsize);
+    eventLoop->setsize = setsize;
+    for (i = eventLoop->maxfd + 1; i < setsize; i++) {
+        eventLoop->events[i].mask = AE_NONE;
+        eventLoop->events[i].ready = AE_NONE;
+        eventLoop->events[i].queued = 0;
+    }
+    return AE_OK;
+}
+
+void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+    eventLoop->api->free(eventLoop);
+    for (j = 0; j < eventLoop->timeEvents; j++) zfree(eventLoop->timeEventHeap[j]);
+    zfree(eventLoop->events);
+    zfree(eventLoop->fired);
+    zfree(eventLoop->pending);
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventTable);
+    zfree(eventLoop);
+}
+
+void aeStop(aeEventLoop *eventLoop) {
+    eventLoop->stop = 1;
+}
+
+int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
+                      aeFileProc *proc, void *clientData) {
+    aeFileEvent *fe;
+    int drains;
+    if (fd >= eventLoop->setsize) {
+        errno = ERANGE;
+        return AE_ERR;
+    }
+    fe = &eventLoop->events[fd];
+    drains = mask & AE_DRAINS;
+    mask &= ~AE_DRAINS;
+    if (fe->mask == AE_NONE) fe->ready = fe->drains = AE_NONE;
+    if (eventLoop->api->addEvent(eventLoop, fd, mask) == -1) return AE_ERR;
+    fe->mask |= mask;
+    fe->drains = drains ? fe->drains | mask : fe->drains & ~mask;
+    if (mask & AE_READABLE) fe->rfileProc = proc;
+    if (mask & AE_WRITABLE) fe->wfileProc = proc;
+    fe->clientData = clientData;
+    if (fd > eventLoop->maxfd) eventLoop->maxfd = fd;
+    aeQueueReady(eventLoop, fd);
+    return AE_OK;
+}
+
+void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeFileEvent *fe;
+    if (fd >= eventLoop->setsize) return;
+    fe = &eventLoop->events[fd];
+    if (fe->mask == AE_NONE) return;
+    eventLoop->api->delEvent(eventLoop, fd, mask);
+    fe->mask = fe->mask & (~mask);
+    if (fe->mask == AE_NONE) fe->ready = AE_NONE;
+    if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
+        int j;
+        for (j = eventLoop->maxfd - 1; j >= 0; j--)
+            if (eventLoop->events[j].mask != AE_NONE) break;
+        eventLoop->maxfd = j;
+    }
+}
+
+int aeGetFileEvents(aeEventLoop *eventLoop, int fd, int mask) {
+    AE_NOT_USED(mask);
+    if (fd >= eventLoop->setsize) return 0;
+    return eventLoop->events[fd].mask;
+}
+
+/* Handlers call this when read() or write() returned EAGAIN or moved less
+ * than asked: the next edge from the kernel marks the fd ready again. */
+void aeFileEventDrained(aeEventLoop *eventLoop, int fd, int mask) {
+    if (fd >= eventLoop->setsize) return;
+    eventLoop->events[fd].ready &= ~mask;
+}
+
+static void aeGetTime(long *seconds, long *milliseconds) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    *seconds = tv.tv_sec;
+    *milliseconds = tv.tv_usec / 1000;
+}
+
+static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
+    long cur_sec, cur_ms, when_sec, when_ms;
+    aeGetTime(&cur_sec, &cur_ms);
+    when_sec = cur_sec + milliseconds / 1000;
+    when_ms = cur_ms + milliseconds % 1000;
+    if (when_ms >= 1000) {
+        when_sec++;
+        when_ms -= 1000;
+    }
+    *sec = when_sec;
+    *ms = when_ms;
+}
+
+/* Time events live in a binary min-heap ordered by deadline, so the
+ * nearest timer is the root and expiring one costs O(log n). A chained
+ * table indexed by id, linked through te->next, finds an event for
+ * aeDeleteTimeEvent() without scanning the heap. */
+
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when_sec < b->when_sec ||
+           (a->when_sec == b->when_sec && a->when_ms < b->when_ms);
+}
+
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int idx, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[idx] = te;
+    te->heapidx = idx;
+}
+
+static void aeTimeHeapUp(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[idx];
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (!aeTimeEventBefore(te, eventLoop->timeEventHeap[parent])) break;
+        aeTimeHeapSet(eventLoop, idx, eventLoop->timeEventHeap[parent]);
+        idx = parent;
+    }
+    aeTimeHeapSet(eventLoop, idx, te);
+}
+
+static void aeTimeHeapDown(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[idx];
+    int n = eventLoop->timeEvents;
+    while (1) {
+        int child = idx * 2 + 1;
+        if (child >= n) break;
+        if (child + 1 < n && aeTimeEventBefore(eventLoop->timeEventHeap[child + 1],
+                                               eventLoop->timeEventHeap[child]))
+            child++;
+        if (!aeTimeEventBefore(eventLoop->timeEventHeap[child], te)) break;
+        aeTimeHeapSet(eventLoop, idx, eventLoop->timeEventHeap[child]);
+        idx = child;
+    }
+    aeTimeHeapSet(eventLoop, idx, te);
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int idx = te->heapidx;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEvents];
+    if (last == te) return;
+    aeTimeHeapSet(eventLoop, idx, last);
+    aeTimeHeapUp(eventLoop, idx);
+    aeTimeHeapDown(eventLoop, last->heapidx);
+}
+
+static void aeTimeTableAdd(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    unsigned long slot;
+    if ((unsigned long) eventLoop->timeEvents >= eventLoop->timeEventTableSize) {
+        unsigned long size = eventLoop->timeEventTableSize * 2, j;
+        aeTimeEvent **table = zmalloc(sizeof(aeTimeEvent *) * size);
+        memset(table, 0, sizeof(aeTimeEvent *) * size);
+        for (j = 0; j < eventLoop->timeEventTableSize; j++) {
+            aeTimeEvent *cur = eventLoop->timeEventTable[j], *next;
+            while (cur) {
+                next = cur->next;
+                cur->next = table[cur->id & (size - 1)];
+                table[cur->id & (size - 1)] = cur;
+                cur = next;
+            }
+        }
+        zfree(eventLoop->timeEventTable);
+        eventLoop->timeEventTable = table;
+        eventLoop->timeEventTableSize = size;
+        eventLoop->timeEventHeap =
+                zre_alloc(eventLoop->timeEventHeap, sizeof(aeTimeEvent *) * size);
+    }
+    slot = te->id & (eventLoop->timeEventTableSize - 1);
+    te->next = eventLoop->timeEventTable[slot];
+    eventLoop->timeEventTable[slot] = te;
+}
+
+static aeTimeEvent *aeTimeTableUnlink(aeEventLoop *eventLoop, long long id) {
+    unsigned long slot = id & (eventLoop->timeEventTableSize - 1);
+    aeTimeEvent *te = eventLoop->timeEventTable[slot], *prev = NULL;
+    while (te) {
+        if (te->id == id) {
+            if (prev == NULL)
+                eventLoop->timeEventTable[slot] = te->next;
+            else
+                prev->next = te->next;
+            return te;
+        }
+        prev = te;
+        te = te->next;
+    }
+    return NULL;
+}
+
+static aeTimeEvent *aeTimeTableFind(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent *te = eventLoop->timeEventTable[id & (eventLoop->timeEventTableSize - 1)];
+    while (te && te->id != id) te = te->next;
+    return te;
+}
+
+long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
+                            aeTimeProc *proc, void *clientData,
+                            aeEventFinalizerProc *finalizerProc) {
+    long long id = eventLoop->timeEventNextId++;
+    aeTimeEvent *te;
+    te = zmalloc(sizeof(*te));
+    if (te == NULL) return AE_ERR;
+    te->id = id;
+    aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
+    te->timeProc = proc;
+    te->finalizerProc = finalizerProc;
+    te->clientData = clientData;
+    aeTimeTableAdd(eventLoop, te);
+    aeTimeHeapSet(eventLoop, eventLoop->timeEvents++, te);
+    aeTimeHeapUp(eventLoop, te->heapidx);
+    return id;
+}
+
+int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent *te = aeTimeTableUnlink(eventLoop, id);
+    if (te == NULL) return AE_ERR;
+    aeTimeHeapRemove(eventLoop, te);
+    if (te->finalizerProc) te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
+    return AE_OK;
+}
+
+static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop) {
+    return eventLoop->timeEvents ? eventLoop->timeEventHeap[0] : NULL;
+}
+
+/* Events created while processing are not run in the same call, as
+ * before: the loop stops at the first one and picks it up next time. */
+static int processTimeEvents(aeEventLoop *eventLoop) {
+    int processed = 0, j;
+    long long maxId;
+    time_t now = time(NULL);
+    if (now < eventLoop->lastTime) {
+        for (j = 0; j < eventLoop->timeEvents; j++)
+            eventLoop->timeEventHeap[j]->when_sec = 0;
+        for (j = eventLoop->timeEvents / 2 - 1; j >= 0; j--)
+            aeTimeHeapDown(eventLoop, j);
+    }
+    eventLoop->lastTime = now;
+    maxId = eventLoop->timeEventNextId - 1;
+    while (eventLoop->timeEvents) {
+        aeTimeEvent *te = eventLoop->timeEventHeap[0];
+        long now_sec, now_ms;
+        long long id = te->id;
+        int retval;
+        if (id > maxId) break;
+        aeGetTime(&now_sec, &now_ms);
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms))
+            break;
+        retval = te->timeProc(eventLoop, id, te->clientData);
+        processed++;
+        if ((te = aeTimeTableFind(eventLoop, id)) == NULL) continue;
+        if (retval != AE_NO_MORE) {
+            aeAddMillisecondsToNow(retval, &te->when_sec, &te->when_ms);
+            aeTimeHeapDown(eventLoop, te->heapidx);
+            aeTimeHeapUp(eventLoop, te->heapidx);
+        } else {
+            aeDeleteTimeEvent(eventLoop, id);
+        }
+    }
+    return processed;
+}
+
+int aeProcessEvents(aeEventLoop *eventLoop, int flags) {
+    int processed = 0, numevents;
+    if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
+    if (eventLoop->maxfd != -1 ||
+        ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
+        int j;
+        aeTimeEvent *shortest = NULL;
+        struct timeval tv, *tvp;
+        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
+            shortest = aeSearchNearestTimer(eventLoop);
+        if (shortest) {
+            long now_sec, now_ms;
+            aeGetTime(&now_sec, &now_ms);
+            tvp = &tv;
+            tvp->tv_sec = shortest->when_sec - now_sec;
+            if (shortest->when_ms < now_ms) {
+                tvp->tv_usec = ((shortest->when_ms + 1000) - now_ms) * 1000;
+                tvp->tv_sec--;
+            } else {
+                tvp->tv_usec = (shortest->when_ms - now_ms) * 1000;
+            }
+            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
+            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+        } else {
+            if (flags & AE_DONT_WAIT) {
+                tv.tv_sec = tv.tv_usec = 0;
+                tvp = &tv;
+            } else {
+                tvp = NULL;
+            }
+        }
+        numevents = eventLoop->api->poll(eventLoop, tvp);
+        for (j = 0; j < numevents; j++) {
+            aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
+            int mask = eventLoop->fired[j].mask;
+            int fd = eventLoop->fired[j].fd;
+            int rfired = 0, probe;
+            if (fe->mask & mask & AE_READABLE) {
+                rfired = 1;
+                fe->rfileProc(eventLoop, fd, fe->clientData, mask);
+            }
+            if (fe->mask & mask & AE_WRITABLE) {
+                if (!rfired || fe->wfileProc != fe->rfileProc)
+                    fe->wfileProc(eventLoop, fd, fe->clientData, mask);
+            }
+            probe = mask & fe->mask & fe->ready & ~fe->drains;
+            if (probe) aeProbeReady(eventLoop, fd, probe);
+            processed++;
+        }
+    }
+    if (flags & AE_TIME_EVENTS) processed += processTimeEvents(eventLoop);
+    return processed;
+}
+
+int aeWait(int fd, int mask, long long milliseconds) {
+    struct pollfd pfd;
+    int retmask = 0, retval;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = fd;
+    if (mask & AE_READABLE) pfd.events |= POLLIN;
+    if (mask & AE_WRITABLE) pfd.events |= POLLOUT;
+    if ((retval = poll(&pfd, 1, milliseconds)) == 1) {
+        if (pfd.revents & POLLIN) retmask |= AE_READABLE;
+        if (pfd.revents & POLLOUT) retmask |= AE_WRITABLE;
+        if (pfd.revents & POLLERR) retmask |= AE_WRITABLE;
+        if (pfd.revents & POLLHUP) retmask |= AE_WRITABLE;
+        return retmask;
+    } else {
+        return retval;
+    }
+}
+
+void aeMain(aeEventLoop *eventLoop) {
+    eventLoop->stop = 0;
+    while (!eventLoop->stop) {
+        if (eventLoop->beforeSleep != NULL) eventLoop->beforeSleep(eventLoop);
+        aeProcessEvents(eventLoop, AE_ALL_EVENT);
+    }
+}
+
+char *aeGetApiName(aeEventLoop *eventLoop) {
+    return eventLoop->api->name;
+}
+
+void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforeSleep) {
+    eventLoop->beforeSleep = beforeSleep;
+}
+
+#ifdef AE_BENCHMARK_MAIN
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/* Ping-pong over socketpairs the way the server answers clients: read
+ * the query, install a write handler, write the reply and remove the
+ * handler again. Reports ops/sec spent in aeProcessEvents() and the
+ * syscalls issued per op by the backend and by the handlers. */
+
+static long long benchOps, benchIO;
+
+static long long benchUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void benchWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    ssize_t n = write(fd, "+PONG\r\n", 7);
+    AE_NOT_USED(privdata);
+    AE_NOT_USED(mask);
+    benchIO++;
+    if (n == -1 && errno == EAGAIN) {
+        aeFileEventDrained(el, fd, AE_WRITABLE);
+        return;
+    }
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    benchOps++;
+}
+
+static void benchReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    AE_NOT_USED(privdata);
+    AE_NOT_USED(mask);
+    benchIO++;
+    if (n == -1 && errno == EAGAIN) {
+        aeFileEventDrained(el, fd, AE_READABLE);
+        return;
+    }
+    if (n <= 0) return;
+    if (n < (ssize_t) sizeof(buf)) aeFileEventDrained(el, fd, AE_READABLE);
+    aeCreateFileEvent(el, fd, AE_WRITABLE | AE_DRAINS, benchWriteHandler, NULL);
+}
+
+static void benchConnections(int conns, long long duration) {
+    aeEventLoop *el;
+    int *client = zmalloc(sizeof(int) * conns);
+    int *served = zmalloc(sizeof(int) * conns);
+    int j, batch = conns < 1000 ? conns : 1000, next = 0;
+    long long spent = 0, ops = 0, start;
+    char buf[64];
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t) conns * 2 + 64) {
+        rl.rlim_cur = (rlim_t) conns * 2 + 64;
+        if (rl.rlim_max < rl.rlim_cur || setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            printf("%d conns: skipped, needs %d fds\n", conns,
+                   conns * 2 + 64);
+            zfree(client);
+            zfree(served);
+            return;
+        }
+    }
+    el = aeCreateEventLoop(conns * 2 + 64);
+    for (j = 0; j < conns; j++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            exit(1);
+        }
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        aeCreateFileEvent(el, sv[0], AE_READABLE | AE_DRAINS, benchReadHandler, NULL);
+        served[j] = sv[0];
+        client[j] = sv[1];
+    }
+    aeProcessEvents(el, AE_FILE_EVENTS | AE_DONT_WAIT);
+    el->apicalls = 0;
+    benchOps = benchIO = 0;
+    start = benchUstime();
+    while (benchUstime() - start < duration) {
+        long long t;
+        for (j = 0; j < batch; j++)
+            if (write(client[(next + j) % conns], "PING\r\n", 6) != 6) exit(1);
+        t = benchUstime();
+        while (benchOps < ops + batch)
+            aeProcessEvents(el, AE_FILE_EVENTS | AE_DONT_WAIT);
+        spent += benchUstime() - t;
+        for (j = 0; j < batch; j++)
+            if (read(client[(next + j) % conns], buf, sizeof(buf)) != 7) exit(1);
+        ops += batch;
+        next = (next + batch) % conns;
+    }
+    printf("%s %d conns: %.0f ops/sec, %.3f backend + %.3f handler syscalls/op\n",
+           aeGetApiName(el), conns, (double) ops * 1000000 / (spent ? spent : 1),
+           (double) el->apicalls / ops, (double) benchIO / ops);
+    for (j = 0; j < conns; j++) {
+        aeDeleteFileEvent(el, served[j], AE_READABLE);
+        close(served[j]);
+        close(client[j]);
+    }
+    aeDeleteEventLoop(el);
+    zfree(client);
+    zfree(served);
+}
+
+int main(int argc, char **argv) {
+    long long duration = (argc > 1 ? atoll(argv[1]) : 1000) * 1000;
+    int j;
+    if (argc <= 2) {
+        benchConnections(1000, duration);
+        benchConnections(10000, duration);
+        benchConnections(50000, duration);
+    }
+    for (j = 2; j < argc; j++) benchConnections(atoi(argv[j]), duration);
+    return 0;
+}
+#endif
@@ -12,12 +12,15 @@
 #define AE_NONE 0
 #define AE_READABLE 1
 #define AE_WRITABLE 2
+/* The handler calls aeFileEventDrained() whenever it stops short of EAGAIN. */
+#define AE_DRAINS 4
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
 #define AE_ALL_EVENT (AE_FILE_EVENTS | AE_TIME_EVENTS)
 #define AE_DONT_WAIT 4
 #define AE_NO_MORE -1
 #define AE_NOT_USED(v) ((void)v)
+#define AE_TIME_EVENTS_INITIAL_SIZE 16
 
 struct aeEventLoop;
 
@@ -31,6 +34,9 @@ typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
 
 typedef struct aeFileEvent {
     int mask;
+    int ready;
+    int drains;
+    int queued;
     aeFileProc *rfileProc;
     aeFileProc *wfileProc;
     void *clientData;
@@ -44,6 +50,7 @@ typedef struct aeTimeEvent {
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
+    int heapidx;
     struct aeTimeEvent *next;
 
 } aeTimeEvent;
@@ -60,10 +67,17 @@ typedef struct aeEventLoop {
     time_t lastTime;
     aeFileEvent *events;
     aeFiredEvent *fired;
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap;
+    int timeEvents;
+    aeTimeEvent **timeEventTable;
+    unsigned long timeEventTableSize;
     int stop;
+    const struct aeApi *api;
     void *api_data;
     aeBeforeSleepProc *beforeSleep;
+    int *pending;
+    int npending;
+    long long apicalls;
 } aeEventLoop;
 
 aeEventLoop *aeCreateEventLoop(int setsize);
@@ -78,6 +92,8 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
 
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd, int mask);
 
+void aeFileEventDrained(aeEventLoop *eventLoop, int fd, int mask);
+
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds, aeTimeProc *proc, void *clientData,
                             aeEventFinalizerProc *finalizerProc);
 
@@ -89,7 +105,7 @@ int aeWait(int fd, int mask, long long milliseconds);
 
 void aeMain(aeEventLoop *eventLoop);
 
-char *aeGetApiName(void);
+char *aeGetApiName(aeEventLoop *eventLoop);
 
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforeSleep);
 
@@ -0,0 +1,83 @@
+#include <sys/epoll.h>
+
+/* Every fd is registered once, edge triggered, for both directions.
+ * Changing the mask afterwards never touches the kernel: ae.c filters the
+ * reported readiness against fe->mask. */
+
+typedef struct aeEpollState {
+    int epfd;
+    struct epoll_event *events;
+} aeEpollState;
+
+static int aeEpollCreate(aeEventLoop *eventLoop) {
+    aeEpollState *state = zmalloc(sizeof(aeEpollState));
+    if (!state) return -1;
+    state->events = zmalloc(sizeof(struct epoll_event) * eventLoop->setsize);
+    if (!state->events) {
+        zfree(state);
+        return -1;
+    }
+    state->epfd = epoll_create(1024);
+    if (state->epfd == -1) {
+        zfree(state->events);
+        zfree(state);
+        return -1;
+    }
+    eventLoop->api_data = state;
+    return 0;
+}
+
+static int aeEpollResize(aeEventLoop *eventLoop, int setsize) {
+    aeEpollState *state = eventLoop->api_data;
+    state->events = zre_alloc(state->events, sizeof(struct epoll_event) * setsize);
+    return 0;
+}
+
+static void aeEpollFree(aeEventLoop *eventLoop) {
+    aeEpollState *state = eventLoop->api_data;
+    close(state->epfd);
+    zfree(state->events);
+    zfree(state);
+}
+
+static int aeEpollAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeEpollState *state = eventLoop->api_data;
+    struct epoll_event ee = {0};
+    AE_NOT_USED(mask);
+    if (eventLoop->events[fd].mask != AE_NONE) return 0;
+    ee.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ee.data.fd = fd;
+    eventLoop->apicalls++;
+    if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, fd, &ee) == -1) return -1;
+    return 0;
+}
+
+static void aeEpollDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeEpollState *state = eventLoop->api_data;
+    struct epoll_event ee = {0};
+    if ((eventLoop->events[fd].mask & (~delmask)) != AE_NONE) return;
+    eventLoop->apicalls++;
+    epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+}
+
+static int aeEpollPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeEpollState *state = eventLoop->api_data;
+    int retval, j, timeout = -1;
+    if (tvp) timeout = tvp->tv_sec * 1000 + tvp->tv_usec / 1000;
+    if (eventLoop->npending) timeout = 0;
+    eventLoop->apicalls++;
+    retval = epoll_wait(state->epfd, state->events, eventLoop->setsize, timeout);
+    for (j = 0; j < retval; j++) {
+        struct epoll_event *e = state->events + j;
+        int mask = 0;
+        if (e->events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            mask |= AE_READABLE;
+        if (e->events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) mask |= AE_WRITABLE;
+        aeSetReady(eventLoop, e->data.fd, mask);
+    }
+    return aeCollectReady(eventLoop);
+}
+
+static const aeApi aeEpollApi = {
+    "epoll", aeEpollCreate, aeEpollResize, aeEpollFree, aeEpollAddEvent, aeEpollDelEvent, aeEpollPoll
+};
@@ -0,0 +1,209 @@
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* io_uring backend built on multishot poll requests, which fire on every
+ * wakeup like EPOLLET. Registrations and removals are only queued on the
+ * submission ring and go to the kernel together with the wait, so a loop
+ * iteration costs at most one io_uring_enter(), and none at all when ae.c
+ * still has ready fds and completions can be reaped from the shared ring.
+ * The generation in the upper half of user_data filters the completions
+ * of requests that were removed before the kernel saw the removal. */
+
+#define AE_URING_ENTRIES 1024
+#define AE_URING_IGNORE UINT64_MAX
+
+typedef struct aeUringState {
+    int ringfd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size, sqes_size;
+    uint32_t *gen;
+} aeUringState;
+
+static int aeUringEnter(aeEventLoop *eventLoop, unsigned wait, struct timeval *tvp) {
+    aeUringState *state = eventLoop->api_data;
+    unsigned submit = *state->sq_tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    eventLoop->apicalls++;
+    if (wait && tvp) {
+        memset(&arg, 0, sizeof(arg));
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        return syscall(__NR_io_uring_enter, state->ringfd, submit, wait,
+                       flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    return syscall(__NR_io_uring_enter, state->ringfd, submit, wait, flags, NULL, 0);
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->api_data;
+    unsigned tail = *state->sq_tail;
+    struct io_uring_sqe *sqe;
+    if (tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) == state->sq_entries) {
+        aeUringEnter(eventLoop, 0, NULL);
+        if (tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE) == state->sq_entries)
+            return NULL;
+    }
+    sqe = &state->sqes[tail & *state->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(state->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static int aeUringArm(aeEventLoop *eventLoop, int fd) {
+    aeUringState *state = eventLoop->api_data;
+    struct io_uring_sqe *sqe = aeUringGetSqe(eventLoop);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN | POLLOUT;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ((uint64_t) state->gen[fd] << 32) | (uint32_t) fd;
+    return 0;
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop) {
+    aeUringState *state = zmalloc(sizeof(aeUringState));
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *ring;
+    unsigned j;
+    if (!state) return -1;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = eventLoop->setsize * 2;
+    state->ringfd = syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &p);
+    if (state->ringfd == -1) {
+        zfree(state);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(state->ringfd);
+        zfree(state);
+        return -1;
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    state->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    state->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->ring = mmap(NULL, state->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->ring == MAP_FAILED || state->sqes == MAP_FAILED) {
+        if (state->ring != MAP_FAILED) munmap(state->ring, state->ring_size);
+        if (state->sqes != MAP_FAILED) munmap(state->sqes, state->sqes_size);
+        close(state->ringfd);
+        zfree(state);
+        return -1;
+    }
+    ring = state->ring;
+    state->sq_entries = p.sq_entries;
+    state->sq_head = (unsigned *) (ring + p.sq_off.head);
+    state->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    state->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    state->sq_flags = (unsigned *) (ring + p.sq_off.flags);
+    state->cq_head = (unsigned *) (ring + p.cq_off.head);
+    state->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    state->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    for (j = 0; j < p.sq_entries; j++)
+        ((unsigned *) (ring + p.sq_off.array))[j] = j;
+    state->gen = zmalloc(sizeof(uint32_t) * eventLoop->setsize);
+    memset(state->gen, 0, sizeof(uint32_t) * eventLoop->setsize);
+    eventLoop->api_data = state;
+    return 0;
+}
+
+static int aeUringResize(aeEventLoop *eventLoop, int setsize) {
+    aeUringState *state = eventLoop->api_data;
+    state->gen = zre_alloc(state->gen, sizeof(uint32_t) * setsize);
+    if (setsize > eventLoop->setsize)
+        memset(state->gen + eventLoop->setsize, 0,
+               sizeof(uint32_t) * (setsize - eventLoop->setsize));
+    return 0;
+}
+
+static void aeUringFree(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->api_data;
+    munmap(state->sqes, state->sqes_size);
+    munmap(state->ring, state->ring_size);
+    close(state->ringfd);
+    zfree(state->gen);
+    zfree(state);
+}
+
+static int aeUringAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeUringState *state = eventLoop->api_data;
+    AE_NOT_USED(mask);
+    if (eventLoop->events[fd].mask != AE_NONE) return 0;
+    state->gen[fd]++;
+    return aeUringArm(eventLoop, fd);
+}
+
+static void aeUringDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeUringState *state = eventLoop->api_data;
+    struct io_uring_sqe *sqe;
+    if ((eventLoop->events[fd].mask & (~delmask)) != AE_NONE) return;
+    sqe = aeUringGetSqe(eventLoop);
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ((uint64_t) state->gen[fd] << 32) | (uint32_t) fd;
+        sqe->user_data = AE_URING_IGNORE;
+    }
+    state->gen[fd]++;
+}
+
+static void aeUringReap(aeEventLoop *eventLoop) {
+    aeUringState *state = eventLoop->api_data;
+    unsigned head = *state->cq_head;
+    unsigned tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        int fd = (int) (uint32_t) cqe->user_data, mask = 0;
+        head++;
+        if (cqe->user_data == AE_URING_IGNORE ||
+            (uint32_t) (cqe->user_data >> 32) != state->gen[fd] ||
+            eventLoop->events[fd].mask == AE_NONE)
+            continue;
+        if (cqe->res < 0) {
+            /* Let the handlers find out about the error. */
+            aeSetReady(eventLoop, fd, AE_READABLE | AE_WRITABLE);
+            if (cqe->res == -EBADF || cqe->res == -EINVAL) continue;
+        } else {
+            if (cqe->res & (POLLIN | POLLERR | POLLHUP)) mask |= AE_READABLE;
+            if (cqe->res & (POLLOUT | POLLERR | POLLHUP)) mask |= AE_WRITABLE;
+            aeSetReady(eventLoop, fd, mask);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) aeUringArm(eventLoop, fd);
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int aeUringPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeUringState *state = eventLoop->api_data;
+    unsigned submit = *state->sq_tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+    int wait = eventLoop->npending == 0 &&
+               *state->cq_head == __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    if (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0) wait = 0;
+    if (submit || wait ||
+        (__atomic_load_n(state->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+        aeUringEnter(eventLoop, wait, tvp);
+    aeUringReap(eventLoop);
+    return aeCollectReady(eventLoop);
+}
+
+static const aeApi aeUringApi = {
+    "io_uring", aeUringCreate, aeUringResize, aeUringFree, aeUringAddEvent, aeUringDelEvent, aeUringPoll
+};
@@ -14,6 +14,9 @@ void bioKillThreads(void);
 
 #define CACHE_BIO_CLOSE_FILE 0
 #define CACHE_BIO_AOF_FSYNC 1
-#define CACHE_BIO_NUM_OPS 2
+#define CACHE_BIO_DICT_REHASH 2
+#define CACHE_BIO_SNAPSHOT 3
+#define CACHE_BIO_LAZY_FREE 4
+#define CACHE_BIO_NUM_OPS 5
 
 #endif
\ No newline at end of file
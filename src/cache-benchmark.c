@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Pipelined throughput benchmark:
+ *
+ *   cache-benchmark [host] [port] [clients] [pipeline] [requests] [ping|set]
+ *   cache-benchmark [host] [port] [clients] [pipeline] [requests] zipf
+ *                   [keyspace] [alpha] [scan-percent]
+ *
+ * Every client keeps `pipeline` requests in flight and refills the
+ * pipeline as soon as all of its replies are in, so the server always
+ * finds a whole batch of commands in a single read.
+ *
+ * zipf replays a cache-aside trace and reports the hit ratio: GETs of
+ * key:<n> with n drawn from a Zipfian distribution over `keyspace` keys,
+ * each miss followed by a SET of the key, and scan-percent of the GETs
+ * replaced by scan:<n> keys that are stored but never read again, like a warmup
+ * walking the whole data set. Run it against a server whose maxmemory is
+ * below the size of the keyspace to compare the eviction policies. */
+
+#define ZIPF_VALUE_LEN 100
+#define ZIPF_CMD_MAX 128
+#define ZIPF_SET (-1)
+/* Keys are tracked by number: key:<n> as n, scan:<n> as -2 - n. */
+#define zipfIsScanKey(id) ((id) < ZIPF_SET)
+#define zipfScanKey(n) (-2 - (n))
+
+typedef struct benchClient {
+    int fd;
+    int inflight;
+    char *obuf;
+    size_t olen, opos;
+} benchClient;
+
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long) tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static int connectTo(const char *host, int port) {
+    struct sockaddr_in sa;
+    int fd, yes = 1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) return -1;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Counts the complete replies in buf. Only status, error and integer
+ * replies are expected, so every reply is a single line. */
+static int countReplies(const char *buf, size_t len) {
+    int n = 0;
+    size_t j;
+    for (j = 0; j < len; j++)
+        if (buf[j] == '\n') n++;
+    return n;
+}
+
+typedef struct zipfClient {
+    int fd;
+    char *obuf;
+    size_t olen, opos;
+    char *ibuf;
+    size_t ilen, icap;
+    long long *pending; /* What each awaited reply is for, in order. */
+    int npending, nreplied;
+    long long *fill;    /* Keys that missed and have to be SET. */
+    int nfill;
+} zipfClient;
+
+/* Returns the length of the first reply in buf, 0 if it is incomplete.
+ * *null is set for a null bulk reply. */
+static size_t parseReply(const char *buf, size_t len, int *null) {
+    const char *nl = memchr(buf, '\n', len);
+    long long bulklen;
+    size_t linelen;
+    if (nl == NULL) return 0;
+    linelen = nl - buf + 1;
+    *null = 0;
+    if (buf[0] != '$') return linelen;
+    bulklen = atoll(buf + 1);
+    if (bulklen < 0) {
+        *null = 1;
+        return linelen;
+    }
+    if (linelen + bulklen + 2 > len) return 0;
+    return linelen + bulklen + 2;
+}
+
+static void zipfKeyName(char *buf, size_t size, long long id) {
+    if (zipfIsScanKey(id))
+        snprintf(buf, size, "scan:%lld", zipfScanKey(id));
+    else
+        snprintf(buf, size, "key:%lld", id);
+}
+
+static size_t appendCommand(char *buf, const char *cmd, const char *key,
+                            const char *val) {
+    int keylen = strlen(key);
+    if (val)
+        return sprintf(buf, "*3\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n",
+                       (int) strlen(cmd), cmd, keylen, key, (int) strlen(val), val);
+    return sprintf(buf, "*2\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n", (int) strlen(cmd),
+                   cmd, keylen, key);
+}
+
+/* Rank of a key drawn from the Zipfian distribution whose cumulative
+ * probabilities are in cdf. */
+static long long zipfNext(const double *cdf, long long keyspace) {
+    double u = drand48();
+    long long lo = 0, hi = keyspace - 1;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int runZipf(const char *host, int port, int numclients, int pipeline,
+                   long long requests, long long keyspace, double alpha,
+                   int scanperc) {
+    zipfClient *clients = calloc(numclients, sizeof(zipfClient));
+    struct pollfd *pfd = calloc(numclients, sizeof(struct pollfd));
+    double *cdf = malloc(sizeof(double) * keyspace), sum = 0;
+    long long sent = 0, done = 0, gets = 0, hits = 0, scans = 0, start;
+    char val[ZIPF_VALUE_LEN + 1], key[64];
+    int j, k;
+
+    if (keyspace <= 0 || cdf == NULL) {
+        fprintf(stderr, "keyspace must be positive\n");
+        return 1;
+    }
+    for (k = 0; k < keyspace; k++) cdf[k] = sum += 1.0 / pow(k + 1, alpha);
+    for (k = 0; k < keyspace; k++) cdf[k] /= sum;
+    memset(val, 'x', ZIPF_VALUE_LEN);
+    val[ZIPF_VALUE_LEN] = '\0';
+    for (j = 0; j < numclients; j++) {
+        zipfClient *c = clients + j;
+        if ((c->fd = connectTo(host, port)) == -1) {
+            fprintf(stderr, "Could not connect to %s:%d: %s\n", host, port,
+                    strerror(errno));
+            return 1;
+        }
+        c->obuf = malloc((size_t) 2 * pipeline * (ZIPF_CMD_MAX + ZIPF_VALUE_LEN));
+        c->icap = 16 * 1024;
+        c->ibuf = malloc(c->icap);
+        c->pending = malloc(sizeof(long long) * 2 * pipeline);
+        c->fill = malloc(sizeof(long long) * pipeline);
+    }
+
+    start = ustime();
+    while (done < requests) {
+        for (j = 0; j < numclients; j++) {
+            zipfClient *c = clients + j;
+            if (c->nreplied == c->npending && c->opos == c->olen &&
+                (sent < requests || c->nfill)) {
+                c->npending = c->nreplied = 0;
+                c->olen = c->opos = 0;
+                for (k = 0; k < c->nfill; k++) {
+                    zipfKeyName(key, sizeof(key), c->fill[k]);
+                    c->olen += appendCommand(c->obuf + c->olen, "SET", key, val);
+                    c->pending[c->npending++] = ZIPF_SET;
+                }
+                c->nfill = 0;
+                for (k = 0; k < pipeline && sent < requests; k++, sent++) {
+                    long long id;
+                    if (scanperc && random() % 100 < scanperc)
+                        id = zipfScanKey(scans++);
+                    else
+                        id = zipfNext(cdf, keyspace);
+                    zipfKeyName(key, sizeof(key), id);
+                    c->olen += appendCommand(c->obuf + c->olen, "GET", key, NULL);
+                    c->pending[c->npending++] = id;
+                }
+            }
+            pfd[j].fd = c->fd;
+            pfd[j].events = POLLIN;
+            if (c->opos < c->olen) pfd[j].events |= POLLOUT;
+        }
+        if (poll(pfd, numclients, 1000) == -1 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        for (j = 0; j < numclients; j++) {
+            zipfClient *c = clients + j;
+            ssize_t nwritten, nread;
+            size_t pos = 0, len;
+            int null;
+            if (pfd[j].revents & POLLOUT) {
+                nwritten = write(c->fd, c->obuf + c->opos, c->olen - c->opos);
+                if (nwritten > 0) c->opos += nwritten;
+            }
+            if (!(pfd[j].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            if (c->ilen == c->icap) c->ibuf = realloc(c->ibuf, c->icap *= 2);
+            nread = read(c->fd, c->ibuf + c->ilen, c->icap - c->ilen);
+            if (nread <= 0) {
+                fprintf(stderr, "Connection lost\n");
+                return 1;
+            }
+            c->ilen += nread;
+            while ((len = parseReply(c->ibuf + pos, c->ilen - pos, &null)) != 0) {
+                long long what = c->pending[c->nreplied++];
+                pos += len;
+                if (what == ZIPF_SET) continue;
+                done++;
+                if (null) c->fill[c->nfill++] = what;
+                if (zipfIsScanKey(what)) continue;
+                gets++;
+                if (!null) hits++;
+            }
+            memmove(c->ibuf, c->ibuf + pos, c->ilen - pos);
+            c->ilen -= pos;
+        }
+    }
+
+    printf("ZIPF: %lld requests, %lld keys, alpha %.2f, %d%% scan: "
+           "%.2f requests per second, hit ratio %.4f\n",
+           done, keyspace, alpha, scanperc,
+           (double) done * 1000000 / (ustime() - start),
+           gets ? (double) hits / gets : 0);
+    for (j = 0; j < numclients; j++) {
+        close(clients[j].fd);
+        free(clients[j].obuf);
+        free(clients[j].ibuf);
+        free(clients[j].pending);
+        free(clients[j].fill);
+    }
+    free(clients);
+    free(pfd);
+    free(cdf);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 6379;
+    int numclients = argc > 3 ? atoi(argv[3]) : 50;
+    int pipeline = argc > 4 ? atoi(argv[4]) : 16;
+    long long requests = argc > 5 ? atoll(argv[5]) : 1000000;
+    int set = argc > 6 && !strcmp(argv[6], "set");
+    const char *cmd = set ? "*3\r\n$3\r\nSET\r\n$7\r\nkey:000\r\n$3\r\nxxx\r\n"
+                          : "*1\r\n$4\r\nPING\r\n";
+    size_t cmdlen = strlen(cmd);
+    benchClient *clients = calloc(numclients, sizeof(benchClient));
+    struct pollfd *pfd = calloc(numclients, sizeof(struct pollfd));
+    long long sent = 0, done = 0, start;
+    char rbuf[16 * 1024];
+    int j, k;
+
+    if (numclients <= 0 || pipeline <= 0) {
+        fprintf(stderr, "clients and pipeline must be positive\n");
+        return 1;
+    }
+    if (argc > 6 && !strcmp(argv[6], "zipf")) {
+        return runZipf(host, port, numclients, pipeline, requests,
+                       argc > 7 ? atoll(argv[7]) : 1000000,
+                       argc > 8 ? atof(argv[8]) : 0.99,
+                       argc > 9 ? atoi(argv[9]) : 0);
+    }
+    for (j = 0; j < numclients; j++) {
+        benchClient *c = clients + j;
+        if ((c->fd = connectTo(host, port)) == -1) {
+            fprintf(stderr, "Could not connect to %s:%d: %s\n", host, port,
+                    strerror(errno));
+            return 1;
+        }
+        c->obuf = malloc(cmdlen * pipeline);
+        for (k = 0; k < pipeline; k++) memcpy(c->obuf + k * cmdlen, cmd, cmdlen);
+    }
+
+    start = ustime();
+    while (done < requests) {
+        for (j = 0; j < numclients; j++) {
+            benchClient *c = clients + j;
+            if (c->inflight == 0 && c->opos == c->olen && sent < requests) {
+                c->inflight = pipeline;
+                if (requests - sent < pipeline) c->inflight = requests - sent;
+                c->olen = cmdlen * c->inflight;
+                c->opos = 0;
+                sent += c->inflight;
+            }
+            pfd[j].fd = c->fd;
+            pfd[j].events = POLLIN;
+            if (c->opos < c->olen) pfd[j].events |= POLLOUT;
+        }
+        if (poll(pfd, numclients, 1000) == -1 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        for (j = 0; j < numclients; j++) {
+            benchClient *c = clients + j;
+            ssize_t nwritten, nread;
+            if (pfd[j].revents & POLLOUT) {
+                nwritten = write(c->fd, c->obuf + c->opos, c->olen - c->opos);
+                if (nwritten > 0) c->opos += nwritten;
+            }
+            if (pfd[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+                nread = read(c->fd, rbuf, sizeof(rbuf));
+                if (nread <= 0) {
+                    fprintf(stderr, "Connection lost\n");
+                    return 1;
+                }
+                k = countReplies(rbuf, nread);
+                c->inflight -= k;
+                done += k;
+            }
+        }
+    }
+
+    printf("%s: %lld requests, %d clients, pipeline %d: %.2f requests per second\n",
+           set ? "SET" : "PING", done, numclients, pipeline,
+           (double) done * 1000000 / (ustime() - start));
+    for (j = 0; j < numclients; j++) {
+        close(clients[j].fd);
+        free(clients[j].obuf);
+    }
+    free(clients);
+    free(pfd);
+    return 0;
+}
@@ -151,8 +151,8 @@ struct cacheCommand cacheCommandTable[] = {
         {"sync",             syncCommand,             1,  "ars",   0,  NULL,               0, 0,  0, 0, 0},
         {"psync",            syncCommand,             3,  "ars",   0,  NULL,               0, 0,  0, 0, 0},
         {"replconf",         replconfCommand,         -1, "arslt", 0,  NULL,               0, 0,  0, 0, 0},
-        {"flushdb",          flushdbCommand,          1,  "w",     0,  NULL,               0, 0,  0, 0, 0},
-        {"flushall",         flushallCommand,         1,  "w",     0,  NULL,               0, 0,  0, 0, 0},
+        {"flushdb",          flushdbCommand,          -1, "w",     0,  NULL,               0, 0,  0, 0, 0},
+        {"flushall",         flushallCommand,         -1, "w",     0,  NULL,               0, 0,  0, 0, 0},
         {"sort",             sortCommand,             -2, "wm",    0,  sortGetKeys,        1, 1,  1, 0, 0},
         {"info",             infoCommand,             -1, "rlt",   0,  NULL,               0, 0,  0, 0, 0},
         {"monitor",          monitorCommand,          1,  "ars",   0,  NULL,               0, 0,  0, 0, 0},
@@ -199,8 +199,6 @@ struct cacheCommand cacheCommandTable[] = {
         {"latency",          latencyCommand,          -2, "arslt", 0,  NULL,               0, 0,  0, 0, 0},
 };
 
-struct evictionPoolEntry *evictionPoolAlloc(void);
-
 void cacheLogRaw(int level, const char *msg) {
     const int syslogLevelMap[] = {LOG_DEBUG, LOG_INFO, LOG_NOTICE, LOG_WARNING};
     const char *c = ".-*#";
@@ -324,21 +322,57 @@ void dictSdsDestructor(void *private, void *val) {
     sdsFree(val);
 }
 
+void dictEmbeddedEntryDestructor(void *private, DictEntry *de) {
+    DICT_NOTUSED(private);
+    zfree(de);
+}
+
+/* What dbAdd() stores: the key is copied and the reference to val is
+ * taken over, val being the object stored. Short keys of a bucketed dict
+ * are copied into the entry allocation itself, saving the separate sds
+ * allocation and the pointer chase to it on every lookup. The value is
+ * not embedded: replies, propagation and the snapshot hold references to
+ * it that may outlive the entry. */
+int dbDictAdd(Dict *d, Sds key, cobj *val) {
+    size_t klen = sdsLen(key);
+    cacheEmbeddedEntry *e;
+    struct Sdshdr *sh;
+    if (!dictIsBucketed(d) || klen > CACHE_EMBEDDED_KEY_MAX_LEN) {
+        Sds copy = sdsDup(key);
+        if (dictAdd(d, copy, val) == DICT_OK) return DICT_OK;
+        sdsFree(copy);
+        return DCIT_ERR;
+    }
+    e = zmalloc_slab(sizeof(*e) + sizeof(struct Sdshdr) + klen + 1);
+    sh = (struct Sdshdr *) e->data;
+    sh->len = klen;
+    sh->free = 0;
+    memcpy(sh->buf, key, klen);
+    sh->buf[klen] = '\0';
+    e->key = sh->buf;
+    e->val = val;
+    if (dictAddEmbedded(d, (DictEntry *) e) != DICT_OK) {
+        zfree(e);
+        return DCIT_ERR;
+    }
+    return DICT_OK;
+}
+
 int dictObjKeyCompare(void *private, const void *key1, const void *key2) {
     const cobj *o1 = key1, *o2 = key2;
     return dictSdsKeyCompare(private, o1->ptr, o2->ptr);
 }
 
-unsigned int dictObjHash(const void *key) {
+uint64_t dictObjHash(const void *key) {
     const cobj *o = key;
     return dictGenHashFunction(o->ptr, (int) sdsLen((Sds) o->ptr));
 }
 
-unsigned int dictSdsHash(const void *key) {
+uint64_t dictSdsHash(const void *key) {
     return dictGenHashFunction((unsigned char *) key, sdsLen((char *) key));
 }
 
-unsigned int dictSdsCaseHash(const void *key) {
+uint64_t dictSdsCaseHash(const void *key) {
     return dictGenCaseHashFunction((unsigned char *) key, sdsLen((char *) key));
 }
 
@@ -357,7 +391,7 @@ int dictEncObjKeyCompare(void *privdata, const void *key1, const void *key2) {
     return cmp;
 }
 
-unsigned int dictEncObjHash(const void *key) {
+uint64_t dictEncObjHash(const void *key) {
     cobj *o = (cobj *) key;
     if (sdsEncodedObject(o)) {
         return dictGenHashFunction(o->ptr, sdsLen((Sds) o->ptr));
@@ -368,7 +402,7 @@ unsigned int dictEncObjHash(const void *key) {
             len = ll2string(buf, 32, (long) o->ptr);
             return dictGenHashFunction((unsigned char *) buf, len);
         } else {
-            unsigned int hash;
+            uint64_t hash;
             o = getDecodedObject(0);
             hash = dictGenHashFunction(o->ptr, sdsLen((Sds) o->ptr));
             decrRefCount(o);
@@ -382,57 +416,72 @@ DictType setDictType = {dictEncObjHash,
                         NULL,
                         dictEncObjKeyCompare,
                         dictCacheObjectDestructor,
+                        NULL,
+                        DICT_LAYOUT_CHAINED,
                         NULL};
 DictType zsetDictType = {dictEncObjHash,
                          NULL,
                          NULL,
                          dictEncObjKeyCompare,
                          dictCacheObjectDestructor,
+                         NULL,
+                         DICT_LAYOUT_CHAINED,
                          NULL};
 DictType dbDictType = {dictSdsHash,
                        NULL,
                        NULL,
                        dictSdsKeyCompare,
                        dictSdsDestructor,
-                       dictCacheObjectDestructor};
+                       dictCacheObjectDestructor,
+                       DICT_LAYOUT_BUCKETED,
+                       dictEmbeddedEntryDestructor};
 DictType shaScriptObjectDictType = {dictSdsCaseHash,
                                     NULL,
                                     NULL,
                                     dictSdsKeyCaseCompare,
                                     dictSdsDestructor,
-                                    dictCacheObjectDestructor};
+                                    dictCacheObjectDestructor,
+                                    DICT_LAYOUT_CHAINED,
+                                    NULL};
 DictType keyptrDictType = {dictSdsHash, NULL, NULL,
-                           dictSdsKeyCompare, NULL, NULL};
+                           dictSdsKeyCompare, NULL, NULL,
+                           DICT_LAYOUT_BUCKETED, NULL};
 
 DictType commandTableDictType = {
         dictSdsCaseHash, NULL, NULL, dictSdsKeyCaseCompare,
-        dictSdsDestructor, NULL};
+        dictSdsDestructor, NULL,
+        DICT_LAYOUT_CHAINED, NULL};
 
 DictType hashDictType = {dictEncObjHash,
                          NULL,
                          NULL,
                          dictEncObjKeyCompare,
                          dictCacheObjectDestructor,
-                         dictCacheObjectDestructor};
+                         dictCacheObjectDestructor,
+                         DICT_LAYOUT_CHAINED,
+                         NULL};
 DictType keylistDictType = {
         dictObjHash, NULL, NULL, dictObjKeyCompare, dictCacheObjectDestructor,
-        dictListDestructor};
+        dictListDestructor,
+        DICT_LAYOUT_CHAINED, NULL};
 
 DictType clusterNodesDictType = {
         dictSdsHash, NULL, NULL, dictSdsKeyCompare, dictSdsDestructor, NULL,
+        DICT_LAYOUT_CHAINED, NULL,
 };
 
 DictType migrateCacheDictType = {
-        dictSdsHash, NULL, NULL, dictSdsKeyCompare, dictSdsDestructor, NULL};
+        dictSdsHash, NULL, NULL, dictSdsKeyCompare, dictSdsDestructor, NULL,
+        DICT_LAYOUT_CHAINED, NULL};
 
 DictType replScriptCacheDictType = {
         dictSdsCaseHash, NULL, NULL, dictSdsKeyCaseCompare,
-        dictSdsDestructor, NULL};
+        dictSdsDestructor, NULL,
+        DICT_LAYOUT_CHAINED, NULL};
 
 int htNeedsResize(Dict *dict) {
-    long long size, used;
-    size = dictSlots(dict);
-    used = dictSize(dict);
+    unsigned long size, used;
+    dictLockedSizes(dict, &size, &used);
     return (size && used && size > DICT_HT_INITIAL_SIZE &&
             (used * 100 / size < CACHE_HT_MINFILL));
 }
@@ -443,12 +492,24 @@ void tryResizeHashTables(int dbid) {
         dictResize(server.db[dbid].expires);
 }
 
+/* Returns 1 while a bio thread owns the rehashing of the dict. Large
+ * dicts are handed over before they would need to grow in the foreground. */
+int backgroundRehash(Dict *d) {
+    if (dictIsBgRehashing(d)) return !dictBgRehashFinish(d);
+    if (!server.bgrehashing || dictSize(d) < CACHE_BG_REHASH_MIN_KEYS) return 0;
+    if (dictBgRehashStart(d) == DCIT_ERR) return 0;
+    bioCreateBackgroundJob(CACHE_BIO_DICT_REHASH, d, NULL, NULL);
+    return 1;
+}
+
 int incrmentallyRehash(int dbid) {
-    if (dictIsRehashing(server.db[dbid].dict)) {
+    if (!backgroundRehash(server.db[dbid].dict) &&
+        dictIsRehashing(server.db[dbid].dict)) {
         dictRehashMilliseconds(server.db[dbid].dict, 1);
         return 1;
     }
-    if (dictIsRehashing(server.db[dbid].expires)) {
+    if (!backgroundRehash(server.db[dbid].expires) &&
+        dictIsRehashing(server.db[dbid].expires)) {
         dictRehashMilliseconds(server.db[dbid].expires, 1);
         return 1;
     }
@@ -463,22 +524,52 @@ void updateDictResizePolicy(void) {
     }
 }
 
+static void activeExpireKey(cacheDB *db, cobj *keyobj) {
+    size_t used;
+    propagateExpire(db, keyobj);
+    used = zmalloc_used_memory();
+    dbDelete(db, keyobj);
+    used -= zmalloc_used_memory();
+    if ((ssize_t) used > 0) server.stat_expired_bytes += used;
+    notifyKeyspaceEvent(CACHE_NOTIFY_EXPIRED, "expired", keyobj, db->id);
+    server.stat_expiredkeys++;
+}
+
 int activeExpireCycleTryExpire(cacheDB *db, DictEntry *de, long long now) {
     long long t = dictGetSignedIntegerVal(de);
     if (now > t) {
         Sds key = dictGetKey(de);
         cobj *keyobj = createStringObject(key, SdsLen(key));
-        propagateExpire(db, keyobj);
-        dbDelete(db, keyobj);
-        notifyKeyspaceEvent(CACHE_NOTIFY_EXPIRED, "expired", keyobj, db->id);
+        activeExpireKey(db, keyobj);
         decrRefCount(keyobj);
-        server.stat_expiredkeys++;
         return 1;
     } else {
         return 0;
     }
 }
 
+/* Expires the keys of db that are due, earliest deadline first, straight
+ * from db->expires_index instead of sampling db->expires. Index entries
+ * whose deadline no longer matches db->expires are dropped. Returns 1 if
+ * the cycle ran out of time. */
+static int activeExpireCycleIndexed(cacheDB *db, long long start,
+                                    long long time_limit) {
+    cobj *keys[ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP];
+    long long when[ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP];
+    unsigned int found, j;
+    do {
+        found = expireIndexGetExpired(db, mstime(), keys, when,
+                                      ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP);
+        for (j = 0; j < found; j++) {
+            expireIndexDelete(db, keys[j]->ptr, when[j]);
+            if (getExpire(db, keys[j]) == when[j]) activeExpireKey(db, keys[j]);
+            decrRefCount(keys[j]);
+        }
+        if (ustime() - start > time_limit) return 1;
+    } while (found == ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP);
+    return 0;
+}
+
 void activeExpireCycle(int type) {
     static unsigned int current_db = 0;
     static int time_limit_exit = 0;
@@ -500,10 +591,16 @@ void activeExpireCycle(int type) {
     if (time_limit <= 0) time_limit = 1;
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         time_limit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION;
-    for (j = 0; j < dbs_per_call; j++) {
+    for (j = 0; j < dbs_per_call && !time_limit_exit; j++) {
         int expired;
         cacheDB *db = server.db + (current_db % server.dbnum);
         current_db++;
+        /* The index only knows the deadlines setExpire() reported with
+         * expireIndexAdd(): sampling still runs, so that a volatile key
+         * missing from the index expires all the same. */
+        if (db->expires_index &&
+            (time_limit_exit = activeExpireCycleIndexed(db, start, time_limit)))
+            break;
         do {
             unsigned long num, slots;
             long long now, ttl_sum;
@@ -541,9 +638,10 @@ void activeExpireCycle(int type) {
                 latencyAddSampleIfNeeded("expire-cycle", elapsed / 1000);
                 if (elapsed > time_limit) time_limit_exit = 1;
             }
-            if (time_limit_exit) return;
+            if (time_limit_exit) break;
         } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP);
     }
+    server.stat_expire_cycle_time_used += ustime() - start;
 }
 
 unsigned int getLRUClock(void) {
@@ -701,6 +799,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     }
     clientsCron();
     databaseCron();
+    if (server.eviction_pending) freeMemoryIfNeeded();
+    snapshotCron();
     if (server.rdb_chiled_pid == -1 && server.aof_child_pid == -1 &&
         server.aof_rewrite_scheduled)
         rewriteAppendOnlyFileBackground();
@@ -722,7 +822,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             }
             updateDictResizePolicy();
         }
-    } else {
+    } else if (server.snapshot == NULL) {
         for (j = 0; j < server.saveparamslen; j++) {
             struct saveparam *sp = server.saveparams++;
             if (server.dirty >= sp->changes &&
@@ -731,7 +831,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                  server.lastbgsave_status == CACHE_OK)) {
                 cacheLog(CACHE_NOTICE, "%d changes in %d seconds . Saving ...",
                          sp->changes, (int) sp->seconds);
-                rdbSaveBackground(server.rdb_filename);
+                if (server.rdb_threaded_snapshot)
+                    snapshotStart(server.rdb_filename);
+                else
+                    rdbSaveBackground(server.rdb_filename);
                 break;
             }
         }
@@ -770,6 +873,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
 void beforeSleep(struct aeEventLoop *event_loop) {
     CACHE_NOTUSED(event_loop);
+    handleClientsWithPendingReadsUsingThreads();
     if (server.cluster_enabled) clusterBeforeSleep();
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
@@ -786,7 +890,9 @@ void beforeSleep(struct aeEventLoop *event_loop) {
     }
     if (listLength(server.clients_waiting_acks)) processClientsWaitingReplicas();
     if (listLength(server.unblocked_clients)) processClientsWaitingReplicas();
+    snapshotCron();
     flushAppendOnlyFile(0);
+    handleClientsWithPendingWritesUsingThreads();
 }
 
 void createSharedObjects(void) {
@@ -841,6 +947,9 @@ void createSharedObjects(void) {
     shared.oomerr = createObject(
             CACHE_STRING,
             sdsNew("-OOM command no tallowed when used memory > 'maxmemory'.\r\n"));
+    shared.notadmittederr = createObject(
+            CACHE_STRING,
+            sdsNew("-OOM new key not admitted when used memory > 'maxmemory'.\r\n"));
     shared.execaborterr = createObject(
             CACHE_STRING,
             sdsNew(
@@ -936,18 +1045,33 @@ void initServerConfig(void) {
     server.requirepass = NULL;
     server.rdb_compression = CACHE_DEFAULT_RDB_COMPRESSION;
     server.rdb_checksum = CACHE_DEFAULT_RDB_CHECKSUM;
+    server.rdb_threaded_snapshot = CACHE_DEFAULT_RDB_THREADED_SNAPSHOT;
     server.stop_writes_on_bgsave_err = CACHE_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CACHE_DEFAULT_ACTIVE_REHASHING;
+    server.bgrehashing = CACHE_DEFAULT_BG_REHASHING;
+    server.io_threads_num = CACHE_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_do_reads = CACHE_DEFAULT_IO_THREADS_DO_READS;
+    server.pipeline_batching = CACHE_DEFAULT_PIPELINE_BATCHING;
+    server.keyspace_index = CACHE_DEFAULT_KEYSPACE_INDEX;
+    server.expires_index = CACHE_DEFAULT_EXPIRES_INDEX;
+    server.lazyfree = CACHE_DEFAULT_LAZYFREE;
     server.notify_keyspace_events = 0;
     server.maxclients = CACHE_MAX_CLIENTS;
     server.bpop_blocked_clients = 0;
     server.maxmemory = CACHE_DEFAULT_MAXMEMORY;
     server.maxmemory_policy = CACHE_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CACHE_DEFAULT_MAXMEMORY_SAMPLES;
+    server.maxmemory_eviction_budget = CACHE_DEFAULT_MAXMEMORY_EVICTION_BUDGET;
+    server.lfu_log_factor = CACHE_DEFAULT_LFU_LOG_FACTOR;
+    server.lfu_decay_time = CACHE_DEFAULT_LFU_DECAY_TIME;
+    server.admission_filter = CACHE_DEFAULT_ADMISSION_FILTER;
+    server.admission_sketch_width = CACHE_DEFAULT_ADMISSION_SKETCH_WIDTH;
     server.hash_max_ziplist_entries = CACHE_HASH_MAX_ZIPLIST_ENTRIES;
     server.hash_max_ziplist_value = CACHE_HASH_MAX_ZIPLIST_VALUE;
     server.list_max_ziplist_entries = CACHE_LIST_MAX_ZIPLIST_ENTRIES;
     server.list_max_ziplist_value = CACHE_LIST_MAX_ZIPLIST_VALUE;
+    server.list_max_ziplist_size = CACHE_LIST_MAX_ZIPLIST_SIZE;
+    server.list_compress_depth = CACHE_LIST_COMPRESS_DEPTH;
     server.set_max_intset_entries = CACHE_SET_MAX_INTSET_ENTRIES;
     server.zset_max_ziplist_entries = CACHE_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = CACHE_ZSET_MAX_ZIPLIST_VALUE;
@@ -1022,6 +1146,7 @@ void initServerConfig(void) {
 
     server.commands = dictCreate(&commandTableDictType, NULL);
     server.orig_commands = dictCreate(&commandTableDictType, NULL);
+    server.commands_renamed = 0;
     populateCommandTable();
     server.delCommand = lookupCommandByCString("del");
 
@@ -1161,6 +1286,10 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_bytes = 0;
+    server.stat_expire_cycle_time_used = 0;
+    server.stat_admission_admitted = 0;
+    server.stat_admission_rejected = 0;
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
@@ -1191,20 +1320,32 @@ void initServer(void) {
         openlog(server.syslog_ident, LOG_PID | LOG_NDELAY | LOG_NOWAIT,
                 server.syslog_facility);
     server.pid = getpid();
+    commandTableCheckRenamed();
     server.current_client = NULL;
     server.clients = listCreate();
     server.clients_to_close = listCreate();
+    server.clients_pending_read = listCreate();
+    server.clients_pending_write = listCreate();
+    server.batch_active = 0;
+    cacheOpArrayInit(&server.batch_propagate);
+    server.reply_zerocopy_clients = 0;
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.slaveseldb = -1;
     server.unblocked_clients = listCreate();
-    server.ready_keys - listCreate();
+    server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
     createSharedObjects();
     adjustOpenFilesLimit();
     server.el = aeCreateEventLoop(server.maxclients + CACHE_EVENTLOOP_FDSET_INCR);
+#ifdef HAVE_IO_URING
+    if (strcmp(aeGetApiName(server.el), "io_uring") != 0)
+        cacheLog(CACHE_WARNING, "io_uring could not be set up, falling back "
+                                "to %s.", aeGetApiName(server.el));
+#endif
+    cacheLog(CACHE_NOTICE, "Event loop backend: %s", aeGetApiName(server.el));
     server.db = zmalloc(sizeof(cacheDB) * server.dbnum);
     if (server.port != 0 &&
         listenToPort(server.port, server.ipfd, &server.ipfd_count) == CACHE_ERR)
@@ -1225,20 +1366,27 @@ void initServer(void) {
     }
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType, NULL);
+        server.db[j].keys_index = server.keyspace_index ? raxNew() : NULL;
         server.db[j].expires = dictCreate(&keyptrDictType, NULL);
+        server.db[j].expires_index = server.expires_index ? raxNew() : NULL;
         server.db[j].blocking_keys = dictCreate(&keylistDictType, NULL);
         server.db[j].ready_keys = dictCreate(&setDictType, NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType, NULL);
-        server.db[j].eviction_pool = evictionPoolAlloc();
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
     }
+    server.eviction_pool = evictionPoolAlloc();
+    server.eviction_pending = 0;
+    server.admission_sketch = server.admission_filter
+                              ? cmSketchCreate(server.admission_sketch_width)
+                              : NULL;
     server.pubsub_channels = dictCreate(&keylistDictType, NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns, freePubsubPattern);
     listSetMatchMethod(server.pubsub_patterns, listMatchPubsubPattern);
     server.cronloops = 0;
     server.rdb_chiled_pid = -1;
+    server.snapshot = NULL;
     server.aof_child_pid = -1;
     server.rdb_child_type = CACHE_RDB_CHILD_TYPE_NONE;
     aofRewriteBufferReset();
@@ -1288,12 +1436,118 @@ void initServer(void) {
         server.maxmemory = 3072LL * (1024 * 1024);
         server.maxmemory_policy = CACHE_MAXMEMORY_NO_EVICTION;
     }
+    zmalloc_slab_set_reserve(server.maxmemory);
     if (server.cluster_enabled) clusterInit();
     replicationScriptCacheInit();
     scriptingInit();
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    initThreadedIO();
+}
+
+/* cacheCommandTable never changes after startup, so it is indexed by a
+ * minimal perfect hash (hash and displace): the name is hashed once, its
+ * bucket picks the displacement that maps it to its own slot, and a single
+ * compare confirms the hit. */
+#define CACHE_NUM_COMMANDS (sizeof(cacheCommandTable) / sizeof(struct cacheCommand))
+#define CACHE_CMD_HASH_BUCKETS 64
+#define CACHE_CMD_HASH_MAX_DISP (1 << 20)
+
+static struct cacheCommand *commandSlots[CACHE_NUM_COMMANDS];
+static uint32_t commandDisp[CACHE_CMD_HASH_BUCKETS];
+
+/* FNV-1a over the names with ASCII case folded. Non-letters may fold
+ * together as well, the final compare sorts that out. */
+static inline uint64_t commandNameHash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--) h = (h ^ (unsigned char) (*s++ | 0x20)) * 0x100000001b3ULL;
+    return h;
+}
+
+static inline unsigned commandNameBucket(uint64_t h) {
+    return (h >> 32) & (CACHE_CMD_HASH_BUCKETS - 1);
+}
+
+static inline unsigned commandNameSlot(uint64_t h, uint32_t disp) {
+    uint32_t x = (uint32_t) h ^ disp;
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return (unsigned) (((uint64_t) x * CACHE_NUM_COMMANDS) >> 32);
+}
+
+static inline int commandNameMatches(struct cacheCommand *cmd, const char *name,
+                                     size_t len) {
+    return (name[0] | 0x20) == cmd->name[0] &&
+           !strncasecmp(cmd->name, name, len) && cmd->name[len] == '\0';
+}
+
+static void buildCommandPerfectHash(void) {
+    unsigned count[CACHE_CMD_HASH_BUCKETS] = {0}, order[CACHE_CMD_HASH_BUCKETS];
+    unsigned bucketof[CACHE_NUM_COMMANDS], slot[CACHE_NUM_COMMANDS];
+    uint64_t hash[CACHE_NUM_COMMANDS];
+    unsigned b, i, j, k;
+    for (j = 0; j < CACHE_NUM_COMMANDS; j++) {
+        struct cacheCommand *c = cacheCommandTable + j;
+        hash[j] = commandNameHash(c->name, strlen(c->name));
+        bucketof[j] = commandNameBucket(hash[j]);
+        count[bucketof[j]]++;
+        commandSlots[j] = NULL;
+    }
+    /* Place the largest buckets first, while the table is still empty. */
+    for (b = 0; b < CACHE_CMD_HASH_BUCKETS; b++) order[b] = b;
+    for (i = 1; i < CACHE_CMD_HASH_BUCKETS; i++) {
+        unsigned o = order[i];
+        for (k = i; k > 0 && count[order[k - 1]] < count[o]; k--)
+            order[k] = order[k - 1];
+        order[k] = o;
+    }
+    for (i = 0; i < CACHE_CMD_HASH_BUCKETS && count[order[i]]; i++) {
+        uint32_t disp;
+        b = order[i];
+        for (disp = 0; disp < CACHE_CMD_HASH_MAX_DISP; disp++) {
+            int fits = 1;
+            for (j = 0; j < CACHE_NUM_COMMANDS && fits; j++) {
+                if (bucketof[j] != b) continue;
+                slot[j] = commandNameSlot(hash[j], disp);
+                if (commandSlots[slot[j]]) fits = 0;
+                for (k = 0; k < j && fits; k++)
+                    if (bucketof[k] == b && slot[k] == slot[j]) fits = 0;
+            }
+            if (fits) break;
+        }
+        if (disp == CACHE_CMD_HASH_MAX_DISP)
+            cachePanic("Can't build the command table hash, duplicated command?");
+        commandDisp[b] = disp;
+        for (j = 0; j < CACHE_NUM_COMMANDS; j++)
+            if (bucketof[j] == b) commandSlots[slot[j]] = cacheCommandTable + j;
+    }
+}
+
+static struct cacheCommand *lookupStaticCommand(const char *name, size_t len) {
+    uint64_t h = commandNameHash(name, len);
+    struct cacheCommand *cmd =
+            commandSlots[commandNameSlot(h, commandDisp[commandNameBucket(h)])];
+    return commandNameMatches(cmd, name, len) ? cmd : NULL;
+}
+
+/* rename-command edits server.commands while the config is loaded. Once
+ * the dict no longer holds exactly cacheCommandTable under the original
+ * names, the static hash would still find renamed and disabled commands,
+ * so lookups have to go through the dict. */
+void commandTableCheckRenamed(void) {
+    DictIterator *di;
+    DictEntry *de;
+    server.commands_renamed = dictSize(server.commands) != CACHE_NUM_COMMANDS;
+    di = dictGetIterator(server.commands);
+    while (!server.commands_renamed && (de = dictNext(di)) != NULL) {
+        struct cacheCommand *cmd = dictGetVal(de);
+        if (strcasecmp(dictGetKey(de), cmd->name)) server.commands_renamed = 1;
+    }
+    dictReleaseIterator(di);
 }
 
 void populateCommandTable(void) {
@@ -1354,6 +1608,7 @@ void populateCommandTable(void) {
         retval2 = dictAdd(server.orig_commands, sdsNew(c->name), c);
         cacheAssert(retval1 == DICT_OK && retval2 == DICT_OK);
     }
+    buildCommandPerfectHash();
 }
 
 void resetCommandTableStats(void) {
@@ -1390,6 +1645,7 @@ void cacheOpArrayFree(cacheOPArray *oa) {
         int j;
         cacheOP *op;
         oa->num_ops--;
+        op = oa->ops + oa->num_ops;
         for (j = 0; j < op->argc; j++) {
             decrRefCount(op->argv[j]);
         }
@@ -1399,19 +1655,24 @@ void cacheOpArrayFree(cacheOPArray *oa) {
 }
 
 struct cacheCommand *lookupCommand(Sds name) {
+    if (!server.commands_renamed) return lookupStaticCommand(name, sdsLen(name));
     return dictFetchValue(server.commands, name);
 }
 
 struct cacheCommand *lookupCommandByCString(char *s) {
     struct cacheCommand *cmd;
-    Sds name = sdsNew(s);
+    Sds name;
+    if (!server.commands_renamed) return lookupStaticCommand(s, strlen(s));
+    name = sdsNew(s);
     cmd = dictFetchValue(server.commands, name);
     sdsFree(name);
     return cmd;
 }
 
 struct cacheCommand *lookupCmmandOrOriginal(Sds name) {
-    struct cacheCommand *cmd = dictFetchValue(server.commands, name);
+    struct cacheCommand *cmd;
+    if (!server.commands_renamed) return lookupStaticCommand(name, sdsLen(name));
+    cmd = dictFetchValue(server.commands, name);
     if (!cmd) {
         cmd = dictFetchValue(server.orig_commands, name);
     }
@@ -1420,6 +1681,16 @@ struct cacheCommand *lookupCmmandOrOriginal(Sds name) {
 
 void propagate(struct cacheCommand *cmd, int db_id, cobj **argv, int argc,
                int flags) {
+    if (server.batch_active) {
+        cobj **copy = zmalloc(sizeof(cobj *) * argc);
+        int j;
+        for (j = 0; j < argc; j++) {
+            copy[j] = argv[j];
+            incrRefCount(argv[j]);
+        }
+        cacheOpArrayAppend(&server.batch_propagate, cmd, db_id, copy, argc, flags);
+        return;
+    }
     if (server.aof_state != CACHE_AOF_OFF && flags & CACHE_PROPAGATE_AOF) {
         feedAppendOnlyFile(cmd, db_id, argv, argc);
     }
@@ -1428,6 +1699,21 @@ void propagate(struct cacheCommand *cmd, int db_id, cobj **argv, int argc,
     }
 }
 
+/* Expired and evicted keys are propagated as DEL through propagate(), so
+ * that inside a command batch the DEL is queued after the writes that
+ * were executed before it instead of overtaking them. */
+void propagateExpire(cacheDB *db, cobj *key) {
+    cobj *argv[2];
+    argv[0] = shared.del;
+    argv[1] = key;
+    incrRefCount(argv[0]);
+    incrRefCount(argv[1]);
+    propagate(server.delCommand, db->id, argv, 2,
+              CACHE_PROPAGATE_AOF | CACHE_PROPAGATE_REPL);
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+}
+
 void alsoPropagate(struct cacheCommand *cmd, int db_id, cobj **argv, int argc,
                    int target) {
     cacheOpArrayAppend(&server.also_propagate, cmd, db_id, argv, argc, target);
@@ -1438,9 +1724,60 @@ void forceCommandPropagation(cacheClient *c, int flags) {
     if (flags & CACHE_PROPAGATE_AOF) c->flags |= CACHE_FORCE_AOF;
 }
 
+/* Commands pipelined in one read run as a batch, see processInputBuffer():
+ * the OOM check costs a comparison while used memory is under maxmemory
+ * and evicts as soon as a command of the batch took it past, but once
+ * eviction failed it is not retried while memory stays over. call() reads
+ * the clock once per command instead of twice, the end of one command
+ * being the start of the next, and propagation to the AOF and the slaves
+ * is queued and done in order when the batch ends. */
+void beginCommandBatch(void) {
+    if (!server.pipeline_batching || server.batch_active) return;
+    server.batch_active = 1;
+    server.batch_clock = ustime();
+    server.batch_deny_oom = 0;
+}
+
+void flushCommandBatch(cacheClient *c) {
+    cacheOPArray ops = server.batch_propagate;
+    int active = server.batch_active, j;
+    if (!active) return;
+    server.batch_active = 0;
+    cacheOpArrayInit(&server.batch_propagate);
+    for (j = 0; j < ops.num_ops; j++) {
+        cacheOP *op = &ops.ops[j];
+        propagate(op->cmd, op->db_id, op->argv, op->argc, op->target);
+    }
+    cacheOpArrayFree(&ops);
+    server.batch_active = active;
+    if (c) c->woff = server.master_repl_offset;
+}
+
+void endCommandBatch(cacheClient *c) {
+    if (!server.batch_active) return;
+    flushCommandBatch(c);
+    server.batch_active = 0;
+}
+
 void call(cacheClient *c, int flags) {
     long long dirty, start, duration;
     int client_old_flags = c->flags;
+    if (listLength(server.monitors) && !server.loading &&
+        !(c->cmd->flags & (CACHE_CMD_SKIP_MONITOR | CACHE_CMD_ADMIN))) {
+        replicationFeedMonitors(c, server.monitors, c->db->id, c->argv, c->argc);
+    }
+    c->flags &= ~(CACHE_FORCE_AOF | CACHE_FORCE_REPL);
+    cacheOpArrayInit(&server.also_propagate);
+    dirty = server.dirty;
+    start = server.batch_active ? server.batch_clock : ustime();
+    if (server.admission_sketch && c->cmd->firstkey > 0 && c->cmd->firstkey < c->argc)
+        admissionRecordAccess(c->argv[c->cmd->firstkey]->ptr);
+    c->cmd->proc(c);
+    duration = ustime();
+    if (server.batch_active) server.batch_clock = duration;
+    duration -= start;
+    dirty = server.dirty - dirty;
+    if (dirty < 0) dirty = 0;
     if (server.loading && c->flags & CACHE_LUA_CLIENT) {
         flags &= ~(CACHE_CALL_SLOWLOG | CACHE_CALL_STATS);
     }
@@ -1466,7 +1803,7 @@ void call(cacheClient *c, int flags) {
     if (flags & CACHE_CALL_PROPAGATE) {
         int flags = CACHE_PROPAGATE_NONE;
         if (c->flags & CACHE_FORCE_REPL) flags |= CACHE_PROPAGATE_REPL;
-        if (c->flags & CACHE_FORCE_AOF) flags |= CACHE_FORCE_AOF;
+        if (c->flags & CACHE_FORCE_AOF) flags |= CACHE_PROPAGATE_AOF;
         if (dirty) flags |= (CACHE_PROPAGATE_REPL | CACHE_PROPAGATE_AOF);
         if (flags != CACHE_PROPAGATE_NONE)
             propagate(c->cmd, c->db->id, c->argv, c->argc, flags);
@@ -1486,12 +1823,17 @@ void call(cacheClient *c, int flags) {
 }
 
 int processCommand(cacheClient *c) {
-    if (!strcasecmp(c->argv[0]->ptr, "quit")) {
+    Sds name = c->argv[0]->ptr;
+    /* Clients mostly repeat the command they sent last. */
+    if (server.commands_renamed || !c->lastcmd ||
+        !commandNameMatches(c->lastcmd, name, sdsLen(name)))
+        c->lastcmd = lookupCommand(name);
+    c->cmd = c->lastcmd;
+    if (!c->cmd && !strcasecmp(name, "quit")) {
         addReply(c, shared.ok);
         c->flags |= CACHE_CLOSE_AFTER_REPLY;
         return CACHE_ERR;
     }
-    c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
     if (!c->cmd) {
         flagTransaction(c);
         addReplyErrorFormat(c, "unknown command '%s' ", (char *) c->argv[0]->ptr);
@@ -1525,12 +1867,35 @@ int processCommand(cacheClient *c) {
         }
     }
     if (server.maxmemory) {
-        int retval = freeMemoryIfNeeded();
+        int retval;
+        if (!server.batch_active) {
+            retval = freeMemoryIfNeeded();
+        } else if (zmalloc_used_memory() <= server.maxmemory) {
+            retval = CACHE_OK;
+            server.batch_deny_oom = 0;
+        } else if (server.batch_deny_oom) {
+            retval = CACHE_ERR;
+        } else {
+            retval = freeMemoryIfNeeded();
+            server.batch_deny_oom = retval == CACHE_ERR;
+        }
         if ((c->cmd->flags & CACHE_CMD_DENYOOM) && retval == CACHE_ERR) {
             flagTransaction(c);
             addReply(c, shared.oomerr);
             return CACHE_OK;
         }
+        /* A command about to create a key that is not worth a victim is
+         * refused before it runs, see admissionAdmitKey(). */
+        if ((c->cmd->flags & CACHE_CMD_DENYOOM) && server.admission_sketch &&
+            !(c->flags & CACHE_MASTER) && c->cmd->firstkey > 0 &&
+            c->cmd->firstkey < c->argc &&
+            dictFind(c->db->dict, c->argv[c->cmd->firstkey]->ptr) == NULL &&
+            !admissionAdmitKey(c->argv[c->cmd->firstkey]->ptr)) {
+            admissionRecordAccess(c->argv[c->cmd->firstkey]->ptr);
+            flagTransaction(c);
+            addReply(c, shared.notadmittederr);
+            return CACHE_OK;
+        }
     }
     if (((server.stop_writes_on_bgsave_err && server.saveparamslen > 0 && server.lastbgsave_status == CACHE_ERR) ||
          server.aof_last_write_status == CACHE_ERR) && server.masterhost == NULL &&
@@ -1578,6 +1943,20 @@ int processCommand(cacheClient *c) {
         addReply(c, shared.slowscripterr);
         return CACHE_OK;
     }
+    if (c->flags & CACHE_MULTI && c->cmd->proc != execCommand &&
+        c->cmd->proc != discardCommand && c->cmd->proc != multiCommand &&
+        c->cmd->proc != watchCommand) {
+        queueMultiCommand(c);
+        addReply(c, shared.queued);
+    } else {
+        if (server.batch_active &&
+            (c->cmd->proc == waitCommand || c->cmd->flags & CACHE_CMD_ADMIN))
+            flushCommandBatch(c);
+        call(c, CACHE_CALL_FULL);
+        if (!server.batch_active) c->woff = server.master_repl_offset;
+        if (listLength(server.ready_keys)) handleClientsBlockedOnLists();
+    }
+    return CACHE_OK;
 }
 
 
@@ -31,6 +31,11 @@ typedef long long ms_time_t;
 #include "dict.h"
 #include "intset.h"
 #include "latency.h"
+#include "listpack.h"
+#include "quicklist.h"
+#include "rax.h"
+#include "roaring.h"
+#include "cmsketch.h"
 #include "sds.h"
 #include "sparkline.h"
 #include "util.h"
@@ -83,6 +88,7 @@ typedef long long ms_time_t;
 #define CACHE_DEFAULT_RDB_COMPRESSION 1
 #define CACHE_DEFAULT_RDB_CHECKSUM 1
 #define CACHE_DEFAULT_RDB_FILENAME "dump.rdb"
+#define CACHE_DEFAULT_RDB_THREADED_SNAPSHOT 0
 #define CACHE_DEFAULT_REPL_DISKLESS_SYNC 0
 #define CACHE_DEFAULT_REPL_DISKLESS_SYNC_DELAY 5
 #define CACHE_DEFAULT_SLAVE_SERVER_STALE_DATA 1
@@ -90,10 +96,30 @@ typedef long long ms_time_t;
 #define CACHE_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define CACHE_DEFAULT_MAXMEMORY 0
 #define CACHE_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CACHE_DEFAULT_MAXMEMORY_EVICTION_BUDGET 500
+#define CACHE_EVICTION_LAZYFREE_WAIT 100000 /* us */
+#define CACHE_DEFAULT_ADMISSION_FILTER 0
+#define CACHE_DEFAULT_ADMISSION_SKETCH_WIDTH (1 << 20)
+#define CACHE_ADMISSION_WARM_FREQ 6
 #define CACHE_DEFAULT_AOF_FILENAME "appendonly.aof"
 #define CACHE_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define CACHE_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CACHE_DEFAULT_ACTIVE_REHASHING 1
+#define CACHE_DEFAULT_BG_REHASHING 0
+#define CACHE_BG_REHASH_MIN_KEYS (1024 * 1024)
+#define CACHE_DEFAULT_IO_THREADS_NUM 1
+#define CACHE_DEFAULT_IO_THREADS_DO_READS 0
+#define CACHE_IO_THREADS_MAX_NUM 128
+#define CACHE_DEFAULT_PIPELINE_BATCHING 0
+#define CACHE_DEFAULT_KEYSPACE_INDEX 0
+#define CACHE_DEFAULT_EXPIRES_INDEX 0
+#define CACHE_DEFAULT_LAZYFREE 0
+#define CACHE_LAZYFREE_THRESHOLD 64
+#define CACHE_EMPTYDB_NO_FLAGS 0
+#define CACHE_EMPTYDB_ASYNC (1 << 0)
+#define CACHE_IO_THREADS_OP_IDLE 0
+#define CACHE_IO_THREADS_OP_READ 1
+#define CACHE_IO_THREADS_OP_WRITE 2
 #define CACHE_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CACHE_DEFAULT_MIN_SLAVES_TO_WRITE 0
 #define CACHE_DEFAULT_MIN_SLAVES_MAX_LAG 10
@@ -115,6 +141,8 @@ typedef long long ms_time_t;
 #define CACHE_MAX_QUERYBUF_LEN (1024 * 1024 * 1024)
 #define CACHE_IOBUF_LEN (1024 * 16)
 #define CACHE_REPLY_CHUNK_BYTES (16 * 1024)
+#define CACHE_REPLY_ZEROCOPY_MIN_BYTES 1024
+#define CACHE_IOV_MAX 64
 #define CACHE_INLINE_MAX_SIZE (1024 * 16)
 #define CACHE_MBULK_BIG_ARG (1024 * 32)
 #define CACHE_LONGSTR_SIZE 21
@@ -149,6 +177,10 @@ typedef long long ms_time_t;
 #define CACHE_ENCODING_INTSET 6
 #define CACHE_ENCODING_SKIPLIST 7
 #define CACHE_ENCODING_EMBSTR 8
+#define CACHE_ENCODING_QUICKLIST 9
+#define CACHE_ENCODING_LISTPACK 10
+#define CACHE_ENCODING_ROARING 11
+#define CACHE_ENCODING_EMBSTR_SIZE_LIMIT 44 /* 69 bytes with the header */
 #define CACHE_RDB_6BITLEN 0
 #define CACHE_RDB_14BITLEN 1
 #define CACHE_RDB_32BITLEN 2
@@ -182,6 +214,10 @@ typedef long long ms_time_t;
 #define CACHE_PRE_PSYNC (1 << 16)
 #define CACHE_READONLY (1 << 17)
 #define CACHE_PUBSUB (1 << 18)
+#define CACHE_PENDING_READ (1 << 19)
+#define CACHE_PENDING_WRITE (1 << 20)
+#define CACHE_PENDING_COMMAND (1 << 21)
+#define CACHE_CLOSE_AFTER_IO (1 << 22)
 
 #define CACKE_BLOCKED_NONE 0
 #define CACHE_BLOCKED_LIST 1
@@ -233,6 +269,8 @@ typedef long long ms_time_t;
 #define CACHE_HASH_MAX_ZIPLIST_VALUE 64
 #define CACHE_LIST_MAX_ZIPLIST_ENTRIES 512
 #define CACHE_LIST_MAX_ZIPLIST_VALUE 64
+#define CACHE_LIST_MAX_ZIPLIST_SIZE -2
+#define CACHE_LIST_COMPRESS_DEPTH 0
 #define CACHE_SET_MAX_INTSET_ENTRIES 512
 #define CACHE_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define CACHE_ZSET_MAX_ZIPLIST_VALUE 64
@@ -247,6 +285,10 @@ typedef long long ms_time_t;
 #define CACHE_MAXMEMORY_ALLKEYS_LRU 3
 #define CACHE_MAXMEMORY_ALLKEYS_RANDOM 4
 #define CACHE_MAXMEMORY_NO_EVICTION 5
+#define CACHE_MAXMEMORY_VOLATILE_LFU 6
+#define CACHE_MAXMEMORY_ALLKEYS_LFU 7
+#define CACHE_MAXMEMORY_IS_LFU(p) \
+  ((p) == CACHE_MAXMEMORY_VOLATILE_LFU || (p) == CACHE_MAXMEMORY_ALLKEYS_LFU)
 #define CACHE_DEFAULT_MAXMEMORY_POLICY CACHE_MAXMEMORY_NO_EVICTION
 #define CACHE_LUA_TIME_LIMIT 5000
 #define UNIT_SECONDS 0
@@ -294,6 +336,12 @@ typedef long long ms_time_t;
 #define CACHE_LRU_BITS 24
 #define CACHE_LRU_CLOCK_MAX ((1 << CACHE_LRU_BITS) - 1)
 #define CACHE_LRU_CLOCK_RESOLUTION 1000
+/* With an LFU policy the lru field holds the minute of the last counter
+ * decrement in its 16 high bits and a logarithmic access counter in the
+ * 8 low bits. */
+#define CACHE_LFU_INIT_VAL 5
+#define CACHE_DEFAULT_LFU_LOG_FACTOR 10
+#define CACHE_DEFAULT_LFU_DECAY_TIME 1
 typedef struct cacheObject {
     unsigned type: 4;
     unsigned encoding: 4;
@@ -314,21 +362,37 @@ typedef struct cacheObject {
     _var.ptr = _ptr;                       \
   } while (0);
 
-#define CACHE_EVICTION_POOL_SIZE 16
+/* A short key stored in the same allocation as its keyspace entry: the
+ * first fields are those of a DictEntry, the key sds follows them. The
+ * value is the caller's object, as with any other entry. See dbDictAdd(). */
+#define CACHE_EMBEDDED_KEY_MAX_LEN 64
+
+typedef struct cacheEmbeddedEntry {
+    void *key;
+    void *val;
+    uint64_t hash;
+    char data[];
+} cacheEmbeddedEntry;
+
+#define CACHE_EVICTION_POOL_SIZE 64
+#define CACHE_EVICTION_BATCH_SAMPLES 64
+#define CACHE_EVICTION_SAMPLES_MAX 256
 struct evictionPoolEntry {
     unsigned long long idle;
-    Sds *key;
+    Sds key;
+    int dbid;
 };
 
 typedef struct cacheDB {
     Dict *dict;
+    Rax *keys_index;
     Dict *expires;
+    Rax *expires_index;
     Dict *blocking_keys;
     Dict *ready_keys;
     Dict *watched_keys;
     int id;
     long long avg_ttl;
-    struct evictionPoolEntry *eviction_pool;
 } cacheDB;
 
 typedef struct multiCmd {
@@ -373,6 +437,9 @@ typedef struct cacheClient {
     long bulklen;
     List *reply;
     unsigned long reply_bytes;
+    unsigned long reply_sent; /* Written reply nodes left to release, see networking.c. */
+    ListNode *reply_unsent; /* First node after them while reply_sent > 0. */
+    int reply_zerocopy; /* c->reply references objects it doesn't own. */
     int sentlen;
     time_t ctime;
     time_t lastinteraction;
@@ -413,7 +480,7 @@ struct sharedObjectStruct {
             *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr, *outofrangeerr,
             *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr, *masterdownerr,
             *roslaveerr, *execaborterr, *noautherr, *noreplicaserr, *busykeyerr,
-            *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
+            *oomerr, *notadmittederr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
             *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *rpop, *lpop,
             *lpush, *emptyscan, *minstring, *maxstring,
             *select[CACHE_SHARED_SELECT_CMDS], *integers[CACHE_SHARED_INTEGERS],
@@ -474,10 +541,14 @@ struct cacheServer {
     cacheDB *db;
     Dict *commands;
     Dict *orig_commands;
+    /* Set once server.commands diverges from cacheCommandTable: lookups
+     * then go through the dict instead of the static perfect hash. */
+    int commands_renamed;
     aeEventLoop *el;
     unsigned lruclock: CACHE_LRU_BITS;
     int shutdown_asap;
     int activerehashing;
+    int bgrehashing;
     char *requirepass;
     char *pidfile;
     int arch_bits;
@@ -497,6 +568,10 @@ struct cacheServer {
     int cfd_count;
     List *clients;
     List *clients_to_close;
+    List *clients_pending_read, *clients_pending_write;
+    int io_threads_num;
+    int io_threads_do_reads;
+    int io_threads_active;
     List *slaves, *monitors;
     cacheClient *current_client;
     int clients_paused;
@@ -515,6 +590,10 @@ struct cacheServer {
     long long stat_numcommands;
     long long stat_numconnections;
     long long stat_expiredkeys;
+    long long stat_expired_bytes;
+    long long stat_expire_cycle_time_used;
+    long long stat_admission_admitted;
+    long long stat_admission_rejected;
     long long stat_evictedkeys;
     long long stat_keyspace_hits;
     long long stat_keyspace_misses;
@@ -595,7 +674,18 @@ struct cacheServer {
     int stop_writes_on_bgsave_err;
     int rdb_pipe_write_result_to_parent;
     int rdb_pipe_read_result_from_child;
+    int rdb_threaded_snapshot;
+    struct snapshotState *snapshot;
     cacheOPArray also_propagate;
+    int pipeline_batching;
+    int batch_active;
+    int batch_deny_oom;
+    long long batch_clock;
+    cacheOPArray batch_propagate;
+    int keyspace_index;
+    int expires_index;
+    int lazyfree;
+    unsigned long reply_zerocopy_clients; /* Clients with reply_zerocopy set. */
     char *logfile;
     int syslog_enabled;
     char *syslog_ident;
@@ -646,6 +736,14 @@ struct cacheServer {
     unsigned long long maxmemory;
     int maxmemory_policy;
     int maxmemory_samples;
+    long long maxmemory_eviction_budget;
+    int lfu_log_factor;
+    int lfu_decay_time;
+    int admission_filter;
+    unsigned long long admission_sketch_width;
+    CmSketch *admission_sketch;
+    struct evictionPoolEntry *eviction_pool;
+    int eviction_pending;
     unsigned int bpop_blocked_clients;
     List *unblocked_clients;
     List *ready_keys;
@@ -658,6 +756,8 @@ struct cacheServer {
     size_t hash_max_ziplist_value;
     size_t list_max_ziplist_entries;
     size_t list_max_ziplist_value;
+    int list_max_ziplist_size;
+    int list_compress_depth;
     size_t set_max_intset_entries;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
@@ -738,14 +838,14 @@ typedef struct {
     cobj *subject;
     unsigned char encoding;
     unsigned char direction;
-    unsigned char *zi;
-    ListNode *ln;
+    unsigned char *lpi;
+    quicklistIter *iter;
 } listTypeIterator;
 
 typedef struct {
     listTypeIterator *li;
-    unsigned char *zi;
-    ListNode *ln;
+    unsigned char *lpi;
+    quicklistEntry entry;
 } listTypeEntry;
 
 typedef struct {
@@ -753,6 +853,7 @@ typedef struct {
     int encoding;
     int ii;
     DictIterator *di;
+    roaringIterator ri;
 } setTypeIterator;
 
 typedef struct {
@@ -773,6 +874,7 @@ extern DictType zsetDictType;
 extern DictType clusterNodesDictType;
 extern DictType clusterNodesBlackListDictType;
 extern DictType dbDictType;
+extern DictType keyptrDictType;
 extern DictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern DictType hashDictType;
@@ -804,6 +906,28 @@ void resetClient(cacheClient *c);
 
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 
+int writeToClient(int fd, cacheClient *c, int handler_installed);
+
+int prepareClientToWrite(cacheClient *c);
+
+int clientHasPendingReplies(cacheClient *c);
+
+void clientReleaseSentReplies(cacheClient *c);
+
+void clientReplyReleased(cacheClient *c);
+
+extern int io_threads_op;
+
+void initThreadedIO(void);
+
+int postponeClientRead(cacheClient *c);
+
+void queueClientForWrite(cacheClient *c);
+
+int handleClientsWithPendingReadsUsingThreads(void);
+
+int handleClientsWithPendingWritesUsingThreads(void);
+
 void *addDeferredMultiBulkLength(cacheClient *c);
 
 void setDeferredMultiBulkLength(cacheClient *c, void *node, long length);
@@ -989,10 +1113,16 @@ cobj *createListObject(void);
 
 cobj *createZipListObject(void);
 
+cobj *createQuicklistObject(void);
+
+cobj *createListListpackObject(void);
+
 cobj *createSetObject(void);
 
 cobj *createIntsetObject(void);
 
+cobj *createRoaringSetObject(void);
+
 cobj *createHashObject(void);
 
 cobj *createZsetObject(void);
@@ -1027,6 +1157,12 @@ int equalStringObjects(cobj *a, cobj *b);
 
 unsigned long long estimateObjectIdleTime(cobj *o);
 
+void initObjectLRUOrLFU(cobj *o);
+
+cobj *objectCommandLookup(cacheClient *c, cobj *key);
+
+cobj *objectCommandLookupOrReply(cacheClient *c, cobj *key, cobj *reply);
+
 #define sdsEncodedObject(objptr)               \
   ((objptr)->encoding == CACHE_ENCODING_RAW || \
    (objptr)->encoding == CACHE_ENCODING_EMBSTR)
@@ -1086,6 +1222,16 @@ void stopLoading(void);
 
 #include "rdb.h"
 
+int snapshotStart(char *filename);
+
+void snapshotCron(void);
+
+void snapshotTouchKey(cacheDB *db, cobj *key);
+
+void snapshotAbort(void);
+
+void snapshotWrite(void *arg);
+
 void flushAppendOnlyFile(int force);
 
 void feedAppendOnlyFile(struct cacheCommand *cmd, int dictid, cobj **argv,
@@ -1143,8 +1289,24 @@ void zsetConvert(cobj *zobj, int encoding);
 
 unsigned long zslGetRank(zskiplist *zsl, double score, cobj *o);
 
+unsigned long LFUGetTimeInMinutes(void);
+
+uint8_t LFULogIncr(uint8_t counter);
+
+unsigned long LFUDecrAndReturn(cobj *o);
+
+void updateLFU(cobj *val);
+
+struct evictionPoolEntry *evictionPoolAlloc(void);
+
 int freeMemoryIfNeeded(void);
 
+void admissionRecordAccess(Sds key);
+
+int admissionAdmitKey(Sds key);
+
+Sds genAdmissionInfoString(Sds info);
+
 int processCommand(cacheClient *c);
 
 void setupSignalHandlers(void);
@@ -1157,6 +1319,14 @@ struct cacheCommand *lookupCmmandOrOriginal(Sds name);
 
 void call(cacheClient *c, int flags);
 
+void cacheOpArrayInit(cacheOPArray *oa);
+
+void beginCommandBatch(void);
+
+void flushCommandBatch(cacheClient *c);
+
+void endCommandBatch(cacheClient *c);
+
 void propagate(struct cacheCommand *cmd, int dbid, cobj **argv, int argc,
                int target);
 
@@ -1168,11 +1338,11 @@ void forceCommandPropagation(cacheClient *c, int flags);
 int prepareForShutdown(void);
 
 #ifdef __GUNC__
-void redislog(int level, const char *fmt, ...)
+void cacheLog(int level, const char *fmt, ...)
     __attribute__((format(printf, 2, 3)));
 #else
 
-void redislog(int level, const char *fmt, ...);
+void cacheLog(int level, const char *fmt, ...);
 
 #endif
 
@@ -1190,6 +1360,8 @@ void oom(const char *msg);
 
 void populateCommandTable(void);
 
+void commandTableCheckRenamed(void);
+
 void resetCommandTableStats(void);
 
 void adjustOpenFilesLimit(void);
@@ -1216,12 +1388,16 @@ void setTypeReleaseIterator(setTypeIterator *si);
 
 int setTypeNext(setTypeIterator *si, cobj **objele, int64_t *llele);
 
+cobj *setTypeNextObject(setTypeIterator *si);
+
 int setTypeRandomElement(cobj *setobj, cobj **objele, int64_t *llele);
 
 unsigned long setTypeSize(cobj *subject);
 
 void setTypeConvert(cobj *subject, int enc);
 
+cobj *setTypeRoaringToIntset(cobj *setobj);
+
 void hashTypeConvert(cobj *o, int enc);
 
 void hashTypeTryCnversion(cobj *subject, cobj **argv, int start, int end);
@@ -1297,6 +1473,8 @@ cobj *lookupKey(cacheDB *db, cobj *key);
 
 cobj *loohupKeyRead(cacheDB *db, cobj *key);
 
+cobj *lookupKeyRead(cacheDB *db, cobj *key);
+
 cobj *lookupKeyWrite(cacheDB *db, cobj *key);
 
 cobj *lookupKeyReadOrReply(cacheClient *c, cobj *key, cobj *reply);
@@ -1305,6 +1483,9 @@ cobj *lookupKeyWriteOrReply(cacheClient *c, cobj *key, cobj *reply);
 
 void dbAdd(cacheDB *db, cobj *key, cobj *val);
 
+int dbDictAdd(Dict *d, Sds key, cobj *val);
+
+
 void dbOverwrite(cacheDB *db, cobj *key, cobj *val);
 
 void setKey(cacheDB *db, cobj *key, cobj *val);
@@ -1319,12 +1500,60 @@ cobj *dbUnshareStringValue(cacheDB *db, cobj *key, cobj *o);
 
 long long emptyDb(void(callback)(void *));
 
+size_t lazyfreeGetPendingObjectsCount(void);
+
+size_t lazyfreeGetQueuedObjectsCount(void);
+
+size_t lazyfreeGetFreedObjectsCount(void);
+
+size_t lazyfreeGetFreeEffort(cobj *obj);
+
+void freeObjAsync(cobj *obj);
+
+int dbAsyncDelete(cacheDB *db, cobj *key);
+
+void emptyDbAsync(cacheDB *db);
+
+void slotToKeyFlushAsync(void);
+
+void lazyfreeFreeObjectFromBioThread(cobj *obj);
+
+void lazyfreeFreeDatabaseFromBioThread(Dict *d, Rax *index);
+
+int getFlushCommandFlags(cacheClient *c, int *flags);
+
 int selectDb(cacheClient *c, int id);
 
 void signalModifiedKey(cacheDB *db, cobj *key);
 
 void signalFlushedDb(cacheDB *db);
 
+void dbIndexAdd(cacheDB *db, Sds key);
+
+void dbIndexDelete(cacheDB *db, Sds key);
+
+void dbIndexEmpty(cacheDB *db);
+
+typedef void(dbIndexKeyFunction)(void *privdata, const char *key, size_t len);
+
+int dbIndexMatchKeys(cacheDB *db, Sds pattern, dbIndexKeyFunction *fn,
+                     void *privdata);
+
+void expireIndexAdd(cacheDB *db, Sds key, long long when);
+
+void expireIndexDelete(cacheDB *db, Sds key, long long when);
+
+void expireIndexEmpty(cacheDB *db);
+
+unsigned int expireIndexGetExpired(cacheDB *db, long long now, cobj **keys,
+                                   long long *when, unsigned int count);
+
+void slotToKeyAdd(cobj *key);
+
+void slotToKeyDel(cobj *key);
+
+void slotToKeyFlush(void);
+
 unsigned int getKeysInSlot(unsigned int hashslot, cobj **keys,
                            unsigned int count);
 
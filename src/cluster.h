@@ -105,7 +105,8 @@ typedef struct clusterState {
     clusterNode *migrating_slots_to[CACHE_CLUSTER_SLOTS];
     clusterNode *importing_slots_from[CACHE_CLUSTER_SLOTS];
     clusterNode *slots[CACHE_CLUSTER_SLOTS];
-    zskiplist *slots_to_keys;
+    Rax *slots_to_keys;
+    uint64_t slots_keys_count[CACHE_CLUSTER_SLOTS];
     ms_time_t failover_auth_time;
     int failover_auth_count;
     int failover_auth_sent;
@@ -214,4 +215,6 @@ int clusterRedirectBlockedClientIfNeeded(cacheClient *c);
 void clusterRedirectClient(cacheClient *c, clusterNode *n, int hashsolt,
                            int error_code);
 
+unsigned int keyHashSlot(char *key, int keylen);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include "cmsketch.h"
+
+#include <string.h>
+
+#include "zmalloc.h"
+
+static uint64_t _cmSketchRoundWidth(uint64_t width) {
+  uint64_t w = 64;
+  while (w < width) w <<= 1;
+  return w;
+}
+
+/* Counter of `row` for hash. The rows use double hashing on the two
+ * halves of the hash, so one 64 bit hash is enough for all of them. */
+static inline uint64_t _cmSketchIndex(CmSketch *s, uint64_t hash, int row) {
+  uint64_t h2 = ((hash >> 32) | (hash << 32)) * 0x9E3779B97F4A7C15ULL;
+  return row * s->width + ((hash + row * (h2 | 1)) & (s->width - 1));
+}
+
+static inline unsigned int _cmSketchGet(CmSketch *s, uint64_t idx) {
+  return (s->table[idx >> 1] >> ((idx & 1) << 2)) & 0xf;
+}
+
+CmSketch *cmSketchCreate(uint64_t width) {
+  CmSketch *s = zmalloc(sizeof(*s));
+  s->width = _cmSketchRoundWidth(width);
+  s->table = zcalloc(s->width * CMSKETCH_DEPTH / 2);
+  s->additions = 0;
+  s->sample_size = s->width * CMSKETCH_SAMPLE_FACTOR;
+  s->resets = 0;
+  return s;
+}
+
+void cmSketchRelease(CmSketch *s) {
+  zfree(s->table);
+  zfree(s);
+}
+
+/* Conservative update: only the counters at the current minimum are
+ * incremented, which keeps the overestimate of cold keys down. */
+void cmSketchIncr(CmSketch *s, uint64_t hash) {
+  uint64_t idx[CMSKETCH_DEPTH];
+  unsigned int min = CMSKETCH_COUNTER_MAX;
+  int row;
+  for (row = 0; row < CMSKETCH_DEPTH; row++) {
+    unsigned int c;
+    idx[row] = _cmSketchIndex(s, hash, row);
+    c = _cmSketchGet(s, idx[row]);
+    if (c < min) min = c;
+  }
+  if (min == CMSKETCH_COUNTER_MAX) return;
+  for (row = 0; row < CMSKETCH_DEPTH; row++) {
+    if (_cmSketchGet(s, idx[row]) == min)
+      s->table[idx[row] >> 1] += 1 << ((idx[row] & 1) << 2);
+  }
+  if (++s->additions >= s->sample_size) cmSketchReset(s);
+}
+
+unsigned int cmSketchEstimate(CmSketch *s, uint64_t hash) {
+  unsigned int min = CMSKETCH_COUNTER_MAX;
+  int row;
+  for (row = 0; row < CMSKETCH_DEPTH; row++) {
+    unsigned int c = _cmSketchGet(s, _cmSketchIndex(s, hash, row));
+    if (c < min) min = c;
+  }
+  return min;
+}
+
+/* Halves every counter. */
+void cmSketchReset(CmSketch *s) {
+  uint64_t j, len = s->width * CMSKETCH_DEPTH / 2;
+  for (j = 0; j < len; j++) s->table[j] = (s->table[j] >> 1) & 0x77;
+  s->additions /= 2;
+  s->resets++;
+}
+
+#ifdef CMSKETCH_BENCHMARK_MAIN
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Replays a trace of Zipfian reads over `keys` keys with bursts of keys
+ * read once, as a scan or a load test warmup would, against an LRU cache
+ * of `capacity` keys: once admitting every miss, once only admitting a
+ * miss whose sketch estimate beats the LRU victim. */
+
+#define BENCH_BURST_EVERY 100000
+#define BENCH_BURST_LEN 20000
+
+typedef struct benchCache {
+  long capacity, used;
+  int32_t *slot; /* Key id to slot, -1 when not cached. */
+  long *key, *prev, *next;
+  long head, tail;
+} benchCache;
+
+static long long benchUstime(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t benchHash(long id) {
+  uint64_t h = (uint64_t)id * 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+static void benchUnlink(benchCache *c, long s) {
+  if (c->prev[s] != -1) c->next[c->prev[s]] = c->next[s]; else c->head = c->next[s];
+  if (c->next[s] != -1) c->prev[c->next[s]] = c->prev[s]; else c->tail = c->prev[s];
+}
+
+static void benchPushHead(benchCache *c, long s) {
+  c->prev[s] = -1;
+  c->next[s] = c->head;
+  if (c->head != -1) c->prev[c->head] = s;
+  c->head = s;
+  if (c->tail == -1) c->tail = s;
+}
+
+static double benchReplay(long *trace, long len, long ids, long capacity,
+                          CmSketch *sketch) {
+  benchCache c;
+  long j, hits = 0, gets = 0;
+  c.capacity = capacity;
+  c.used = 0;
+  c.slot = malloc(sizeof(int32_t) * ids);
+  memset(c.slot, -1, sizeof(int32_t) * ids);
+  c.key = malloc(sizeof(long) * capacity);
+  c.prev = malloc(sizeof(long) * capacity);
+  c.next = malloc(sizeof(long) * capacity);
+  c.head = c.tail = -1;
+  for (j = 0; j < len; j++) {
+    long id = trace[j], s;
+    if (id >= 0) gets++;
+    else id = -id - 1;
+    if (sketch) cmSketchIncr(sketch, benchHash(id));
+    if ((s = c.slot[id]) != -1) {
+      if (trace[j] >= 0) hits++;
+      benchUnlink(&c, s);
+      benchPushHead(&c, s);
+      continue;
+    }
+    if (c.used < c.capacity) {
+      s = c.used++;
+    } else {
+      s = c.tail;
+      if (sketch && cmSketchEstimate(sketch, benchHash(id)) <=
+                        cmSketchEstimate(sketch, benchHash(c.key[s])))
+        continue;
+      benchUnlink(&c, s);
+      c.slot[c.key[s]] = -1;
+    }
+    c.key[s] = id;
+    c.slot[id] = s;
+    benchPushHead(&c, s);
+  }
+  free(c.slot);
+  free(c.key);
+  free(c.prev);
+  free(c.next);
+  return (double)hits / gets;
+}
+
+int main(int argc, char **argv) {
+  long keys = argc > 1 ? atol(argv[1]) : 1000000;
+  long capacity = argc > 2 ? atol(argv[2]) : 10000;
+  long len = argc > 3 ? atol(argv[3]) : 5000000;
+  double alpha = argc > 4 ? atof(argv[4]) : 0.99, sum = 0;
+  double *cdf = malloc(sizeof(double) * keys);
+  long *trace = malloc(sizeof(long) * len), j, ids = keys;
+  CmSketch *sketch;
+  long long start, elapsed;
+  unsigned int sink = 0;
+
+  for (j = 0; j < keys; j++) cdf[j] = sum += 1.0 / pow(j + 1, alpha);
+  for (j = 0; j < len; j++) {
+    if (j % BENCH_BURST_EVERY < BENCH_BURST_LEN) {
+      /* Read once keys are stored negated so that they do not count as
+       * cache reads. */
+      trace[j] = -(ids++) - 1;
+    } else {
+      double u = drand48() * sum;
+      long lo = 0, hi = keys - 1;
+      while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+      }
+      trace[j] = lo;
+    }
+  }
+
+  printf("%ld requests over %ld keys, alpha %.2f, cache of %ld keys\n", len,
+         keys, alpha, capacity);
+  printf("lru: hit ratio %.4f\n", benchReplay(trace, len, ids, capacity, NULL));
+  sketch = cmSketchCreate(capacity * 16);
+  printf("lru + admission: hit ratio %.4f (%lu bytes of sketch)\n",
+         benchReplay(trace, len, ids, capacity, sketch),
+         (unsigned long)(sketch->width * CMSKETCH_DEPTH / 2));
+  start = benchUstime();
+  for (j = 0; j < len; j++) {
+    uint64_t h = benchHash(trace[j]);
+    cmSketchIncr(sketch, h);
+    sink += cmSketchEstimate(sketch, h);
+  }
+  elapsed = benchUstime() - start;
+  printf("sketch incr + estimate: %.1f ns (%u)\n", elapsed * 1000.0 / len,
+         sink & 1);
+  cmSketchRelease(sketch);
+  free(trace);
+  free(cdf);
+  return 0;
+}
+#endif
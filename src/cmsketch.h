@@ -0,0 +1,32 @@
+#ifndef CMSKETCH_H
+#define CMSKETCH_H
+
+#include <stdint.h>
+
+/* Count-min sketch of 4 bit counters, CMSKETCH_DEPTH rows of `width`
+ * counters packed two per byte. Every `width` * CMSKETCH_SAMPLE_FACTOR
+ * increments all the counters are halved, so the estimates follow the
+ * recent popularity of a key rather than its whole history. */
+#define CMSKETCH_DEPTH 4
+#define CMSKETCH_COUNTER_MAX 15
+#define CMSKETCH_SAMPLE_FACTOR 10
+
+typedef struct CmSketch {
+    uint8_t *table;
+    uint64_t width;
+    uint64_t additions;
+    uint64_t sample_size;
+    uint64_t resets;
+} CmSketch;
+
+CmSketch *cmSketchCreate(uint64_t width);
+
+void cmSketchRelease(CmSketch *s);
+
+void cmSketchIncr(CmSketch *s, uint64_t hash);
+
+unsigned int cmSketchEstimate(CmSketch *s, uint64_t hash);
+
+void cmSketchReset(CmSketch *s);
+
+#endif
@@ -16,6 +16,10 @@
 #define HAVE_BACKTRACE 1
 #define HAVE_EPOLL 1
 
+#if defined(USE_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+#define HAVE_IO_URING 1
+#endif
+
 #define aof_fsync fdatasync
 #define HAVE_SYNC_FILE_RANGE 1
 
@@ -2,68 +2,213 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "cacheassert.h"
 #include "macros.h"
 #include "zmalloc.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DICT_BUCKET_MAX_FILL 4
+#define dictBucketTag(h) ((uint8_t)((h) >> 56))
+#define _dictSize(d) ((d)->ht[0].used + (d)->ht[1].used)
+#define _dictSlots(d)                          \
+  (((d)->ht[0].size + (d)->ht[1].size) *       \
+   (dictIsBucketed(d) ? DICT_BUCKET_SLOTS : 1))
+#define DICT_FIND_BATCH 16
+
+#define DICT_BG_RUNNING 0
+#define DICT_BG_CANCEL 1
+#define DICT_BG_DONE 2
+#define DICT_BG_BATCH 100
+
+/* A rehash driven by a background thread. While d->bg is set the main
+ * thread takes the lock around every table access; `waiting` lets the
+ * helper step aside between batches when the main thread wants in. */
+typedef struct DictBgRehash {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int state;
+  int waiting;
+} DictBgRehash;
+
+/* Called with entries that were not saved yet by the running snapshot
+ * right before they are deleted or their value is replaced. */
+typedef struct DictSnapshot {
+  dictScanFunction *fn;
+  void *privdata;
+} DictSnapshot;
+
+#define _dictEntryEpoch(d) ((d)->epoch ? DICT_HASH_EPOCH_BIT : 0)
+#define _dictEntryHash(d, h) \
+  (((h) & ~(DICT_HASH_EPOCH_BIT | DICT_HASH_EMBEDDED_BIT)) | _dictEntryEpoch(d))
+
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 static int _dictExpandIfNeeded(Dict *d);
 static unsigned long _dictNextPower(unsigned long size);
-static int _dictKeyIndex(Dict *d, const void *key);
+static long _dictKeyIndex(Dict *d, const void *key, uint64_t h);
 static int _dictInit(Dict *d, DictType *type, void *privDataPtr);
 static void _dictReset(DictHT *d);
 static void _dictRehashStep(Dict *d);
 static int dictGenericDelete(Dict *d, const void *key, int no_free);
+static DictEntry *_dictGenericDelete(Dict *d, const void *key, int no_free);
 static int _dictClear(Dict *d, DictHT *ht, void(callback)(void *));
+static int _dictExpand(Dict *d, unsigned long size);
+static int _dictRehash(Dict *d, int n);
 static long long dictFingerPrint(Dict *d);
 static unsigned long rev(unsigned long v);
+static DictBucket *_dictBucketLookup(Dict *d, DictHT *ht, const void *key,
+                                     uint64_t h, int *slot);
+static DictBucket *_dictBucketFreeSlot(DictHT *ht, uint64_t h, int *slot);
+
+static uint64_t dict_hash_function_seed = 5381;
+void dictSetHashFunctionSeed(uint64_t seed) { dict_hash_function_seed = seed; }
+uint64_t dictGetHashFunctionSeed(void) { return dict_hash_function_seed; }
+
+static void _dictLock(Dict *d) {
+  if (d->bg) {
+    __atomic_add_fetch(&d->bg->waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&d->bg->lock);
+    __atomic_sub_fetch(&d->bg->waiting, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void _dictUnlock(Dict *d) {
+  if (d->bg) pthread_mutex_unlock(&d->bg->lock);
+}
 
-static uint32_t dict_hash_function_seed = 5381;
-void dictSetHashFunctionSeed(uint32_t seed) { dict_hash_function_seed = seed; }
-uint32_t dictGetHashFunctionSeed(void) { return dict_hash_function_seed; }
+/* An embedded entry was allocated together with its key by the caller:
+ * its value is released as usual, the rest goes back through the
+ * entryDestructor of the type. */
+static void _dictFreeEntry(Dict *d, DictEntry *he) {
+  dictFreeVal(d, he);
+  if (he->hash & DICT_HASH_EMBEDDED_BIT) {
+    d->type->entryDestructor(d->privdata, he);
+    return;
+  }
+  dictFreeKey(d, he);
+  zfree(he);
+}
 
-_dictClear(Dict *d, DictHT *ht, void(callback)(void *)) {
+int _dictClear(Dict *d, DictHT *ht, void(callback)(void *)) {
   unsigned long i;
   for (i = 0; i < ht->size && ht->used > 0; i++) {
     DictEntry *he, *next_he;
     if (callback && (i & 65535) == 0) callback(d->privdata);
-    if ((he == ht->table[i]) == NULL) continue;
+    if (dictIsBucketed(d)) {
+      DictBucket *b = &ht->buckets[i];
+      int j;
+      for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+        if (!(b->presence & (1 << j))) continue;
+        _dictFreeEntry(d, b->entries[j]);
+        ht->used--;
+      }
+      continue;
+    }
+    if ((he = ht->table[i]) == NULL) continue;
     while (he) {
       next_he = he->next;
-      dictFreeKey(d, he);
-      dictFreeVal(d, he);
-      zfree(he);
+      _dictFreeEntry(d, he);
       ht->used--;
       he = next_he;
     }
   }
   zfree(ht->table);
+  zfree(ht->buckets);
   _dictReset(ht);
   return DICT_OK;
 }
 
+/* Compares the tag against the whole 8-byte bucket header at once and
+ * returns the occupied slots whose tag matches, one bit per slot. */
+static inline unsigned int _dictBucketMatch(const DictBucket *b, uint8_t tag) {
+#if defined(__SSE2__)
+  __m128i header = _mm_loadl_epi64((const __m128i *)b);
+  __m128i eq = _mm_cmpeq_epi8(header, _mm_set1_epi8((char)tag));
+  return ((unsigned int)_mm_movemask_epi8(eq) >> 1) & b->presence &
+         DICT_BUCKET_FULL;
+#else
+  uint64_t w, t;
+  memcpy(&w, b, sizeof(w));
+  w ^= 0x0101010101010101ULL * tag;
+  t = ~(((w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | w |
+        0x7f7f7f7f7f7f7f7fULL);
+  return ((unsigned int)(((t >> 7) * 0x0102040810204080ULL) >> 56) >> 1) &
+         b->presence;
+#endif
+}
+
+DictBucket *_dictBucketLookup(Dict *d, DictHT *ht, const void *key,
+                              uint64_t h, int *slot) {
+  unsigned long idx, probes = 0;
+  uint8_t tag = dictBucketTag(h);
+  if (ht->size == 0) return NULL;
+  idx = h & ht->size_mask;
+  while (1) {
+    DictBucket *b = &ht->buckets[idx];
+    unsigned int match = _dictBucketMatch(b, tag);
+    while (match) {
+      int j = __builtin_ctz(match);
+      if (dictCompareKeys(d, key, b->entries[j]->key)) {
+        *slot = j;
+        return b;
+      }
+      match &= match - 1;
+    }
+    if (!(b->presence & DICT_BUCKET_EVER_FULL) || ++probes == ht->size)
+      return NULL;
+    idx = (idx + 1) & ht->size_mask;
+  }
+}
+
+DictBucket *_dictBucketFreeSlot(DictHT *ht, uint64_t h, int *slot) {
+  unsigned long idx = h & ht->size_mask, probes;
+  for (probes = 0; probes < ht->size; probes++) {
+    DictBucket *b = &ht->buckets[idx];
+    if ((b->presence & DICT_BUCKET_FULL) != DICT_BUCKET_FULL) {
+      *slot = __builtin_ctz(~b->presence & DICT_BUCKET_FULL);
+      return b;
+    }
+    b->presence |= DICT_BUCKET_EVER_FULL;
+    idx = (idx + 1) & ht->size_mask;
+  }
+  return NULL;
+}
+
 int _dictExpandIfNeeded(Dict *d) {
+  /* A pending background expand gets the same slack as a forked child. */
+  int can_resize = dict_can_resize && d->bg == NULL;
   if (dictIsRehashing(d)) return DICT_OK;
-  if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+  if (d->ht[0].size == 0) return _dictExpand(d, DICT_HT_INITIAL_SIZE);
+  if (dictIsBucketed(d)) {
+    if (d->ht[0].used >= d->ht[0].size * DICT_BUCKET_MAX_FILL &&
+        (can_resize ||
+         d->ht[0].used >= d->ht[0].size * (DICT_BUCKET_SLOTS - 1)))
+      return _dictExpand(d, d->ht[0].used * 2);
+    return DICT_OK;
+  }
   if (d->ht[0].used >= d->ht[0].size &&
-      (dict_can_resize ||
-       d->ht[0].used / d->ht[0].size > dict_force_resize_ratio))
-    return dictExpand(d, d->ht[0].used * 2);
+      (can_resize || d->ht[0].used / d->ht[0].size > dict_force_resize_ratio))
+    return _dictExpand(d, d->ht[0].used * 2);
   return DICT_OK;
 }
 
-int _dictKeyIndex(Dict *d, const void *key) {
-  unsigned int h, idx, table;
+long _dictKeyIndex(Dict *d, const void *key, uint64_t h) {
+  unsigned long idx, table;
   DictEntry *he;
   if (_dictExpandIfNeeded(d) == DCIT_ERR) return -1;
-  h = dictHashKey(d, key);
   for (table = 0; table <= 1; table++) {
     idx = h & d->ht[table].size_mask;
     he = d->ht[table].table[idx];
@@ -87,6 +232,7 @@ unsigned long _dictNextPower(unsigned long size) {
 
 void _dictReset(DictHT *ht) {
   ht->table = NULL;
+  ht->buckets = NULL;
   ht->size = 0;
   ht->size_mask = 0;
   ht->used = 0;
@@ -99,11 +245,19 @@ int _dictInit(Dict *d, DictType *t, void *privDataPtr) {
   d->privdata = privDataPtr;
   d->rehashidx = -1;
   d->iterators = 0;
+  d->epoch = 0;
+  d->bg = NULL;
+  d->snapshot = NULL;
   return DICT_OK;
 }
 
+/* With a background rehash in flight the main thread only steps in when
+ * the helper has fallen so far behind that the target table is full. */
 void _dictRehashStep(Dict *d) {
-  if (d->iterators == 0) dictRehash(d, 1);
+  unsigned long grow_at = d->ht[1].size;
+  if (dictIsBucketed(d)) grow_at *= DICT_BUCKET_MAX_FILL;
+  if (d->iterators == 0 && (d->bg == NULL || d->ht[1].used >= grow_at))
+    _dictRehash(d, 1);
 }
 
 void dictEnableResize(void) { dict_can_resize = 1; }
@@ -111,26 +265,49 @@ void dictEnableResize(void) { dict_can_resize = 1; }
 void dictDisableResize(void) { dict_can_resize = 0; }
 
 void dictEmpty(Dict *d, void(callback)(void *)) {
+  _dictLock(d);
   _dictClear(d, &d->ht[0], callback);
   _dictClear(d, &d->ht[1], callback);
   d->rehashidx = -1;
   d->iterators = 0;
+  _dictUnlock(d);
 }
 
-unsigned long dictScan(Dict *d, unsigned long v, dictScanFunction *fn,
-                       void *priv_data) {
-  DictHT *t0, *t1;
+static void _dictScanSlot(Dict *d, DictHT *ht, unsigned long idx,
+                          dictScanFunction *fn, void *priv_data) {
   const DictEntry *de;
-  unsigned long m0, m1;
-  if (dictSize(d) == 0) return 0;
-  if (!dictIsRehashing(d)) {
-    t0 = &(d->ht[0]);
-    m0 = t0->size_mask;
-    de = t0->table[v & m0];
+  unsigned long probes = 0;
+  idx &= ht->size_mask;
+  if (!dictIsBucketed(d)) {
+    de = ht->table[idx];
     while (de) {
       fn(priv_data, de);
       de = de->next;
     }
+    return;
+  }
+  /* Entries displaced from a full bucket live further along the probe
+   * chain, so the chain is emitted as a whole. */
+  while (1) {
+    DictBucket *b = &ht->buckets[idx];
+    int j;
+    for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+      if (b->presence & (1 << j)) fn(priv_data, b->entries[j]);
+    }
+    if (!(b->presence & DICT_BUCKET_EVER_FULL) || ++probes == ht->size) break;
+    idx = (idx + 1) & ht->size_mask;
+  }
+}
+
+static unsigned long _dictScan(Dict *d, unsigned long v, dictScanFunction *fn,
+                               void *priv_data) {
+  DictHT *t0, *t1;
+  unsigned long m0, m1;
+  if (_dictSize(d) == 0) return 0;
+  if (!dictIsRehashing(d)) {
+    t0 = &(d->ht[0]);
+    m0 = t0->size_mask;
+    _dictScanSlot(d, t0, v & m0, fn, priv_data);
   } else {
     t0 = &d->ht[0];
     t1 = &d->ht[1];
@@ -140,17 +317,9 @@ unsigned long dictScan(Dict *d, unsigned long v, dictScanFunction *fn,
     }
     m0 = t0->size_mask;
     m1 = t1->size_mask;
-    de = t0->table[v & m0];
-    while (de) {
-      fn(priv_data, de);
-      de = de->next;
-    }
+    _dictScanSlot(d, t0, v & m0, fn, priv_data);
     do {
-      de = t1->table[v & m1];
-      while (de) {
-        fn(priv_data, de);
-        de = de->next;
-      }
+      _dictScanSlot(d, t1, v & m1, fn, priv_data);
       v = (((v | m0) + 1) & ~m0) | (v & m0);
     } while (v & (m0 ^ m1));
   }
@@ -161,6 +330,14 @@ unsigned long dictScan(Dict *d, unsigned long v, dictScanFunction *fn,
   return v;
 }
 
+unsigned long dictScan(Dict *d, unsigned long v, dictScanFunction *fn,
+                       void *priv_data) {
+  _dictLock(d);
+  v = _dictScan(d, v, fn, priv_data);
+  _dictUnlock(d);
+  return v;
+}
+
 unsigned long rev(unsigned long v) {
   unsigned long s = 8 * sizeof(v);
   unsigned long mask = ~0;
@@ -171,13 +348,14 @@ unsigned long rev(unsigned long v) {
   return v;
 }
 
-unsigned int dictGetSomeKeys(Dict *d, DictEntry **des, unsigned int count) {
+static unsigned int _dictGetSomeKeys(Dict *d, DictEntry **des,
+                                     unsigned int count) {
   unsigned int j;
   unsigned int tables;
   unsigned int stored = 0, max_size_mask;
   unsigned int max_steps;
 
-  if (dictSize(d) < count) count = dictSize(d);
+  if (_dictSize(d) < count) count = _dictSize(d);
   max_steps = count * 10;
   for (j = 0; j < count; j++) {
     if (dictIsRehashing(d))
@@ -199,6 +377,27 @@ unsigned int dictGetSomeKeys(Dict *d, DictEntry **des, unsigned int count) {
         continue;
       }
       if (i >= d->ht[j].size) continue;
+      if (dictIsBucketed(d)) {
+        DictBucket *b = &d->ht[j].buckets[i];
+        int k;
+        if ((b->presence & DICT_BUCKET_FULL) == 0) {
+          emply_len++;
+          if (emply_len >= 5 && emply_len > count) {
+            i = random() & max_size_mask;
+            emply_len = 0;
+          }
+          continue;
+        }
+        emply_len = 0;
+        for (k = 0; k < DICT_BUCKET_SLOTS; k++) {
+          if (!(b->presence & (1 << k))) continue;
+          *des = b->entries[k];
+          des++;
+          stored++;
+          if (stored == count) return stored;
+        }
+        continue;
+      }
       DictEntry *he = d->ht[j].table[i];
       if (he == NULL) {
         emply_len++;
@@ -222,12 +421,41 @@ unsigned int dictGetSomeKeys(Dict *d, DictEntry **des, unsigned int count) {
   return stored;
 }
 
-DictEntry *dictGetRandomKey(Dict *d) {
+unsigned int dictGetSomeKeys(Dict *d, DictEntry **des, unsigned int count) {
+  _dictLock(d);
+  count = _dictGetSomeKeys(d, des, count);
+  _dictUnlock(d);
+  return count;
+}
+
+static DictEntry *_dictBucketGetRandomKey(Dict *d) {
+  DictBucket *b;
+  unsigned int h;
+  int used[DICT_BUCKET_SLOTS], count = 0, j;
+  do {
+    if (dictIsRehashing(d)) {
+      h = d->rehashidx +
+          (random() % (d->ht[0].size + d->ht[1].size - d->rehashidx));
+      b = (h >= d->ht[0].size) ? &d->ht[1].buckets[h - d->ht[0].size]
+                               : &d->ht[0].buckets[h];
+    } else {
+      h = random() & d->ht[0].size_mask;
+      b = &d->ht[0].buckets[h];
+    }
+  } while ((b->presence & DICT_BUCKET_FULL) == 0);
+  for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+    if (b->presence & (1 << j)) used[count++] = j;
+  }
+  return b->entries[used[random() % count]];
+}
+
+static DictEntry *_dictGetRandomKey(Dict *d) {
   DictEntry *he, *orighe;
   unsigned int h;
   int list_len, list_ele;
-  if (dictSize(d) == 0) return NULL;
+  if (_dictSize(d) == 0) return NULL;
   if (dictIsRehashing(d)) _dictRehashStep(d);
+  if (dictIsBucketed(d)) return _dictBucketGetRandomKey(d);
   if (dictIsRehashing(d)) {
     do {
       h = d->rehashidx +
@@ -253,26 +481,67 @@ DictEntry *dictGetRandomKey(Dict *d) {
   return he;
 }
 
+DictEntry *dictGetRandomKey(Dict *d) {
+  DictEntry *he;
+  _dictLock(d);
+  he = _dictGetRandomKey(d);
+  _dictUnlock(d);
+  return he;
+}
+
 void dictReleaseIterator(DictIterator *iter) {
   if (!(iter->index == -1 && iter->table == 0)) {
-    if (iter->safe)
+    if (iter->pinned) {
+      _dictLock(iter->d);
       iter->d->iterators--;
-    else
-      assert(iter->fingerPrint == dictFingerPrint(iter->d));
+      _dictUnlock(iter->d);
+    }
+    if (!iter->safe) assert(iter->fingerPrint == dictFingerPrint(iter->d));
   }
   zfree(iter);
 }
 
+/* Iterators of a dict being rehashed in the background pin it, so the
+ * helper thread pauses until they are released. */
+static void _dictIteratorStart(DictIterator *iter) {
+  _dictLock(iter->d);
+  if (iter->safe || iter->d->bg) {
+    iter->d->iterators++;
+    iter->pinned = 1;
+  }
+  if (!iter->safe) iter->fingerPrint = dictFingerPrint(iter->d);
+  _dictUnlock(iter->d);
+}
+
+static DictEntry *_dictBucketNext(DictIterator *iter) {
+  while (1) {
+    DictHT *ht = &iter->d->ht[iter->table];
+    if (iter->index == -1 && iter->table == 0) _dictIteratorStart(iter);
+    if (iter->index >= 0 && iter->index < (long)ht->size) {
+      DictBucket *b = &ht->buckets[iter->index];
+      while (++iter->slot < DICT_BUCKET_SLOTS) {
+        if (b->presence & (1 << iter->slot)) return b->entries[iter->slot];
+      }
+    }
+    iter->index++;
+    iter->slot = -1;
+    if (iter->index >= (long)ht->size) {
+      if (dictIsRehashing(iter->d) && iter->table == 0) {
+        iter->table++;
+        iter->index = 0;
+      } else
+        break;
+    }
+  }
+  return NULL;
+}
+
 DictEntry *dictNext(DictIterator *iter) {
+  if (dictIsBucketed(iter->d)) return _dictBucketNext(iter);
   while (1) {
     if (iter->entry == NULL) {
       DictHT *ht = &iter->d->ht[iter->table];
-      if (iter->index == -1 && iter->table == 0) {
-        if (iter->safe)
-          iter->d->iterators++;
-        else
-          iter->fingerPrint = dictFingerPrint(iter->d);
-      }
+      if (iter->index == -1 && iter->table == 0) _dictIteratorStart(iter);
 
       iter->index++;
       if (iter->index >= (long)ht->size) {
@@ -306,6 +575,8 @@ DictIterator *dictGetIterator(Dict *d) {
   iter->table = 0;
   iter->index = -1;
   iter->safe = 0;
+  iter->slot = -1;
+  iter->pinned = 0;
   iter->entry = NULL;
   iter->nextEntry = NULL;
   return iter;
@@ -314,10 +585,12 @@ DictIterator *dictGetIterator(Dict *d) {
 long long dictFingerPrint(Dict *d) {
   long long integers[6], hash = 0;
   int j;
-  integers[0] = (long)d->ht[0].table;
+  integers[0] = (long)(dictIsBucketed(d) ? (void *)d->ht[0].buckets
+                                         : (void *)d->ht[0].table);
   integers[1] = d->ht[0].size;
   integers[2] = d->ht[0].used;
-  integers[3] = (long)d->ht[1].table;
+  integers[3] = (long)(dictIsBucketed(d) ? (void *)d->ht[1].buckets
+                                         : (void *)d->ht[1].table);
   integers[4] = d->ht[1].size;
   integers[5] = d->ht[1].used;
 
@@ -340,13 +613,17 @@ void *dictFetchValue(Dict *d, const void *key) {
   return he ? dictGetVal(he) : NULL;
 }
 
-DictEntry *dictFind(Dict *d, const void *key) {
+static DictEntry *_dictFindWithHash(Dict *d, const void *key, uint64_t h) {
   DictEntry *he;
-  unsigned int h, idx, table;
-  if (d->ht[0].size == 0) return NULL;
-  if (dictIsRehashing(d)) _dictRehashStep(d);
-  h = dictHashKey(d, key);
+  unsigned long idx, table;
+  int slot;
   for (table = 0; table <= 1; table++) {
+    if (dictIsBucketed(d)) {
+      DictBucket *b = _dictBucketLookup(d, &d->ht[table], key, h, &slot);
+      if (b) return b->entries[slot];
+      if (!dictIsRehashing(d)) return NULL;
+      continue;
+    }
     idx = h & d->ht[table].size_mask;
     he = d->ht[table].table[idx];
     while (he) {
@@ -358,7 +635,92 @@ DictEntry *dictFind(Dict *d, const void *key) {
   return NULL;
 }
 
+static DictEntry *_dictFind(Dict *d, const void *key) {
+  if (d->ht[0].size == 0) return NULL;
+  if (dictIsRehashing(d)) _dictRehashStep(d);
+  return _dictFindWithHash(d, key, dictHashKey(d, key));
+}
+
+static void _dictPrefetch(Dict *d, uint64_t h) {
+  unsigned long table;
+  for (table = 0; table <= 1; table++) {
+    DictHT *ht = &d->ht[table];
+    if (ht->size == 0) break;
+    if (dictIsBucketed(d))
+      __builtin_prefetch(&ht->buckets[h & ht->size_mask]);
+    else
+      __builtin_prefetch(&ht->table[h & ht->size_mask]);
+    if (!dictIsRehashing(d)) break;
+  }
+}
+
+/* Second hop: the first entry the slot of h points to, which the lookup
+ * has to compare the key against. */
+static void _dictPrefetchEntry(Dict *d, uint64_t h) {
+  DictHT *ht = &d->ht[0];
+  if (dictIsBucketed(d)) {
+    DictBucket *b = &ht->buckets[h & ht->size_mask];
+    unsigned int match = _dictBucketMatch(b, dictBucketTag(h));
+    if (match) __builtin_prefetch(b->entries[__builtin_ctz(match)]);
+  } else {
+    DictEntry *he = ht->table[h & ht->size_mask];
+    if (he) __builtin_prefetch(he);
+  }
+}
+
+/* dictFind for count keys at once, the entries (or NULL) stored in des.
+ * The keys are hashed and their slots prefetched DICT_FIND_BATCH at a
+ * time before any of them is compared, so that the cache misses of the
+ * lookups overlap instead of following one another. */
+void dictFindBatch(Dict *d, const void **keys, unsigned int count,
+                   DictEntry **des) {
+  uint64_t h[DICT_FIND_BATCH];
+  unsigned int i, j, n;
+
+  _dictLock(d);
+  if (d->ht[0].size == 0) {
+    for (i = 0; i < count; i++) des[i] = NULL;
+    _dictUnlock(d);
+    return;
+  }
+  if (dictIsRehashing(d)) _dictRehashStep(d);
+  for (i = 0; i < count; i += n) {
+    n = count - i < DICT_FIND_BATCH ? count - i : DICT_FIND_BATCH;
+    for (j = 0; j < n; j++) {
+      h[j] = dictHashKey(d, keys[i + j]);
+      _dictPrefetch(d, h[j]);
+    }
+    for (j = 0; j < n; j++) _dictPrefetchEntry(d, h[j]);
+    for (j = 0; j < n; j++)
+      des[i + j] = _dictFindWithHash(d, keys[i + j], h[j]);
+  }
+  _dictUnlock(d);
+}
+
+DictEntry *dictFind(Dict *d, const void *key) {
+  DictEntry *he;
+  _dictLock(d);
+  he = _dictFind(d, key);
+  _dictUnlock(d);
+  return he;
+}
+
+static void _dictBgFree(Dict *d) {
+  pthread_mutex_destroy(&d->bg->lock);
+  pthread_cond_destroy(&d->bg->cond);
+  zfree(d->bg);
+  d->bg = NULL;
+}
+
 void dictRelease(Dict *d) {
+  if (d->bg) {
+    pthread_mutex_lock(&d->bg->lock);
+    if (d->bg->state == DICT_BG_RUNNING) d->bg->state = DICT_BG_CANCEL;
+    while (d->bg->state != DICT_BG_DONE)
+      pthread_cond_wait(&d->bg->cond, &d->bg->lock);
+    pthread_mutex_unlock(&d->bg->lock);
+    _dictBgFree(d);
+  }
   _dictClear(d, &d->ht[0], NULL);
   _dictClear(d, &d->ht[1], NULL);
   zfree(d);
@@ -374,45 +736,76 @@ unsigned int dictIntHashFunction(unsigned int key) {
   return key;
 }
 
-int dictDeleteNoFree(Dict *d, const void *key) {
-  return dictGenericDelete(d, key, 1);
+/* Takes the entry of key out of the dict and returns it, or NULL, without
+ * freeing anything: the caller releases it with dictFreeUnlinkedEntry()
+ * once done with the key and value. */
+DictEntry *dictUnlink(Dict *d, const void *key) {
+  DictEntry *he;
+  _dictLock(d);
+  he = _dictGenericDelete(d, key, 1);
+  _dictUnlock(d);
+  return he;
+}
+
+void dictFreeUnlinkedEntry(Dict *d, DictEntry *he) {
+  if (he == NULL) return;
+  _dictFreeEntry(d, he);
 }
 
 int dictDelete(Dict *d, const void *key) {
   return dictGenericDelete(d, key, 0);
 }
 
-int dictGenericDelete(Dict *d, const void *key, int no_free) {
-  unsigned int h, idx;
+static DictEntry *_dictGenericDelete(Dict *d, const void *key, int no_free) {
+  uint64_t h;
+  unsigned long idx;
   DictEntry *he, *prev_he;
-  int table;
-  if (d->ht[0].size == 0) return DCIT_ERR;
+  int table, slot;
+  if (d->ht[0].size == 0) return NULL;
   if (dictIsRehashing(d)) _dictRehashStep(d);
   h = dictHashKey(d, key);
   for (table = 0; table <= 1; table++) {
+    if (dictIsBucketed(d)) {
+      DictBucket *b = _dictBucketLookup(d, &d->ht[table], key, h, &slot);
+      if (b) {
+        he = b->entries[slot];
+        dictSnapshotMark(d, he);
+        b->presence &= ~(1 << slot);
+        if (!no_free) _dictFreeEntry(d, he);
+        d->ht[table].used--;
+        return he;
+      }
+      if (!dictIsRehashing(d)) break;
+      continue;
+    }
     idx = h & d->ht[table].size_mask;
     he = d->ht[table].table[idx];
     prev_he = NULL;
     while (he) {
       if (dictCompareKeys(d, key, he->key)) {
+        dictSnapshotMark(d, he);
         if (prev_he)
           prev_he->next = he->next;
         else
           d->ht[table].table[idx] = he->next;
-        if (!no_free) {
-          dictFreeKey(d, he);
-          dictFreeVal(d, he);
-        }
-        zfree(he);
+        if (!no_free) _dictFreeEntry(d, he);
         d->ht[table].used--;
-        return DICT_OK;
+        return he;
       }
       prev_he = he;
       he = he->next;
     }
     if (!dictIsRehashing(d)) break;
   }
-  return DCIT_ERR;
+  return NULL;
+}
+
+int dictGenericDelete(Dict *d, const void *key, int no_free) {
+  int retval;
+  _dictLock(d);
+  retval = _dictGenericDelete(d, key, no_free) ? DICT_OK : DCIT_ERR;
+  _dictUnlock(d);
+  return retval;
 }
 
 DictEntry *dictReplaceRaw(Dict *d, void *key) {
@@ -423,28 +816,86 @@ DictEntry *dictReplaceRaw(Dict *d, void *key) {
 int dictReplace(Dict *d, void *key, void *val) {
   DictEntry *entry, aux_entry;
   if (dictAdd(d, key, val) == DICT_OK) return 1;
-  entry = dictFind(d, key);
-  aux_entry = *entry;
-  dictSetVal(d, entry, val);
+  entry = dictSnapshotFind(d, key);
+  aux_entry.v = entry->v;
+  distSetVal(d, entry, val);
   dictFreeVal(d, &aux_entry);
   return 0;
 }
 
-DictEntry *dictAddRaw(Dict *d, void *key) {
-  int index;
-  DictEntry *entry;
+static DictEntry *_dictBucketAddRaw(Dict *d, void *key, DictEntry *entry) {
+  uint64_t h;
+  int table, slot;
+  DictBucket *b;
+  DictHT *ht;
+  if (_dictExpandIfNeeded(d) == DCIT_ERR) return NULL;
+  h = dictHashKey(d, key);
+  for (table = 0; table <= 1; table++) {
+    if (_dictBucketLookup(d, &d->ht[table], key, h, &slot)) return NULL;
+    if (!dictIsRehashing(d)) break;
+  }
+  ht = dictIsRehashing(d) ? &(d->ht[1]) : &(d->ht[0]);
+  b = _dictBucketFreeSlot(ht, h, &slot);
+  assert(b != NULL);
+  if (entry) {
+    entry->hash = _dictEntryHash(d, h) | DICT_HASH_EMBEDDED_BIT;
+  } else {
+    entry = zmalloc_slab(DICT_BUCKET_ENTRY_SIZE);
+    entry->hash = _dictEntryHash(d, h);
+    dictSetKey(d, entry, key);
+  }
+  b->entries[slot] = entry;
+  b->tags[slot] = dictBucketTag(h);
+  b->presence |= 1 << slot;
+  ht->used++;
+  return entry;
+}
+
+/* Links `entry` when the caller allocated it, or a new entry for `key`. */
+static DictEntry *_dictAddRaw(Dict *d, void *key, DictEntry *entry) {
+  long index;
+  uint64_t h;
   DictHT *ht;
   if (dictIsRehashing(d)) _dictRehashStep(d);
-  if ((index = _dictKeyIndex(d, key)) == -1) return NULL;
+  if (dictIsBucketed(d)) return _dictBucketAddRaw(d, key, entry);
+  h = dictHashKey(d, key);
+  if ((index = _dictKeyIndex(d, key, h)) == -1) return NULL;
   ht = dictIsRehashing(d) ? &(d->ht[1]) : &(d->ht[0]);
-  entry = zmalloc(sizeof(*entry));
+  if (entry) {
+    entry->hash = _dictEntryHash(d, h) | DICT_HASH_EMBEDDED_BIT;
+  } else {
+    entry = zmalloc_slab(sizeof(*entry));
+    entry->hash = _dictEntryHash(d, h);
+    dictSetKey(d, entry, key);
+  }
   entry->next = ht->table[index];
   ht->table[index] = entry;
   ht->used++;
-  dictSetKey(d, entry, key);
   return entry;
 }
 
+DictEntry *dictAddRaw(Dict *d, void *key) {
+  DictEntry *entry;
+  _dictLock(d);
+  entry = _dictAddRaw(d, key, NULL);
+  _dictUnlock(d);
+  return entry;
+}
+
+/* Adds an entry the caller allocated, DICT_BUCKET_ENTRY_SIZE bytes for a
+ * bucketed dict and sizeof(DictEntry) otherwise, with key and value
+ * already set, typically in the same allocation as the entry. Once linked the dict owns it, and releases it through the
+ * entryDestructor of the type, which must be set. Returns DCIT_ERR if
+ * the key exists, the entry is then left to the caller. */
+int dictAddEmbedded(Dict *d, DictEntry *entry) {
+  DictEntry *added;
+  assert(d->type->entryDestructor != NULL);
+  _dictLock(d);
+  added = _dictAddRaw(d, entry->key, entry);
+  _dictUnlock(d);
+  return added ? DICT_OK : DCIT_ERR;
+}
+
 int dictAdd(Dict *d, void *key, void *val) {
   DictEntry *entry = dictAddRaw(d, key);
   if (!entry) return DCIT_ERR;
@@ -468,11 +919,54 @@ int dictRehashMilliseconds(Dict *d, int ms) {
   return rehashes;
 }
 
-int dictRehash(Dict *d, int n) {
+static int _dictBucketRehash(Dict *d, int n) {
+  int empty_visits = n * 10;
+  while (n-- && d->ht[0].used != 0) {
+    DictBucket *b;
+    int j;
+    assert(d->ht[0].size > (unsigned long)d->rehashidx);
+    while ((d->ht[0].buckets[d->rehashidx].presence & DICT_BUCKET_FULL) ==
+           0) {
+      d->rehashidx++;
+      if (--empty_visits == 0) {
+        return 1;
+      }
+    }
+    b = &d->ht[0].buckets[d->rehashidx];
+    for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+      DictBucket *nb;
+      int slot;
+      if (!(b->presence & (1 << j))) continue;
+      nb = _dictBucketFreeSlot(&d->ht[1], b->entries[j]->hash, &slot);
+      assert(nb != NULL);
+      nb->entries[slot] = b->entries[j];
+      nb->tags[slot] = b->tags[j];
+      nb->presence |= 1 << slot;
+      d->ht[0].used--;
+      d->ht[1].used++;
+    }
+    /* Keep the ever-full bit: later buckets may still be reached through
+     * this one until the whole table has been migrated. */
+    b->presence &= DICT_BUCKET_EVER_FULL;
+    d->rehashidx++;
+  }
+
+  if (d->ht[0].used == 0) {
+    zfree(d->ht[0].buckets);
+    d->ht[0] = d->ht[1];
+    _dictReset(&d->ht[1]);
+    d->rehashidx = -1;
+    return 0;
+  }
+  return 1;
+}
+
+int _dictRehash(Dict *d, int n) {
   int empty_visits = n * 10;
   if (!dictIsRehashing(d)) {
     return 0;
   }
+  if (dictIsBucketed(d)) return _dictBucketRehash(d, n);
   while (n-- && d->ht[0].used != 0) {
     DictEntry *de, *next_de;
     assert(d->ht[0].size > (unsigned long)d->rehashidx);
@@ -484,9 +978,9 @@ int dictRehash(Dict *d, int n) {
     }
     de = d->ht[0].table[d->rehashidx];
     while (de) {
-      unsigned int h;
+      unsigned long h;
       next_de = de->next;
-      h = dictHashKey(d, de->key) & d->ht[1].size_mask;
+      h = de->hash & d->ht[1].size_mask;
       de->next = d->ht[1].table[h];
       d->ht[1].table[h] = de;
       d->ht[0].used--;
@@ -507,16 +1001,38 @@ int dictRehash(Dict *d, int n) {
   return 1;
 }
 
-int dictExpand(Dict *d, unsigned long size) {
+int dictRehash(Dict *d, int n) {
+  int more;
+  _dictLock(d);
+  more = _dictRehash(d, n);
+  _dictUnlock(d);
+  return more;
+}
+
+static unsigned long _dictTableSize(Dict *d, unsigned long size) {
+  if (dictIsBucketed(d))
+    return _dictNextPower((size + DICT_BUCKET_MAX_FILL - 1) /
+                          DICT_BUCKET_MAX_FILL);
+  return _dictNextPower(size);
+}
+
+static void _dictAllocTable(Dict *d, DictHT *n, unsigned long realsize) {
+  _dictReset(n);
+  n->size = realsize;
+  n->size_mask = realsize - 1;
+  if (dictIsBucketed(d))
+    n->buckets = zcalloc(realsize * sizeof(DictBucket));
+  else
+    n->table = zcalloc(realsize * sizeof(DictEntry *));
+}
+
+int _dictExpand(Dict *d, unsigned long size) {
   DictHT n;
-  unsigned long realsize = _dictNextPower(size);
+  unsigned long realsize = _dictTableSize(d, size);
   if (dictIsRehashing(d) || d->ht[0].used > size) return DCIT_ERR;
   if (realsize == d->ht[0].size) return DCIT_ERR;
-  n.size = realsize;
-  n.size_mask = realsize - 1;
-  n.table = zcalloc(realsize * sizeof(DictEntry *));
-  n.used = 0;
-  if (d->ht[0].table == NULL) {
+  _dictAllocTable(d, &n, realsize);
+  if (d->ht[0].size == 0) {
     d->ht[0] = n;
     return DICT_OK;
   }
@@ -525,12 +1041,124 @@ int dictExpand(Dict *d, unsigned long size) {
   return DICT_OK;
 }
 
+int dictExpand(Dict *d, unsigned long size) {
+  int retval;
+  _dictLock(d);
+  retval = _dictExpand(d, size);
+  _dictUnlock(d);
+  return retval;
+}
+
 int dictResize(Dict *d) {
   int minimal;
-  if (!dict_can_resize || dictIsRehashing(d)) return DCIT_ERR;
+  if (d->bg || !dict_can_resize || dictIsRehashing(d)) return DCIT_ERR;
   minimal = d->ht[0].used;
   if (minimal < DICT_HT_INITIAL_SIZE) minimal = DICT_HT_INITIAL_SIZE;
-  return dictExpand(d, minimal);
+  return _dictExpand(d, minimal);
+}
+
+unsigned long dictLockedSize(Dict *d) {
+  unsigned long size;
+  _dictLock(d);
+  size = _dictSize(d);
+  _dictUnlock(d);
+  return size;
+}
+
+unsigned long dictLockedSlots(Dict *d) {
+  unsigned long slots;
+  _dictLock(d);
+  slots = _dictSlots(d);
+  _dictUnlock(d);
+  return slots;
+}
+
+/* Both sizes read under one lock, so that they agree with each other
+ * while a background rehash moves entries from one table to the other. */
+void dictLockedSizes(Dict *d, unsigned long *slots, unsigned long *size) {
+  _dictLock(d);
+  *slots = _dictSlots(d);
+  *size = _dictSize(d);
+  _dictUnlock(d);
+}
+
+/* Hands the growth of a large dict to a background thread once it is
+ * rehashing or within a quarter of its next expand. The caller queues
+ * dictBgRehash() on a bio thread and polls dictBgRehashFinish(). */
+int dictBgRehashStart(Dict *d) {
+  unsigned long grow_at = d->ht[0].size;
+  if (d->bg || d->iterators || d->ht[0].size == 0) return DCIT_ERR;
+  if (dictIsBucketed(d)) grow_at *= DICT_BUCKET_MAX_FILL;
+  if (!dictIsRehashing(d) && d->ht[0].used < grow_at / 4 * 3)
+    return DCIT_ERR;
+  d->bg = zmalloc(sizeof(*d->bg));
+  pthread_mutex_init(&d->bg->lock, NULL);
+  pthread_cond_init(&d->bg->cond, NULL);
+  d->bg->state = DICT_BG_RUNNING;
+  d->bg->waiting = 0;
+  return DICT_OK;
+}
+
+/* Runs on the helper thread: allocates and zeroes the new table without
+ * holding the lock, installs it, then migrates DICT_BG_BATCH buckets per
+ * lock hold. Migration pauses while iterators pin the dict or resizing
+ * is disabled because a child process is saving. */
+void dictBgRehash(Dict *d) {
+  DictBgRehash *bg = d->bg;
+  DictHT n;
+  unsigned long realsize;
+  int paused;
+
+  n.size = 0;
+  pthread_mutex_lock(&bg->lock);
+  realsize = _dictTableSize(d, d->ht[0].used * 2);
+  if (!dictIsRehashing(d) && realsize > d->ht[0].size) {
+    pthread_mutex_unlock(&bg->lock);
+    _dictAllocTable(d, &n, realsize);
+    pthread_mutex_lock(&bg->lock);
+  }
+  while (bg->state == DICT_BG_RUNNING) {
+    paused = d->iterators != 0 ||
+             !__atomic_load_n(&dict_can_resize, __ATOMIC_RELAXED);
+    if (!paused) {
+      if (n.size) {
+        if (!dictIsRehashing(d) && d->ht[0].size != 0 &&
+            n.size > d->ht[0].size) {
+          d->ht[1] = n;
+          d->rehashidx = 0;
+        } else {
+          zfree(n.table);
+          zfree(n.buckets);
+        }
+        n.size = 0;
+      }
+      if (!dictIsRehashing(d)) break;
+      _dictRehash(d, DICT_BG_BATCH);
+    }
+    pthread_mutex_unlock(&bg->lock);
+    if (paused) usleep(1000);
+    while (__atomic_load_n(&bg->waiting, __ATOMIC_RELAXED)) sched_yield();
+    pthread_mutex_lock(&bg->lock);
+  }
+  if (n.size) {
+    zfree(n.table);
+    zfree(n.buckets);
+  }
+  bg->state = DICT_BG_DONE;
+  pthread_cond_broadcast(&bg->cond);
+  pthread_mutex_unlock(&bg->lock);
+}
+
+/* Main thread handoff: returns 1 once the helper is done and the dict is
+ * back to lock-free single-threaded access. */
+int dictBgRehashFinish(Dict *d) {
+  int done;
+  if (d->bg == NULL) return 1;
+  pthread_mutex_lock(&d->bg->lock);
+  done = d->bg->state == DICT_BG_DONE;
+  pthread_mutex_unlock(&d->bg->lock);
+  if (done) _dictBgFree(d);
+  return done;
 }
 
 Dict *dictCreate(DictType *type, void *privDataPtr) {
@@ -539,45 +1167,163 @@ Dict *dictCreate(DictType *type, void *privDataPtr) {
   return d;
 }
 
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
-  unsigned int hash = (unsigned int)dict_hash_function_seed;
+/* wyhash-style 64-bit hash: 128-bit multiply-and-fold mixing, three
+ * independent lanes for keys longer than 48 bytes. */
+#define DICT_WYP0 0xa0761d6478bd642fULL
+#define DICT_WYP1 0xe7037ed1a0b428dbULL
+#define DICT_WYP2 0x8ebc6af09c88c6e3ULL
+#define DICT_WYP3 0x589965cc75374cc3ULL
+
+static inline void _dictMum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl, lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t _dictMix(uint64_t a, uint64_t b) {
+  _dictMum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t _dictRead8(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t _dictRead4(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+uint64_t dictGenHashFunction(const void *key, int len) {
+  const unsigned char *p = (const unsigned char *)key;
+  uint64_t seed = dict_hash_function_seed, a, b;
+  size_t i = (size_t)len;
+  seed ^= _dictMix(seed ^ DICT_WYP0, DICT_WYP1);
+  if (i <= 16) {
+    if (i >= 4) {
+      a = (_dictRead4(p) << 32) | _dictRead4(p + ((i >> 3) << 2));
+      b = (_dictRead4(p + i - 4) << 32) |
+          _dictRead4(p + i - 4 - ((i >> 3) << 2));
+    } else if (i > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[i >> 1] << 8) | p[i - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = _dictMix(_dictRead8(p) ^ DICT_WYP1, _dictRead8(p + 8) ^ seed);
+        see1 = _dictMix(_dictRead8(p + 16) ^ DICT_WYP2,
+                        _dictRead8(p + 24) ^ see1);
+        see2 = _dictMix(_dictRead8(p + 32) ^ DICT_WYP3,
+                        _dictRead8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = _dictMix(_dictRead8(p) ^ DICT_WYP1, _dictRead8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = _dictRead8(p + i - 16);
+    b = _dictRead8(p + i - 8);
+  }
+  a ^= DICT_WYP1;
+  b ^= seed;
+  _dictMum(&a, &b);
+  return _dictMix(a ^ DICT_WYP0 ^ (uint64_t)len, b ^ DICT_WYP1);
+}
+
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
+  uint64_t hash = dict_hash_function_seed;
   while (len--) {
     hash = ((hash << 5) + hash) + (tolower(*buf++));
   }
-  return hash;
+  /* Spread the result so the high bits used for bucket tags vary too. */
+  return _dictMix(hash ^ DICT_WYP0, DICT_WYP1);
 }
 
-unsigned int dictGenHashFunction(const void *key, int len) {
-  uint32_t seed = dict_hash_function_seed;
-  const uint32_t m = 0x5bd1e995;
-  const int r = 24;
-  uint32_t h = seed ^ len;
-  const unsigned char *data = (const unsigned char *)key;
-  while (len > 4) {
-    uint32_t k = *(uint32_t *)data;
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h *= m;
-    h ^= k;
-    data += 4;
-    len -= 4;
-  };
+/* Starts a point-in-time snapshot: flipping the epoch makes every
+ * existing entry unsaved, while entries added from now on carry the new
+ * epoch and are left out. */
+void dictSnapshotStart(Dict *d, dictScanFunction *fn, void *privdata) {
+  d->snapshot = zmalloc(sizeof(*d->snapshot));
+  d->snapshot->fn = fn;
+  d->snapshot->privdata = privdata;
+  d->epoch = !d->epoch;
+}
 
-  switch (len) {
-    case 3:
-      h ^= data[2] << 16;
-    case 2:
-      h ^= data[1] << 8;
-    case 1:
-      h ^= data[0];
-      h *= m;
-  };
+/* Marks the entry as saved by the running snapshot. Returns 1 if it was
+ * not saved yet, in which case the snapshot callback has seen it. The
+ * caller must hold the dict: dict.c calls it under _dictLock, and so
+ * does dictScan() for its callback. Anything else uses dictSnapshotFind. */
+int dictSnapshotMark(Dict *d, DictEntry *de) {
+  if (d->snapshot == NULL ||
+      (de->hash & DICT_HASH_EPOCH_BIT) == _dictEntryEpoch(d))
+    return 0;
+  de->hash ^= DICT_HASH_EPOCH_BIT;
+  d->snapshot->fn(d->snapshot->privdata, de);
+  return 1;
+}
 
-  h ^= h >> 13;
-  h *= m;
-  h ^= h >> 15;
-  return (unsigned int)h;
+/* dictFind() that also marks the entry, both under the lock, so that a
+ * background rehash cannot run between the two. */
+DictEntry *dictSnapshotFind(Dict *d, const void *key) {
+  DictEntry *he;
+  _dictLock(d);
+  if ((he = _dictFind(d, key)) != NULL) dictSnapshotMark(d, he);
+  _dictUnlock(d);
+  return he;
+}
+
+void dictSnapshotEnd(Dict *d) {
+  zfree(d->snapshot);
+  d->snapshot = NULL;
+}
+
+/* Ends a snapshot whose walk did not complete. Entries it never reached
+ * still carry the previous epoch and would count as saved once the next
+ * snapshot flips it back, so they are moved to the current one first. */
+void dictSnapshotAbort(Dict *d) {
+  int table;
+  unsigned long i;
+  _dictLock(d);
+  for (table = 0; table <= 1; table++) {
+    DictHT *ht = &d->ht[table];
+    for (i = 0; i < ht->size && ht->used > 0; i++) {
+      DictEntry *he;
+      if (dictIsBucketed(d)) {
+        DictBucket *b = &ht->buckets[i];
+        int j;
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+          if (!(b->presence & (1 << j))) continue;
+          he = b->entries[j];
+          he->hash = (he->hash & ~DICT_HASH_EPOCH_BIT) | _dictEntryEpoch(d);
+        }
+        continue;
+      }
+      for (he = ht->table[i]; he; he = he->next)
+        he->hash = (he->hash & ~DICT_HASH_EPOCH_BIT) | _dictEntryEpoch(d);
+    }
+  }
+  _dictUnlock(d);
+  dictSnapshotEnd(d);
 }
 
 #if 0
@@ -635,7 +1381,7 @@ void dictPrintStats(Dict *d) {
   }
 }
 
-static unsigned int _dictStringCopyHTHashFunction(const void *key) {
+static uint64_t _dictStringCopyHTHashFunction(const void *key) {
   return dictGenHashFunction((unsigned char *)key, strlen((char *)key));
 }
 
@@ -673,3 +1419,236 @@ DictType dictTypeHeapStringCopyKeyValue = {
 };
 
 #endif
+
+#ifdef DICT_BENCHMARK_MAIN
+
+#include "sds.h"
+
+static uint64_t benchSdsHash(const void *key) {
+  return dictGenHashFunction(key, sdsLen((Sds)key));
+}
+
+static int benchSdsKeyCompare(void *privdata, const void *key1,
+                              const void *key2) {
+  size_t l1 = sdsLen((Sds)key1), l2 = sdsLen((Sds)key2);
+  DICT_NOTUSED(privdata);
+  return l1 == l2 && memcmp(key1, key2, l1) == 0;
+}
+
+static void benchSdsDestructor(void *privdata, void *val) {
+  DICT_NOTUSED(privdata);
+  sdsFree(val);
+}
+
+/* Same callbacks as dbDictType and keyptrDictType in cache.c. */
+static DictType benchTypes[] = {
+    {benchSdsHash, NULL, NULL, benchSdsKeyCompare, benchSdsDestructor, NULL,
+     DICT_LAYOUT_CHAINED},
+    {benchSdsHash, NULL, NULL, benchSdsKeyCompare, benchSdsDestructor, NULL,
+     DICT_LAYOUT_BUCKETED},
+    {benchSdsHash, NULL, NULL, benchSdsKeyCompare, NULL, NULL,
+     DICT_LAYOUT_CHAINED},
+    {benchSdsHash, NULL, NULL, benchSdsKeyCompare, NULL, NULL,
+     DICT_LAYOUT_BUCKETED},
+};
+static char *benchNames[] = {"dbDictType/chained", "dbDictType/bucketed",
+                             "keyptrDictType/chained",
+                             "keyptrDictType/bucketed"};
+
+static void benchRun(int t, Sds *keys, long count) {
+  Dict *d = dictCreate(&benchTypes[t], NULL);
+  int owns_keys = benchTypes[t].keyDestructor != NULL;
+  size_t mem = zmalloc_used_memory();
+  long long start, add, hit, miss, del;
+  long j;
+
+  start = timeInMilliseconds();
+  for (j = 0; j < count; j++) {
+    Sds key = owns_keys ? sdsDup(keys[j]) : keys[j];
+    DictEntry *de = dictAddRaw(d, key);
+    assert(de != NULL);
+    dictSetSignedIntegerVal(de, j);
+  }
+  add = timeInMilliseconds() - start;
+  while (dictIsRehashing(d)) dictRehashMilliseconds(d, 100);
+  mem = zmalloc_used_memory() - mem;
+
+  start = timeInMilliseconds();
+  for (j = 0; j < count; j++) {
+    DictEntry *de = dictFind(d, keys[(j * 7919) % count]);
+    assert(de != NULL);
+  }
+  hit = timeInMilliseconds() - start;
+
+  start = timeInMilliseconds();
+  for (j = 0; j < count; j++) {
+    Sds key = sdsCatLen(sdsDup(keys[j]), "!", 1);
+    assert(dictFind(d, key) == NULL);
+    sdsFree(key);
+  }
+  miss = timeInMilliseconds() - start;
+
+  start = timeInMilliseconds();
+  for (j = 0; j < count; j++) assert(dictDelete(d, keys[j]) == DICT_OK);
+  del = timeInMilliseconds() - start;
+
+  printf("%-24s add %6lld ms  hit %6lld ms  miss %6lld ms  del %6lld ms  "
+         "%.1f bytes/key\n",
+         benchNames[t], add, hit, miss, del, (double)mem / count);
+  dictRelease(d);
+}
+
+/* A string value as createObject() lays out an EMBSTR: the 16-byte
+ * object header followed by the sds. */
+typedef struct benchValue {
+  uint64_t header;
+  void *ptr;
+  char sds[];
+} benchValue;
+
+static void benchValueDestructor(void *privdata, void *val) {
+  DICT_NOTUSED(privdata);
+  zfree(val);
+}
+
+static void benchEntryDestructor(void *privdata, DictEntry *de) {
+  DICT_NOTUSED(privdata);
+  zfree(de);
+}
+
+static benchValue *benchCreateValue(void *buf, const char *s, size_t len) {
+  benchValue *v = buf ? buf : zmalloc_slab(sizeof(*v) + sizeof(struct Sdshdr) + len + 1);
+  struct Sdshdr *sh = (struct Sdshdr *)v->sds;
+  sh->len = len;
+  sh->free = 0;
+  memcpy(sh->buf, s, len + 1);
+  v->ptr = sh->buf;
+  return v;
+}
+
+/* Memory per key and GET cost of a regular keyspace entry (entry, key
+ * sds, value object) against the layout dbDictAdd() in cache.c uses for
+ * short keys, where the key sds is part of the entry allocation. */
+static void benchEmbedded(Sds *keys, long count) {
+  DictType types[2] = {
+      {benchSdsHash, NULL, NULL, benchSdsKeyCompare, benchSdsDestructor,
+       benchValueDestructor, DICT_LAYOUT_BUCKETED, NULL},
+      {benchSdsHash, NULL, NULL, benchSdsKeyCompare, benchSdsDestructor,
+       benchValueDestructor, DICT_LAYOUT_BUCKETED, benchEntryDestructor}};
+  const char *val = "value:0123456789";
+  size_t vlen = strlen(val);
+  long long start, get;
+  uint64_t sink = 0;
+  long j;
+  int t;
+  for (t = 0; t < 2; t++) {
+    Dict *d = dictCreate(&types[t], NULL);
+    size_t mem = zmalloc_used_memory();
+    for (j = 0; j < count; j++) {
+      if (t == 0) {
+        assert(dictAdd(d, sdsDup(keys[j]), benchCreateValue(NULL, val, vlen)) ==
+               DICT_OK);
+      } else {
+        size_t klen = sdsLen(keys[j]);
+        DictEntry *de = zmalloc_slab(DICT_BUCKET_ENTRY_SIZE + sizeof(struct Sdshdr) +
+                                     klen + 1);
+        struct Sdshdr *sh = (struct Sdshdr *)((char *)de + DICT_BUCKET_ENTRY_SIZE);
+        sh->len = klen;
+        sh->free = 0;
+        memcpy(sh->buf, keys[j], klen + 1);
+        de->key = sh->buf;
+        de->v.val = benchCreateValue(NULL, val, vlen);
+        assert(dictAddEmbedded(d, de) == DICT_OK);
+      }
+    }
+    mem = zmalloc_used_memory() - mem;
+    start = timeInMilliseconds();
+    for (j = 0; j < count; j++) {
+      DictEntry *de = dictFind(d, keys[(j * 7919) % count]);
+      sink += ((benchValue *)dictGetVal(de))->sds[sizeof(struct Sdshdr)];
+    }
+    get = timeInMilliseconds() - start;
+    printf("%-24s get %6lld ms  %.1f bytes/key\n",
+           t ? "embedded key" : "entry+key+object", get, (double)mem / count);
+    dictRelease(d);
+  }
+  if (sink == 0) printf("\n");
+}
+
+/* The 32-bit MurmurHash2 previously used by dictGenHashFunction, kept
+ * here as the baseline for the throughput comparison. */
+static uint32_t benchMurmurHash2(const void *key, int len) {
+  const uint32_t m = 0x5bd1e995;
+  uint32_t h = (uint32_t)dictGetHashFunctionSeed() ^ len;
+  const unsigned char *data = (const unsigned char *)key;
+  while (len >= 4) {
+    uint32_t k;
+    memcpy(&k, data, 4);
+    k *= m;
+    k ^= k >> 24;
+    k *= m;
+    h *= m;
+    h ^= k;
+    data += 4;
+    len -= 4;
+  }
+  switch (len) {
+    case 3:
+      h ^= data[2] << 16;
+    case 2:
+      h ^= data[1] << 8;
+    case 1:
+      h ^= data[0];
+      h *= m;
+  }
+  h ^= h >> 13;
+  h *= m;
+  h ^= h >> 15;
+  return h;
+}
+
+static void benchHash(void) {
+  static unsigned char buf[512 + 64];
+  int sizes[] = {8, 16, 24, 32, 64, 128, 256, 512};
+  long long start, elapsed[2];
+  uint64_t sink = 0;
+  long iters, j;
+  int s;
+
+  for (j = 0; j < (long)sizeof(buf); j++) buf[j] = (unsigned char)random();
+  for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+    iters = (1L << 30) / sizes[s] / 4;
+    start = timeInMilliseconds();
+    for (j = 0; j < iters; j++)
+      sink += dictGenHashFunction(buf + (j & 63), sizes[s]);
+    elapsed[0] = timeInMilliseconds() - start;
+    start = timeInMilliseconds();
+    for (j = 0; j < iters; j++)
+      sink += benchMurmurHash2(buf + (j & 63), sizes[s]);
+    elapsed[1] = timeInMilliseconds() - start;
+    printf("hash %3d bytes  dictGenHashFunction %7.2f GB/s  "
+           "murmur2 %7.2f GB/s\n",
+           sizes[s], (double)iters * sizes[s] / 1e6 / (elapsed[0] + 1),
+           (double)iters * sizes[s] / 1e6 / (elapsed[1] + 1));
+  }
+  if (sink == 0) printf("\n");
+}
+
+int main(int argc, char **argv) {
+  long count = (argc > 1) ? atol(argv[1]) : 5000000;
+  Sds *keys = zmalloc(sizeof(Sds) * count);
+  long j;
+  int t;
+
+  zmalloc_slab_set_reserve(0);
+  benchHash();
+  for (j = 0; j < count; j++) keys[j] = sdsFromLongLong(j);
+  for (t = 0; t < (int)(sizeof(benchTypes) / sizeof(benchTypes[0])); t++)
+    benchRun(t, keys, count);
+  benchEmbedded(keys, count);
+  for (j = 0; j < count; j++) sdsFree(keys[j]);
+  zfree(keys);
+  return 0;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef DICT_H
 #define DICT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define DICT_OK 0
@@ -8,6 +9,19 @@
 
 #define DICT_NOTUSED(V) ((void)V)
 
+#define DICT_LAYOUT_CHAINED 0
+#define DICT_LAYOUT_BUCKETED 1
+
+#define DICT_BUCKET_SLOTS 7
+#define DICT_BUCKET_FULL ((1 << DICT_BUCKET_SLOTS) - 1)
+#define DICT_BUCKET_EVER_FULL (1 << DICT_BUCKET_SLOTS)
+
+/* Entries keep the snapshot epoch they were last saved in as one bit of
+ * the cached hash, below the bucket tag and above any usable index bit. */
+#define DICT_HASH_EPOCH_BIT (1ULL << 55)
+/* Set for entries allocated by the caller, see dictAddEmbedded(). */
+#define DICT_HASH_EMBEDDED_BIT (1ULL << 54)
+
 typedef struct DictEntry {
     void *key;
     union {
@@ -16,11 +30,22 @@ typedef struct DictEntry {
         int64_t s64;
         double d;
     } v;
+    uint64_t hash;
     struct DictEntry *next;
 } DictEntry;
 
+/* One cache line: a presence byte, one hash tag per slot and the entry
+ * pointers. Entries of a bucketed dict are allocated without `next`. */
+typedef struct DictBucket {
+    uint8_t presence;
+    uint8_t tags[DICT_BUCKET_SLOTS];
+    DictEntry *entries[DICT_BUCKET_SLOTS];
+} DictBucket;
+
+#define DICT_BUCKET_ENTRY_SIZE offsetof(DictEntry, next)
+
 typedef struct DictType {
-    unsigned int (*hashFunction)(const void *key);
+    uint64_t (*hashFunction)(const void *key);
 
     void *(*keyDup)(void *privdata, const void *key);
 
@@ -31,10 +56,15 @@ typedef struct DictType {
     void (*keyDestructor)(void *privdata, void *key);
 
     void (*valDestructor)(void *privdata, void *obj);
+
+    int layout;
+
+    void (*entryDestructor)(void *privdata, DictEntry *de);
 } DictType;
 
 typedef struct DictHT {
     DictEntry **table;
+    DictBucket *buckets;
     unsigned long size;
     unsigned long size_mask;
     unsigned long used;
@@ -46,12 +76,15 @@ typedef struct Dict {
     DictHT ht[2];
     long rehashidx;
     int iterators;
+    int epoch;
+    struct DictBgRehash *bg;
+    struct DictSnapshot *snapshot;
 } Dict;
 
 typedef struct DictIterator {
     Dict *d;
     long index;
-    int table, safe;
+    int table, safe, slot, pinned;
     DictEntry *entry, *nextEntry;
     long long fingerPrint;
 } DictIterator;
@@ -109,13 +142,23 @@ typedef void(dictScanFunction)(void *privdata, const DictEntry *de);
 
 #define dictHashKey(d, key) (d)->type->hashFunction(key)
 #define dictGetKey(he) ((he)->key)
+#define dictGetHash(he) \
+  ((he)->hash & ~(DICT_HASH_EPOCH_BIT | DICT_HASH_EMBEDDED_BIT))
+#define dictIsEmbedded(he) (((he)->hash & DICT_HASH_EMBEDDED_BIT) != 0)
 #define dictGetVal(he) ((he)->v.val)
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsugnedIntergerVal(he) ((he)->v.u64)
 #define dictGetDoubleVal(he) ((he)->v.d)
-#define dictSlots(args) ((args)->ht[0].size + (args)->ht[1].size)
-#define dictSize(args) ((args)->ht[0].used + (args)->ht[1].used)
+#define dictIsBucketed(d) ((d)->type->layout == DICT_LAYOUT_BUCKETED)
+#define dictSlots(args)                                   \
+  ((args)->bg ? dictLockedSlots(args)                     \
+              : ((args)->ht[0].size + (args)->ht[1].size) * \
+                    (dictIsBucketed(args) ? DICT_BUCKET_SLOTS : 1))
+#define dictSize(args)                    \
+  ((args)->bg ? dictLockedSize(args)      \
+              : (args)->ht[0].used + (args)->ht[1].used)
 #define dictIsRehashing(args) ((args)->rehashidx != -1)
+#define dictIsBgRehashing(args) ((args)->bg != NULL)
 
 extern DictType dictTypeHeapStringCopyKey;
 extern DictType dictTypeHeapStrings;
@@ -129,18 +172,25 @@ int dictAdd(Dict *d, void *key, void *val);
 
 DictEntry *dictAddRaw(Dict *d, void *key);
 
+int dictAddEmbedded(Dict *d, DictEntry *entry);
+
 int dictReplace(Dict *d, void *key, void *val);
 
 DictEntry *dictReplaceRaw(Dict *d, void *key);
 
 int dictDelete(Dict *d, const void *key);
 
-int dictDeleteNoFree(Dict *d, const void *key);
+DictEntry *dictUnlink(Dict *d, const void *key);
+
+void dictFreeUnlinkedEntry(Dict *d, DictEntry *he);
 
 void dictRelease(Dict *d);
 
 DictEntry *dictFind(Dict *d, const void *key);
 
+void dictFindBatch(Dict *d, const void **keys, unsigned int count,
+                   DictEntry **des);
+
 void *dictFetchValue(Dict *d, const void *key);
 
 int dictResize(Dict *d);
@@ -159,9 +209,9 @@ unsigned int dictGetSomeKeys(Dict *d, DictEntry **des, unsigned int count);
 
 void dictPrintStats(Dict *d);
 
-unsigned int dictGenHashFunction(const void *key, int len);
+uint64_t dictGenHashFunction(const void *key, int len);
 
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 
 void dictEmpty(Dict *d, void(callback)(void *));
 
@@ -175,11 +225,33 @@ long long timeInMilliseconds();
 
 int dictRehashMilliseconds(Dict *d, int ms);
 
-void dictSetHashFunctionSeed(uint32_t init_val);
+void dictSetHashFunctionSeed(uint64_t init_val);
 
-unsigned int dictGetHashFunctionSeed(void);
+uint64_t dictGetHashFunctionSeed(void);
 
 unsigned long dictScan(Dict *d, unsigned long v, dictScanFunction *fn,
                        void *priv_data);
 
+unsigned long dictLockedSize(Dict *d);
+
+unsigned long dictLockedSlots(Dict *d);
+
+void dictLockedSizes(Dict *d, unsigned long *slots, unsigned long *size);
+
+int dictBgRehashStart(Dict *d);
+
+void dictBgRehash(Dict *d);
+
+int dictBgRehashFinish(Dict *d);
+
+void dictSnapshotStart(Dict *d, dictScanFunction *fn, void *privdata);
+
+int dictSnapshotMark(Dict *d, DictEntry *de);
+
+DictEntry *dictSnapshotFind(Dict *d, const void *key);
+
+void dictSnapshotEnd(Dict *d);
+
+void dictSnapshotAbort(Dict *d);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,489 @@
+#include "cache.h"
+
+/* Eviction for maxmemory. The LRU, LFU and TTL policies share one
+ * candidate pool for every db, kept sorted by eviction score and persisted
+ * across calls. It is refilled with a batch of dictGetSomeKeys samples
+ * from all the dbs at once only when half of it has been used, so a burst
+ * of writes evicts many keys per refill instead of sampling again for
+ * every key.
+ *
+ * The LFU policies rank keys by an 8 bit logarithmic access counter that
+ * decays by one every lfu_decay_time minutes: a key read once by a scan
+ * stays near CACHE_LFU_INIT_VAL and goes before the keys that are read
+ * over and over, however recently the scan touched it. */
+
+unsigned long LFUGetTimeInMinutes(void) {
+    return (server.unixtime / 60) & 65535;
+}
+
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+    if (now >= ldt) return now - ldt;
+    return 65535 - ldt + now;
+}
+
+/* Increments the counter with probability 1 / ((counter - init) *
+ * lfu_log_factor + 1): with the default factor it takes about a million
+ * accesses to saturate. */
+uint8_t LFULogIncr(uint8_t counter) {
+    double r, baseval, p;
+    if (counter == 255) return 255;
+    r = (double) rand() / RAND_MAX;
+    baseval = counter - CACHE_LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    p = 1.0 / (baseval * server.lfu_log_factor + 1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* Returns the counter of o decayed by the periods elapsed since its last
+ * decrement. The object itself is only updated on access. */
+unsigned long LFUDecrAndReturn(cobj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long num_periods =
+            server.lfu_decay_time ? LFUTimeElapsed(ldt) / server.lfu_decay_time : 0;
+    if (num_periods) counter = (num_periods > counter) ? 0 : counter - num_periods;
+    return counter;
+}
+
+/* Called by the keyspace lookups on every access in place of refreshing
+ * the LRU clock when an LFU policy is selected: lookupKey() is not part
+ * of this tree, EVICT_BENCHMARK_MAIN below replays it. */
+void updateLFU(cobj *val) {
+    unsigned long counter = LFUDecrAndReturn(val);
+    counter = LFULogIncr(counter);
+    val->lru = (LFUGetTimeInMinutes() << 8) | counter;
+}
+
+struct evictionPoolEntry *evictionPoolAlloc(void) {
+    struct evictionPoolEntry *ep;
+    int j;
+    ep = zmalloc(sizeof(*ep) * CACHE_EVICTION_POOL_SIZE);
+    for (j = 0; j < CACHE_EVICTION_POOL_SIZE; j++) {
+        ep[j].idle = 0;
+        ep[j].key = NULL;
+        ep[j].dbid = 0;
+    }
+    return ep;
+}
+
+static int evictionPolicyIsVolatile(void) {
+    return server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_LRU ||
+           server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_TTL ||
+           server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_RANDOM ||
+           server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_LFU;
+}
+
+static Dict *evictionSampleDict(cacheDB *db) {
+    return evictionPolicyIsVolatile() ? db->expires : db->dict;
+}
+
+/* Entries are packed at the start of the pool. */
+static int evictionPoolLength(struct evictionPoolEntry *pool) {
+    int k = 0;
+    while (k < CACHE_EVICTION_POOL_SIZE && pool[k].key) k++;
+    return k;
+}
+
+/* Adds a copy of key to the pool, sorted by ascending idle time, unless
+ * the pool is full of better candidates. */
+static void evictionPoolInsert(struct evictionPoolEntry *pool, int dbid, Sds key,
+                               unsigned long long idle) {
+    int k = 0;
+    while (k < CACHE_EVICTION_POOL_SIZE && pool[k].key && pool[k].idle < idle) k++;
+    if (k == 0 && pool[CACHE_EVICTION_POOL_SIZE - 1].key != NULL) return;
+    if (k < CACHE_EVICTION_POOL_SIZE && pool[k].key == NULL) {
+        /* Inserting into an empty slot. */
+    } else if (pool[CACHE_EVICTION_POOL_SIZE - 1].key == NULL) {
+        memmove(pool + k + 1, pool + k,
+                sizeof(pool[0]) * (CACHE_EVICTION_POOL_SIZE - k - 1));
+    } else {
+        k--;
+        sdsFree(pool[0].key);
+        memmove(pool, pool + 1, sizeof(pool[0]) * k);
+    }
+    pool[k].key = sdsDup(key);
+    pool[k].idle = idle;
+    pool[k].dbid = dbid;
+}
+
+/* Candidates are ranked by idle: the larger the better to evict. For
+ * the LFU policies it is 255 minus the decayed counter, for volatile-ttl
+ * ULLONG_MAX minus the deadline. */
+static void evictionPoolPopulate(struct evictionPoolEntry *pool) {
+    DictEntry *samples[CACHE_EVICTION_SAMPLES_MAX];
+    unsigned int count, k;
+    int j, batch = server.maxmemory_samples;
+
+    if (batch < CACHE_EVICTION_BATCH_SAMPLES) batch = CACHE_EVICTION_BATCH_SAMPLES;
+    if (batch > CACHE_EVICTION_SAMPLES_MAX) batch = CACHE_EVICTION_SAMPLES_MAX;
+    for (j = 0; j < server.dbnum; j++) {
+        cacheDB *db = server.db + j;
+        Dict *sampledict = evictionSampleDict(db);
+        if (dictSize(sampledict) == 0) continue;
+        count = dictGetSomeKeys(sampledict, samples, batch);
+        for (k = 0; k < count; k++) {
+            Sds key = dictGetKey(samples[k]);
+            unsigned long long idle;
+            if (server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_TTL) {
+                idle = ULLONG_MAX - dictGetSignedIntegerVal(samples[k]);
+            } else {
+                DictEntry *de = samples[k];
+                if (sampledict != db->dict) de = dictFind(db->dict, key);
+                if (de == NULL) continue;
+                if (CACHE_MAXMEMORY_IS_LFU(server.maxmemory_policy))
+                    idle = 255 - LFUDecrAndReturn(dictGetVal(de));
+                else
+                    idle = estimateObjectIdleTime(dictGetVal(de));
+            }
+            evictionPoolInsert(pool, j, key, idle);
+        }
+    }
+}
+
+/* Takes the best candidate out of the pool. Candidates that left the
+ * keyspace since they were sampled are dropped. The caller frees the
+ * returned key. */
+static Sds evictionPoolPop(struct evictionPoolEntry *pool, int *dbid) {
+    int k;
+    for (k = evictionPoolLength(pool) - 1; k >= 0; k--) {
+        Sds key = pool[k].key;
+        pool[k].key = NULL;
+        if (dictFind(evictionSampleDict(server.db + pool[k].dbid), key)) {
+            *dbid = pool[k].dbid;
+            return key;
+        }
+        sdsFree(key);
+    }
+    return NULL;
+}
+
+/* Like evictionPoolPop, but leaves the candidate in the pool. */
+static Sds evictionPoolPeek(struct evictionPoolEntry *pool) {
+    int k;
+    for (k = evictionPoolLength(pool) - 1; k >= 0; k--) {
+        if (dictFind(evictionSampleDict(server.db + pool[k].dbid), pool[k].key))
+            return pool[k].key;
+        sdsFree(pool[k].key);
+        pool[k].key = NULL;
+    }
+    return NULL;
+}
+
+static Sds evictionRandomKey(int *dbid) {
+    static unsigned int next_db = 0;
+    int j;
+    for (j = 0; j < server.dbnum; j++) {
+        cacheDB *db = server.db + (next_db++ % server.dbnum);
+        Dict *sampledict = evictionSampleDict(db);
+        DictEntry *de;
+        if (dictSize(sampledict) == 0) continue;
+        if ((de = dictGetRandomKey(sampledict)) == NULL) continue;
+        *dbid = db->id;
+        return sdsDup(dictGetKey(de));
+    }
+    return NULL;
+}
+
+static size_t evictionUsedMemory(void) {
+    size_t mem_used = zmalloc_used_memory();
+    if (listLength(server.slaves)) {
+        ListIter li;
+        ListNode *ln;
+        listRewind(server.slaves, &li);
+        while ((ln = listNext(&li))) {
+            cacheClient *slave = listNodeValue(ln);
+            unsigned long obuf_bytes = getClientOutputBufferMemoryUsage(slave);
+            if (obuf_bytes > mem_used)
+                mem_used = 0;
+            else
+                mem_used -= obuf_bytes;
+        }
+    }
+    if (server.aof_state != CACHE_AOF_OFF) {
+        mem_used -= sdsAllocSize(server.aof_buf);
+        mem_used -= aofRewriteBufferSize();
+    }
+    return mem_used;
+}
+
+/* Set when the last eviction handed its value to the lazyfree thread:
+ * the job is done once lazyfreeGetFreedObjectsCount() reaches the target. */
+static int eviction_waits_lazyfree = 0;
+static size_t eviction_lazyfree_target;
+static long long eviction_lazyfree_since;
+
+/* Evicts keys until used memory is back under maxmemory. Eviction stops
+ * after maxmemory_eviction_budget microseconds: if it freed something the
+ * command is allowed and serverCron carries on where it stopped. Returns
+ * CACHE_ERR when nothing more can be evicted.
+ *
+ * A lazily deleted value is still allocated when dbDelete returns, so
+ * eviction stops after it and does not resume before the lazyfree thread
+ * freed it, instead of evicting more keys for memory on its way out.
+ * Jobs queued after it are not waited for, and the wait ends after
+ * CACHE_EVICTION_LAZYFREE_WAIT microseconds in any case, so that a long
+ * FLUSHALL ASYNC ahead of it cannot hold eviction off. */
+int freeMemoryIfNeeded(void) {
+    size_t mem_used, mem_tofree, mem_freed;
+    int slaves = listLength(server.slaves), keys_freed = 0, random_policy;
+    long long start, latency;
+
+    if (eviction_waits_lazyfree) {
+        if (lazyfreeGetFreedObjectsCount() < eviction_lazyfree_target &&
+            ustime() - eviction_lazyfree_since < CACHE_EVICTION_LAZYFREE_WAIT)
+            return CACHE_OK;
+        eviction_waits_lazyfree = 0;
+    }
+    server.eviction_pending = 0;
+    mem_used = evictionUsedMemory();
+    if (mem_used <= server.maxmemory) return CACHE_OK;
+    if (server.maxmemory_policy == CACHE_MAXMEMORY_NO_EVICTION) return CACHE_ERR;
+    random_policy = server.maxmemory_policy == CACHE_MAXMEMORY_ALLKEYS_RANDOM ||
+                    server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_RANDOM;
+    mem_tofree = mem_used - server.maxmemory;
+    mem_freed = 0;
+    start = ustime();
+    latencyStartMonitor(latency);
+    while (mem_freed < mem_tofree) {
+        struct evictionPoolEntry *pool = server.eviction_pool;
+        Sds bestkey;
+        int bestdbid = 0;
+        long long delta;
+        size_t lazy_queued;
+        cacheDB *db;
+        cobj *keyobj;
+
+        if (random_policy) {
+            bestkey = evictionRandomKey(&bestdbid);
+        } else {
+            if (evictionPoolLength(pool) < CACHE_EVICTION_POOL_SIZE / 2)
+                evictionPoolPopulate(pool);
+            if ((bestkey = evictionPoolPop(pool, &bestdbid)) == NULL) {
+                evictionPoolPopulate(pool);
+                bestkey = evictionPoolPop(pool, &bestdbid);
+            }
+        }
+        if (bestkey == NULL) break;
+
+        db = server.db + bestdbid;
+        keyobj = createStringObject(bestkey, sdsLen(bestkey));
+        propagateExpire(db, keyobj);
+        lazy_queued = lazyfreeGetQueuedObjectsCount();
+        delta = (long long) zmalloc_used_memory();
+        dbDelete(db, keyobj);
+        delta -= (long long) zmalloc_used_memory();
+        mem_freed += delta;
+        if (lazyfreeGetQueuedObjectsCount() > lazy_queued) {
+            eviction_waits_lazyfree = 1;
+            eviction_lazyfree_target = lazyfreeGetQueuedObjectsCount();
+            eviction_lazyfree_since = ustime();
+        }
+        server.stat_evictedkeys++;
+        notifyKeyspaceEvent(CACHE_NOTIFY_EVICTED, "evicted", keyobj, db->id);
+        decrRefCount(keyobj);
+        sdsFree(bestkey);
+        keys_freed++;
+
+        if (eviction_waits_lazyfree) {
+            server.eviction_pending = 1;
+            break;
+        }
+        if ((keys_freed & 15) == 0) {
+            if (slaves) flushSlavesOutputBuffers();
+            if (ustime() - start > server.maxmemory_eviction_budget) {
+                server.eviction_pending = 1;
+                break;
+            }
+        }
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("eviction-cycle", latency);
+    if (mem_freed < mem_tofree && !server.eviction_pending) return CACHE_ERR;
+    return CACHE_OK;
+}
+
+/* TinyLFU admission. With admission-filter enabled every command records
+ * an access to its first key in a count-min sketch. Once memory is full a
+ * key that is not in the keyspace yet is only admitted if it was accessed
+ * more often than the key that would be evicted to make room for it, so
+ * keys read once do not push hot keys out. A warm key still gets in now
+ * and then, so that a victim that collides with hot keys in the sketch
+ * cannot hold its place forever. */
+
+void admissionRecordAccess(Sds key) {
+    cmSketchIncr(server.admission_sketch, dictGenHashFunction(key, sdsLen(key)));
+}
+
+/* Called by processCommand before a command that may grow memory creates
+ * key: returns 0 if the key should not be stored, in which case the
+ * command is refused with an OOM error. */
+int admissionAdmitKey(Sds key) {
+    int random_policy, dbid, admit;
+    unsigned int freq, victim_freq;
+    Sds victim;
+
+    if (server.admission_sketch == NULL || server.maxmemory == 0 ||
+        server.maxmemory_policy == CACHE_MAXMEMORY_NO_EVICTION ||
+        evictionUsedMemory() <= server.maxmemory)
+        return 1;
+    random_policy = server.maxmemory_policy == CACHE_MAXMEMORY_ALLKEYS_RANDOM ||
+                    server.maxmemory_policy == CACHE_MAXMEMORY_VOLATILE_RANDOM;
+    if (random_policy) {
+        victim = evictionRandomKey(&dbid);
+    } else {
+        if (evictionPoolLength(server.eviction_pool) < CACHE_EVICTION_POOL_SIZE / 2)
+            evictionPoolPopulate(server.eviction_pool);
+        victim = evictionPoolPeek(server.eviction_pool);
+    }
+    if (victim == NULL) return 1;
+    freq = cmSketchEstimate(server.admission_sketch,
+                            dictGenHashFunction(key, sdsLen(key)));
+    victim_freq = cmSketchEstimate(server.admission_sketch,
+                                   dictGenHashFunction(victim, sdsLen(victim)));
+    if (random_policy) sdsFree(victim);
+    admit = freq > victim_freq ||
+            (freq >= CACHE_ADMISSION_WARM_FREQ && (random() & 127) == 0);
+    if (admit)
+        server.stat_admission_admitted++;
+    else
+        server.stat_admission_rejected++;
+    return admit;
+}
+
+Sds genAdmissionInfoString(Sds info) {
+    CmSketch *s = server.admission_sketch;
+    return sdsCatPrintf(info,
+                        "# Admission\r\n"
+                        "admission_filter:%d\r\n"
+                        "admission_sketch_bytes:%llu\r\n"
+                        "admission_sketch_resets:%llu\r\n"
+                        "admission_admitted:%lld\r\n"
+                        "admission_rejected:%lld\r\n",
+                        s != NULL,
+                        s ? (unsigned long long) s->width * CMSKETCH_DEPTH / 2 : 0,
+                        s ? (unsigned long long) s->resets : 0,
+                        server.stat_admission_admitted,
+                        server.stat_admission_rejected);
+}
+
+#ifdef EVICT_BENCHMARK_MAIN
+#include <math.h>
+#include <stdio.h>
+
+/* Replays a trace of Zipfian reads over `keys` keys, with bursts of keys
+ * read once as in the CMSKETCH_BENCHMARK_MAIN trace, against a keyspace
+ * of `capacity` keys. A miss stores the key, evicting the worst of
+ * CACHE_DEFAULT_MAXMEMORY_SAMPLES sampled keys when full: once ranked by
+ * idle time with allkeys-lru, once by the decayed counter with
+ * allkeys-lfu. Objects go through initObjectLRUOrLFU() and hits through
+ * updateLFU() or the LRU clock, as in lookupKey(), while the clock moves
+ * a second every BENCH_OPS_PER_SEC requests. Links with the server
+ * objects, less the one defining main(). */
+
+#define BENCH_BURST_EVERY 100000
+#define BENCH_BURST_LEN 20000
+#define BENCH_OPS_PER_SEC 10000
+
+static double benchReplay(long *trace, long len, long ids, long capacity,
+                          int policy) {
+    cobj *objs = zmalloc(sizeof(cobj) * ids);
+    long *resident = zmalloc(sizeof(long) * capacity);
+    long *slot = zmalloc(sizeof(long) * ids);
+    long used = 0, hits = 0, gets = 0, j;
+    int lfu = CACHE_MAXMEMORY_IS_LFU(policy), k;
+
+    server.maxmemory_policy = policy;
+    server.unixtime = 1000000000;
+    server.lruclock = server.unixtime & CACHE_LRU_CLOCK_MAX;
+    for (j = 0; j < ids; j++) slot[j] = -1;
+    for (j = 0; j < len; j++) {
+        long id = trace[j], s, best = -1;
+        unsigned long long score, best_score = 0;
+        if (j % BENCH_OPS_PER_SEC == 0) {
+            server.unixtime++;
+            server.lruclock = server.unixtime & CACHE_LRU_CLOCK_MAX;
+        }
+        if (id >= 0) gets++;
+        else id = -id - 1;
+        if (slot[id] != -1) {
+            if (trace[j] >= 0) hits++;
+            if (lfu)
+                updateLFU(objs + id);
+            else
+                objs[id].lru = LRU_CLOCK();
+            continue;
+        }
+        if (used < capacity) {
+            s = used++;
+        } else {
+            for (k = 0; k < CACHE_DEFAULT_MAXMEMORY_SAMPLES; k++) {
+                long candidate = random() % capacity;
+                cobj *o = objs + resident[candidate];
+                score = lfu ? 255 - LFUDecrAndReturn(o) : estimateObjectIdleTime(o);
+                if (best == -1 || score > best_score) {
+                    best = candidate;
+                    best_score = score;
+                }
+            }
+            s = best;
+            slot[resident[s]] = -1;
+        }
+        resident[s] = id;
+        slot[id] = s;
+        initObjectLRUOrLFU(objs + id);
+    }
+    zfree(objs);
+    zfree(resident);
+    zfree(slot);
+    return (double) hits / gets;
+}
+
+int main(int argc, char **argv) {
+    long keys = argc > 1 ? atol(argv[1]) : 1000000;
+    long capacity = argc > 2 ? atol(argv[2]) : 10000;
+    long len = argc > 3 ? atol(argv[3]) : 5000000;
+    double alpha = argc > 4 ? atof(argv[4]) : 0.99, sum = 0;
+    double *cdf = zmalloc(sizeof(double) * keys);
+    long *trace = zmalloc(sizeof(long) * len), j, ids = keys;
+    long long start;
+    cobj o;
+
+    server.hz = CACHE_DEFAULT_HZ;
+    server.lfu_log_factor = CACHE_DEFAULT_LFU_LOG_FACTOR;
+    server.lfu_decay_time = CACHE_DEFAULT_LFU_DECAY_TIME;
+    for (j = 0; j < keys; j++) cdf[j] = sum += 1.0 / pow(j + 1, alpha);
+    for (j = 0; j < len; j++) {
+        if (j % BENCH_BURST_EVERY < BENCH_BURST_LEN) {
+            trace[j] = -(ids++) - 1;
+        } else {
+            double u = drand48() * sum;
+            long lo = 0, hi = keys - 1;
+            while (lo < hi) {
+                long mid = lo + (hi - lo) / 2;
+                if (cdf[mid] < u)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            trace[j] = lo;
+        }
+    }
+
+    printf("%ld requests over %ld keys, alpha %.2f, keyspace of %ld keys\n", len,
+           keys, alpha, capacity);
+    printf("allkeys-lru: hit ratio %.4f\n",
+           benchReplay(trace, len, ids, capacity, CACHE_MAXMEMORY_ALLKEYS_LRU));
+    printf("allkeys-lfu: hit ratio %.4f\n",
+           benchReplay(trace, len, ids, capacity, CACHE_MAXMEMORY_ALLKEYS_LFU));
+    initObjectLRUOrLFU(&o);
+    start = ustime();
+    for (j = 0; j < len; j++) updateLFU(&o);
+    printf("updateLFU: %.1f ns (counter %lu)\n",
+           (ustime() - start) * 1000.0 / len, LFUDecrAndReturn(&o));
+    zfree(trace);
+    zfree(cdf);
+    return 0;
+}
+#endif
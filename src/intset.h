@@ -27,4 +27,8 @@ uint32_t intsetLen(intset *is);
 
 size_t insertBlobLen(intset *is);
 
+uint32_t intsetFilterSorted(intset *is, int64_t *v, uint32_t n, int keep);
+
+void intsetDecode(intset *is, int64_t *out);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include "cache.h"
+
+/* Threaded network I/O. readQueryFromClient() parks readable clients on
+ * server.clients_pending_read through postponeClientRead(), and
+ * replies are queued on server.clients_pending_write instead of
+ * installing a write handler right away. beforeSleep() then fans both
+ * lists out to the I/O threads: they read and parse query buffers into
+ * argv, or write c->buf and c->reply, while commands themselves are
+ * still executed by the main thread. Thread 0 is the main thread. */
+
+#define CACHE_IO_THREADS_SPIN 1000000
+
+static pthread_t io_threads[CACHE_IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_mutex[CACHE_IO_THREADS_MAX_NUM];
+static unsigned long io_threads_pending[CACHE_IO_THREADS_MAX_NUM];
+static List *io_threads_list[CACHE_IO_THREADS_MAX_NUM];
+int io_threads_op = CACHE_IO_THREADS_OP_IDLE;
+
+static unsigned long getIOPendingCount(int i) {
+    return __atomic_load_n(&io_threads_pending[i], __ATOMIC_ACQUIRE);
+}
+
+static void setIOPendingCount(int i, unsigned long count) {
+    __atomic_store_n(&io_threads_pending[i], count, __ATOMIC_RELEASE);
+}
+
+static void processIOThreadList(int id) {
+    ListIter li;
+    ListNode *ln;
+    listRewind(io_threads_list[id], &li);
+    while ((ln = listNext(&li)) != NULL) {
+        cacheClient *c = listNodeValue(ln);
+        if (io_threads_op == CACHE_IO_THREADS_OP_WRITE)
+            writeToClient(c->fd, c, 0);
+        else
+            readQueryFromClient(server.el, c->fd, c, AE_READABLE);
+    }
+    while ((ln = listFirst(io_threads_list[id])) != NULL)
+        listDelNode(io_threads_list[id], ln);
+}
+
+/* Spins waiting for work and parks on its mutex when the main thread
+ * stops threaded I/O because there is not enough traffic. */
+void *IOThreadMain(void *myid) {
+    long id = (long) myid;
+    while (1) {
+        int j;
+        for (j = 0; j < CACHE_IO_THREADS_SPIN; j++)
+            if (getIOPendingCount(id) != 0) break;
+        if (getIOPendingCount(id) == 0) {
+            pthread_mutex_lock(&io_threads_mutex[id]);
+            pthread_mutex_unlock(&io_threads_mutex[id]);
+            continue;
+        }
+        processIOThreadList(id);
+        setIOPendingCount(id, 0);
+    }
+}
+
+void initThreadedIO(void) {
+    pthread_t tid;
+    long j;
+    server.io_threads_active = 0;
+    if (server.io_threads_num <= 1) return;
+    if (server.io_threads_num > CACHE_IO_THREADS_MAX_NUM) {
+        cacheLog(CACHE_WARNING, "Fatal: too many I/O threads configured. "
+                                "The maximum number is %d.",
+                 CACHE_IO_THREADS_MAX_NUM);
+        exit(1);
+    }
+    zmalloc_enable_thread_safeness();
+    for (j = 0; j < server.io_threads_num; j++) {
+        io_threads_list[j] = listCreate();
+        if (j == 0) continue;
+        pthread_mutex_init(&io_threads_mutex[j], NULL);
+        setIOPendingCount(j, 0);
+        pthread_mutex_lock(&io_threads_mutex[j]);
+        if (pthread_create(&tid, NULL, IOThreadMain, (void *) j) != 0) {
+            cacheLog(CACHE_WARNING, "Fatal: Can't initialize I/O threads.");
+            exit(1);
+        }
+        io_threads[j] = tid;
+    }
+}
+
+static void startThreadedIO(void) {
+    int j;
+    for (j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads_mutex[j]);
+    server.io_threads_active = 1;
+}
+
+static void stopThreadedIO(void) {
+    int j;
+    handleClientsWithPendingReadsUsingThreads();
+    for (j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads_mutex[j]);
+    server.io_threads_active = 0;
+}
+
+/* Threads only pay off when there are at least two clients per thread
+ * to serve; below that the main thread does the work alone. */
+static int stopThreadedIOIfNeeded(void) {
+    unsigned long pending = listLength(server.clients_pending_write);
+    if (server.io_threads_num <= 1) return 1;
+    if (pending < (unsigned long) server.io_threads_num * 2) {
+        if (server.io_threads_active) stopThreadedIO();
+        return 1;
+    }
+    return 0;
+}
+
+/* Hands the clients of `list` out round robin, processes the share of
+ * the main thread and waits until every I/O thread is done. */
+static void runThreadedIO(List *list, int op, int flag) {
+    ListIter li;
+    ListNode *ln;
+    unsigned long item_id = 0, pending;
+    int j;
+    listRewind(list, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        cacheClient *c = listNodeValue(ln);
+        if (op == CACHE_IO_THREADS_OP_WRITE) c->flags &= ~flag;
+        listAddNodeTail(io_threads_list[item_id % server.io_threads_num], c);
+        item_id++;
+    }
+    io_threads_op = op;
+    for (j = 1; j < server.io_threads_num; j++)
+        setIOPendingCount(j, listLength(io_threads_list[j]));
+    processIOThreadList(0);
+    do {
+        pending = 0;
+        for (j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+    } while (pending != 0);
+    io_threads_op = CACHE_IO_THREADS_OP_IDLE;
+}
+
+/* Called by prepareClientToWrite(): the reply is flushed before the
+ * next poll, and a write handler is only installed for what is left. */
+void queueClientForWrite(cacheClient *c) {
+    if (c->flags & CACHE_PENDING_WRITE) return;
+    c->flags |= CACHE_PENDING_WRITE;
+    listAddNodeHead(server.clients_pending_write, c);
+}
+
+/* Installs the write handler for the replies a round left unwritten. */
+static void installWriteHandlerIfNeeded(cacheClient *c) {
+    if (c->flags & CACHE_CLOSE_ASAP) return;
+    if (clientHasPendingReplies(c) &&
+        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE | AE_DRAINS,
+                          sendReplyToClient, c) == AE_ERR)
+        freeClientAsync(c);
+}
+
+int handleClientsWithPendingWritesUsingThreads(void) {
+    ListNode *ln;
+    int processed = listLength(server.clients_pending_write);
+    if (processed == 0) return 0;
+    if (stopThreadedIOIfNeeded()) {
+        /* On the main thread writeToClient() may free the client, so it
+         * leaves the list before it is written to. */
+        while ((ln = listFirst(server.clients_pending_write)) != NULL) {
+            cacheClient *c = listNodeValue(ln);
+            listDelNode(server.clients_pending_write, ln);
+            c->flags &= ~CACHE_PENDING_WRITE;
+            if (writeToClient(c->fd, c, 0) == CACHE_ERR) continue;
+            installWriteHandlerIfNeeded(c);
+        }
+        return processed;
+    }
+    if (!server.io_threads_active) startThreadedIO();
+    runThreadedIO(server.clients_pending_write, CACHE_IO_THREADS_OP_WRITE,
+                  CACHE_PENDING_WRITE);
+    while ((ln = listFirst(server.clients_pending_write)) != NULL) {
+        cacheClient *c = listNodeValue(ln);
+        listDelNode(server.clients_pending_write, ln);
+        clientReleaseSentReplies(c);
+        if (c->flags & CACHE_CLOSE_AFTER_IO) {
+            c->flags &= ~CACHE_CLOSE_AFTER_IO;
+            freeClientAsync(c);
+            continue;
+        }
+        installWriteHandlerIfNeeded(c);
+    }
+    return processed;
+}
+
+/* Called first thing by readQueryFromClient(). Returns 1 when the read
+ * was deferred to the I/O threads. */
+int postponeClientRead(cacheClient *c) {
+    if (server.io_threads_active && server.io_threads_do_reads &&
+        !(c->flags & (CACHE_MASTER | CACHE_SLAVE | CACHE_PENDING_READ))) {
+        c->flags |= CACHE_PENDING_READ;
+        listAddNodeHead(server.clients_pending_read, c);
+        return 1;
+    }
+    return 0;
+}
+
+/* The I/O threads read and parse at most one command per client; the
+ * main thread then executes it and lets processInputBuffer() handle any
+ * further pipelined commands already in the query buffer. */
+int handleClientsWithPendingReadsUsingThreads(void) {
+    ListNode *ln;
+    int processed = listLength(server.clients_pending_read);
+    if (!server.io_threads_active || !server.io_threads_do_reads) return 0;
+    if (processed == 0) return 0;
+    runThreadedIO(server.clients_pending_read, CACHE_IO_THREADS_OP_READ, 0);
+    while ((ln = listFirst(server.clients_pending_read)) != NULL) {
+        cacheClient *c = listNodeValue(ln);
+        c->flags &= ~CACHE_PENDING_READ;
+        listDelNode(server.clients_pending_read, ln);
+        if (c->flags & CACHE_CLOSE_AFTER_IO) {
+            c->flags &= ~CACHE_CLOSE_AFTER_IO;
+            freeClientAsync(c);
+            continue;
+        }
+        if (c->flags & CACHE_CLOSE_ASAP) continue;
+        if (c->flags & CACHE_PENDING_COMMAND) {
+            c->flags &= ~CACHE_PENDING_COMMAND;
+            if (processCommand(c) == CACHE_OK) resetClient(c);
+        }
+        processInputBuffer(c);
+        /* Replies added while the read was pending were not queued. */
+        if (clientHasPendingReplies(c)) queueClientForWrite(c);
+    }
+    return processed;
+}
@@ -0,0 +1,321 @@
+#include "cache.h"
+#include "cluster.h"
+
+/* Ordered key indexes kept next to the keyspace dicts. With
+ * keyspace-index enabled db->keys_index holds every key of the db, so a
+ * KEYS pattern such as session:1234:* only walks the keys below its
+ * literal prefix. In cluster mode slots_to_keys holds every key behind
+ * its two-byte hash slot, which makes the keys of a slot one subtree.
+ * With expires-index enabled db->expires_index holds every volatile key
+ * behind its eight-byte deadline, so the keys that are due come first. */
+
+#define CACHE_SLOT_KEY_STATIC_LEN 64
+#define CACHE_EXPIRE_KEY_STATIC_LEN 64
+
+void dbIndexAdd(cacheDB *db, Sds key) {
+    if (db->keys_index)
+        raxInsert(db->keys_index, (unsigned char *) key, sdsLen(key), NULL, NULL);
+}
+
+void dbIndexDelete(cacheDB *db, Sds key) {
+    if (db->keys_index)
+        raxRemove(db->keys_index, (unsigned char *) key, sdsLen(key), NULL);
+}
+
+void dbIndexEmpty(cacheDB *db) {
+    if (db->keys_index == NULL) return;
+    raxFree(db->keys_index, NULL);
+    db->keys_index = raxNew();
+}
+
+/* Length of the part of a glob pattern that only matches itself. */
+static size_t globLiteralPrefix(const char *pattern, size_t len) {
+    size_t j;
+    for (j = 0; j < len; j++) {
+        char c = pattern[j];
+        if (c == '*' || c == '?' || c == '[' || c == '\\') break;
+    }
+    return j;
+}
+
+typedef struct dbIndexMatch {
+    Sds pattern;
+    dbIndexKeyFunction *fn;
+    void *privdata;
+} dbIndexMatch;
+
+static int dbIndexMatchKey(void *privdata, const unsigned char *key, size_t len,
+                           void *value) {
+    dbIndexMatch *m = privdata;
+    CACHE_NOTUSED(value);
+    if (stringMatchLen(m->pattern, sdsLen(m->pattern), (const char *) key, len, 0))
+        m->fn(m->privdata, (const char *) key, len);
+    return 1;
+}
+
+/* Calls fn, in key order, for the keys of db matching pattern, only
+ * visiting the keys that share its literal prefix. Returns CACHE_ERR
+ * without calling fn when db is not indexed or the pattern starts with a
+ * wildcard: the caller then has to go through db->dict. */
+int dbIndexMatchKeys(cacheDB *db, Sds pattern, dbIndexKeyFunction *fn,
+                     void *privdata) {
+    size_t plen = sdsLen(pattern), prefix = globLiteralPrefix(pattern, plen);
+    dbIndexMatch m;
+    if (db->keys_index == NULL || prefix == 0) return CACHE_ERR;
+    if (prefix == plen) {
+        if (raxFind(db->keys_index, (unsigned char *) pattern, plen, NULL))
+            fn(privdata, pattern, plen);
+        return CACHE_OK;
+    }
+    m.pattern = pattern;
+    m.fn = fn;
+    m.privdata = privdata;
+    raxWalkPrefix(db->keys_index, (unsigned char *) pattern, prefix,
+                  dbIndexMatchKey, &m);
+    return CACHE_OK;
+}
+
+/* Builds the expires_index key of `key`: its deadline, big endian with
+ * the sign bit flipped so that byte order is numeric order, then the key
+ * itself. Returns buf, or a new allocation when it does not fit. */
+static unsigned char *expireIndexKey(Sds key, long long when,
+                                     unsigned char *buf, size_t *len) {
+    size_t keylen = sdsLen(key);
+    uint64_t deadline = (uint64_t) when ^ (1ULL << 63);
+    unsigned char *idx = buf;
+    int j;
+    *len = keylen + 8;
+    if (*len > CACHE_EXPIRE_KEY_STATIC_LEN) idx = zmalloc(*len);
+    for (j = 7; j >= 0; j--) {
+        idx[j] = deadline & 0xff;
+        deadline >>= 8;
+    }
+    memcpy(idx + 8, key, keylen);
+    return idx;
+}
+
+void expireIndexAdd(cacheDB *db, Sds key, long long when) {
+    unsigned char buf[CACHE_EXPIRE_KEY_STATIC_LEN], *idx;
+    size_t len;
+    if (db->expires_index == NULL) return;
+    idx = expireIndexKey(key, when, buf, &len);
+    raxInsert(db->expires_index, idx, len, NULL, NULL);
+    if (idx != buf) zfree(idx);
+}
+
+void expireIndexDelete(cacheDB *db, Sds key, long long when) {
+    unsigned char buf[CACHE_EXPIRE_KEY_STATIC_LEN], *idx;
+    size_t len;
+    if (db->expires_index == NULL) return;
+    idx = expireIndexKey(key, when, buf, &len);
+    raxRemove(db->expires_index, idx, len, NULL);
+    if (idx != buf) zfree(idx);
+}
+
+void expireIndexEmpty(cacheDB *db) {
+    if (db->expires_index == NULL) return;
+    raxFree(db->expires_index, NULL);
+    db->expires_index = raxNew();
+}
+
+typedef struct expiredKeys {
+    uint64_t now;
+    cobj **keys;
+    long long *when;
+    unsigned int count, found;
+} expiredKeys;
+
+static int expiredKeysCollect(void *privdata, const unsigned char *key,
+                              size_t len, void *value) {
+    expiredKeys *ek = privdata;
+    uint64_t deadline = 0;
+    int j;
+    CACHE_NOTUSED(value);
+    for (j = 0; j < 8; j++) deadline = (deadline << 8) | key[j];
+    if (deadline >= ek->now) return 0;
+    ek->when[ek->found] = (long long) (deadline ^ (1ULL << 63));
+    ek->keys[ek->found++] = createStringObject((char *) key + 8, len - 8);
+    return ek->found < ek->count;
+}
+
+/* Fills keys and when with up to count keys of db whose deadline is
+ * before now, earliest first, and returns how many were found. The index
+ * is not modified: the caller deletes the keys it actually expires. */
+unsigned int expireIndexGetExpired(cacheDB *db, long long now, cobj **keys,
+                                   long long *when, unsigned int count) {
+    expiredKeys ek;
+    if (db->expires_index == NULL || count == 0) return 0;
+    ek.now = (uint64_t) now ^ (1ULL << 63);
+    ek.keys = keys;
+    ek.when = when;
+    ek.count = count;
+    ek.found = 0;
+    raxWalkPrefix(db->expires_index, (unsigned char *) "", 0, expiredKeysCollect,
+                  &ek);
+    return ek.found;
+}
+
+/* Builds the slots_to_keys key of `key`: its slot, big endian, then the
+ * key itself. Returns buf, or a new allocation when it does not fit. */
+static unsigned char *slotToKeyIndex(cobj *key, unsigned char *buf,
+                                     size_t *len, unsigned int *hashslot) {
+    size_t keylen = sdsLen(key->ptr);
+    unsigned char *idx = buf;
+    *hashslot = keyHashSlot(key->ptr, keylen);
+    *len = keylen + 2;
+    if (*len > CACHE_SLOT_KEY_STATIC_LEN) idx = zmalloc(*len);
+    idx[0] = *hashslot >> 8;
+    idx[1] = *hashslot & 0xff;
+    memcpy(idx + 2, key->ptr, keylen);
+    return idx;
+}
+
+void slotToKeyAdd(cobj *key) {
+    unsigned char buf[CACHE_SLOT_KEY_STATIC_LEN], *idx;
+    unsigned int hashslot;
+    size_t len;
+    idx = slotToKeyIndex(key, buf, &len, &hashslot);
+    if (raxInsert(server.cluster->slots_to_keys, idx, len, NULL, NULL))
+        server.cluster->slots_keys_count[hashslot]++;
+    if (idx != buf) zfree(idx);
+}
+
+void slotToKeyDel(cobj *key) {
+    unsigned char buf[CACHE_SLOT_KEY_STATIC_LEN], *idx;
+    unsigned int hashslot;
+    size_t len;
+    idx = slotToKeyIndex(key, buf, &len, &hashslot);
+    if (raxRemove(server.cluster->slots_to_keys, idx, len, NULL))
+        server.cluster->slots_keys_count[hashslot]--;
+    if (idx != buf) zfree(idx);
+}
+
+void slotToKeyFlush(void) {
+    raxFree(server.cluster->slots_to_keys, NULL);
+    server.cluster->slots_to_keys = raxNew();
+    memset(server.cluster->slots_keys_count, 0,
+           sizeof(server.cluster->slots_keys_count));
+}
+
+typedef struct slotKeys {
+    cobj **keys;
+    unsigned int count, found;
+} slotKeys;
+
+static int slotKeysCollect(void *privdata, const unsigned char *key, size_t len,
+                           void *value) {
+    slotKeys *sk = privdata;
+    CACHE_NOTUSED(value);
+    sk->keys[sk->found++] = createStringObject((char *) key + 2, len - 2);
+    return sk->found < sk->count;
+}
+
+unsigned int getKeysInSlot(unsigned int hashslot, cobj **keys,
+                           unsigned int count) {
+    unsigned char prefix[2];
+    slotKeys sk;
+    if (count == 0) return 0;
+    prefix[0] = hashslot >> 8;
+    prefix[1] = hashslot & 0xff;
+    sk.keys = keys;
+    sk.count = count;
+    sk.found = 0;
+    raxWalkPrefix(server.cluster->slots_to_keys, prefix, 2, slotKeysCollect, &sk);
+    return sk.found;
+}
+
+unsigned int countKeysInSlot(unsigned int hashslot) {
+    return server.cluster->slots_keys_count[hashslot];
+}
+
+unsigned int delkeysInSlot(unsigned int hashslot) {
+    unsigned int j = 0;
+    cobj *key;
+    while (getKeysInSlot(hashslot, &key, 1) == 1) {
+        dbDelete(&server.db[0], key);
+        decrRefCount(key);
+        j++;
+    }
+    return j;
+}
+
+#ifdef KEYINDEX_BENCHMARK_MAIN
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Expires volatile keys through db->expires_index the way
+ * activeExpireCycleIndexed() does, a quarter of the due ones having been
+ * given a later deadline since, and checks that every due key comes out
+ * once, earliest deadline first, that the moved ones are only met as
+ * stale entries, and that nothing due is left. Then prints ns per key. */
+
+static long long benchNstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t benchHash(long id) {
+    uint64_t h = (uint64_t) id * 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 33);
+}
+
+int main(int argc, char **argv) {
+    long keys = argc > 1 ? atol(argv[1]) : 1000000, due = 0, expired = 0, stale = 0;
+    long long now = 1000000000, last = LLONG_MIN, start, *deadline;
+    cobj *found[ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP];
+    long long when[ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP];
+    unsigned int n, j;
+    cacheDB db;
+    long id;
+
+    memset(&db, 0, sizeof(db));
+    db.expires_index = raxNew();
+    deadline = zmalloc(sizeof(long long) * keys);
+    for (id = 0; id < keys; id++) {
+        Sds key = sdsCatPrintf(sdsEmpty(), "key:%ld", id);
+        deadline[id] = now - keys / 2 + (long long) (benchHash(id) % keys);
+        expireIndexAdd(&db, key, deadline[id]);
+        if ((id & 3) == 0 && deadline[id] < now) {
+            deadline[id] = now + id;
+            expireIndexAdd(&db, key, deadline[id]);
+        }
+        if (deadline[id] < now) due++;
+        sdsFree(key);
+    }
+
+    start = benchNstime();
+    do {
+        n = expireIndexGetExpired(&db, now, found, when,
+                                  ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP);
+        for (j = 0; j < n; j++) {
+            expireIndexDelete(&db, found[j]->ptr, when[j]);
+            id = atol((char *) found[j]->ptr + 4);
+            if (when[j] < last) {
+                printf("FAIL: %s out of deadline order\n", (char *) found[j]->ptr);
+                return 1;
+            }
+            last = when[j];
+            if (deadline[id] == when[j]) {
+                deadline[id] = LLONG_MAX;
+                expired++;
+            } else {
+                stale++;
+            }
+            decrRefCount(found[j]);
+        }
+    } while (n == ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP);
+    start = benchNstime() - start;
+
+    if (expired != due || expireIndexGetExpired(&db, now, found, when, 1) != 0) {
+        printf("FAIL: expired %ld of %ld due keys\n", expired, due);
+        return 1;
+    }
+    printf("%ld keys: %ld expired, %ld stale entries skipped, %.1f ns/key\n",
+           keys, expired, stale, (double) start / (expired + stale));
+    raxFree(db.expires_index, NULL);
+    zfree(deadline);
+    return 0;
+}
+#endif
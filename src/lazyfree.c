@@ -0,0 +1,169 @@
+#include "cache.h"
+#include "bio.h"
+#include "cluster.h"
+
+/* Lazy freeing. With lazyfree enabled, deleting or overwriting a value
+ * made of more than CACHE_LAZYFREE_THRESHOLD allocations only unlinks it
+ * from the keyspace: the value itself is released by the
+ * CACHE_BIO_LAZY_FREE thread, so DEL of a set with millions of members
+ * costs the event loop no more than DEL of a string. FLUSHDB ASYNC and
+ * FLUSHALL ASYNC hand the whole dicts of a db to the same thread. */
+
+static size_t lazyfree_objects = 0;
+static size_t lazyfree_queued_objects = 0; /* Only touched by the main thread. */
+static size_t lazyfree_freed_objects = 0;
+
+size_t lazyfreeGetPendingObjectsCount(void) {
+    return __atomic_load_n(&lazyfree_objects, __ATOMIC_RELAXED);
+}
+
+/* Both only grow: a job queued when lazyfreeGetQueuedObjectsCount()
+ * returned n is done once lazyfreeGetFreedObjectsCount() reaches n. */
+size_t lazyfreeGetQueuedObjectsCount(void) {
+    return lazyfree_queued_objects;
+}
+
+size_t lazyfreeGetFreedObjectsCount(void) {
+    return __atomic_load_n(&lazyfree_freed_objects, __ATOMIC_ACQUIRE);
+}
+
+static void lazyfreeQueued(size_t n) {
+    lazyfree_queued_objects += n;
+    __atomic_fetch_add(&lazyfree_objects, n, __ATOMIC_RELAXED);
+}
+
+static void lazyfreeFreed(size_t n) {
+    __atomic_fetch_sub(&lazyfree_objects, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lazyfree_freed_objects, n, __ATOMIC_RELEASE);
+}
+
+/* Roughly the number of allocations freeing obj takes. */
+size_t lazyfreeGetFreeEffort(cobj *obj) {
+    if (obj->type == CACHE_LIST && obj->encoding == CACHE_ENCODING_QUICKLIST) {
+        return ((quicklist *) obj->ptr)->len;
+    } else if (obj->type == CACHE_SET && obj->encoding == CACHE_ENCODING_HT) {
+        return dictSize((Dict *) obj->ptr);
+    } else if (obj->type == CACHE_SET && obj->encoding == CACHE_ENCODING_ROARING) {
+        return ((roaring *) obj->ptr)->len;
+    } else if (obj->type == CACHE_ZSET && obj->encoding == CACHE_ENCODING_SKIPLIST) {
+        return ((zset *) obj->ptr)->zsl->length;
+    } else if (obj->type == CACHE_HASH && obj->encoding == CACHE_ENCODING_HT) {
+        return dictSize((Dict *) obj->ptr);
+    } else {
+        return 1;
+    }
+}
+
+/* Refcounts are not atomic, so only a value nothing else references may
+ * cross threads. The members of sets, hashes and zsets are objects too,
+ * and a reply list may hold one by reference, see networking.c. */
+static int lazyfreeIsShared(cobj *obj) {
+    if (obj->refcount != 1) return 1;
+    if (server.reply_zerocopy_clients == 0) return 0;
+    return (obj->type == CACHE_SET && obj->encoding == CACHE_ENCODING_HT) ||
+           (obj->type == CACHE_HASH && obj->encoding == CACHE_ENCODING_HT) ||
+           (obj->type == CACHE_ZSET && obj->encoding == CACHE_ENCODING_SKIPLIST);
+}
+
+/* Releases obj from the lazyfree thread if it is big enough and nothing
+ * else references it, right away otherwise. */
+void freeObjAsync(cobj *obj) {
+    if (server.lazyfree && !lazyfreeIsShared(obj) &&
+        lazyfreeGetFreeEffort(obj) > CACHE_LAZYFREE_THRESHOLD) {
+        lazyfreeQueued(1);
+        bioCreateBackgroundJob(CACHE_BIO_LAZY_FREE, obj, NULL, NULL);
+    } else {
+        decrRefCount(obj);
+    }
+}
+
+/* The lazy counterpart of dbDelete: the entry leaves db->dict now, a big
+ * value is queued to the lazyfree thread. While a snapshot is running the
+ * value is deleted synchronously, since the snapshot barrier needs it
+ * still linked when the entry is removed. */
+int dbAsyncDelete(cacheDB *db, cobj *key) {
+    DictEntry *de;
+    long long when;
+
+    if ((when = getExpire(db, key)) != -1) {
+        expireIndexDelete(db, key->ptr, when);
+        dictDelete(db->expires, key->ptr);
+    }
+    if ((de = dictFind(db->dict, key->ptr)) == NULL) return 0;
+    if (server.snapshot == NULL) {
+        cobj *val = dictGetVal(de);
+        if (!lazyfreeIsShared(val) &&
+            lazyfreeGetFreeEffort(val) > CACHE_LAZYFREE_THRESHOLD) {
+            lazyfreeQueued(1);
+            bioCreateBackgroundJob(CACHE_BIO_LAZY_FREE, val, NULL, NULL);
+            distSetVal(db->dict, de, NULL);
+        }
+    }
+    dbIndexDelete(db, key->ptr);
+    dictDelete(db->dict, key->ptr);
+    if (server.cluster_enabled) slotToKeyDel(key);
+    return 1;
+}
+
+/* Swaps in empty dicts and indexes for db and releases the old ones from
+ * the lazyfree thread. The only references to values the keyspace does
+ * not own are the argv of a command batch, flushed here, and reply lists;
+ * while a client holds replies by reference, and during a snapshot, which
+ * still references the values, the db is emptied in place instead. */
+void emptyDbAsync(cacheDB *db) {
+    Dict *olddict = db->dict, *oldexpires = db->expires;
+    Rax *oldindex = db->keys_index, *oldexpiresindex = db->expires_index;
+
+    flushCommandBatch(NULL);
+    if (server.snapshot != NULL || server.reply_zerocopy_clients) {
+        dictEmpty(db->dict, NULL);
+        dictEmpty(db->expires, NULL);
+        dbIndexEmpty(db);
+        expireIndexEmpty(db);
+        return;
+    }
+    db->dict = dictCreate(&dbDictType, NULL);
+    db->expires = dictCreate(&keyptrDictType, NULL);
+    db->keys_index = oldindex ? raxNew() : NULL;
+    db->expires_index = oldexpiresindex ? raxNew() : NULL;
+    lazyfreeQueued(dictSize(olddict) + dictSize(oldexpires));
+    /* The expires share their keys with the dict, so they go first. */
+    bioCreateBackgroundJob(CACHE_BIO_LAZY_FREE, NULL, oldexpires, oldexpiresindex);
+    bioCreateBackgroundJob(CACHE_BIO_LAZY_FREE, NULL, olddict, oldindex);
+}
+
+void slotToKeyFlushAsync(void) {
+    Rax *old = server.cluster->slots_to_keys;
+    server.cluster->slots_to_keys = raxNew();
+    memset(server.cluster->slots_keys_count, 0,
+           sizeof(server.cluster->slots_keys_count));
+    bioCreateBackgroundJob(CACHE_BIO_LAZY_FREE, NULL, NULL, old);
+}
+
+void lazyfreeFreeObjectFromBioThread(cobj *obj) {
+    decrRefCount(obj);
+    lazyfreeFreed(1);
+}
+
+void lazyfreeFreeDatabaseFromBioThread(Dict *d, Rax *index) {
+    if (d) {
+        size_t numkeys = dictSize(d);
+        dictRelease(d);
+        lazyfreeFreed(numkeys);
+    }
+    if (index) raxFree(index, NULL);
+}
+
+/* Parses the optional ASYNC argument of FLUSHDB and FLUSHALL. */
+int getFlushCommandFlags(cacheClient *c, int *flags) {
+    if (c->argc > 1) {
+        if (c->argc > 2 || strcasecmp(c->argv[1]->ptr, "async")) {
+            addReply(c, shared.syntaxerr);
+            return CACHE_ERR;
+        }
+        *flags = CACHE_EMPTYDB_ASYNC;
+    } else {
+        *flags = CACHE_EMPTYDB_NO_FLAGS;
+    }
+    return CACHE_OK;
+}
@@ -0,0 +1,625 @@
+#include "listpack.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include "cacheassert.h"
+#include "util.h"
+#include "ziplist.h"
+#include "zmalloc.h"
+
+/* Layout: <total bytes:32> <num elements:16> <entry> ... <entry> <0xff>
+ *
+ * An entry is <encoding+data> <backlen>. backlen is the length of
+ * encoding+data in 1 to 5 bytes of 7 bits each, the most significant
+ * first, where every byte but the first has the high bit set, so that it
+ * can be read from its last byte backwards. The encodings are:
+ *
+ * 0xxxxxxx                   7 bit unsigned integer
+ * 10xxxxxx                   string of up to 63 bytes
+ * 110xxxxx xxxxxxxx          13 bit signed integer
+ * 1110xxxx xxxxxxxx          string of up to 4095 bytes
+ * 11110000 <len:32>          longer string
+ * 11110001 to 11110100       16, 24, 32 and 64 bit signed integer
+ *
+ * Multi byte lengths and integers are stored little endian. The element
+ * count saturates at LP_HDR_NUMELE_UNKNOWN, above which lpLength counts. */
+
+#define LP_HDR_SIZE 6
+#define LP_HDR_NUMELE_UNKNOWN UINT16_MAX
+#define LP_EOF 0xff
+#define LP_MAX_INT_ENCODING_LEN 9
+#define LP_MAX_BACKLEN_SIZE 5
+
+#define LP_ENCODING_7BIT_UINT 0
+#define LP_ENCODING_7BIT_UINT_MASK 0x80
+#define LP_ENCODING_6BIT_STR 0x80
+#define LP_ENCODING_6BIT_STR_MASK 0xc0
+#define LP_ENCODING_13BIT_INT 0xc0
+#define LP_ENCODING_13BIT_INT_MASK 0xe0
+#define LP_ENCODING_12BIT_STR 0xe0
+#define LP_ENCODING_12BIT_STR_MASK 0xf0
+#define LP_ENCODING_32BIT_STR 0xf0
+#define LP_ENCODING_16BIT_INT 0xf1
+#define LP_ENCODING_24BIT_INT 0xf2
+#define LP_ENCODING_32BIT_INT 0xf3
+#define LP_ENCODING_64BIT_INT 0xf4
+
+#define LP_ENCODING_INT 0
+#define LP_ENCODING_STRING 1
+
+#define lpGetTotalBytes(lp)                                                    \
+  ((uint32_t)(lp)[0] | ((uint32_t)(lp)[1] << 8) | ((uint32_t)(lp)[2] << 16) |  \
+   ((uint32_t)(lp)[3] << 24))
+#define lpGetNumElements(lp) ((uint32_t)(lp)[4] | ((uint32_t)(lp)[5] << 8))
+#define lpSetTotalBytes(lp, v)                                                 \
+  do {                                                                         \
+    (lp)[0] = (v) & 0xff;                                                      \
+    (lp)[1] = ((v) >> 8) & 0xff;                                               \
+    (lp)[2] = ((v) >> 16) & 0xff;                                              \
+    (lp)[3] = ((v) >> 24) & 0xff;                                              \
+  } while (0)
+#define lpSetNumElements(lp, v)                                                \
+  do {                                                                         \
+    (lp)[4] = (v) & 0xff;                                                      \
+    (lp)[5] = ((v) >> 8) & 0xff;                                               \
+  } while (0)
+
+unsigned char *lpNew(void) {
+  unsigned char *lp = zmalloc(LP_HDR_SIZE + 1);
+  lpSetTotalBytes(lp, LP_HDR_SIZE + 1);
+  lpSetNumElements(lp, 0);
+  lp[LP_HDR_SIZE] = LP_EOF;
+  return lp;
+}
+
+void lpFree(unsigned char *lp) { zfree(lp); }
+
+size_t lpBytes(unsigned char *lp) { return lpGetTotalBytes(lp); }
+
+/* Encodes v in the smallest integer encoding into buf, returns its size. */
+static unsigned int lpEncodeInteger(unsigned char *buf, int64_t v) {
+  uint64_t uv;
+  if (v >= 0 && v <= 127) {
+    buf[0] = v;
+    return 1;
+  } else if (v >= -4096 && v <= 4095) {
+    uv = v < 0 ? ((uint64_t)1 << 13) + v : (uint64_t)v;
+    buf[0] = (uv >> 8) | LP_ENCODING_13BIT_INT;
+    buf[1] = uv & 0xff;
+    return 2;
+  } else if (v >= -32768 && v <= 32767) {
+    uv = v < 0 ? ((uint64_t)1 << 16) + v : (uint64_t)v;
+    buf[0] = LP_ENCODING_16BIT_INT;
+    buf[1] = uv & 0xff;
+    buf[2] = uv >> 8;
+    return 3;
+  } else if (v >= -8388608 && v <= 8388607) {
+    uv = v < 0 ? ((uint64_t)1 << 24) + v : (uint64_t)v;
+    buf[0] = LP_ENCODING_24BIT_INT;
+    buf[1] = uv & 0xff;
+    buf[2] = (uv >> 8) & 0xff;
+    buf[3] = uv >> 16;
+    return 4;
+  } else if (v >= INT32_MIN && v <= INT32_MAX) {
+    uv = v < 0 ? ((uint64_t)1 << 32) + v : (uint64_t)v;
+    buf[0] = LP_ENCODING_32BIT_INT;
+    buf[1] = uv & 0xff;
+    buf[2] = (uv >> 8) & 0xff;
+    buf[3] = (uv >> 16) & 0xff;
+    buf[4] = uv >> 24;
+    return 5;
+  } else {
+    int j;
+    uv = (uint64_t)v;
+    buf[0] = LP_ENCODING_64BIT_INT;
+    for (j = 1; j <= 8; j++) {
+      buf[j] = uv & 0xff;
+      uv >>= 8;
+    }
+    return 9;
+  }
+}
+
+/* Size of the string header for a string of s_len bytes. */
+static inline unsigned int lpStringHeaderSize(uint32_t s_len) {
+  return s_len < 64 ? 1 : s_len < 4096 ? 2 : 5;
+}
+
+static void lpEncodeString(unsigned char *buf, unsigned char *s,
+                           uint32_t s_len) {
+  if (s_len < 64) {
+    buf[0] = s_len | LP_ENCODING_6BIT_STR;
+    memcpy(buf + 1, s, s_len);
+  } else if (s_len < 4096) {
+    buf[0] = (s_len >> 8) | LP_ENCODING_12BIT_STR;
+    buf[1] = s_len & 0xff;
+    memcpy(buf + 2, s, s_len);
+  } else {
+    buf[0] = LP_ENCODING_32BIT_STR;
+    buf[1] = s_len & 0xff;
+    buf[2] = (s_len >> 8) & 0xff;
+    buf[3] = (s_len >> 16) & 0xff;
+    buf[4] = s_len >> 24;
+    memcpy(buf + 5, s, s_len);
+  }
+}
+
+/* Integers are stored as such when s is the canonical form of one, as in
+ * a ziplist. Sets *enc_len to the size of encoding+data. */
+static int lpEncodeGetType(unsigned char *s, uint32_t s_len,
+                           unsigned char *int_enc, uint64_t *enc_len) {
+  long long v;
+  if (s_len <= 20 && string2ll((char *)s, s_len, &v)) {
+    *enc_len = lpEncodeInteger(int_enc, v);
+    return LP_ENCODING_INT;
+  }
+  *enc_len = lpStringHeaderSize(s_len) + (uint64_t)s_len;
+  return LP_ENCODING_STRING;
+}
+
+/* Writes the backlen of an entry of l bytes to buf, when not NULL, and
+ * returns its size. */
+static unsigned int lpEncodeBacklen(unsigned char *buf, uint64_t l) {
+  if (l <= 127) {
+    if (buf) buf[0] = l;
+    return 1;
+  } else if (l < 16383) {
+    if (buf) {
+      buf[0] = l >> 7;
+      buf[1] = (l & 127) | 128;
+    }
+    return 2;
+  } else if (l < 2097151) {
+    if (buf) {
+      buf[0] = l >> 14;
+      buf[1] = ((l >> 7) & 127) | 128;
+      buf[2] = (l & 127) | 128;
+    }
+    return 3;
+  } else if (l < 268435455) {
+    if (buf) {
+      buf[0] = l >> 21;
+      buf[1] = ((l >> 14) & 127) | 128;
+      buf[2] = ((l >> 7) & 127) | 128;
+      buf[3] = (l & 127) | 128;
+    }
+    return 4;
+  } else {
+    if (buf) {
+      buf[0] = l >> 28;
+      buf[1] = ((l >> 21) & 127) | 128;
+      buf[2] = ((l >> 14) & 127) | 128;
+      buf[3] = ((l >> 7) & 127) | 128;
+      buf[4] = (l & 127) | 128;
+    }
+    return 5;
+  }
+}
+
+/* Decodes the backlen whose last byte is at p. */
+static uint64_t lpDecodeBacklen(unsigned char *p) {
+  uint64_t val = 0, shift = 0;
+  do {
+    val |= (uint64_t)(p[0] & 127) << shift;
+    if (!(p[0] & 128)) break;
+    shift += 7;
+    p--;
+  } while (shift < 35);
+  return val;
+}
+
+/* Size of encoding+data of the entry at p. */
+static uint32_t lpCurrentEncodedSize(unsigned char *p) {
+  if ((p[0] & LP_ENCODING_7BIT_UINT_MASK) == LP_ENCODING_7BIT_UINT) return 1;
+  if ((p[0] & LP_ENCODING_6BIT_STR_MASK) == LP_ENCODING_6BIT_STR)
+    return 1 + (p[0] & 0x3f);
+  if ((p[0] & LP_ENCODING_13BIT_INT_MASK) == LP_ENCODING_13BIT_INT) return 2;
+  if ((p[0] & LP_ENCODING_12BIT_STR_MASK) == LP_ENCODING_12BIT_STR)
+    return 2 + (((p[0] & 0x0f) << 8) | p[1]);
+  switch (p[0]) {
+  case LP_ENCODING_16BIT_INT:
+    return 3;
+  case LP_ENCODING_24BIT_INT:
+    return 4;
+  case LP_ENCODING_32BIT_INT:
+    return 5;
+  case LP_ENCODING_64BIT_INT:
+    return 9;
+  case LP_ENCODING_32BIT_STR:
+    return 5 + ((uint32_t)p[1] | ((uint32_t)p[2] << 8) |
+                ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 24));
+  case LP_EOF:
+    return 1;
+  }
+  assert(NULL);
+  return 0;
+}
+
+static inline unsigned char *lpSkip(unsigned char *p) {
+  uint32_t entry_len = lpCurrentEncodedSize(p);
+  return p + entry_len + lpEncodeBacklen(NULL, entry_len);
+}
+
+unsigned char *lpFirst(unsigned char *lp) {
+  unsigned char *p = lp + LP_HDR_SIZE;
+  return p[0] == LP_EOF ? NULL : p;
+}
+
+unsigned char *lpNext(unsigned char *lp, unsigned char *p) {
+  ((void)lp);
+  if (p[0] == LP_EOF) return NULL;
+  p = lpSkip(p);
+  return p[0] == LP_EOF ? NULL : p;
+}
+
+/* The entry before p, which may be the terminator, or NULL at the head. */
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p) {
+  uint64_t prev_len;
+  if (p - lp == LP_HDR_SIZE) return NULL;
+  p--;
+  prev_len = lpDecodeBacklen(p);
+  prev_len += lpEncodeBacklen(NULL, prev_len);
+  return p - prev_len + 1;
+}
+
+unsigned char *lpLast(unsigned char *lp) {
+  return lpPrev(lp, lp + lpGetTotalBytes(lp) - 1);
+}
+
+unsigned long lpLength(unsigned char *lp) {
+  uint32_t num_ele = lpGetNumElements(lp);
+  unsigned char *p;
+  unsigned long count = 0;
+  if (num_ele != LP_HDR_NUMELE_UNKNOWN) return num_ele;
+  for (p = lpFirst(lp); p; p = lpNext(lp, p)) count++;
+  if (count < LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp, count);
+  return count;
+}
+
+/* Same contract as zipListGet: a string sets *s_val and *s_len, an
+ * integer sets *l_val with *s_val set to NULL. Returns 0 at the end. */
+unsigned int lpGet(unsigned char *p, unsigned char **s_val,
+                   unsigned int *s_len, long long *l_val) {
+  uint64_t uval, neg_start, neg_max;
+  if (p == NULL || p[0] == LP_EOF) return 0;
+  if (s_val) *s_val = NULL;
+  if ((p[0] & LP_ENCODING_7BIT_UINT_MASK) == LP_ENCODING_7BIT_UINT) {
+    uval = p[0] & 0x7f;
+    neg_start = UINT64_MAX;
+    neg_max = 0;
+  } else if ((p[0] & LP_ENCODING_6BIT_STR_MASK) == LP_ENCODING_6BIT_STR) {
+    if (s_val) {
+      *s_len = p[0] & 0x3f;
+      *s_val = p + 1;
+    }
+    return 1;
+  } else if ((p[0] & LP_ENCODING_13BIT_INT_MASK) == LP_ENCODING_13BIT_INT) {
+    uval = ((uint64_t)(p[0] & 0x1f) << 8) | p[1];
+    neg_start = (uint64_t)1 << 12;
+    neg_max = 8191;
+  } else if ((p[0] & LP_ENCODING_12BIT_STR_MASK) == LP_ENCODING_12BIT_STR) {
+    if (s_val) {
+      *s_len = ((p[0] & 0x0f) << 8) | p[1];
+      *s_val = p + 2;
+    }
+    return 1;
+  } else if (p[0] == LP_ENCODING_16BIT_INT) {
+    uval = (uint64_t)p[1] | ((uint64_t)p[2] << 8);
+    neg_start = (uint64_t)1 << 15;
+    neg_max = UINT16_MAX;
+  } else if (p[0] == LP_ENCODING_24BIT_INT) {
+    uval = (uint64_t)p[1] | ((uint64_t)p[2] << 8) | ((uint64_t)p[3] << 16);
+    neg_start = (uint64_t)1 << 23;
+    neg_max = UINT32_MAX >> 8;
+  } else if (p[0] == LP_ENCODING_32BIT_INT) {
+    uval = (uint64_t)p[1] | ((uint64_t)p[2] << 8) | ((uint64_t)p[3] << 16) |
+           ((uint64_t)p[4] << 24);
+    neg_start = (uint64_t)1 << 31;
+    neg_max = UINT32_MAX;
+  } else if (p[0] == LP_ENCODING_64BIT_INT) {
+    int j;
+    uval = 0;
+    for (j = 8; j >= 1; j--) uval = (uval << 8) | p[j];
+    neg_start = (uint64_t)1 << 63;
+    neg_max = UINT64_MAX;
+  } else {
+    if (s_val) {
+      *s_len = (uint32_t)p[1] | ((uint32_t)p[2] << 8) |
+               ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 24);
+      *s_val = p + 5;
+    }
+    return 1;
+  }
+  if (l_val) {
+    /* Two's complement over the width of the encoding. */
+    if (uval >= neg_start)
+      *l_val = -(long long)(neg_max - uval) - 1;
+    else
+      *l_val = (long long)uval;
+  }
+  return 1;
+}
+
+/* Inserts s before or after the entry at p, or replaces it, and returns
+ * the new listpack. p may be the terminator to append. A NULL s deletes
+ * the entry at p. When newp is not NULL it is set to the inserted entry,
+ * or after a delete to the entry that followed, NULL if that was the
+ * last one. */
+unsigned char *lpInsert(unsigned char *lp, unsigned char *s, uint32_t s_len,
+                        unsigned char *p, int where, unsigned char **newp) {
+  unsigned char int_enc[LP_MAX_INT_ENCODING_LEN];
+  unsigned char backlen[LP_MAX_BACKLEN_SIZE];
+  uint64_t enc_len = 0, old_bytes, new_bytes;
+  uint32_t replaced_len = 0, backlen_size = 0;
+  unsigned long poff;
+  int enc_type = LP_ENCODING_STRING, delete = s == NULL;
+  unsigned char *dst;
+
+  if (delete) where = LP_REPLACE;
+  if (where == LP_AFTER) {
+    p = lpSkip(p);
+    where = LP_BEFORE;
+  }
+  poff = p - lp;
+  if (!delete) {
+    enc_type = lpEncodeGetType(s, s_len, int_enc, &enc_len);
+    backlen_size = lpEncodeBacklen(backlen, enc_len);
+  }
+  if (where == LP_REPLACE) {
+    replaced_len = lpCurrentEncodedSize(p);
+    replaced_len += lpEncodeBacklen(NULL, replaced_len);
+  }
+  old_bytes = lpGetTotalBytes(lp);
+  new_bytes = old_bytes + enc_len + backlen_size - replaced_len;
+  if (new_bytes > UINT32_MAX) return NULL;
+
+  if (new_bytes > old_bytes) lp = zre_alloc(lp, new_bytes);
+  dst = lp + poff;
+  memmove(dst + enc_len + backlen_size, dst + replaced_len,
+          old_bytes - poff - replaced_len);
+  if (new_bytes < old_bytes) {
+    lp = zre_alloc(lp, new_bytes);
+    dst = lp + poff;
+  }
+  if (newp) *newp = (delete && dst[0] == LP_EOF) ? NULL : dst;
+  if (!delete) {
+    if (enc_type == LP_ENCODING_INT)
+      memcpy(dst, int_enc, enc_len);
+    else
+      lpEncodeString(dst, s, s_len);
+    memcpy(dst + enc_len, backlen, backlen_size);
+  }
+  if (where != LP_REPLACE || delete) {
+    uint32_t num_ele = lpGetNumElements(lp);
+    if (num_ele != LP_HDR_NUMELE_UNKNOWN) {
+      num_ele += delete ? -1 : 1;
+      lpSetNumElements(lp, num_ele);
+    }
+  }
+  lpSetTotalBytes(lp, new_bytes);
+  return lp;
+}
+
+unsigned char *lpAppend(unsigned char *lp, unsigned char *s, uint32_t s_len) {
+  return lpInsert(lp, s, s_len, lp + lpGetTotalBytes(lp) - 1, LP_BEFORE, NULL);
+}
+
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *s,
+                         uint32_t s_len) {
+  return lpInsert(lp, s, s_len, lp + LP_HDR_SIZE, LP_BEFORE, NULL);
+}
+
+unsigned char *lpAppendInteger(unsigned char *lp, long long value) {
+  char buf[LP_INTBUF_SIZE];
+  int len = ll2string(buf, sizeof(buf), value);
+  return lpAppend(lp, (unsigned char *)buf, len);
+}
+
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p,
+                        unsigned char **newp) {
+  return lpInsert(lp, NULL, 0, p, LP_REPLACE, newp);
+}
+
+/* Deletes up to num entries from index on with a single memmove. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index,
+                             unsigned long num) {
+  unsigned char *p, *end;
+  unsigned long deleted = 0;
+  uint32_t bytes = lpGetTotalBytes(lp), removed, num_ele;
+
+  if (num == 0 || (p = lpSeek(lp, index)) == NULL) return lp;
+  end = p;
+  while (end[0] != LP_EOF && deleted < num) {
+    end = lpSkip(end);
+    deleted++;
+  }
+  removed = end - p;
+  memmove(p, end, bytes - (end - lp));
+  lp = zre_alloc(lp, bytes - removed);
+  lpSetTotalBytes(lp, bytes - removed);
+  num_ele = lpGetNumElements(lp);
+  if (num_ele != LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp, num_ele - deleted);
+  return lp;
+}
+
+/* The entry at index, negative indexes counting from the tail, or NULL if
+ * out of range. Walks from whichever end is closer when the length is
+ * known. */
+unsigned char *lpSeek(unsigned char *lp, long index) {
+  unsigned long num_ele = lpGetNumElements(lp);
+  unsigned char *p;
+  int forward = index >= 0;
+
+  if (num_ele != LP_HDR_NUMELE_UNKNOWN) {
+    if (index < 0) index = (long)num_ele + index;
+    if (index < 0 || (unsigned long)index >= num_ele) return NULL;
+    forward = (unsigned long)index <= num_ele / 2;
+    if (!forward) index = index - (long)num_ele;
+  }
+  if (forward) {
+    p = lpFirst(lp);
+    while (index > 0 && p) {
+      p = lpNext(lp, p);
+      index--;
+    }
+  } else {
+    p = lpLast(lp);
+    while (index < -1 && p) {
+      p = lpPrev(lp, p);
+      index++;
+    }
+  }
+  return p;
+}
+
+unsigned int lpCompare(unsigned char *p, unsigned char *s,
+                       unsigned int s_len) {
+  unsigned char *e_val;
+  unsigned int e_len;
+  long long e_ll, s_ll;
+  if (!lpGet(p, &e_val, &e_len, &e_ll)) return 0;
+  if (e_val) return e_len == s_len && memcmp(e_val, s, s_len) == 0;
+  return s_len <= 20 && string2ll((char *)s, s_len, &s_ll) && s_ll == e_ll;
+}
+
+/* Like zipListFind: compares every skip + 1 entries from p, so that
+ * skip = 1 looks at the keys of a field-value listpack only. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      unsigned int s_len, unsigned int skip) {
+  unsigned int skip_cnt = 0;
+  int s_int = -1;
+  long long s_ll = 0;
+
+  while (p) {
+    if (skip_cnt == 0) {
+      unsigned char *e_val = NULL;
+      unsigned int e_len;
+      long long e_ll;
+      lpGet(p, &e_val, &e_len, &e_ll);
+      if (e_val) {
+        if (e_len == s_len && memcmp(e_val, s, s_len) == 0) return p;
+      } else {
+        if (s_int == -1)
+          s_int = s_len <= 20 && string2ll((char *)s, s_len, &s_ll);
+        if (s_int && e_ll == s_ll) return p;
+      }
+      skip_cnt = skip;
+    } else {
+      skip_cnt--;
+    }
+    p = lpNext(lp, p);
+  }
+  return NULL;
+}
+
+/* Converts the ziplist of a CACHE_RDB_TYPE_*_ZIPLIST payload. Lists,
+ * field-value hashes and member-score zsets lay their entries out the
+ * same way in both formats, so one converter serves all three. */
+unsigned char *lpNewFromZiplist(unsigned char *zl) {
+  unsigned char *lp = lpNew(), *p = zipListIndex(zl, 0), *s_val;
+  unsigned int s_len;
+  long long l_val;
+  while (zipListGet(p, &s_val, &s_len, &l_val)) {
+    if (s_val)
+      lp = lpAppend(lp, s_val, s_len);
+    else
+      lp = lpAppendInteger(lp, l_val);
+    p = zipListNext(zl, p);
+  }
+  return lp;
+}
+
+#ifdef LISTPACK_BENCHMARK_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Insert/delete cost against a ziplist at 128 to 8192 entries:
+ *
+ * - cascade: a 300 byte value inserted at the head of a list of 250 byte
+ *   values, which turns the 1 byte prev_len of every ziplist entry into 5
+ *   bytes, one entry at a time.
+ * - random: insert and delete of a 16 byte value at a random position of
+ *   a list of 16 byte values. */
+
+static long long benchNstime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned char *benchClone(unsigned char *blob, size_t len) {
+  unsigned char *copy = zmalloc(len);
+  memcpy(copy, blob, len);
+  return copy;
+}
+
+static void benchCascade(int n) {
+  unsigned char val[300], *zl = zipListNew(), *lp = lpNew();
+  int reps = n >= 2048 ? 3 : 50, j;
+  long long zl_ns = 0, lp_ns = 0, start;
+
+  memset(val, 'x', sizeof(val));
+  for (j = 0; j < n; j++) {
+    zl = zipListPush(zl, val, 250, ZIP_LIST_TAIL);
+    lp = lpAppend(lp, val, 250);
+  }
+  for (j = 0; j < reps; j++) {
+    unsigned char *copy = benchClone(zl, zipListBlobLen(zl));
+    start = benchNstime();
+    copy = zipListPush(copy, val, 300, ZIP_LIST_HEAD);
+    zl_ns += benchNstime() - start;
+    zfree(copy);
+    copy = benchClone(lp, lpBytes(lp));
+    start = benchNstime();
+    copy = lpPrepend(copy, val, 300);
+    lp_ns += benchNstime() - start;
+    lpFree(copy);
+  }
+  printf("cascade %5d entries: ziplist %10.0f ns, listpack %8.0f ns\n", n,
+         (double)zl_ns / reps, (double)lp_ns / reps);
+  zfree(zl);
+  lpFree(lp);
+}
+
+static void benchRandom(int n) {
+  unsigned char val[16], *zl = zipListNew(), *lp = lpNew(), *p;
+  int ops = 20000, j;
+  long long zl_ns, lp_ns, start;
+
+  memset(val, 'y', sizeof(val));
+  for (j = 0; j < n; j++) {
+    zl = zipListPush(zl, val, sizeof(val), ZIP_LIST_TAIL);
+    lp = lpAppend(lp, val, sizeof(val));
+  }
+  srand(n);
+  start = benchNstime();
+  for (j = 0; j < ops; j++) {
+    int idx = rand() % n;
+    zl = zipListInsert(zl, zipListIndex(zl, idx), val, sizeof(val));
+    p = zipListIndex(zl, rand() % n);
+    zl = zipListDelete(zl, &p);
+  }
+  zl_ns = benchNstime() - start;
+  srand(n);
+  start = benchNstime();
+  for (j = 0; j < ops; j++) {
+    int idx = rand() % n;
+    lp = lpInsert(lp, val, sizeof(val), lpSeek(lp, idx), LP_BEFORE, NULL);
+    lp = lpDelete(lp, lpSeek(lp, rand() % n), NULL);
+  }
+  lp_ns = benchNstime() - start;
+  printf("random  %5d entries: ziplist %10.0f ns, listpack %8.0f ns\n", n,
+         (double)zl_ns / ops, (double)lp_ns / ops);
+  zfree(zl);
+  lpFree(lp);
+}
+
+int main(void) {
+  int n;
+  for (n = 128; n <= 8192; n *= 2) benchCascade(n);
+  for (n = 128; n <= 8192; n *= 2) benchRandom(n);
+  return 0;
+}
+#endif
@@ -0,0 +1,62 @@
+#ifndef LISTPACK_H
+#define LISTPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A listpack is a ziplist where every entry ends with its own length
+ * (backlen) instead of starting with the length of the previous one. An
+ * insert or delete only moves the bytes after it: no other entry has to
+ * be rewritten, so there are no cascade updates, and walking backwards
+ * reads one backlen instead of decoding a prev_len and an entry header. */
+
+#define LP_BEFORE 0
+#define LP_AFTER 1
+#define LP_REPLACE 2
+
+#define LP_INTBUF_SIZE 21
+
+unsigned char *lpNew(void);
+
+void lpFree(unsigned char *lp);
+
+unsigned char *lpInsert(unsigned char *lp, unsigned char *s, uint32_t s_len,
+                        unsigned char *p, int where, unsigned char **newp);
+
+unsigned char *lpAppend(unsigned char *lp, unsigned char *s, uint32_t s_len);
+
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *s, uint32_t s_len);
+
+unsigned char *lpAppendInteger(unsigned char *lp, long long value);
+
+unsigned char *lpDelete(unsigned char *lp, unsigned char *p,
+                        unsigned char **newp);
+
+unsigned char *lpDeleteRange(unsigned char *lp, long index,
+                             unsigned long num);
+
+unsigned int lpGet(unsigned char *p, unsigned char **s_val,
+                   unsigned int *s_len, long long *l_val);
+
+unsigned char *lpFirst(unsigned char *lp);
+
+unsigned char *lpLast(unsigned char *lp);
+
+unsigned char *lpNext(unsigned char *lp, unsigned char *p);
+
+unsigned char *lpPrev(unsigned char *lp, unsigned char *p);
+
+unsigned char *lpSeek(unsigned char *lp, long index);
+
+unsigned long lpLength(unsigned char *lp);
+
+size_t lpBytes(unsigned char *lp);
+
+unsigned int lpCompare(unsigned char *p, unsigned char *s, unsigned int s_len);
+
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s,
+                      unsigned int s_len, unsigned int skip);
+
+unsigned char *lpNewFromZiplist(unsigned char *zl);
+
+#endif
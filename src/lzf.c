@@ -0,0 +1,126 @@
+#include "lzf.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/* A stream is a sequence of literal runs and back references. A control
+ * byte below 32 starts a run of ctrl + 1 literal bytes. Otherwise its top
+ * 3 bits are the match length - 2 (7 meaning that a second byte adds to
+ * it) and the low 5 bits, with the next byte, the distance - 1. */
+#define LZF_HLOG 12
+#define LZF_HSIZE (1 << LZF_HLOG)
+#define LZF_MAX_LIT (1 << 5)
+#define LZF_MAX_OFF (1 << 13)
+#define LZF_MAX_REF ((1 << 8) + (1 << 3))
+
+static inline unsigned int _lzfHash(const uint8_t *p) {
+  uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - LZF_HLOG);
+}
+
+unsigned int lzf_compress(const void *in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len) {
+  const uint8_t *in = in_data, *ip = in, *in_end = in + in_len;
+  uint8_t *out = out_data, *op = out, *out_end = out + out_len, *lit_ctrl = NULL;
+  uint32_t htab[LZF_HSIZE];
+  unsigned int lit = 0;
+
+  if (in_len == 0) return 0;
+  memset(htab, 0, sizeof(htab));
+  while (ip < in_end) {
+    if (ip + 2 < in_end) {
+      unsigned int h = _lzfHash(ip);
+      const uint8_t *ref = in + htab[h];
+      unsigned long off = ip - ref - 1;
+      htab[h] = ip - in;
+      if (ref < ip && off < LZF_MAX_OFF && ref[0] == ip[0] &&
+          ref[1] == ip[1] && ref[2] == ip[2]) {
+        unsigned int len = 3, maxlen = in_end - ip;
+        const uint8_t *p;
+        if (maxlen > LZF_MAX_REF) maxlen = LZF_MAX_REF;
+        while (len < maxlen && ref[len] == ip[len]) len++;
+        if (op + 3 > out_end) return 0;
+        if (lit) {
+          *lit_ctrl = lit - 1;
+          lit = 0;
+        }
+        if (len - 2 < 7) {
+          *op++ = (off >> 8) + ((len - 2) << 5);
+        } else {
+          *op++ = (off >> 8) + (7 << 5);
+          *op++ = len - 2 - 7;
+        }
+        *op++ = off;
+        for (p = ip + 1; p < ip + len && p + 2 < in_end; p++)
+          htab[_lzfHash(p)] = p - in;
+        ip += len;
+        continue;
+      }
+    }
+    if (lit == 0) {
+      if (op + 2 > out_end) return 0;
+      lit_ctrl = op++;
+    } else if (op + 1 > out_end) {
+      return 0;
+    }
+    *op++ = *ip++;
+    if (++lit == LZF_MAX_LIT) {
+      *lit_ctrl = lit - 1;
+      lit = 0;
+    }
+  }
+  if (lit) *lit_ctrl = lit - 1;
+  return op - out;
+}
+
+unsigned int lzf_decompress(const void *in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len) {
+  const uint8_t *ip = in_data, *in_end = ip + in_len;
+  uint8_t *out = out_data, *op = out, *out_end = out + out_len;
+
+  while (ip < in_end) {
+    unsigned int ctrl = *ip++;
+    if (ctrl < LZF_MAX_LIT) {
+      ctrl++;
+      if (op + ctrl > out_end) {
+        errno = E2BIG;
+        return 0;
+      }
+      if (ip + ctrl > in_end) {
+        errno = EINVAL;
+        return 0;
+      }
+      memcpy(op, ip, ctrl);
+      op += ctrl;
+      ip += ctrl;
+    } else {
+      unsigned int len = ctrl >> 5;
+      const uint8_t *ref;
+      if (len == 7) {
+        if (ip >= in_end) {
+          errno = EINVAL;
+          return 0;
+        }
+        len += *ip++;
+      }
+      if (ip >= in_end) {
+        errno = EINVAL;
+        return 0;
+      }
+      ref = op - ((ctrl & 0x1f) << 8) - 1 - *ip++;
+      len += 2;
+      if (op + len > out_end) {
+        errno = E2BIG;
+        return 0;
+      }
+      if (ref < out) {
+        errno = EINVAL;
+        return 0;
+      }
+      /* The reference may overlap the output, so byte by byte. */
+      while (len--) *op++ = *ref++;
+    }
+  }
+  return op - out;
+}
@@ -0,0 +1,16 @@
+#ifndef LZF_H
+#define LZF_H
+
+/* LZF compression, compatible with the liblzf format.
+ *
+ * lzf_compress returns the compressed length, or 0 when the output does
+ * not fit in out_len bytes. lzf_decompress returns the decompressed length,
+ * or 0 with errno set to E2BIG when out_len is too small or to EINVAL when
+ * the input is corrupt. */
+unsigned int lzf_compress(const void *in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len);
+
+unsigned int lzf_decompress(const void *in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len);
+
+#endif
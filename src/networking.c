@@ -0,0 +1,567 @@
+#include "cache.h"
+
+#include <sys/uio.h>
+
+/* Reply path. Small replies are copied into c->buf or appended to the
+ * tail object of c->reply; string objects of CACHE_REPLY_ZEROCOPY_MIN_BYTES
+ * or more are queued by reference instead, so large values, and the
+ * arguments propagated to every slave and monitor, are never copied into
+ * an output buffer. writeToClient() flushes c->buf and the reply objects
+ * with a single writev() per round.
+ *
+ * Queued objects may be shared with the keyspace and with other clients,
+ * and refcounts are not atomic: on an I/O thread the fully written reply
+ * nodes are only counted in c->reply_sent, and the main thread releases
+ * them with clientReleaseSentReplies() once the threads are joined;
+ * c->reply_unsent keeps the place of the first node still to write.
+ * Such an object may also be the member of a set, hash or zset, so
+ * server.reply_zerocopy_clients counts the clients holding any: while it
+ * is non-zero lazyfree.c frees those aggregates on the main thread. */
+
+int clientHasPendingReplies(cacheClient *c) {
+    return c->bufpos || listLength(c->reply) > c->reply_sent;
+}
+
+void clientReleaseSentReplies(cacheClient *c) {
+    while (c->reply_sent) {
+        listDelNode(c->reply, listFirst(c->reply));
+        c->reply_sent--;
+    }
+    c->reply_unsent = NULL;
+    clientReplyReleased(c);
+}
+
+static ListNode *clientFirstUnsentReply(cacheClient *c) {
+    return c->reply_sent ? c->reply_unsent : listFirst(c->reply);
+}
+
+/* Called on the main thread once nodes left c->reply, and by freeClient()
+ * after emptying it. */
+void clientReplyReleased(cacheClient *c) {
+    if (c->reply_zerocopy && listLength(c->reply) == 0) {
+        c->reply_zerocopy = 0;
+        server.reply_zerocopy_clients--;
+    }
+}
+
+/* A client whose read is still queued for the I/O threads is not queued
+ * for write as well: the reply stays buffered and is queued once the read
+ * was handled, so that no two threads ever work on the same client. */
+int prepareClientToWrite(cacheClient *c) {
+    if (c->flags & CACHE_LUA_CLIENT) return CACHE_OK;
+    if ((c->flags & CACHE_MASTER) && !(c->flags & CACHE_MASTER_FORCE_REPLY))
+        return CACHE_ERR;
+    if (c->fd <= 0) return CACHE_ERR;
+    if (!clientHasPendingReplies(c) && !(c->flags & CACHE_PENDING_READ) &&
+        (c->replstate == CACHE_REPL_NONE || c->replstate == CACHE_REPL_ONLINE) &&
+        !c->repl_put_online_on_ack)
+        queueClientForWrite(c);
+    return CACHE_OK;
+}
+
+static int _addReplyToBuffer(cacheClient *c, const char *s, size_t len) {
+    size_t available = sizeof(c->buf) - c->bufpos;
+    if (c->flags & CACHE_CLOSE_AFTER_REPLY) return CACHE_OK;
+    if (listLength(c->reply) > 0) return CACHE_ERR;
+    if (len > available) return CACHE_ERR;
+    memcpy(c->buf + c->bufpos, s, len);
+    c->bufpos += len;
+    return CACHE_OK;
+}
+
+/* The tail can only be extended when the reply owns it. */
+static cobj *_replyTailIfAppendable(cacheClient *c, size_t len) {
+    ListNode *ln = listLast(c->reply);
+    cobj *tail;
+    if (ln == NULL) return NULL;
+    tail = listNodeValue(ln);
+    if (tail->encoding != CACHE_ENCODING_RAW || tail->refcount != 1) return NULL;
+    if (sdsLen(tail->ptr) + len > CACHE_REPLY_CHUNK_BYTES) return NULL;
+    return tail;
+}
+
+static void _addReplyObjectToList(cacheClient *c, cobj *o) {
+    size_t len = sdsLen(o->ptr);
+    cobj *tail;
+    if (c->flags & CACHE_CLOSE_AFTER_REPLY) return;
+    if (len < CACHE_REPLY_ZEROCOPY_MIN_BYTES &&
+        (tail = _replyTailIfAppendable(c, len)) != NULL) {
+        tail->ptr = sdsCatLen(tail->ptr, o->ptr, len);
+    } else {
+        incrRefCount(o);
+        listAddNodeTail(c->reply, o);
+        if (!c->reply_zerocopy) {
+            c->reply_zerocopy = 1;
+            server.reply_zerocopy_clients++;
+        }
+    }
+    c->reply_bytes += len;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+static void _addReplySdsToList(cacheClient *c, Sds s) {
+    size_t len = sdsLen(s);
+    cobj *tail;
+    if (c->flags & CACHE_CLOSE_AFTER_REPLY) {
+        sdsFree(s);
+        return;
+    }
+    if ((tail = _replyTailIfAppendable(c, len)) != NULL) {
+        tail->ptr = sdsCatLen(tail->ptr, s, len);
+        sdsFree(s);
+    } else {
+        listAddNodeTail(c->reply, createObject(CACHE_STRING, s));
+    }
+    c->reply_bytes += len;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+static void _addReplyStringToList(cacheClient *c, const char *s, size_t len) {
+    cobj *tail;
+    if (c->flags & CACHE_CLOSE_AFTER_REPLY) return;
+    if ((tail = _replyTailIfAppendable(c, len)) != NULL) {
+        tail->ptr = sdsCatLen(tail->ptr, s, len);
+    } else {
+        listAddNodeTail(c->reply, createObject(CACHE_STRING, sdsNewLen(s, len)));
+    }
+    c->reply_bytes += len;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+void addReply(cacheClient *c, cobj *obj) {
+    if (prepareClientToWrite(c) != CACHE_OK) return;
+    if (sdsEncodedObject(obj)) {
+        size_t len = sdsLen(obj->ptr);
+        if (len >= CACHE_REPLY_ZEROCOPY_MIN_BYTES ||
+            _addReplyToBuffer(c, obj->ptr, len) != CACHE_OK)
+            _addReplyObjectToList(c, obj);
+    } else if (obj->encoding == CACHE_ENCODING_INT) {
+        if (listLength(c->reply) == 0 && (sizeof(c->buf) - c->bufpos) >= 32) {
+            char buf[32];
+            int len = ll2string(buf, sizeof(buf), (long) obj->ptr);
+            if (_addReplyToBuffer(c, buf, len) == CACHE_OK) return;
+        }
+        obj = getDecodedObject(obj);
+        if (_addReplyToBuffer(c, obj->ptr, sdsLen(obj->ptr)) != CACHE_OK)
+            _addReplyObjectToList(c, obj);
+        decrRefCount(obj);
+    } else {
+        cachePanic("Wrong obj->encoding in addReply()");
+    }
+}
+
+void addReplySds(cacheClient *c, Sds s) {
+    if (prepareClientToWrite(c) != CACHE_OK) {
+        sdsFree(s);
+        return;
+    }
+    if (_addReplyToBuffer(c, s, sdsLen(s)) == CACHE_OK) {
+        sdsFree(s);
+    } else {
+        _addReplySdsToList(c, s);
+    }
+}
+
+static void addReplyString(cacheClient *c, const char *s, size_t len) {
+    if (prepareClientToWrite(c) != CACHE_OK) return;
+    if (_addReplyToBuffer(c, s, len) != CACHE_OK) _addReplyStringToList(c, s, len);
+}
+
+static void addReplyErrorLength(cacheClient *c, char *s, size_t len) {
+    addReplyString(c, "-ERR ", 5);
+    addReplyString(c, s, len);
+    addReplyString(c, "\r\n", 2);
+}
+
+void addReplyError(cacheClient *c, char *err) {
+    addReplyErrorLength(c, err, strlen(err));
+}
+
+static void addReplyStatusLength(cacheClient *c, char *s, size_t len) {
+    addReplyString(c, "+", 1);
+    addReplyString(c, s, len);
+    addReplyString(c, "\r\n", 2);
+}
+
+void addReplyStatus(cacheClient *c, char *status) {
+    addReplyStatusLength(c, status, strlen(status));
+}
+
+static void addReplyLongLongWithPrefix(cacheClient *c, long long ll, char prefix) {
+    char buf[128];
+    int len;
+    if (prefix == '*' && ll < CACHE_SHARED_BULKHDR_LEN && ll >= 0) {
+        addReply(c, shared.mbulkhdr[ll]);
+        return;
+    } else if (prefix == '$' && ll < CACHE_SHARED_BULKHDR_LEN && ll >= 0) {
+        addReply(c, shared.bulkhdr[ll]);
+        return;
+    }
+    buf[0] = prefix;
+    len = ll2string(buf + 1, sizeof(buf) - 1, ll);
+    buf[len + 1] = '\r';
+    buf[len + 2] = '\n';
+    addReplyString(c, buf, len + 3);
+}
+
+void addReplyLongLong(cacheClient *c, long long ll) {
+    if (ll == 0)
+        addReply(c, shared.czero);
+    else if (ll == 1)
+        addReply(c, shared.cone);
+    else
+        addReplyLongLongWithPrefix(c, ll, ':');
+}
+
+void addReplyMultiBulkLen(cacheClient *c, long length) {
+    addReplyLongLongWithPrefix(c, length, '*');
+}
+
+static void addReplyBulkLen(cacheClient *c, cobj *obj) {
+    size_t len;
+    if (sdsEncodedObject(obj)) {
+        len = sdsLen(obj->ptr);
+    } else {
+        long n = (long) obj->ptr;
+        len = 1;
+        if (n < 0) {
+            len++;
+            n = -n;
+        }
+        while ((n = n / 10) != 0) len++;
+    }
+    addReplyLongLongWithPrefix(c, len, '$');
+}
+
+void addReplyBulk(cacheClient *c, cobj *obj) {
+    addReplyBulkLen(c, obj);
+    addReply(c, obj);
+    addReply(c, shared.crlf);
+}
+
+void addReplyBulkCBuffer(cacheClient *c, void *p, size_t len) {
+    addReplyLongLongWithPrefix(c, len, '$');
+    addReplyString(c, p, len);
+    addReply(c, shared.crlf);
+}
+
+void addReplyBulkCString(cacheClient *c, char *s) {
+    if (s == NULL) {
+        addReply(c, shared.nullbulk);
+    } else {
+        addReplyBulkCBuffer(c, s, strlen(s));
+    }
+}
+
+void addReplyBulkLongLong(cacheClient *c, long long ll) {
+    char buf[64];
+    int len;
+    len = ll2string(buf, 64, ll);
+    addReplyBulkCBuffer(c, buf, len);
+}
+
+unsigned long getClientOutputBufferMemoryUsage(cacheClient *c) {
+    unsigned long list_item_size = sizeof(ListNode) + sizeof(cobj);
+    return c->reply_bytes + (list_item_size * listLength(c->reply));
+}
+
+static void setProtocolError(cacheClient *c, int pos) {
+    if (server.verbosity <= CACHE_VERBOSE) {
+        Sds client = catClientInfoString(sdsEmpty(), c);
+        cacheLog(CACHE_VERBOSE, "Protocol error from client: %s", client);
+        sdsFree(client);
+    }
+    c->flags |= CACHE_CLOSE_AFTER_REPLY;
+    sdsRange(c->querybuf, pos, -1);
+}
+
+static int processInlineBuffer(cacheClient *c) {
+    char *newline;
+    int argc, j;
+    Sds *argv, aux;
+    size_t querylen;
+    newline = strchr(c->querybuf, '\n');
+    if (newline == NULL) {
+        if (sdsLen(c->querybuf) > CACHE_INLINE_MAX_SIZE) {
+            addReplyError(c, "Protocol error: too big inline request");
+            setProtocolError(c, 0);
+        }
+        return CACHE_ERR;
+    }
+    if (newline != c->querybuf && *(newline - 1) == '\r') newline--;
+    querylen = newline - (c->querybuf);
+    aux = sdsNewLen(c->querybuf, querylen);
+    argv = sdsSplitArgs(aux, &argc);
+    sdsFree(aux);
+    if (argv == NULL) {
+        addReplyError(c, "Protocol error: unbalanced quotes in request");
+        setProtocolError(c, 0);
+        return CACHE_ERR;
+    }
+    if (querylen == 0 && c->flags & CACHE_SLAVE) c->repl_ack_time = server.unixtime;
+    sdsRange(c->querybuf, querylen + 2, -1);
+    if (argc) {
+        if (c->argv) zfree(c->argv);
+        c->argv = zmalloc(sizeof(cobj *) * argc);
+    }
+    for (c->argc = 0, j = 0; j < argc; j++) {
+        if (sdsLen(argv[j])) {
+            c->argv[c->argc] = createObject(CACHE_STRING, argv[j]);
+            c->argc++;
+        } else {
+            sdsFree(argv[j]);
+        }
+    }
+    zfree(argv);
+    return CACHE_OK;
+}
+
+static int processMultibulkBuffer(cacheClient *c) {
+    char *newline = NULL;
+    int pos = 0, ok;
+    long long ll;
+    if (c->multibulklen == 0) {
+        cacheAssertWithInfo(c, NULL, c->argc == 0);
+        newline = strchr(c->querybuf, '\r');
+        if (newline == NULL) {
+            if (sdsLen(c->querybuf) > CACHE_INLINE_MAX_SIZE) {
+                addReplyError(c, "Protocol error: too big mbulk count string");
+                setProtocolError(c, 0);
+            }
+            return CACHE_ERR;
+        }
+        if (newline - (c->querybuf) > ((signed) sdsLen(c->querybuf) - 2))
+            return CACHE_ERR;
+        cacheAssertWithInfo(c, NULL, c->querybuf[0] == '*');
+        ok = string2ll(c->querybuf + 1, newline - (c->querybuf + 1), &ll);
+        if (!ok || ll > 1024 * 1024) {
+            addReplyError(c, "Protocol error: invalid multibulk length");
+            setProtocolError(c, pos);
+            return CACHE_ERR;
+        }
+        pos = (newline - c->querybuf) + 2;
+        if (ll <= 0) {
+            sdsRange(c->querybuf, pos, -1);
+            return CACHE_OK;
+        }
+        c->multibulklen = ll;
+        if (c->argv) zfree(c->argv);
+        c->argv = zmalloc(sizeof(cobj *) * c->multibulklen);
+    }
+    cacheAssertWithInfo(c, NULL, c->multibulklen > 0);
+    while (c->multibulklen) {
+        if (c->bulklen == -1) {
+            newline = strchr(c->querybuf + pos, '\r');
+            if (newline == NULL) {
+                if (sdsLen(c->querybuf) > CACHE_INLINE_MAX_SIZE) {
+                    addReplyError(c, "Protocol error: too big bulk count string");
+                    setProtocolError(c, 0);
+                    return CACHE_ERR;
+                }
+                break;
+            }
+            if (newline - (c->querybuf) > ((signed) sdsLen(c->querybuf) - 2)) break;
+            if (c->querybuf[pos] != '$') {
+                addReplyErrorFormat(c, "Protocol error: expected '$', got '%c'",
+                                    c->querybuf[pos]);
+                setProtocolError(c, pos);
+                return CACHE_ERR;
+            }
+            ok = string2ll(c->querybuf + pos + 1, newline - (c->querybuf + pos + 1), &ll);
+            if (!ok || ll < 0 || ll > 512 * 1024 * 1024) {
+                addReplyError(c, "Protocol error: invalid bulk length");
+                setProtocolError(c, pos);
+                return CACHE_ERR;
+            }
+            pos += newline - (c->querybuf + pos) + 2;
+            if (ll >= CACHE_MBULK_BIG_ARG) {
+                size_t qblen;
+                sdsRange(c->querybuf, pos, -1);
+                pos = 0;
+                qblen = sdsLen(c->querybuf);
+                if (qblen < (size_t) ll + 2)
+                    c->querybuf = sdsMakeRoomFor(c->querybuf, ll + 2 - qblen);
+            }
+            c->bulklen = ll;
+        }
+        if (sdsLen(c->querybuf) - pos < (unsigned) (c->bulklen + 2)) break;
+        if (pos == 0 && c->bulklen >= CACHE_MBULK_BIG_ARG &&
+            (signed) sdsLen(c->querybuf) == c->bulklen + 2) {
+            c->argv[c->argc++] = createObject(CACHE_STRING, c->querybuf);
+            sdsIncrLen(c->querybuf, -2);
+            c->querybuf = sdsEmpty();
+            c->querybuf = sdsMakeRoomFor(c->querybuf, c->bulklen + 2);
+            pos = 0;
+        } else {
+            c->argv[c->argc++] = createStringObject(c->querybuf + pos, c->bulklen);
+            pos += c->bulklen + 2;
+        }
+        c->bulklen = -1;
+        c->multibulklen--;
+    }
+    if (pos) sdsRange(c->querybuf, pos, -1);
+    if (c->multibulklen == 0) return CACHE_OK;
+    return CACHE_ERR;
+}
+
+/* Runs every complete command in the query buffer as one batch, see
+ * beginCommandBatch(). On an I/O thread it only parses the first one. */
+void processInputBuffer(cacheClient *c) {
+    int batch = !(c->flags & CACHE_PENDING_READ);
+    if (batch) beginCommandBatch();
+    while (sdsLen(c->querybuf)) {
+        if (!(c->flags & CACHE_SLAVE) && clientsArePaused()) break;
+        if (c->flags & CACHE_BLOCKED) break;
+        if (c->flags & CACHE_CLOSE_AFTER_REPLY) break;
+        if (!c->reqtype) {
+            if (c->querybuf[0] == '*') {
+                c->reqtype = CACHE_REQ_MULTIBULK;
+            } else {
+                c->reqtype = CACHE_REQ_INLINE;
+            }
+        }
+        if (c->reqtype == CACHE_REQ_INLINE) {
+            if (processInlineBuffer(c) != CACHE_OK) break;
+        } else if (c->reqtype == CACHE_REQ_MULTIBULK) {
+            if (processMultibulkBuffer(c) != CACHE_OK) break;
+        } else {
+            cachePanic("Unknown request type");
+        }
+        if (c->argc == 0) {
+            resetClient(c);
+        } else if (c->flags & CACHE_PENDING_READ) {
+            c->flags |= CACHE_PENDING_COMMAND;
+            break;
+        } else {
+            if (processCommand(c) == CACHE_OK) resetClient(c);
+        }
+    }
+    if (batch) endCommandBatch(c);
+}
+
+/* Fills iov with what is left of c->buf followed by the reply objects,
+ * up to CACHE_IOV_MAX entries or CACHE_MAX_WRITE_PER_EVENT bytes. */
+static int clientReplyToIovec(cacheClient *c, struct iovec *iov, size_t *bytes) {
+    ListIter li;
+    ListNode *ln;
+    int iovcnt = 0;
+    size_t offset = c->sentlen;
+    *bytes = 0;
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf + c->sentlen;
+        iov[iovcnt].iov_len = c->bufpos - c->sentlen;
+        *bytes += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    ln = clientFirstUnsentReply(c);
+    li.next = ln;
+    li.direction = AL_START_HEAD;
+    while (iovcnt < CACHE_IOV_MAX && *bytes < CACHE_MAX_WRITE_PER_EVENT &&
+           (ln = listNext(&li)) != NULL) {
+        cobj *o = listNodeValue(ln);
+        size_t objlen = sdsLen(o->ptr);
+        if (objlen > offset) {
+            iov[iovcnt].iov_base = (char *) o->ptr + offset;
+            iov[iovcnt].iov_len = objlen - offset;
+            *bytes += iov[iovcnt++].iov_len;
+        }
+        offset = 0;
+    }
+    return iovcnt;
+}
+
+static void clientConsumeReply(cacheClient *c, size_t nwritten) {
+    ListNode *ln;
+    if (c->bufpos > 0) {
+        size_t avail = c->bufpos - c->sentlen;
+        if (nwritten < avail) {
+            c->sentlen += nwritten;
+            return;
+        }
+        nwritten -= avail;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+    ln = clientFirstUnsentReply(c);
+    while (ln != NULL) {
+        ListNode *next = listNextNode(ln);
+        cobj *o = listNodeValue(ln);
+        size_t objlen = sdsLen(o->ptr);
+        if (nwritten < objlen - c->sentlen) {
+            c->sentlen += nwritten;
+            return;
+        }
+        nwritten -= objlen - c->sentlen;
+        c->sentlen = 0;
+        c->reply_bytes -= objlen;
+        if (io_threads_op == CACHE_IO_THREADS_OP_IDLE) {
+            listDelNode(c->reply, ln);
+        } else {
+            c->reply_sent++;
+            c->reply_unsent = next;
+        }
+        ln = next;
+    }
+    if (io_threads_op == CACHE_IO_THREADS_OP_IDLE) clientReplyReleased(c);
+}
+
+/* Also runs on the I/O threads, where it must not free the client: it
+ * flags it with CACHE_CLOSE_AFTER_IO and lets the main thread do it. */
+int writeToClient(int fd, cacheClient *c, int handler_installed) {
+    struct iovec iov[CACHE_IOV_MAX];
+    ssize_t nwritten = 0, totwritten = 0;
+    while (clientHasPendingReplies(c)) {
+        size_t bytes;
+        int iovcnt = clientReplyToIovec(c, iov, &bytes);
+        if (iovcnt == 0) {
+            clientConsumeReply(c, 0);
+            continue;
+        }
+        nwritten = writev(fd, iov, iovcnt);
+        if (nwritten <= 0) break;
+        clientConsumeReply(c, nwritten);
+        totwritten += nwritten;
+        if ((size_t) nwritten < bytes) {
+            aeFileEventDrained(server.el, fd, AE_WRITABLE);
+            break;
+        }
+        if (totwritten > CACHE_MAX_WRITE_PER_EVENT &&
+            (server.maxmemory == 0 || zmalloc_used_memory() < server.maxmemory))
+            break;
+    }
+    __atomic_add_fetch(&server.stat_net_output_bytes, totwritten, __ATOMIC_RELAXED);
+    if (nwritten == -1) {
+        if (errno == EAGAIN) {
+            aeFileEventDrained(server.el, fd, AE_WRITABLE);
+        } else {
+            cacheLog(CACHE_VERBOSE, "Error writing to client: %s", strerror(errno));
+            if (io_threads_op == CACHE_IO_THREADS_OP_IDLE) {
+                freeClient(c);
+            } else {
+                c->flags |= CACHE_CLOSE_AFTER_IO;
+            }
+            return CACHE_ERR;
+        }
+    }
+    if (totwritten > 0 && !(c->flags & CACHE_MASTER))
+        c->lastinteraction = server.unixtime;
+    if (!clientHasPendingReplies(c)) {
+        c->sentlen = 0;
+        if (handler_installed) aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+        if (c->flags & CACHE_CLOSE_AFTER_REPLY) {
+            if (io_threads_op == CACHE_IO_THREADS_OP_IDLE) {
+                freeClient(c);
+            } else {
+                c->flags |= CACHE_CLOSE_AFTER_IO;
+            }
+            return CACHE_ERR;
+        }
+    }
+    return CACHE_OK;
+}
+
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    CACHE_NOTUSED(el);
+    CACHE_NOTUSED(mask);
+    writeToClient(fd, privdata, 1);
+}
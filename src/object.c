@@ -0,0 +1,169 @@
+#include "cache.h"
+
+/* Stamps a new object with the current LRU clock or, under an LFU policy,
+ * with the current minute and the initial access counter, so that new
+ * keys are not evicted before they had a chance to be read again. */
+void initObjectLRUOrLFU(cobj *o) {
+    if (CACHE_MAXMEMORY_IS_LFU(server.maxmemory_policy))
+        o->lru = (LFUGetTimeInMinutes() << 8) | CACHE_LFU_INIT_VAL;
+    else
+        o->lru = LRU_CLOCK();
+}
+
+unsigned long long estimateObjectIdleTime(cobj *o) {
+    unsigned long long lruclock = LRU_CLOCK();
+    if (lruclock >= o->lru) {
+        return (lruclock - o->lru) * CACHE_LRU_CLOCK_RESOLUTION;
+    } else {
+        return (lruclock + (CACHE_LRU_CLOCK_MAX - o->lru)) *
+               CACHE_LRU_CLOCK_RESOLUTION;
+    }
+}
+
+/* Object headers come from the size-class slabs of zmalloc, like the
+ * dict entries and short keys they are stored with; zfree() tells the
+ * slab pointers apart, so decrRefCount() frees them as usual. */
+cobj *createObject(int type, void *ptr) {
+    cobj *o = zmalloc_slab(sizeof(*o));
+    o->type = type;
+    o->encoding = CACHE_ENCODING_RAW;
+    o->ptr = ptr;
+    o->refcount = 1;
+    initObjectLRUOrLFU(o);
+    return o;
+}
+
+cobj *createRawStringObject(char *ptr, size_t len) {
+    return createObject(CACHE_STRING, sdsNewLen(ptr, len));
+}
+
+/* The object and its sds in one slab slot, for strings short enough to
+ * never be resized in place. */
+cobj *createEmbeddedStringObject(char *ptr, size_t len) {
+    cobj *o = zmalloc_slab(sizeof(*o) + sizeof(struct Sdshdr) + len + 1);
+    struct Sdshdr *sh = (void *) (o + 1);
+    o->type = CACHE_STRING;
+    o->encoding = CACHE_ENCODING_EMBSTR;
+    o->ptr = sh->buf;
+    o->refcount = 1;
+    initObjectLRUOrLFU(o);
+    sh->len = len;
+    sh->free = 0;
+    if (ptr) memcpy(sh->buf, ptr, len);
+    else memset(sh->buf, 0, len);
+    sh->buf[len] = '\0';
+    return o;
+}
+
+cobj *createStringObject(char *ptr, size_t len) {
+    if (len <= CACHE_ENCODING_EMBSTR_SIZE_LIMIT)
+        return createEmbeddedStringObject(ptr, len);
+    return createRawStringObject(ptr, len);
+}
+
+cobj *createQuicklistObject(void) {
+    cobj *o = createObject(CACHE_LIST, quicklistNew(server.list_max_ziplist_size,
+                                                    server.list_compress_depth));
+    o->encoding = CACHE_ENCODING_QUICKLIST;
+    return o;
+}
+
+cobj *createListListpackObject(void) {
+    cobj *o = createObject(CACHE_LIST, lpNew());
+    o->encoding = CACHE_ENCODING_LISTPACK;
+    return o;
+}
+
+void freeListObject(cobj *o) {
+    switch (o->encoding) {
+        case CACHE_ENCODING_QUICKLIST:
+            quicklistRelease(o->ptr);
+            break;
+        case CACHE_ENCODING_LISTPACK:
+            lpFree(o->ptr);
+            break;
+        default:
+            cachePanic("Unknown list encoding type");
+    }
+}
+
+cobj *createSetObject(void) {
+    cobj *o = createObject(CACHE_SET, dictCreate(&setDictType, NULL));
+    o->encoding = CACHE_ENCODING_HT;
+    return o;
+}
+
+cobj *createIntsetObject(void) {
+    cobj *o = createObject(CACHE_SET, intsetNew());
+    o->encoding = CACHE_ENCODING_INTSET;
+    return o;
+}
+
+cobj *createRoaringSetObject(void) {
+    cobj *o = createObject(CACHE_SET, roaringNew());
+    o->encoding = CACHE_ENCODING_ROARING;
+    return o;
+}
+
+void freeSetObject(cobj *o) {
+    switch (o->encoding) {
+        case CACHE_ENCODING_HT:
+            dictRelease((Dict *) o->ptr);
+            break;
+        case CACHE_ENCODING_INTSET:
+            zfree(o->ptr);
+            break;
+        case CACHE_ENCODING_ROARING:
+            roaringFree(o->ptr);
+            break;
+        default:
+            cachePanic("Unknown set encoding type");
+    }
+}
+
+/* OBJECT looks the key up without touching it, so that asking for its
+ * idle time or frequency does not reset them. */
+cobj *objectCommandLookup(cacheClient *c, cobj *key) {
+    DictEntry *de;
+    if ((de = dictFind(c->db->dict, key->ptr)) == NULL) return NULL;
+    return (cobj *) dictGetVal(de);
+}
+
+cobj *objectCommandLookupOrReply(cacheClient *c, cobj *key, cobj *reply) {
+    cobj *o = objectCommandLookup(c, key);
+    if (!o) addReply(c, reply);
+    return o;
+}
+
+void objectCommand(cacheClient *c) {
+    cobj *o;
+    if (!strcasecmp(c->argv[1]->ptr, "refcount") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c, c->argv[2], shared.nullbulk)) == NULL)
+            return;
+        addReplyLongLong(c, o->refcount);
+    } else if (!strcasecmp(c->argv[1]->ptr, "encoding") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c, c->argv[2], shared.nullbulk)) == NULL)
+            return;
+        addReplyBulkCString(c, strEncoding(o->encoding));
+    } else if (!strcasecmp(c->argv[1]->ptr, "idletime") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c, c->argv[2], shared.nullbulk)) == NULL)
+            return;
+        if (CACHE_MAXMEMORY_IS_LFU(server.maxmemory_policy)) {
+            addReplyError(c, "An LFU maxmemory policy is selected, idle time not "
+                             "tracked. Try OBJECT FREQ");
+            return;
+        }
+        addReplyLongLong(c, estimateObjectIdleTime(o) / 1000);
+    } else if (!strcasecmp(c->argv[1]->ptr, "freq") && c->argc == 3) {
+        if ((o = objectCommandLookupOrReply(c, c->argv[2], shared.nullbulk)) == NULL)
+            return;
+        if (!CACHE_MAXMEMORY_IS_LFU(server.maxmemory_policy)) {
+            addReplyError(c, "An LFU maxmemory policy is not selected, access "
+                             "frequency not tracked");
+            return;
+        }
+        addReplyLongLong(c, LFUDecrAndReturn(o));
+    } else {
+        addReplyError(c, "Syntax error. Try OBJECT (refcount|encoding|idletime|freq)");
+    }
+}
@@ -0,0 +1,678 @@
+#include "quicklist.h"
+
+#include <string.h>
+
+#include "adlist.h"
+#include "lzf.h"
+#include "util.h"
+#include "listpack.h"
+#include "zmalloc.h"
+
+/* Byte limits of a node for a fill of -1 to -5. */
+static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
+
+/* Positive fills limit the entry count, but a node never grows past this
+ * many bytes because of it. */
+#define SIZE_SAFETY_LIMIT 8192
+
+/* Nodes smaller than this are not worth compressing, and a compressed node
+ * must save at least MIN_COMPRESS_IMPROVE bytes to be kept. */
+#define MIN_COMPRESS_BYTES 48
+#define MIN_COMPRESS_IMPROVE 8
+
+#define quicklistNodeUpdateSz(node)                                            \
+  do {                                                                         \
+    (node)->sz = lpBytes((node)->lp);                                   \
+  } while (0)
+
+quicklist *quicklistCreate(void) {
+  quicklist *ql = zmalloc(sizeof(*ql));
+  ql->head = ql->tail = NULL;
+  ql->len = 0;
+  ql->count = 0;
+  ql->compress = 0;
+  ql->fill = -2;
+  return ql;
+}
+
+static void quicklistSetCompressDepth(quicklist *ql, int compress) {
+  if (compress > QUICKLIST_COMPRESS_MAX)
+    compress = QUICKLIST_COMPRESS_MAX;
+  else if (compress < 0)
+    compress = 0;
+  ql->compress = compress;
+}
+
+static void quicklistSetFill(quicklist *ql, int fill) {
+  if (fill > QUICKLIST_FILL_MAX)
+    fill = QUICKLIST_FILL_MAX;
+  else if (fill < -5)
+    fill = -5;
+  else if (fill == 0)
+    fill = 1;
+  ql->fill = fill;
+}
+
+void quicklistSetOptions(quicklist *ql, int fill, int compress) {
+  quicklistSetFill(ql, fill);
+  quicklistSetCompressDepth(ql, compress);
+}
+
+quicklist *quicklistNew(int fill, int compress) {
+  quicklist *ql = quicklistCreate();
+  quicklistSetOptions(ql, fill, compress);
+  return ql;
+}
+
+static quicklistNode *quicklistCreateNode(void) {
+  quicklistNode *node = zmalloc(sizeof(*node));
+  node->prev = node->next = NULL;
+  node->lp = NULL;
+  node->sz = 0;
+  node->count = 0;
+  node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+  node->recompress = 0;
+  return node;
+}
+
+unsigned long quicklistCount(quicklist *ql) { return ql->count; }
+
+void quicklistRelease(quicklist *ql) {
+  quicklistNode *current = ql->head, *next;
+  while (current) {
+    next = current->next;
+    zfree(current->lp);
+    zfree(current);
+    current = next;
+  }
+  zfree(ql);
+}
+
+/* Replaces the listpack of node with its LZF form. Returns 0 and leaves the
+ * node alone when it is too small or does not compress well enough. */
+static int __quicklistCompressNode(quicklistNode *node) {
+  quicklistLZF *lzf;
+  node->recompress = 0;
+  if (node->sz < MIN_COMPRESS_BYTES) return 0;
+  lzf = zmalloc(sizeof(*lzf) + node->sz);
+  lzf->sz = lzf_compress(node->lp, node->sz, lzf->compressed, node->sz);
+  if (lzf->sz == 0 || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+    zfree(lzf);
+    return 0;
+  }
+  lzf = zre_alloc(lzf, sizeof(*lzf) + lzf->sz);
+  zfree(node->lp);
+  node->lp = (unsigned char *)lzf;
+  node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+  return 1;
+}
+
+static int __quicklistDecompressNode(quicklistNode *node) {
+  quicklistLZF *lzf = (quicklistLZF *)node->lp;
+  unsigned char *lp = zmalloc(node->sz);
+  if (lzf_decompress(lzf->compressed, lzf->sz, lp, node->sz) == 0) {
+    zfree(lp);
+    return 0;
+  }
+  zfree(lzf);
+  node->lp = lp;
+  node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+  return 1;
+}
+
+#define quicklistCompressNode(node)                                            \
+  do {                                                                         \
+    if ((node) && (node)->encoding == QUICKLIST_NODE_ENCODING_RAW)             \
+      __quicklistCompressNode(node);                                           \
+  } while (0)
+
+#define quicklistDecompressNode(node)                                          \
+  do {                                                                         \
+    if ((node) && (node)->encoding == QUICKLIST_NODE_ENCODING_LZF)             \
+      __quicklistDecompressNode(node);                                         \
+  } while (0)
+
+/* Decompresses node for a read or an update, to be compressed back by
+ * quicklistRecompressOnly once done. */
+#define quicklistDecompressNodeForUse(node)                                    \
+  do {                                                                         \
+    if ((node) && (node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {           \
+      __quicklistDecompressNode(node);                                         \
+      (node)->recompress = 1;                                                  \
+    }                                                                          \
+  } while (0)
+
+#define quicklistRecompressOnly(node)                                          \
+  do {                                                                         \
+    if ((node)->recompress) quicklistCompressNode(node);                       \
+  } while (0)
+
+/* Makes sure the `compress` nodes at both ends are raw, and compresses the
+ * first node past the depth on each side, plus node unless it is within
+ * the depth. Those are the only nodes that can have moved across the depth
+ * boundary since the last push, pop or insert. */
+static void __quicklistCompress(quicklist *ql, quicklistNode *node) {
+  quicklistNode *forward = ql->head, *reverse = ql->tail;
+  int depth = 0, in_depth = 0;
+
+  if (ql->compress == 0 || ql->len < (unsigned int)(ql->compress * 2)) return;
+  while (depth++ < (int)ql->compress) {
+    quicklistDecompressNode(forward);
+    quicklistDecompressNode(reverse);
+    if (forward == node || reverse == node) in_depth = 1;
+    if (forward == reverse || forward->next == reverse) return;
+    forward = forward->next;
+    reverse = reverse->prev;
+  }
+  if (!in_depth) quicklistCompressNode(node);
+  quicklistCompressNode(forward);
+  quicklistCompressNode(reverse);
+}
+
+#define quicklistCompress(ql, node)                                            \
+  do {                                                                         \
+    if ((node)->recompress)                                                    \
+      quicklistCompressNode(node);                                             \
+    else                                                                       \
+      __quicklistCompress((ql), (node));                                       \
+  } while (0)
+
+static void __quicklistInsertNode(quicklist *ql, quicklistNode *old_node,
+                                  quicklistNode *new_node, int after) {
+  if (after) {
+    new_node->prev = old_node;
+    if (old_node) {
+      new_node->next = old_node->next;
+      if (old_node->next) old_node->next->prev = new_node;
+      old_node->next = new_node;
+    }
+    if (ql->tail == old_node) ql->tail = new_node;
+  } else {
+    new_node->next = old_node;
+    if (old_node) {
+      new_node->prev = old_node->prev;
+      if (old_node->prev) old_node->prev->next = new_node;
+      old_node->prev = new_node;
+    }
+    if (ql->head == old_node) ql->head = new_node;
+  }
+  if (ql->len == 0) ql->head = ql->tail = new_node;
+  ql->len++;
+  if (old_node) quicklistCompress(ql, old_node);
+}
+
+static void __quicklistDelNode(quicklist *ql, quicklistNode *node) {
+  if (node->next) node->next->prev = node->prev;
+  if (node->prev) node->prev->next = node->next;
+  if (node == ql->tail) ql->tail = node->prev;
+  if (node == ql->head) ql->head = node->next;
+  ql->count -= node->count;
+  ql->len--;
+  zfree(node->lp);
+  zfree(node);
+  /* A node within the depth may have been compressed so far. */
+  __quicklistCompress(ql, NULL);
+}
+
+/* Whether an entry of sz bytes still fits in node under fill. The
+ * overhead is the largest encoding header and backlen the entry can
+ * take. */
+static int _quicklistNodeAllowInsert(const quicklistNode *node, int fill,
+                                     size_t sz) {
+  size_t entry_sz, new_sz;
+  if (node == NULL) return 0;
+  entry_sz = sz + (sz < 64 ? 1 : sz < 4096 ? 2 : 5);
+  new_sz = node->sz + entry_sz +
+           (entry_sz <= 127 ? 1 : entry_sz < 16383 ? 2 : 5);
+  if (fill >= 0)
+    return new_sz <= SIZE_SAFETY_LIMIT && (int)node->count < fill;
+  return new_sz <= optimization_level[-fill - 1];
+}
+
+int quicklistPushHead(quicklist *ql, void *value, size_t sz) {
+  quicklistNode *orig_head = ql->head;
+  if (_quicklistNodeAllowInsert(ql->head, ql->fill, sz)) {
+    ql->head->lp = lpPrepend(ql->head->lp, value, sz);
+    quicklistNodeUpdateSz(ql->head);
+  } else {
+    quicklistNode *node = quicklistCreateNode();
+    node->lp = lpPrepend(lpNew(), value, sz);
+    quicklistNodeUpdateSz(node);
+    __quicklistInsertNode(ql, ql->head, node, 0);
+  }
+  ql->count++;
+  ql->head->count++;
+  return orig_head != ql->head;
+}
+
+int quicklistPushTail(quicklist *ql, void *value, size_t sz) {
+  quicklistNode *orig_tail = ql->tail;
+  if (_quicklistNodeAllowInsert(ql->tail, ql->fill, sz)) {
+    ql->tail->lp = lpAppend(ql->tail->lp, value, sz);
+    quicklistNodeUpdateSz(ql->tail);
+  } else {
+    quicklistNode *node = quicklistCreateNode();
+    node->lp = lpAppend(lpNew(), value, sz);
+    quicklistNodeUpdateSz(node);
+    __quicklistInsertNode(ql, ql->tail, node, 1);
+  }
+  ql->count++;
+  ql->tail->count++;
+  return orig_tail != ql->tail;
+}
+
+void quicklistPush(quicklist *ql, void *value, size_t sz, int where) {
+  if (where == QUICKLIST_HEAD)
+    quicklistPushHead(ql, value, sz);
+  else
+    quicklistPushTail(ql, value, sz);
+}
+
+/* Builds a quicklist holding the entries of lp, which is freed. */
+quicklist *quicklistCreateFromListpack(int fill, int compress,
+                                       unsigned char *lp) {
+  quicklist *ql = quicklistNew(fill, compress);
+  unsigned char *p = lpFirst(lp), *value;
+  unsigned int sz;
+  long long longval;
+  char buf[32];
+
+  while (lpGet(p, &value, &sz, &longval)) {
+    if (!value) {
+      sz = ll2string(buf, sizeof(buf), longval);
+      value = (unsigned char *)buf;
+    }
+    quicklistPushTail(ql, value, sz);
+    p = lpNext(lp, p);
+  }
+  lpFree(lp);
+  return ql;
+}
+
+/* Deletes the entry at *p of node, a raw node. Returns 1 if that emptied
+ * and freed the node. */
+static int quicklistDelIndex(quicklist *ql, quicklistNode *node,
+                             unsigned char **p) {
+  node->lp = lpDelete(node->lp, *p, p);
+  node->count--;
+  ql->count--;
+  if (node->count == 0) {
+    __quicklistDelNode(ql, node);
+    return 1;
+  }
+  quicklistNodeUpdateSz(node);
+  return 0;
+}
+
+static void *_quicklistSaver(unsigned char *data, unsigned int sz) {
+  unsigned char *vstr = NULL;
+  if (data) {
+    vstr = zmalloc(sz);
+    memcpy(vstr, data, sz);
+  }
+  return vstr;
+}
+
+/* Pops the head or tail entry. A string is handed to saver, whose result
+ * is stored in *data, an integer is stored in *sval with *data set to
+ * NULL. Returns 0 if the list is empty. */
+int quicklistPopCustom(quicklist *ql, int where, unsigned char **data,
+                       unsigned int *sz, long long *sval,
+                       void *(*saver)(unsigned char *data, unsigned int sz)) {
+  quicklistNode *node;
+  unsigned char *p, *vstr;
+  unsigned int vlen;
+  long long vlong;
+
+  if (data) *data = NULL;
+  if (ql->count == 0) return 0;
+  node = where == QUICKLIST_HEAD ? ql->head : ql->tail;
+  quicklistDecompressNodeForUse(node);
+  p = lpSeek(node->lp, where == QUICKLIST_HEAD ? 0 : -1);
+  if (!lpGet(p, &vstr, &vlen, &vlong)) return 0;
+  if (vstr) {
+    if (data) *data = saver(vstr, vlen);
+    if (sz) *sz = vlen;
+  } else {
+    if (sval) *sval = vlong;
+  }
+  if (!quicklistDelIndex(ql, node, &p)) quicklistRecompressOnly(node);
+  return 1;
+}
+
+/* Like quicklistPopCustom, with strings returned as a zmalloc'ed copy. */
+int quicklistPop(quicklist *ql, int where, unsigned char **data,
+                 unsigned int *sz, long long *sval) {
+  return quicklistPopCustom(ql, where, data, sz, sval, _quicklistSaver);
+}
+
+/* Splits node around offset: node keeps the entries up to offset included
+ * if after is set, from offset on otherwise, and the returned node gets
+ * the others. */
+static quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
+                                          int after) {
+  quicklistNode *new_node = quicklistCreateNode();
+  unsigned int count = node->count;
+
+  new_node->lp = zmalloc(node->sz);
+  memcpy(new_node->lp, node->lp, node->sz);
+  if (after) {
+    node->lp = lpDeleteRange(node->lp, offset + 1, count - offset - 1);
+    new_node->lp = lpDeleteRange(new_node->lp, 0, offset + 1);
+  } else {
+    node->lp = lpDeleteRange(node->lp, 0, offset);
+    new_node->lp = lpDeleteRange(new_node->lp, offset, count - offset);
+  }
+  node->count = lpLength(node->lp);
+  quicklistNodeUpdateSz(node);
+  new_node->count = lpLength(new_node->lp);
+  quicklistNodeUpdateSz(new_node);
+  return new_node;
+}
+
+/* Inserts value next to entry. When the node of entry is full the value
+ * goes to the neighbour node if entry is at the edge and the neighbour has
+ * room, to a new node if it does not, and otherwise the node is split at
+ * entry. */
+static void _quicklistInsert(quicklist *ql, quicklistEntry *entry, void *value,
+                             size_t sz, int after) {
+  quicklistNode *node = entry->node, *new_node;
+  int at_head, at_tail;
+
+  if (node == NULL) {
+    new_node = quicklistCreateNode();
+    new_node->lp = lpPrepend(lpNew(), value, sz);
+    new_node->count = 1;
+    quicklistNodeUpdateSz(new_node);
+    __quicklistInsertNode(ql, NULL, new_node, after);
+    ql->count++;
+    return;
+  }
+
+  quicklistDecompressNodeForUse(node);
+  at_tail = after && lpNext(node->lp, entry->zi) == NULL;
+  at_head = !after && lpPrev(node->lp, entry->zi) == NULL;
+  if (_quicklistNodeAllowInsert(node, ql->fill, sz)) {
+    if (at_tail) {
+      node->lp = lpAppend(node->lp, value, sz);
+    } else {
+      unsigned char *p =
+          after ? lpNext(node->lp, entry->zi) : entry->zi;
+      node->lp = lpInsert(node->lp, value, sz, p, LP_BEFORE, NULL);
+    }
+    node->count++;
+    quicklistNodeUpdateSz(node);
+    quicklistRecompressOnly(node);
+  } else if (at_tail && _quicklistNodeAllowInsert(node->next, ql->fill, sz)) {
+    new_node = node->next;
+    quicklistDecompressNodeForUse(new_node);
+    new_node->lp = lpPrepend(new_node->lp, value, sz);
+    new_node->count++;
+    quicklistNodeUpdateSz(new_node);
+    quicklistRecompressOnly(new_node);
+    quicklistRecompressOnly(node);
+  } else if (at_head && _quicklistNodeAllowInsert(node->prev, ql->fill, sz)) {
+    new_node = node->prev;
+    quicklistDecompressNodeForUse(new_node);
+    new_node->lp = lpAppend(new_node->lp, value, sz);
+    new_node->count++;
+    quicklistNodeUpdateSz(new_node);
+    quicklistRecompressOnly(new_node);
+    quicklistRecompressOnly(node);
+  } else if (at_tail || at_head) {
+    new_node = quicklistCreateNode();
+    new_node->lp = lpPrepend(lpNew(), value, sz);
+    new_node->count = 1;
+    quicklistNodeUpdateSz(new_node);
+    __quicklistInsertNode(ql, node, new_node, after);
+    quicklistCompress(ql, new_node);
+  } else {
+    int offset = entry->offset < 0 ? entry->offset + (int)node->count
+                                   : entry->offset;
+    new_node = _quicklistSplitNode(node, offset, after);
+    if (after)
+      new_node->lp = lpPrepend(new_node->lp, value, sz);
+    else
+      new_node->lp = lpAppend(new_node->lp, value, sz);
+    new_node->count++;
+    quicklistNodeUpdateSz(new_node);
+    __quicklistInsertNode(ql, node, new_node, after);
+    quicklistCompress(ql, new_node);
+  }
+  ql->count++;
+}
+
+void quicklistInsertBefore(quicklist *ql, quicklistEntry *entry, void *value,
+                           size_t sz) {
+  _quicklistInsert(ql, entry, value, sz, 0);
+}
+
+void quicklistInsertAfter(quicklist *ql, quicklistEntry *entry, void *value,
+                          size_t sz) {
+  _quicklistInsert(ql, entry, value, sz, 1);
+}
+
+/* Deletes the entry quicklistNext just returned. The iterator goes on
+ * with the entry that followed it. */
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+  quicklistNode *prev = entry->node->prev, *next = entry->node->next;
+  int deleted_node = quicklistDelIndex(iter->quicklist, entry->node, &entry->zi);
+
+  /* The following entry now has the offset of the deleted one, as the
+   * offsets run from the head when iterating forward and from the tail
+   * backwards. */
+  iter->zi = NULL;
+  if (deleted_node) {
+    if (iter->direction == AL_START_HEAD) {
+      iter->current = next;
+      iter->offset = 0;
+    } else {
+      iter->current = prev;
+      iter->offset = -1;
+    }
+  }
+}
+
+quicklistIter *quicklistGetIterator(quicklist *ql, int direction) {
+  quicklistIter *iter = zmalloc(sizeof(*iter));
+  if (direction == AL_START_HEAD) {
+    iter->current = ql->head;
+    iter->offset = 0;
+  } else {
+    iter->current = ql->tail;
+    iter->offset = -1;
+  }
+  iter->direction = direction;
+  iter->quicklist = ql;
+  iter->zi = NULL;
+  return iter;
+}
+
+/* An iterator whose first entry is the one at idx, or NULL if idx is out
+ * of range. */
+quicklistIter *quicklistGetIteratorAtIdx(quicklist *ql, int direction,
+                                         long long idx) {
+  quicklistEntry entry;
+  quicklistIter *iter;
+
+  if (!quicklistIndex(ql, idx, &entry)) return NULL;
+  iter = quicklistGetIterator(ql, direction);
+  iter->current = entry.node;
+  iter->offset = entry.offset;
+  if (direction == AL_START_HEAD && iter->offset < 0)
+    iter->offset += entry.node->count;
+  else if (direction == AL_START_TAIL && iter->offset >= 0)
+    iter->offset -= entry.node->count;
+  return iter;
+}
+
+void quicklistReleaseIterator(quicklistIter *iter) {
+  if (iter->current) quicklistCompress(iter->quicklist, iter->current);
+  zfree(iter);
+}
+
+static void _quicklistInitEntry(quicklistEntry *entry) {
+  entry->quicklist = NULL;
+  entry->node = NULL;
+  entry->zi = NULL;
+  entry->value = NULL;
+  entry->longval = -123456789;
+  entry->sz = 0;
+  entry->offset = 123456789;
+}
+
+/* Fills entry with the next entry of iter and returns 1, or returns 0 at
+ * the end of the list. Nodes are decompressed while the iterator is on
+ * them and compressed back when it leaves. */
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
+  _quicklistInitEntry(entry);
+  entry->quicklist = iter->quicklist;
+  while (iter->current) {
+    entry->node = iter->current;
+    if (!iter->zi) {
+      quicklistDecompressNodeForUse(iter->current);
+      iter->zi = lpSeek(iter->current->lp, iter->offset);
+    } else if (iter->direction == AL_START_HEAD) {
+      iter->zi = lpNext(iter->current->lp, iter->zi);
+      iter->offset++;
+    } else {
+      iter->zi = lpPrev(iter->current->lp, iter->zi);
+      iter->offset--;
+    }
+    if (iter->zi) {
+      entry->zi = iter->zi;
+      entry->offset = iter->offset;
+      lpGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+      return 1;
+    }
+    quicklistCompress(iter->quicklist, iter->current);
+    if (iter->direction == AL_START_HEAD) {
+      iter->current = iter->current->next;
+      iter->offset = 0;
+    } else {
+      iter->current = iter->current->prev;
+      iter->offset = -1;
+    }
+  }
+  entry->node = NULL;
+  return 0;
+}
+
+/* Fills entry with the entry at idx, negative indexes counting from the
+ * tail. The node of the entry is left decompressed. */
+int quicklistIndex(quicklist *ql, long long idx, quicklistEntry *entry) {
+  int forward = idx < 0 ? 0 : 1;
+  unsigned long long index = forward ? idx : (-idx) - 1, accum = 0;
+  quicklistNode *n = forward ? ql->head : ql->tail;
+
+  _quicklistInitEntry(entry);
+  entry->quicklist = ql;
+  if (index >= ql->count) return 0;
+  while (n && accum + n->count <= index) {
+    accum += n->count;
+    n = forward ? n->next : n->prev;
+  }
+  if (!n) return 0;
+  entry->node = n;
+  entry->offset = forward ? (int)(index - accum) : -(int)(index - accum) - 1;
+  quicklistDecompressNodeForUse(n);
+  entry->zi = lpSeek(n->lp, entry->offset);
+  lpGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+  return 1;
+}
+
+int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
+  return lpCompare(p1, p2, p2_len);
+}
+
+#ifdef QUICKLIST_BENCHMARK_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Memory per element and LPUSH/RPOP cost of a queue of N short values
+ * kept as a quicklist, against the adlist of cobj + sds values the
+ * linkedlist encoding used. */
+
+/* Stands in for a cobj, and its ptr for an sds of len + free + buf. */
+typedef struct benchObj {
+  unsigned type : 4;
+  unsigned encoding : 4;
+  unsigned lru : 24;
+  int refcount;
+  void *ptr;
+} benchObj;
+
+static long long benchUstime(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void benchQuicklist(long n, int fill, int compress) {
+  size_t before = zmalloc_used_memory(), used;
+  quicklist *ql = quicklistNew(fill, compress);
+  long long start;
+  unsigned char *data;
+  unsigned int sz, nodes;
+  long long sval;
+  char buf[32];
+  long j;
+
+  start = benchUstime();
+  for (j = 0; j < n; j++) {
+    int len = snprintf(buf, sizeof(buf), "job:%ld", j);
+    quicklistPushHead(ql, buf, len);
+  }
+  used = zmalloc_used_memory() - before;
+  nodes = ql->len;
+  for (j = 0; j < n; j++) {
+    quicklistPop(ql, QUICKLIST_TAIL, &data, &sz, &sval);
+    zfree(data);
+  }
+  printf("quicklist fill %d compress %d: %.1f bytes/element, %u nodes, "
+         "%.1f ns per lpush + rpop\n",
+         fill, compress, (double)used / n, nodes,
+         (benchUstime() - start) * 1000.0 / n);
+  quicklistRelease(ql);
+}
+
+static void benchLinkedlist(long n) {
+  size_t before = zmalloc_used_memory(), used;
+  List *l = listCreate();
+  long long start;
+  char buf[32];
+  long j;
+
+  start = benchUstime();
+  for (j = 0; j < n; j++) {
+    int len = snprintf(buf, sizeof(buf), "job:%ld", j);
+    benchObj *o = zmalloc(sizeof(*o));
+    o->ptr = zmalloc(sizeof(unsigned int) * 2 + len + 1);
+    memcpy((char *)o->ptr + sizeof(unsigned int) * 2, buf, len + 1);
+    o->refcount = 1;
+    listAddNodeHead(l, o);
+  }
+  used = zmalloc_used_memory() - before;
+  for (j = 0; j < n; j++) {
+    ListNode *ln = listLast(l);
+    benchObj *o = listNodeValue(ln);
+    zfree(o->ptr);
+    zfree(o);
+    listDelNode(l, ln);
+  }
+  printf("linkedlist: %.1f bytes/element, %.1f ns per lpush + rpop\n",
+         (double)used / n, (benchUstime() - start) * 1000.0 / n);
+  listRelease(l);
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  printf("%ld elements\n", n);
+  benchLinkedlist(n);
+  benchQuicklist(n, -2, 0);
+  benchQuicklist(n, -2, 1);
+  benchQuicklist(n, 128, 0);
+  return 0;
+}
+#endif
@@ -0,0 +1,111 @@
+#ifndef QUICKLIST_H
+#define QUICKLIST_H
+
+#include <stddef.h>
+
+/* A quicklist is a doubly linked list of listpacks. Every node holds up to
+ * `fill` entries when fill is positive, or a listpack of up to 4k, 8k, 16k,
+ * 32k or 64k bytes for a fill of -1 to -5, so a list of millions of short
+ * elements costs a few bytes per element instead of a ListNode and a cobj
+ * each. Nodes more than `compress` nodes away from both ends are kept LZF
+ * compressed, as the ends are what LPUSH/RPOP touch. */
+
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL -1
+
+#define QUICKLIST_NODE_ENCODING_RAW 1
+#define QUICKLIST_NODE_ENCODING_LZF 2
+
+#define QUICKLIST_FILL_MAX ((1 << 15) - 1)
+#define QUICKLIST_COMPRESS_MAX ((1 << 16) - 1)
+
+typedef struct quicklistNode {
+    struct quicklistNode *prev;
+    struct quicklistNode *next;
+    unsigned char *lp; /* A listpack, or a quicklistLZF once compressed. */
+    unsigned int sz; /* Uncompressed size of lp in bytes. */
+    unsigned int count : 16;
+    unsigned int encoding : 2;
+    unsigned int recompress : 1; /* Decompressed for access only. */
+} quicklistNode;
+
+typedef struct quicklistLZF {
+    unsigned int sz;
+    char compressed[];
+} quicklistLZF;
+
+typedef struct quicklist {
+    quicklistNode *head;
+    quicklistNode *tail;
+    unsigned long count; /* Entries in all the listpacks. */
+    unsigned int len; /* Nodes. */
+    int fill : 16;
+    unsigned int compress : 16;
+} quicklist;
+
+typedef struct quicklistIter {
+    quicklist *quicklist;
+    quicklistNode *current;
+    unsigned char *zi;
+    long offset;
+    int direction;
+} quicklistIter;
+
+typedef struct quicklistEntry {
+    quicklist *quicklist;
+    quicklistNode *node;
+    unsigned char *zi;
+    unsigned char *value;
+    long long longval;
+    unsigned int sz;
+    int offset;
+} quicklistEntry;
+
+quicklist *quicklistCreate(void);
+
+quicklist *quicklistNew(int fill, int compress);
+
+void quicklistSetOptions(quicklist *ql, int fill, int compress);
+
+quicklist *quicklistCreateFromListpack(int fill, int compress,
+                                       unsigned char *lp);
+
+void quicklistRelease(quicklist *ql);
+
+void quicklistPush(quicklist *ql, void *value, size_t sz, int where);
+
+int quicklistPushHead(quicklist *ql, void *value, size_t sz);
+
+int quicklistPushTail(quicklist *ql, void *value, size_t sz);
+
+int quicklistPopCustom(quicklist *ql, int where, unsigned char **data,
+                       unsigned int *sz, long long *sval,
+                       void *(*saver)(unsigned char *data, unsigned int sz));
+
+int quicklistPop(quicklist *ql, int where, unsigned char **data,
+                 unsigned int *sz, long long *sval);
+
+void quicklistInsertBefore(quicklist *ql, quicklistEntry *entry, void *value,
+                           size_t sz);
+
+void quicklistInsertAfter(quicklist *ql, quicklistEntry *entry, void *value,
+                          size_t sz);
+
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry);
+
+quicklistIter *quicklistGetIterator(quicklist *ql, int direction);
+
+quicklistIter *quicklistGetIteratorAtIdx(quicklist *ql, int direction,
+                                         long long idx);
+
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry);
+
+void quicklistReleaseIterator(quicklistIter *iter);
+
+int quicklistIndex(quicklist *ql, long long idx, quicklistEntry *entry);
+
+unsigned long quicklistCount(quicklist *ql);
+
+int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
+
+#endif
@@ -0,0 +1,377 @@
+#include "rax.h"
+
+#include <string.h>
+
+#include "zmalloc.h"
+
+#define RAX_STACK_INIT 32
+
+static RaxNode *raxNewNode(const unsigned char *label, size_t len) {
+  RaxNode *n = zmalloc(sizeof(*n) + len);
+  n->len = len;
+  n->numchildren = 0;
+  n->iskey = 0;
+  n->value = NULL;
+  n->children = NULL;
+  if (label) memcpy(n->label, label, len);
+  return n;
+}
+
+Rax *raxNew(void) {
+  Rax *rax = zmalloc(sizeof(*rax));
+  rax->head = raxNewNode(NULL, 0);
+  rax->numele = 0;
+  rax->numnodes = 1;
+  return rax;
+}
+
+/* Index of the child whose label starts with c, or where it would go. */
+static int raxChildIndex(RaxNode *n, unsigned char c, int *found) {
+  int lo = 0, hi = n->numchildren - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    unsigned char m = n->children[mid]->label[0];
+    if (m == c) {
+      *found = 1;
+      return mid;
+    }
+    if (m < c)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  *found = 0;
+  return lo;
+}
+
+static void raxAddChild(RaxNode *n, int idx, RaxNode *child) {
+  n->children =
+      zre_alloc(n->children, sizeof(RaxNode *) * (n->numchildren + 1));
+  memmove(n->children + idx + 1, n->children + idx,
+          sizeof(RaxNode *) * (n->numchildren - idx));
+  n->children[idx] = child;
+  n->numchildren++;
+}
+
+static void raxDelChild(RaxNode *n, int idx) {
+  memmove(n->children + idx, n->children + idx + 1,
+          sizeof(RaxNode *) * (n->numchildren - idx - 1));
+  if (--n->numchildren == 0) {
+    zfree(n->children);
+    n->children = NULL;
+  }
+}
+
+/* Splits the label of parent->children[idx] after `at` bytes and returns
+ * the new node holding the first part. */
+static RaxNode *raxSplit(Rax *rax, RaxNode *parent, int idx, size_t at) {
+  RaxNode *c = parent->children[idx];
+  RaxNode *head = raxNewNode(c->label, at);
+  RaxNode *tail = raxNewNode(c->label + at, c->len - at);
+  tail->iskey = c->iskey;
+  tail->value = c->value;
+  tail->children = c->children;
+  tail->numchildren = c->numchildren;
+  head->children = zmalloc(sizeof(RaxNode *));
+  head->children[0] = tail;
+  head->numchildren = 1;
+  parent->children[idx] = head;
+  zfree(c);
+  rax->numnodes++;
+  return head;
+}
+
+/* Merges parent->children[idx], which is no key and has a single child,
+ * with that child. */
+static void raxMerge(Rax *rax, RaxNode *parent, int idx) {
+  RaxNode *m = parent->children[idx], *c = m->children[0];
+  RaxNode *n = raxNewNode(NULL, m->len + c->len);
+  memcpy(n->label, m->label, m->len);
+  memcpy(n->label + m->len, c->label, c->len);
+  n->iskey = c->iskey;
+  n->value = c->value;
+  n->children = c->children;
+  n->numchildren = c->numchildren;
+  parent->children[idx] = n;
+  zfree(m->children);
+  zfree(m);
+  zfree(c);
+  rax->numnodes--;
+}
+
+/* Returns 1 if the key was added, 0 if it existed and only its value was
+ * replaced, storing the previous one in *old when given. */
+int raxInsert(Rax *rax, const unsigned char *key, size_t len, void *value,
+              void **old) {
+  RaxNode *n = rax->head;
+  size_t i = 0;
+  while (1) {
+    RaxNode *c, *leaf;
+    size_t common = 1;
+    int found, idx;
+    if (i == len) {
+      if (n->iskey) {
+        if (old) *old = n->value;
+        n->value = value;
+        return 0;
+      }
+      n->iskey = 1;
+      n->value = value;
+      rax->numele++;
+      return 1;
+    }
+    idx = raxChildIndex(n, key[i], &found);
+    if (!found) {
+      leaf = raxNewNode(key + i, len - i);
+      leaf->iskey = 1;
+      leaf->value = value;
+      raxAddChild(n, idx, leaf);
+      rax->numnodes++;
+      rax->numele++;
+      return 1;
+    }
+    c = n->children[idx];
+    while (common < c->len && i + common < len &&
+           c->label[common] == key[i + common])
+      common++;
+    if (common < c->len) c = raxSplit(rax, n, idx, common);
+    n = c;
+    i += common;
+  }
+}
+
+static RaxNode *raxLookup(Rax *rax, const unsigned char *key, size_t len,
+                          RaxNode ***parents, int **idxs, int *depth) {
+  RaxNode *n = rax->head;
+  size_t i = 0;
+  int cap = RAX_STACK_INIT;
+  if (parents) *depth = 0;
+  while (i < len) {
+    int found, idx = raxChildIndex(n, key[i], &found);
+    RaxNode *c;
+    if (!found) return NULL;
+    c = n->children[idx];
+    if (c->len > len - i || memcmp(c->label, key + i, c->len) != 0)
+      return NULL;
+    if (parents) {
+      if (*depth == cap) {
+        cap *= 2;
+        *parents = zre_alloc(*parents, sizeof(RaxNode *) * cap);
+        *idxs = zre_alloc(*idxs, sizeof(int) * cap);
+      }
+      (*parents)[*depth] = n;
+      (*idxs)[*depth] = idx;
+      (*depth)++;
+    }
+    n = c;
+    i += c->len;
+  }
+  return n;
+}
+
+int raxFind(Rax *rax, const unsigned char *key, size_t len, void **value) {
+  RaxNode *n = raxLookup(rax, key, len, NULL, NULL, NULL);
+  if (n == NULL || !n->iskey) return 0;
+  if (value) *value = n->value;
+  return 1;
+}
+
+/* Returns 1 if the key was found and removed. Nodes left without a key
+ * and with at most one child are freed or merged with that child, so the
+ * tree stays compressed. */
+int raxRemove(Rax *rax, const unsigned char *key, size_t len, void **old) {
+  RaxNode **parents = zmalloc(sizeof(RaxNode *) * RAX_STACK_INIT), *n, *p;
+  int *idxs = zmalloc(sizeof(int) * RAX_STACK_INIT), depth;
+  n = raxLookup(rax, key, len, &parents, &idxs, &depth);
+  if (n == NULL || !n->iskey) {
+    zfree(parents);
+    zfree(idxs);
+    return 0;
+  }
+  if (old) *old = n->value;
+  n->iskey = 0;
+  n->value = NULL;
+  rax->numele--;
+  if (depth > 0) {
+    p = parents[depth - 1];
+    if (n->numchildren == 0) {
+      raxDelChild(p, idxs[depth - 1]);
+      zfree(n);
+      rax->numnodes--;
+      /* The parent may now be a keyless node with one child. */
+      if (depth > 1 && !p->iskey && p->numchildren == 1)
+        raxMerge(rax, parents[depth - 2], idxs[depth - 2]);
+    } else if (n->numchildren == 1) {
+      raxMerge(rax, p, idxs[depth - 1]);
+    }
+  }
+  zfree(parents);
+  zfree(idxs);
+  return 1;
+}
+
+typedef struct raxWalkFrame {
+  RaxNode *node;
+  int child;
+  size_t keylen;
+} raxWalkFrame;
+
+/* Depth first from `root`, whose key is the first keylen bytes of *buf. */
+static int raxWalkSubtree(RaxNode *root, unsigned char **buf, size_t *bufcap,
+                          size_t keylen, raxWalkFunction *fn,
+                          void *privdata) {
+  int cap = RAX_STACK_INIT, depth = 1, more = 1;
+  raxWalkFrame *stack = zmalloc(sizeof(*stack) * cap);
+  stack[0].node = root;
+  stack[0].child = -1;
+  stack[0].keylen = keylen;
+  while (depth && more) {
+    raxWalkFrame *f = stack + depth - 1;
+    RaxNode *c;
+    if (f->child == -1) {
+      f->child = 0;
+      if (f->node->iskey && !fn(privdata, *buf, f->keylen, f->node->value))
+        more = 0;
+      continue;
+    }
+    if (f->child == f->node->numchildren) {
+      depth--;
+      continue;
+    }
+    c = f->node->children[f->child++];
+    if (f->keylen + c->len > *bufcap) {
+      *bufcap = (f->keylen + c->len) * 2;
+      *buf = zre_alloc(*buf, *bufcap);
+    }
+    memcpy(*buf + f->keylen, c->label, c->len);
+    if (depth == cap) {
+      cap *= 2;
+      stack = zre_alloc(stack, sizeof(*stack) * cap);
+    }
+    stack[depth].node = c;
+    stack[depth].child = -1;
+    stack[depth].keylen = stack[depth - 1].keylen + c->len;
+    depth++;
+  }
+  zfree(stack);
+  return more;
+}
+
+/* Calls fn, in key order, for every key starting with prefix. Only the
+ * subtree below the prefix is visited. Returns 0 if fn stopped the walk. */
+int raxWalkPrefix(Rax *rax, const unsigned char *prefix, size_t len,
+                  raxWalkFunction *fn, void *privdata) {
+  RaxNode *n = rax->head;
+  size_t i = 0, bufcap = len + 64, keylen = len;
+  unsigned char *buf;
+  int more;
+  while (i < len) {
+    int found, idx = raxChildIndex(n, prefix[i], &found);
+    size_t cmp;
+    if (!found) return 1;
+    n = n->children[idx];
+    cmp = n->len < len - i ? n->len : len - i;
+    if (memcmp(n->label, prefix + i, cmp) != 0) return 1;
+    if (cmp < n->len) {
+      /* The prefix ends inside this label. */
+      keylen = i + n->len;
+      break;
+    }
+    i += n->len;
+  }
+  if (keylen > bufcap) bufcap = keylen + 64;
+  buf = zmalloc(bufcap);
+  memcpy(buf, prefix, i < len ? i : len);
+  if (keylen > len) memcpy(buf + i, n->label, n->len);
+  more = raxWalkSubtree(n, &buf, &bufcap, keylen, fn, privdata);
+  zfree(buf);
+  return more;
+}
+
+void raxFree(Rax *rax, void (*free_callback)(void *)) {
+  int cap = RAX_STACK_INIT, depth = 1;
+  RaxNode **stack = zmalloc(sizeof(RaxNode *) * cap);
+  stack[0] = rax->head;
+  while (depth) {
+    RaxNode *n = stack[--depth];
+    int j;
+    if (depth + n->numchildren > cap) {
+      cap = (depth + n->numchildren) * 2;
+      stack = zre_alloc(stack, sizeof(RaxNode *) * cap);
+    }
+    for (j = 0; j < n->numchildren; j++) stack[depth++] = n->children[j];
+    if (n->iskey && free_callback) free_callback(n->value);
+    zfree(n->children);
+    zfree(n);
+  }
+  zfree(stack);
+  zfree(rax);
+}
+
+#ifdef RAX_BENCHMARK_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* KEYS session:<id>:* over N sessions of 10 fields each: walking the
+ * prefix subtree against matching every key, as a dict scan has to. */
+typedef struct benchMatch {
+  const char *prefix;
+  size_t len;
+  long matched;
+} benchMatch;
+
+static int benchCount(void *privdata, const unsigned char *key, size_t len,
+                      void *value) {
+  benchMatch *m = privdata;
+  (void)value;
+  if (len >= m->len && memcmp(key, m->prefix, m->len) == 0) m->matched++;
+  return 1;
+}
+
+static long long benchUstime(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main(int argc, char **argv) {
+  long sessions = argc > 1 ? atol(argv[1]) : 100000, j, f;
+  int queries = 100, q;
+  Rax *rax = raxNew();
+  size_t mem = zmalloc_used_memory();
+  long long start, walk, scan;
+  char key[64];
+  benchMatch m;
+  for (j = 0; j < sessions; j++) {
+    for (f = 0; f < 10; f++) {
+      int len = snprintf(key, sizeof(key), "session:%ld:field%ld", j, f);
+      raxInsert(rax, (unsigned char *)key, len, NULL, NULL);
+    }
+  }
+  mem = zmalloc_used_memory() - mem;
+  start = benchUstime();
+  for (q = 0; q < queries; q++) {
+    m.len = snprintf(key, sizeof(key), "session:%ld:", random() % sessions);
+    m.prefix = key;
+    m.matched = 0;
+    raxWalkPrefix(rax, (unsigned char *)key, m.len, benchCount, &m);
+  }
+  walk = benchUstime() - start;
+  start = benchUstime();
+  for (q = 0; q < 3; q++) {
+    m.len = snprintf(key, sizeof(key), "session:%ld:", random() % sessions);
+    m.prefix = key;
+    m.matched = 0;
+    raxWalkPrefix(rax, (unsigned char *)"", 0, benchCount, &m);
+  }
+  scan = benchUstime() - start;
+  printf("%llu keys, %llu nodes, %.1f bytes/key\n",
+         (unsigned long long)raxSize(rax), (unsigned long long)rax->numnodes,
+         (double)mem / raxSize(rax));
+  printf("prefix walk %.1f us/query, full scan %.1f us/query\n",
+         (double)walk / queries, (double)scan / 3);
+  raxFree(rax, NULL);
+  return 0;
+}
+#endif
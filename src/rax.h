@@ -0,0 +1,46 @@
+#ifndef RAX_H
+#define RAX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compressed radix tree over binary keys. Every node stores the label of
+ * the edge leading to it, so chains of single-child nodes collapse into
+ * one node, and keeps its children sorted by the first label byte: a
+ * depth-first walk visits the keys in lexicographic order. */
+typedef struct RaxNode {
+    uint32_t len;
+    uint16_t numchildren;
+    uint8_t iskey;
+    void *value;
+    struct RaxNode **children;
+    unsigned char label[];
+} RaxNode;
+
+typedef struct Rax {
+    RaxNode *head;
+    uint64_t numele;
+    uint64_t numnodes;
+} Rax;
+
+/* Returning 0 stops the walk. */
+typedef int(raxWalkFunction)(void *privdata, const unsigned char *key,
+                             size_t len, void *value);
+
+#define raxSize(r) ((r)->numele)
+
+Rax *raxNew(void);
+
+void raxFree(Rax *rax, void (*free_callback)(void *));
+
+int raxInsert(Rax *rax, const unsigned char *key, size_t len, void *value,
+              void **old);
+
+int raxRemove(Rax *rax, const unsigned char *key, size_t len, void **old);
+
+int raxFind(Rax *rax, const unsigned char *key, size_t len, void **value);
+
+int raxWalkPrefix(Rax *rax, const unsigned char *prefix, size_t len,
+                  raxWalkFunction *fn, void *privdata);
+
+#endif
@@ -0,0 +1,872 @@
+#include "roaring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "zmalloc.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define ROARING_X86 1
+#endif
+
+/* Members are stored biased by 2^63 so that the containers of negative
+ * numbers sort before the ones of positive numbers. A container is a
+ * bitmap exactly when it holds more than ROARING_ARRAY_MAX members.
+ *
+ * Serialized, all little endian:
+ *
+ * <containers:32> { <key:64> <card:32> <low:16> * card or <word:64> * 1024 }
+ */
+
+#define ROARING_BIAS (1ULL << 63)
+#define ROARING_BITMAP_BYTES (ROARING_BITMAP_WORDS * sizeof(uint64_t))
+
+/* Past this size ratio intersecting two arrays gallops through the larger
+ * one instead of merging them. */
+#define ROARING_GALLOP_RATIO 32
+
+#define roaringIsBitmap(c) ((c)->card > ROARING_ARRAY_MAX)
+#define roaringKey(v) (((uint64_t)(v) ^ ROARING_BIAS) >> 16)
+#define roaringLow(v) ((uint16_t)(v))
+#define roaringValue(key, low)                                                 \
+  ((int64_t)((((uint64_t)(key) << 16) | (low)) ^ ROARING_BIAS))
+#define roaringBitTest(w, low) (((w)[(low) >> 6] >> ((low)&63)) & 1)
+#define roaringBitSet(w, low) ((w)[(low) >> 6] |= 1ULL << ((low)&63))
+#define roaringBitClear(w, low) ((w)[(low) >> 6] &= ~(1ULL << ((low)&63)))
+
+roaring *roaringNew(void) {
+  roaring *r = zmalloc(sizeof(*r));
+  r->card = 0;
+  r->len = r->alloc = 0;
+  r->max_card = 0;
+  r->c = NULL;
+  return r;
+}
+
+void roaringFree(roaring *r) {
+  uint32_t j;
+  for (j = 0; j < r->len; j++)
+    zfree(r->c[j].data);
+  zfree(r->c);
+  zfree(r);
+}
+
+uint64_t roaringCard(const roaring *r) { return r->card; }
+
+size_t roaringBytes(const roaring *r) {
+  size_t bytes = sizeof(*r) + (size_t)r->alloc * sizeof(roaringContainer);
+  uint32_t j;
+  for (j = 0; j < r->len; j++) {
+    const roaringContainer *c = &r->c[j];
+    bytes += roaringIsBitmap(c) ? ROARING_BITMAP_BYTES
+                                : (size_t)c->alloc * sizeof(uint16_t);
+  }
+  return bytes;
+}
+
+/* Index of the first container whose key is not smaller than key. Adds of
+ * growing ids land on the last container, which is checked first. */
+static uint32_t roaringFindContainer(const roaring *r, uint64_t key) {
+  uint32_t lo = 0, hi = r->len;
+  if (hi && r->c[hi - 1].key <= key)
+    return r->c[hi - 1].key == key ? hi - 1 : hi;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) >> 1;
+    if (r->c[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static uint32_t roaringArrayLowerBound(const uint16_t *a, uint32_t n,
+                                       uint16_t v) {
+  uint32_t lo = 0, hi = n;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) >> 1;
+    if (a[mid] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static roaringContainer *roaringInsertContainer(roaring *r, uint32_t i,
+                                                uint64_t key) {
+  if (r->len == r->alloc) {
+    r->alloc = r->alloc ? r->alloc * 2 : 4;
+    r->c = zre_alloc(r->c, r->alloc * sizeof(roaringContainer));
+  }
+  memmove(r->c + i + 1, r->c + i, (r->len - i) * sizeof(roaringContainer));
+  r->len++;
+  r->c[i].key = key;
+  r->c[i].card = 0;
+  r->c[i].alloc = 0;
+  r->c[i].data = NULL;
+  return &r->c[i];
+}
+
+static void roaringDeleteContainer(roaring *r, uint32_t i) {
+  zfree(r->c[i].data);
+  memmove(r->c + i, r->c + i + 1, (r->len - i - 1) * sizeof(roaringContainer));
+  r->len--;
+  if (r->alloc > 4 && r->len < r->alloc / 4) {
+    r->alloc /= 2;
+    r->c = zre_alloc(r->c, r->alloc * sizeof(roaringContainer));
+  }
+}
+
+static void roaringToBitmap(roaringContainer *c) {
+  uint64_t *w = zcalloc(ROARING_BITMAP_BYTES);
+  uint16_t *a = c->data;
+  uint32_t j;
+  for (j = 0; j < c->card; j++)
+    roaringBitSet(w, a[j]);
+  zfree(a);
+  c->data = w;
+  c->alloc = 0;
+}
+
+static void roaringToArray(roaringContainer *c) {
+  uint64_t *w = c->data;
+  uint16_t *a = zmalloc(c->card * sizeof(uint16_t));
+  uint32_t j, n = 0;
+  for (j = 0; j < ROARING_BITMAP_WORDS; j++) {
+    uint64_t word = w[j];
+    while (word) {
+      a[n++] = (j << 6) | __builtin_ctzll(word);
+      word &= word - 1;
+    }
+  }
+  zfree(w);
+  c->data = a;
+  c->alloc = c->card;
+}
+
+static int roaringContainerAdd(roaringContainer *c, uint16_t low) {
+  if (roaringIsBitmap(c)) {
+    uint64_t *w = c->data;
+    if (roaringBitTest(w, low))
+      return 0;
+    roaringBitSet(w, low);
+  } else {
+    uint16_t *a = c->data;
+    uint32_t pos = roaringArrayLowerBound(a, c->card, low);
+    if (pos < c->card && a[pos] == low)
+      return 0;
+    if (c->card == ROARING_ARRAY_MAX) {
+      roaringToBitmap(c);
+      roaringBitSet((uint64_t *)c->data, low);
+      c->card++;
+      return 1;
+    }
+    if (c->card == c->alloc) {
+      c->alloc = c->alloc ? c->alloc * 2 : 4;
+      if (c->alloc > ROARING_ARRAY_MAX)
+        c->alloc = ROARING_ARRAY_MAX;
+      c->data = a = zre_alloc(a, c->alloc * sizeof(uint16_t));
+    }
+    memmove(a + pos + 1, a + pos, (c->card - pos) * sizeof(uint16_t));
+    a[pos] = low;
+  }
+  c->card++;
+  return 1;
+}
+
+static int roaringContainerRemove(roaringContainer *c, uint16_t low) {
+  if (roaringIsBitmap(c)) {
+    uint64_t *w = c->data;
+    if (!roaringBitTest(w, low))
+      return 0;
+    roaringBitClear(w, low);
+    if (--c->card == ROARING_ARRAY_MAX)
+      roaringToArray(c);
+  } else {
+    uint16_t *a = c->data;
+    uint32_t pos = roaringArrayLowerBound(a, c->card, low);
+    if (pos == c->card || a[pos] != low)
+      return 0;
+    memmove(a + pos, a + pos + 1, (c->card - pos - 1) * sizeof(uint16_t));
+    c->card--;
+    if (c->alloc > 4 && c->card < c->alloc / 4) {
+      c->alloc /= 2;
+      c->data = zre_alloc(a, c->alloc * sizeof(uint16_t));
+    }
+  }
+  return 1;
+}
+
+static int roaringContainerContains(const roaringContainer *c, uint16_t low) {
+  if (roaringIsBitmap(c)) {
+    return roaringBitTest((const uint64_t *)c->data, low);
+  } else {
+    const uint16_t *a = c->data;
+    uint32_t pos = roaringArrayLowerBound(a, c->card, low);
+    return pos < c->card && a[pos] == low;
+  }
+}
+
+int roaringAdd(roaring *r, int64_t value) {
+  uint64_t key = roaringKey(value);
+  uint32_t i = roaringFindContainer(r, key);
+  roaringContainer *c;
+
+  if (i == r->len || r->c[i].key != key)
+    c = roaringInsertContainer(r, i, key);
+  else
+    c = &r->c[i];
+  if (!roaringContainerAdd(c, roaringLow(value)))
+    return 0;
+  r->card++;
+  if (c->card > r->max_card)
+    r->max_card = c->card;
+  return 1;
+}
+
+int roaringRemove(roaring *r, int64_t value) {
+  uint64_t key = roaringKey(value);
+  uint32_t i = roaringFindContainer(r, key);
+
+  if (i == r->len || r->c[i].key != key ||
+      !roaringContainerRemove(&r->c[i], roaringLow(value)))
+    return 0;
+  if (r->c[i].card == 0)
+    roaringDeleteContainer(r, i);
+  r->card--;
+  return 1;
+}
+
+int roaringContains(const roaring *r, int64_t value) {
+  uint64_t key = roaringKey(value);
+  uint32_t i = roaringFindContainer(r, key);
+  return i < r->len && r->c[i].key == key &&
+         roaringContainerContains(&r->c[i], roaringLow(value));
+}
+
+/* The low bits of the rank-th member of a container. */
+static uint16_t roaringContainerSelect(const roaringContainer *c,
+                                       uint32_t rank) {
+  const uint64_t *w = c->data;
+  uint32_t j;
+  uint64_t word;
+
+  if (!roaringIsBitmap(c))
+    return ((const uint16_t *)c->data)[rank];
+  for (j = 0;; j++) {
+    uint32_t bits = __builtin_popcountll(w[j]);
+    if (rank < bits)
+      break;
+    rank -= bits;
+  }
+  word = w[j];
+  while (rank--)
+    word &= word - 1;
+  return (j << 6) | __builtin_ctzll(word);
+}
+
+/* A random member of a non empty set. A container drawn at random is kept
+ * with probability card / max_card, which gives every member the same
+ * chance. When the containers are very uneven and the draws keep failing,
+ * the member is picked by rank. */
+int64_t roaringRandom(const roaring *r) {
+  const roaringContainer *c;
+  uint64_t rank;
+  int tries;
+
+  for (tries = 0; tries < 16; tries++) {
+    c = &r->c[random() % r->len];
+    if ((uint32_t)(random() % r->max_card) < c->card)
+      return roaringValue(c->key,
+                          roaringContainerSelect(c, random() % c->card));
+  }
+  rank = (((uint64_t)random() << 31) | random()) % r->card;
+  for (c = r->c; rank >= c->card; c++)
+    rank -= c->card;
+  return roaringValue(c->key, roaringContainerSelect(c, rank));
+}
+
+void roaringInitIterator(roaringIterator *it, const roaring *r) {
+  it->r = r;
+  it->ci = 0;
+  it->pos = 0;
+}
+
+int roaringNext(roaringIterator *it, int64_t *value) {
+  while (it->ci < it->r->len) {
+    const roaringContainer *c = &it->r->c[it->ci];
+    if (!roaringIsBitmap(c)) {
+      if (it->pos < c->card) {
+        *value = roaringValue(c->key, ((const uint16_t *)c->data)[it->pos++]);
+        return 1;
+      }
+    } else {
+      const uint64_t *w = c->data;
+      while (it->pos < ROARING_BITMAP_WORDS * 64) {
+        uint64_t word = w[it->pos >> 6] >> (it->pos & 63);
+        if (word) {
+          uint32_t low = it->pos + __builtin_ctzll(word);
+          it->pos = low + 1;
+          *value = roaringValue(c->key, low);
+          return 1;
+        }
+        it->pos = ((it->pos >> 6) + 1) << 6;
+      }
+    }
+    it->ci++;
+    it->pos = 0;
+  }
+  return 0;
+}
+
+/* ------------------------- Set operations ------------------------------ */
+
+static roaringContainer *roaringAppendContainer(roaring *r, uint64_t key,
+                                                uint32_t card) {
+  roaringContainer *c = roaringInsertContainer(r, r->len, key);
+  c->card = card;
+  r->card += card;
+  if (card > r->max_card)
+    r->max_card = card;
+  return c;
+}
+
+static void roaringAppendArray(roaring *r, uint64_t key, const uint16_t *a,
+                               uint32_t card) {
+  roaringContainer *c;
+  if (card == 0)
+    return;
+  c = roaringAppendContainer(r, key, card);
+  c->data = zmalloc(card * sizeof(uint16_t));
+  c->alloc = card;
+  memcpy(c->data, a, card * sizeof(uint16_t));
+}
+
+/* Appends a bitmap the caller computed, taking ownership of it. */
+static void roaringAppendBitmap(roaring *r, uint64_t key, uint64_t *w) {
+  roaringContainer *c;
+  uint32_t card = 0, j;
+
+  for (j = 0; j < ROARING_BITMAP_WORDS; j++)
+    card += __builtin_popcountll(w[j]);
+  if (card == 0) {
+    zfree(w);
+    return;
+  }
+  c = roaringAppendContainer(r, key, card);
+  c->data = w;
+  if (card <= ROARING_ARRAY_MAX)
+    roaringToArray(c);
+}
+
+static uint64_t *roaringBitmapCopy(const roaringContainer *c) {
+  uint64_t *w = zmalloc(ROARING_BITMAP_BYTES);
+  if (roaringIsBitmap(c)) {
+    memcpy(w, c->data, ROARING_BITMAP_BYTES);
+  } else {
+    const uint16_t *a = c->data;
+    uint32_t j;
+    memset(w, 0, ROARING_BITMAP_BYTES);
+    for (j = 0; j < c->card; j++)
+      roaringBitSet(w, a[j]);
+  }
+  return w;
+}
+
+/* Array intersection kernels. out has room for the smaller input, they
+ * return how many members they wrote to it. */
+static uint32_t roaringArrayAndScalar(const uint16_t *a, uint32_t na,
+                                      const uint16_t *b, uint32_t nb,
+                                      uint16_t *out) {
+  uint32_t i = 0, j = 0, n = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (a[i] > b[j]) {
+      j++;
+    } else {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return n;
+}
+
+/* First index from j on where b is not smaller than v, probing 1, 2, 4...
+ * entries ahead before bisecting. */
+static uint32_t roaringGallop(const uint16_t *b, uint32_t j, uint32_t nb,
+                              uint16_t v) {
+  uint32_t lo = j, hi, step = 1;
+  if (j >= nb || b[j] >= v)
+    return j;
+  while (lo + step < nb && b[lo + step] < v) {
+    lo += step;
+    step <<= 1;
+  }
+  hi = lo + step < nb ? lo + step : nb;
+  while (lo + 1 < hi) {
+    uint32_t mid = (lo + hi) >> 1;
+    if (b[mid] < v)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return hi;
+}
+
+static uint32_t roaringArrayAndGallop(const uint16_t *a, uint32_t na,
+                                      const uint16_t *b, uint32_t nb,
+                                      uint16_t *out) {
+  uint32_t i, j = 0, n = 0;
+  for (i = 0; i < na && j < nb; i++) {
+    j = roaringGallop(b, j, nb, a[i]);
+    if (j < nb && b[j] == a[i])
+      out[n++] = a[i];
+  }
+  return n;
+}
+
+#ifdef ROARING_X86
+/* Compares 8 members of a with all 8 rotations of 8 members of b, then
+ * moves past the block with the smaller maximum, both on a tie. */
+static uint32_t roaringArrayAndSse2(const uint16_t *a, uint32_t na,
+                                    const uint16_t *b, uint32_t nb,
+                                    uint16_t *out) {
+  uint32_t i = 0, j = 0, n = 0;
+  while (i + 8 <= na && j + 8 <= nb) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+    __m128i eq = _mm_cmpeq_epi16(va, vb);
+    uint16_t amax = a[i + 7], bmax = b[j + 7];
+    unsigned int mask;
+    int r;
+
+    for (r = 1; r < 8; r++) {
+      vb = _mm_or_si128(_mm_srli_si128(vb, 2), _mm_slli_si128(vb, 14));
+      eq = _mm_or_si128(eq, _mm_cmpeq_epi16(va, vb));
+    }
+    /* Two mask bits per matching lane, lowest lane first. */
+    mask = _mm_movemask_epi8(eq);
+    while (mask) {
+      out[n++] = a[i + (__builtin_ctz(mask) >> 1)];
+      mask &= mask - 1;
+      mask &= mask - 1;
+    }
+    if (amax <= bmax)
+      i += 8;
+    if (bmax <= amax)
+      j += 8;
+  }
+  return n + roaringArrayAndScalar(a + i, na - i, b + j, nb - j, out + n);
+}
+#endif
+
+static uint32_t roaringArrayAnd(const uint16_t *a, uint32_t na,
+                                const uint16_t *b, uint32_t nb,
+                                uint16_t *out) {
+  if (na > nb)
+    return roaringArrayAnd(b, nb, a, na, out);
+  if ((uint64_t)na * ROARING_GALLOP_RATIO < nb)
+    return roaringArrayAndGallop(a, na, b, nb, out);
+#ifdef ROARING_X86
+  return roaringArrayAndSse2(a, na, b, nb, out);
+#else
+  return roaringArrayAndScalar(a, na, b, nb, out);
+#endif
+}
+
+static void roaringContainerAnd(roaring *r, const roaringContainer *x,
+                                const roaringContainer *y) {
+  uint16_t buf[ROARING_ARRAY_MAX];
+  uint32_t n = 0, j;
+
+  if (roaringIsBitmap(x) && roaringIsBitmap(y)) {
+    const uint64_t *wx = x->data, *wy = y->data;
+    uint64_t *w = zmalloc(ROARING_BITMAP_BYTES);
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++)
+      w[j] = wx[j] & wy[j];
+    roaringAppendBitmap(r, x->key, w);
+    return;
+  }
+  if (roaringIsBitmap(x)) {
+    const roaringContainer *t = x;
+    x = y;
+    y = t;
+  }
+  if (roaringIsBitmap(y)) {
+    const uint16_t *a = x->data;
+    const uint64_t *w = y->data;
+    for (j = 0; j < x->card; j++)
+      if (roaringBitTest(w, a[j]))
+        buf[n++] = a[j];
+  } else {
+    n = roaringArrayAnd(x->data, x->card, y->data, y->card, buf);
+  }
+  roaringAppendArray(r, x->key, buf, n);
+}
+
+static void roaringContainerOr(roaring *r, const roaringContainer *x,
+                               const roaringContainer *y) {
+  uint16_t buf[2 * ROARING_ARRAY_MAX];
+  uint64_t *w;
+  uint32_t j;
+
+  if (!roaringIsBitmap(x) && !roaringIsBitmap(y) &&
+      x->card + y->card <= ROARING_ARRAY_MAX) {
+    const uint16_t *a = x->data, *b = y->data;
+    uint32_t i = 0, k = 0, n = 0;
+    while (i < x->card && k < y->card) {
+      if (a[i] < b[k]) {
+        buf[n++] = a[i++];
+      } else if (a[i] > b[k]) {
+        buf[n++] = b[k++];
+      } else {
+        buf[n++] = a[i++];
+        k++;
+      }
+    }
+    while (i < x->card)
+      buf[n++] = a[i++];
+    while (k < y->card)
+      buf[n++] = b[k++];
+    roaringAppendArray(r, x->key, buf, n);
+    return;
+  }
+  if (!roaringIsBitmap(x)) {
+    const roaringContainer *t = x;
+    x = y;
+    y = t;
+  }
+  w = roaringBitmapCopy(x);
+  if (roaringIsBitmap(y)) {
+    const uint64_t *wy = y->data;
+    for (j = 0; j < ROARING_BITMAP_WORDS; j++)
+      w[j] |= wy[j];
+  } else {
+    const uint16_t *a = y->data;
+    for (j = 0; j < y->card; j++)
+      roaringBitSet(w, a[j]);
+  }
+  roaringAppendBitmap(r, x->key, w);
+}
+
+static void roaringContainerAndNot(roaring *r, const roaringContainer *x,
+                                   const roaringContainer *y) {
+  uint16_t buf[ROARING_ARRAY_MAX];
+  uint32_t n = 0, j, k = 0;
+
+  if (roaringIsBitmap(x)) {
+    uint64_t *w = roaringBitmapCopy(x);
+    if (roaringIsBitmap(y)) {
+      const uint64_t *wy = y->data;
+      for (j = 0; j < ROARING_BITMAP_WORDS; j++)
+        w[j] &= ~wy[j];
+    } else {
+      const uint16_t *b = y->data;
+      for (j = 0; j < y->card; j++)
+        roaringBitClear(w, b[j]);
+    }
+    roaringAppendBitmap(r, x->key, w);
+    return;
+  }
+  if (roaringIsBitmap(y)) {
+    const uint16_t *a = x->data;
+    const uint64_t *w = y->data;
+    for (j = 0; j < x->card; j++)
+      if (!roaringBitTest(w, a[j]))
+        buf[n++] = a[j];
+  } else {
+    const uint16_t *a = x->data, *b = y->data;
+    for (j = 0; j < x->card; j++) {
+      k = roaringGallop(b, k, y->card, a[j]);
+      if (k == y->card || b[k] != a[j])
+        buf[n++] = a[j];
+    }
+  }
+  roaringAppendArray(r, x->key, buf, n);
+}
+
+static void roaringAppendCopy(roaring *r, const roaringContainer *x) {
+  if (roaringIsBitmap(x))
+    roaringAppendBitmap(r, x->key, roaringBitmapCopy(x));
+  else
+    roaringAppendArray(r, x->key, x->data, x->card);
+}
+
+roaring *roaringAnd(const roaring *a, const roaring *b) {
+  roaring *r = roaringNew();
+  uint32_t i = 0, j = 0;
+
+  while (i < a->len && j < b->len) {
+    if (a->c[i].key < b->c[j].key)
+      i++;
+    else if (a->c[i].key > b->c[j].key)
+      j++;
+    else
+      roaringContainerAnd(r, &a->c[i++], &b->c[j++]);
+  }
+  return r;
+}
+
+roaring *roaringOr(const roaring *a, const roaring *b) {
+  roaring *r = roaringNew();
+  uint32_t i = 0, j = 0;
+
+  while (i < a->len || j < b->len) {
+    if (j == b->len || (i < a->len && a->c[i].key < b->c[j].key))
+      roaringAppendCopy(r, &a->c[i++]);
+    else if (i == a->len || a->c[i].key > b->c[j].key)
+      roaringAppendCopy(r, &b->c[j++]);
+    else
+      roaringContainerOr(r, &a->c[i++], &b->c[j++]);
+  }
+  return r;
+}
+
+roaring *roaringAndNot(const roaring *a, const roaring *b) {
+  roaring *r = roaringNew();
+  uint32_t i, j = 0;
+
+  for (i = 0; i < a->len; i++) {
+    while (j < b->len && b->c[j].key < a->c[i].key)
+      j++;
+    if (j < b->len && b->c[j].key == a->c[i].key)
+      roaringContainerAndNot(r, &a->c[i], &b->c[j]);
+    else
+      roaringAppendCopy(r, &a->c[i]);
+  }
+  return r;
+}
+
+/* Keeps the members of the sorted run v[0..n) that are (keep = 1) or are
+ * not (keep = 0) in r, compacting them to the front of v, and returns how
+ * many are left. Containers are walked along with v and arrays galloped
+ * through from the last match, so a short run against a large set only
+ * touches the containers it falls in. */
+uint32_t roaringFilterSorted(const roaring *r, int64_t *v, uint32_t n,
+                             int keep) {
+  uint32_t i, k = 0, ci = 0, pos = 0;
+
+  for (i = 0; i < n; i++) {
+    uint64_t key = roaringKey(v[i]);
+    uint16_t low = roaringLow(v[i]);
+    int found = 0;
+
+    if (ci < r->len && r->c[ci].key < key) {
+      uint32_t step = 1, hi;
+      while (ci + step < r->len && r->c[ci + step].key < key) {
+        ci += step;
+        step <<= 1;
+      }
+      hi = ci + step < r->len ? ci + step : r->len;
+      while (ci + 1 < hi) {
+        uint32_t mid = (ci + hi) >> 1;
+        if (r->c[mid].key < key)
+          ci = mid;
+        else
+          hi = mid;
+      }
+      ci = hi;
+      pos = 0;
+    }
+    if (ci < r->len && r->c[ci].key == key) {
+      const roaringContainer *c = &r->c[ci];
+      if (roaringIsBitmap(c)) {
+        found = roaringBitTest((const uint64_t *)c->data, low);
+      } else {
+        pos = roaringGallop(c->data, pos, c->card, low);
+        found = pos < c->card && ((const uint16_t *)c->data)[pos] == low;
+      }
+    }
+    v[k] = v[i];
+    k += found == keep;
+  }
+  return k;
+}
+
+/* ---------------------------- Serialization ----------------------------- */
+
+size_t roaringSerializedSize(const roaring *r) {
+  size_t bytes = sizeof(uint32_t);
+  uint32_t j;
+  for (j = 0; j < r->len; j++) {
+    const roaringContainer *c = &r->c[j];
+    bytes += sizeof(uint64_t) + sizeof(uint32_t);
+    bytes += roaringIsBitmap(c) ? ROARING_BITMAP_BYTES
+                                : c->card * sizeof(uint16_t);
+  }
+  return bytes;
+}
+
+void roaringSerialize(const roaring *r, unsigned char *buf) {
+  uint32_t j;
+  memcpy(buf, &r->len, sizeof(uint32_t));
+  buf += sizeof(uint32_t);
+  for (j = 0; j < r->len; j++) {
+    const roaringContainer *c = &r->c[j];
+    size_t data = roaringIsBitmap(c) ? ROARING_BITMAP_BYTES
+                                     : c->card * sizeof(uint16_t);
+    memcpy(buf, &c->key, sizeof(uint64_t));
+    memcpy(buf + sizeof(uint64_t), &c->card, sizeof(uint32_t));
+    buf += sizeof(uint64_t) + sizeof(uint32_t);
+    memcpy(buf, c->data, data);
+    buf += data;
+  }
+}
+
+/* Rebuilds a set from roaringSerialize() output, NULL if the blob is not
+ * a well formed set: keys must be increasing, arrays sorted and bitmap
+ * cards right, so that a corrupted file cannot break the invariants. */
+roaring *roaringDeserialize(const unsigned char *buf, size_t len) {
+  const unsigned char *end = buf + len;
+  roaring *r;
+  uint32_t count, j, k;
+
+  if (len < sizeof(uint32_t))
+    return NULL;
+  memcpy(&count, buf, sizeof(uint32_t));
+  buf += sizeof(uint32_t);
+  if (count > (len - sizeof(uint32_t)) / (sizeof(uint64_t) + sizeof(uint32_t)))
+    return NULL;
+
+  r = roaringNew();
+  for (j = 0; j < count; j++) {
+    roaringContainer *c;
+    uint64_t key;
+    uint32_t card;
+    size_t data;
+
+    if ((size_t)(end - buf) < sizeof(uint64_t) + sizeof(uint32_t))
+      goto err;
+    memcpy(&key, buf, sizeof(uint64_t));
+    memcpy(&card, buf + sizeof(uint64_t), sizeof(uint32_t));
+    buf += sizeof(uint64_t) + sizeof(uint32_t);
+    if ((r->len && key <= r->c[r->len - 1].key) || key >> 48 || card == 0 ||
+        card > ROARING_BITMAP_WORDS * 64)
+      goto err;
+    data = card > ROARING_ARRAY_MAX ? ROARING_BITMAP_BYTES
+                                    : card * sizeof(uint16_t);
+    if ((size_t)(end - buf) < data)
+      goto err;
+
+    c = roaringAppendContainer(r, key, card);
+    c->data = zmalloc(data);
+    memcpy(c->data, buf, data);
+    buf += data;
+    if (roaringIsBitmap(c)) {
+      const uint64_t *w = c->data;
+      uint32_t bits = 0;
+      for (k = 0; k < ROARING_BITMAP_WORDS; k++)
+        bits += __builtin_popcountll(w[k]);
+      if (bits != card)
+        goto err;
+    } else {
+      const uint16_t *a = c->data;
+      c->alloc = card;
+      for (k = 1; k < card; k++)
+        if (a[k - 1] >= a[k])
+          goto err;
+    }
+  }
+  if (buf != end)
+    goto err;
+  return r;
+
+err:
+  roaringFree(r);
+  return NULL;
+}
+
+#ifdef ROARING_BENCHMARK_MAIN
+#include <stdio.h>
+#include <time.h>
+
+/* Bytes per member for dense, sparse and random members, and ns per
+ * member of the array intersection kernels on two 4096 member arrays and
+ * on a 64 member array against a 4096 member one. */
+
+static long long benchNstime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t benchRandom(void) {
+  return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+}
+
+static void benchBytes(const char *name, int n, int64_t start, int64_t step,
+                       int random) {
+  roaring *r = roaringNew();
+  int j;
+
+  for (j = 0; j < n; j++)
+    roaringAdd(r, random ? (int64_t)benchRandom() : start + j * step);
+  printf("%-8s %8llu members %6.2f bytes/member\n", name,
+         (unsigned long long)roaringCard(r),
+         (double)roaringBytes(r) / roaringCard(r));
+  roaringFree(r);
+}
+
+static int benchCompare(const void *a, const void *b) {
+  return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+static uint32_t benchArray(uint16_t *a, uint32_t n, uint32_t range) {
+  uint32_t i, m = 0;
+  for (i = 0; i < n; i++)
+    a[i] = rand() % range;
+  qsort(a, n, sizeof(uint16_t), benchCompare);
+  for (i = 0; i < n; i++)
+    if (m == 0 || a[m - 1] != a[i])
+      a[m++] = a[i];
+  return m;
+}
+
+typedef uint32_t (*benchKernel)(const uint16_t *, uint32_t, const uint16_t *,
+                                uint32_t, uint16_t *);
+
+static void benchKernelRun(const char *name, benchKernel k, uint32_t ref,
+                           const uint16_t *a, uint32_t na, const uint16_t *b,
+                           uint32_t nb, uint16_t *out) {
+  long long start = benchNstime();
+  uint32_t n = 0;
+  int j;
+
+  for (j = 0; j < 1000; j++)
+    n = k(a, na, b, nb, out);
+  printf(" %s %6.3f", name,
+         (double)(benchNstime() - start) / 1000 / (na + nb));
+  if (n != ref)
+    printf(" (%u != %u!)", n, ref);
+}
+
+int main(void) {
+  static uint16_t a[ROARING_ARRAY_MAX], b[ROARING_ARRAY_MAX],
+      out[ROARING_ARRAY_MAX];
+  uint32_t na, nb, sizes[] = {64, ROARING_ARRAY_MAX}, s, ref;
+
+  srand(1);
+  benchBytes("dense", 1000000, 0, 1, 0);
+  benchBytes("stride", 1000000, 0, 16, 0);
+  benchBytes("sparse", 1000000, -(1LL << 40), 1LL << 24, 0);
+  benchBytes("random", 20000, 0, 0, 1);
+
+  for (s = 0; s < 2; s++) {
+    na = benchArray(a, sizes[s], 16384);
+    nb = benchArray(b, ROARING_ARRAY_MAX, 16384);
+    ref = roaringArrayAndScalar(a, na, b, nb, out);
+    printf("%4u x %4u:", na, nb);
+    benchKernelRun("scalar", roaringArrayAndScalar, ref, a, na, b, nb, out);
+    benchKernelRun("gallop", roaringArrayAndGallop, ref, a, na, b, nb, out);
+#ifdef ROARING_X86
+    benchKernelRun("sse2", roaringArrayAndSse2, ref, a, na, b, nb, out);
+#endif
+    printf(" ns/member\n");
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,71 @@
+#ifndef ROARING_H
+#define ROARING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A roaring set of 64 bit integers: members are grouped by their high 48
+ * bits into containers holding the low 16 bits, either as a sorted array
+ * of up to ROARING_ARRAY_MAX uint16 or, past that, as a 65536 bit bitmap.
+ * A member costs 2 bytes in an array container and down to 1 bit in a
+ * bitmap one, against about 80 bytes in a hash table set. */
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITMAP_WORDS 1024
+
+typedef struct roaringContainer {
+  uint64_t key;
+  uint32_t card;
+  uint32_t alloc; /* Slots of an array container, 0 for a bitmap. */
+  void *data;
+} roaringContainer;
+
+typedef struct roaring {
+  uint64_t card;
+  uint32_t len, alloc;
+  uint32_t max_card; /* Upper bound of the container cards, for sampling. */
+  roaringContainer *c;
+} roaring;
+
+typedef struct roaringIterator {
+  const roaring *r;
+  uint32_t ci;
+  uint32_t pos;
+} roaringIterator;
+
+roaring *roaringNew(void);
+
+void roaringFree(roaring *r);
+
+int roaringAdd(roaring *r, int64_t value);
+
+int roaringRemove(roaring *r, int64_t value);
+
+int roaringContains(const roaring *r, int64_t value);
+
+uint64_t roaringCard(const roaring *r);
+
+size_t roaringBytes(const roaring *r);
+
+int64_t roaringRandom(const roaring *r);
+
+roaring *roaringAnd(const roaring *a, const roaring *b);
+
+roaring *roaringOr(const roaring *a, const roaring *b);
+
+roaring *roaringAndNot(const roaring *a, const roaring *b);
+
+uint32_t roaringFilterSorted(const roaring *r, int64_t *v, uint32_t n,
+                             int keep);
+
+void roaringInitIterator(roaringIterator *it, const roaring *r);
+
+int roaringNext(roaringIterator *it, int64_t *value);
+
+size_t roaringSerializedSize(const roaring *r);
+
+void roaringSerialize(const roaring *r, unsigned char *buf);
+
+roaring *roaringDeserialize(const unsigned char *buf, size_t len);
+
+#endif
@@ -8,6 +8,8 @@
 
 #include "zmalloc.h"
 #define SDS_LLSTR_SIZE 21
+/* Short strings, keys mostly, are carved from the zmalloc slabs. */
+#define SDS_SLAB_MAX 64
 
 int sdsU112str(char *s, unsigned long long v) {
   char *p, aux;
@@ -663,10 +665,16 @@ void sdsUpdateLen(Sds s) {
 
 Sds sdsNewLen(const void *init, size_t init_len) {
   struct Sdshdr *sh;
-  if (init)
-    sh = zmalloc(sizeof(struct Sdshdr) + init_len + 1);
-  else
-    sh = zcalloc(sizeof(struct Sdshdr) + init_len + 1);
+  size_t size = sizeof(struct Sdshdr) + init_len + 1;
+  if (size <= SDS_SLAB_MAX) {
+    sh = zmalloc_slab(size);
+    if (!init)
+      memset(sh, 0, size);
+  } else if (init) {
+    sh = zmalloc(size);
+  } else {
+    sh = zcalloc(size);
+  }
   if (sh == NULL)
     return NULL;
   sh->len = init_len;
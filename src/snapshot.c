@@ -0,0 +1,328 @@
+#include "cache.h"
+#include "bio.h"
+#include "endianconv.h"
+
+#define CACHE_SNAPSHOT_MAX_PENDING (64 * 1024)
+#define CACHE_SNAPSHOT_SCAN_CALLS 1024
+
+/* Fork-free RDB save. The main thread walks the keyspace with dictScan
+ * and queues references to the values; a bio thread serializes them.
+ * Keys about to be deleted, overwritten or modified in place before the
+ * walk reached them are queued first through the dict snapshot barrier,
+ * so the file is a point-in-time image of the keyspace. */
+
+typedef struct snapshotItem {
+    int dbid;
+    Sds key;
+    cobj *val;
+    long long expire;
+    Sds payload;
+    struct snapshotItem *next; /* Next queued item with the same val. */
+} snapshotItem;
+
+typedef struct snapshotState {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    List *pending;
+    Dict *queued; /* val -> its pending items, for snapshotReclaim(). */
+    List *done;
+    snapshotItem *current;
+    int dbid;
+    unsigned long cursor;
+    int scanning;
+    int aborted;
+    int finished;
+    int status;
+    long long now;
+    char tmpfile[256];
+    char *filename;
+} snapshotState;
+
+static uint64_t snapshotPtrHash(const void *key) {
+    return dictGenHashFunction(&key, sizeof(key));
+}
+
+static DictType snapshotQueuedDictType = {snapshotPtrHash,
+                                          NULL,
+                                          NULL,
+                                          NULL,
+                                          NULL,
+                                          NULL,
+                                          DICT_LAYOUT_CHAINED,
+                                          NULL};
+
+/* Both called with st->lock held. */
+static void snapshotIndexAdd(snapshotState *st, snapshotItem *item) {
+    DictEntry *de = dictFind(st->queued, item->val);
+    if (de == NULL) {
+        item->next = NULL;
+        dictAdd(st->queued, item->val, item);
+    } else {
+        item->next = dictGetVal(de);
+        distSetVal(st->queued, de, item);
+    }
+}
+
+static void snapshotIndexDelete(snapshotState *st, snapshotItem *item) {
+    DictEntry *de = dictFind(st->queued, item->val);
+    snapshotItem **prev = (snapshotItem **) &dictGetVal(de);
+    while (*prev != item) prev = &(*prev)->next;
+    *prev = item->next;
+    if (dictGetVal(de) == NULL) dictDelete(st->queued, item->val);
+}
+
+static void snapshotQueue(snapshotState *st, snapshotItem *item) {
+    pthread_mutex_lock(&st->lock);
+    if (item->val) snapshotIndexAdd(st, item);
+    listAddNodeTail(st->pending, item);
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void snapshotSaveEntry(void *privdata, const DictEntry *de) {
+    cacheDB *db = privdata;
+    snapshotItem *item = zmalloc(sizeof(*item));
+    cobj keyobj;
+    item->dbid = db->id;
+    item->key = sdsDup(dictGetKey(de));
+    item->val = dictGetVal(de);
+    item->payload = NULL;
+    initStaticStringObject(keyobj, item->key);
+    item->expire = getExpire(db, &keyobj);
+    incrRefCount(item->val);
+    snapshotQueue(server.snapshot, item);
+}
+
+static void snapshotScanCallback(void *privdata, const DictEntry *de) {
+    cacheDB *db = privdata;
+    dictSnapshotMark(db->dict, (DictEntry *) de);
+}
+
+static void snapshotFreeItem(snapshotItem *item) {
+    if (item->val) decrRefCount(item->val);
+    sdsFree(item->key);
+    sdsFree(item->payload);
+    zfree(item);
+}
+
+/* Serializes a queued value on the main thread so it can be modified in
+ * place. Waits if the writer is serializing that very value right now. */
+static void snapshotReclaim(snapshotState *st, cobj *o) {
+    snapshotItem *item, *next;
+    DictEntry *de;
+    pthread_mutex_lock(&st->lock);
+    while (st->current && st->current->val == o)
+        pthread_cond_wait(&st->cond, &st->lock);
+    if ((de = dictFind(st->queued, o)) == NULL) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    for (item = dictGetVal(de); item; item = next) {
+        rio payload;
+        cobj keyobj;
+        next = item->next;
+        rioInitWithBuffer(&payload, sdsEmpty());
+        initStaticStringObject(keyobj, item->key);
+        rdbSaveKeyValuePair(&payload, &keyobj, item->val, item->expire, st->now);
+        item->payload = payload.io.buffer.ptr;
+        item->val = NULL;
+        item->next = NULL;
+        decrRefCount(o);
+    }
+    dictDelete(st->queued, o);
+    pthread_mutex_unlock(&st->lock);
+}
+
+int snapshotStart(char *filename) {
+    snapshotState *st;
+    int j;
+    if (server.snapshot != NULL || server.rdb_chiled_pid != -1) return CACHE_ERR;
+    st = zmalloc(sizeof(*st));
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+    st->pending = listCreate();
+    st->queued = dictCreate(&snapshotQueuedDictType, NULL);
+    st->done = listCreate();
+    st->current = NULL;
+    st->dbid = 0;
+    st->cursor = 0;
+    st->scanning = 1;
+    st->aborted = 0;
+    st->finished = 0;
+    st->status = CACHE_OK;
+    st->now = mstime();
+    snprintf(st->tmpfile, sizeof(st->tmpfile), "temp-snapshot-%d.rdb",
+             (int) getpid());
+    st->filename = z_str_dup(filename);
+    server.snapshot = st;
+    for (j = 0; j < server.dbnum; j++)
+        dictSnapshotStart(server.db[j].dict, snapshotSaveEntry, &server.db[j]);
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+    server.rdb_save_time_start = time(NULL);
+    bioCreateBackgroundJob(CACHE_BIO_SNAPSHOT, st, NULL, NULL);
+    cacheLog(CACHE_NOTICE, "Background saving started by snapshot thread");
+    return CACHE_OK;
+}
+
+/* Write barrier for commands about to modify a value in place. Only the
+ * set commands call it in this tree: the list, hash and zset commands and
+ * APPEND, SETRANGE and INCRBYFLOAT, which are not part of it, have to call
+ * it before they modify their value too. */
+void snapshotTouchKey(cacheDB *db, cobj *key) {
+    DictEntry *de;
+    cobj *val;
+    if (server.snapshot == NULL) return;
+    if ((de = dictSnapshotFind(db->dict, key->ptr)) == NULL) return;
+    val = dictGetVal(de);
+    if (val->refcount > 1) snapshotReclaim(server.snapshot, val);
+}
+
+static void snapshotEnd(snapshotState *st) {
+    snapshotItem *item = zmalloc(sizeof(*item));
+    int j;
+    memset(item, 0, sizeof(*item));
+    item->dbid = -1;
+    st->scanning = 0;
+    for (j = 0; j < server.dbnum; j++) {
+        if (st->aborted)
+            dictSnapshotAbort(server.db[j].dict);
+        else
+            dictSnapshotEnd(server.db[j].dict);
+    }
+    snapshotQueue(st, item);
+}
+
+void snapshotAbort(void) {
+    snapshotState *st = server.snapshot;
+    if (st == NULL || !st->scanning) return;
+    st->aborted = 1;
+    snapshotEnd(st);
+}
+
+/* Called from serverCron and beforeSleep: releases the values the writer
+ * is done with, advances the keyspace walk while the queue has room and
+ * reports the result once the writer finished. */
+void snapshotCron(void) {
+    snapshotState *st = server.snapshot;
+    List *done;
+    ListNode *ln;
+    int calls = CACHE_SNAPSHOT_SCAN_CALLS, finished;
+    unsigned long pending;
+    if (st == NULL) return;
+    pthread_mutex_lock(&st->lock);
+    done = st->done;
+    st->done = listCreate();
+    pending = listLength(st->pending);
+    finished = st->finished;
+    pthread_mutex_unlock(&st->lock);
+    while ((ln = listFirst(done)) != NULL) {
+        snapshotFreeItem(listNodeValue(ln));
+        listDelNode(done, ln);
+    }
+    listRelease(done);
+    while (st->scanning && calls-- && pending < CACHE_SNAPSHOT_MAX_PENDING) {
+        cacheDB *db = server.db + st->dbid;
+        st->cursor = dictScan(db->dict, st->cursor, snapshotScanCallback, db);
+        if (st->cursor == 0 && ++st->dbid == server.dbnum) {
+            snapshotEnd(st);
+            break;
+        }
+        pthread_mutex_lock(&st->lock);
+        pending = listLength(st->pending);
+        pthread_mutex_unlock(&st->lock);
+    }
+    if (!finished) return;
+    if (st->status == CACHE_OK) {
+        cacheLog(CACHE_NOTICE, "Background saving terminated with success");
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = CACHE_OK;
+    } else {
+        cacheLog(CACHE_WARNING, "Background snapshot saving error");
+        server.lastbgsave_status = CACHE_ERR;
+    }
+    server.rdb_save_time_last = time(NULL) - server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->cond);
+    listRelease(st->pending);
+    dictRelease(st->queued);
+    listRelease(st->done);
+    zfree(st->filename);
+    zfree(st);
+    server.snapshot = NULL;
+}
+
+/* Runs on the bio thread until the end marker is dequeued. */
+void snapshotWrite(void *arg) {
+    snapshotState *st = arg;
+    snapshotItem *item;
+    FILE *fp = fopen(st->tmpfile, "w");
+    int lastdb = -1, err = (fp == NULL);
+    char magic[10];
+    uint64_t cksum;
+    rio rdb;
+    if (fp == NULL) {
+        cacheLog(CACHE_WARNING, "Failed opening .rdb for saving: %s",
+                 strerror(errno));
+    } else {
+        rioInitWithFile(&rdb, fp);
+        if (server.rdb_checksum) rdb.update_cksum = rioGenericUpdateChecksum;
+        snprintf(magic, sizeof(magic), "REDIS%04d", CACHE_RDB_VERSION);
+        if (rioWrite(&rdb, magic, 9) == 0) err = 1;
+    }
+    while (1) {
+        ListNode *ln;
+        pthread_mutex_lock(&st->lock);
+        while (listLength(st->pending) == 0)
+            pthread_cond_wait(&st->cond, &st->lock);
+        ln = listFirst(st->pending);
+        item = listNodeValue(ln);
+        listDelNode(st->pending, ln);
+        if (item->val) snapshotIndexDelete(st, item);
+        st->current = item;
+        pthread_mutex_unlock(&st->lock);
+        if (item->dbid == -1) break;
+        if (!err && item->dbid != lastdb) {
+            if (rdbSaveType(&rdb, CACHE_RDB_OPCODE_SELECTDB) == -1 ||
+                rdbSaveLen(&rdb, item->dbid) == -1)
+                err = 1;
+            lastdb = item->dbid;
+        }
+        if (!err && item->payload) {
+            if (rioWrite(&rdb, item->payload, sdsLen(item->payload)) == 0) err = 1;
+        } else if (!err) {
+            cobj keyobj;
+            initStaticStringObject(keyobj, item->key);
+            if (rdbSaveKeyValuePair(&rdb, &keyobj, item->val, item->expire,
+                                    st->now) == -1)
+                err = 1;
+        }
+        pthread_mutex_lock(&st->lock);
+        st->current = NULL;
+        listAddNodeTail(st->done, item);
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+    zfree(item);
+    if (fp) {
+        if (!err && !st->aborted) {
+            if (rdbSaveType(&rdb, CACHE_RDB_OPCODE_EOF) == -1) err = 1;
+            cksum = rdb.cksum;
+            memrev64ifbe(&cksum);
+            if (rioWrite(&rdb, &cksum, 8) == 0) err = 1;
+        }
+        if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) err = 1;
+        if (fclose(fp) == EOF) err = 1;
+        if (err || st->aborted || rename(st->tmpfile, st->filename) == -1) {
+            unlink(st->tmpfile);
+            err = 1;
+        }
+    }
+    pthread_mutex_lock(&st->lock);
+    st->status = err ? CACHE_ERR : CACHE_OK;
+    st->current = NULL;
+    st->finished = 1;
+    pthread_mutex_unlock(&st->lock);
+}
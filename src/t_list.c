@@ -0,0 +1,219 @@
+#include "cache.h"
+
+/* Lists start as a single listpack and move to a quicklist, a linked list
+ * of bounded listpacks, once they outgrow list_max_ziplist_entries or get
+ * a value longer than list_max_ziplist_value. */
+
+void listTypeTryConversion(cobj *subject, cobj *value) {
+    if (subject->encoding != CACHE_ENCODING_LISTPACK) return;
+    if (sdsEncodedObject(value) &&
+        sdsLen(value->ptr) > server.list_max_ziplist_value)
+        listTypeConvert(subject, CACHE_ENCODING_QUICKLIST);
+}
+
+void listTypePush(cobj *subject, cobj *value, int where) {
+    listTypeTryConversion(subject, value);
+    if (subject->encoding == CACHE_ENCODING_LISTPACK &&
+        lpLength(subject->ptr) >= server.list_max_ziplist_entries)
+        listTypeConvert(subject, CACHE_ENCODING_QUICKLIST);
+
+    if (subject->encoding == CACHE_ENCODING_LISTPACK) {
+        value = getDecodedObject(value);
+        if (where == CACHE_HEAD)
+            subject->ptr = lpPrepend(subject->ptr, (unsigned char *) value->ptr,
+                                     sdsLen(value->ptr));
+        else
+            subject->ptr = lpAppend(subject->ptr, (unsigned char *) value->ptr,
+                                    sdsLen(value->ptr));
+        decrRefCount(value);
+    } else if (subject->encoding == CACHE_ENCODING_QUICKLIST) {
+        int pos = (where == CACHE_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        value = getDecodedObject(value);
+        quicklistPush(subject->ptr, value->ptr, sdsLen(value->ptr), pos);
+        decrRefCount(value);
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+}
+
+static void *listPopSaver(unsigned char *data, unsigned int sz) {
+    return createStringObject((char *) data, sz);
+}
+
+cobj *listTypePop(cobj *subject, int where) {
+    cobj *value = NULL;
+
+    if (subject->encoding == CACHE_ENCODING_LISTPACK) {
+        unsigned char *p, *vstr;
+        unsigned int vlen;
+        long long vlong;
+        p = (where == CACHE_HEAD) ? lpFirst(subject->ptr) : lpLast(subject->ptr);
+        if (lpGet(p, &vstr, &vlen, &vlong)) {
+            if (vstr)
+                value = createStringObject((char *) vstr, vlen);
+            else
+                value = createStringObjectFromLongLong(vlong);
+            subject->ptr = lpDelete(subject->ptr, p, NULL);
+        }
+    } else if (subject->encoding == CACHE_ENCODING_QUICKLIST) {
+        long long vlong;
+        int pos = (where == CACHE_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        if (quicklistPopCustom(subject->ptr, pos, (unsigned char **) &value, NULL,
+                               &vlong, listPopSaver)) {
+            if (!value) value = createStringObjectFromLongLong(vlong);
+        }
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+    return value;
+}
+
+unsigned long listTypeLength(cobj *subject) {
+    if (subject->encoding == CACHE_ENCODING_LISTPACK) {
+        return lpLength(subject->ptr);
+    } else if (subject->encoding == CACHE_ENCODING_QUICKLIST) {
+        return quicklistCount(subject->ptr);
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+}
+
+/* An iterator starting at index and moving towards the tail for a
+ * direction of CACHE_TAIL, towards the head for CACHE_HEAD. */
+listTypeIterator *listTypeInitIterator(cobj *subject, long index,
+                                       unsigned char direction) {
+    listTypeIterator *li = zmalloc(sizeof(listTypeIterator));
+    li->subject = subject;
+    li->encoding = subject->encoding;
+    li->direction = direction;
+    li->lpi = NULL;
+    li->iter = NULL;
+    if (li->encoding == CACHE_ENCODING_LISTPACK) {
+        li->lpi = lpSeek(subject->ptr, index);
+    } else if (li->encoding == CACHE_ENCODING_QUICKLIST) {
+        int iter_direction = (direction == CACHE_HEAD) ? AL_START_TAIL : AL_START_HEAD;
+        li->iter = quicklistGetIteratorAtIdx(subject->ptr, iter_direction, index);
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+    return li;
+}
+
+void listTypeReleaseIterator(listTypeIterator *li) {
+    if (li->iter) quicklistReleaseIterator(li->iter);
+    zfree(li);
+}
+
+int listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
+    cacheAssert(li->subject->encoding == li->encoding);
+
+    entry->li = li;
+    if (li->encoding == CACHE_ENCODING_LISTPACK) {
+        entry->lpi = li->lpi;
+        if (entry->lpi != NULL) {
+            if (li->direction == CACHE_TAIL)
+                li->lpi = lpNext(li->subject->ptr, li->lpi);
+            else
+                li->lpi = lpPrev(li->subject->ptr, li->lpi);
+            return 1;
+        }
+    } else if (li->encoding == CACHE_ENCODING_QUICKLIST) {
+        return li->iter != NULL && quicklistNext(li->iter, &entry->entry);
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+    return 0;
+}
+
+cobj *listTypeGet(listTypeEntry *entry) {
+    listTypeIterator *li = entry->li;
+    cobj *value = NULL;
+
+    if (li->encoding == CACHE_ENCODING_LISTPACK) {
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+        cacheAssert(entry->lpi != NULL);
+        if (lpGet(entry->lpi, &vstr, &vlen, &vlong)) {
+            if (vstr)
+                value = createStringObject((char *) vstr, vlen);
+            else
+                value = createStringObjectFromLongLong(vlong);
+        }
+    } else if (li->encoding == CACHE_ENCODING_QUICKLIST) {
+        if (entry->entry.value)
+            value = createStringObject((char *) entry->entry.value, entry->entry.sz);
+        else
+            value = createStringObjectFromLongLong(entry->entry.longval);
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+    return value;
+}
+
+void listTypeInsert(listTypeEntry *entry, cobj *value, int where) {
+    cobj *subject = entry->li->subject;
+
+    value = getDecodedObject(value);
+    if (entry->li->encoding == CACHE_ENCODING_LISTPACK) {
+        subject->ptr = lpInsert(subject->ptr, (unsigned char *) value->ptr,
+                                sdsLen(value->ptr), entry->lpi,
+                                (where == CACHE_TAIL) ? LP_AFTER : LP_BEFORE, NULL);
+    } else if (entry->li->encoding == CACHE_ENCODING_QUICKLIST) {
+        if (where == CACHE_TAIL)
+            quicklistInsertAfter(subject->ptr, &entry->entry, value->ptr,
+                                 sdsLen(value->ptr));
+        else
+            quicklistInsertBefore(subject->ptr, &entry->entry, value->ptr,
+                                  sdsLen(value->ptr));
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+    decrRefCount(value);
+}
+
+/* Deletes the entry listTypeNext just returned, the iterator goes on with
+ * the one after it. */
+void listTypeDelete(listTypeEntry *entry) {
+    listTypeIterator *li = entry->li;
+
+    if (li->encoding == CACHE_ENCODING_LISTPACK) {
+        unsigned char *p = entry->lpi;
+        li->subject->ptr = lpDelete(li->subject->ptr, p, &p);
+        if (li->direction == CACHE_TAIL)
+            li->lpi = p;
+        else if (p)
+            li->lpi = lpPrev(li->subject->ptr, p);
+        else
+            li->lpi = lpLast(li->subject->ptr);
+    } else if (li->encoding == CACHE_ENCODING_QUICKLIST) {
+        quicklistDelEntry(li->iter, &entry->entry);
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+}
+
+int listTypeEqual(listTypeEntry *entry, cobj *o) {
+    cacheAssertWithInfo(NULL, o, sdsEncodedObject(o));
+    if (entry->li->encoding == CACHE_ENCODING_LISTPACK) {
+        return lpCompare(entry->lpi, o->ptr, sdsLen(o->ptr));
+    } else if (entry->li->encoding == CACHE_ENCODING_QUICKLIST) {
+        return quicklistCompare(entry->entry.zi, o->ptr, sdsLen(o->ptr));
+    } else {
+        cachePanic("Unknown list encoding");
+    }
+}
+
+void listTypeConvert(cobj *subject, int enc) {
+    cacheAssertWithInfo(NULL, subject, subject->type == CACHE_LIST);
+    cacheAssertWithInfo(NULL, subject, subject->encoding == CACHE_ENCODING_LISTPACK);
+
+    if (enc == CACHE_ENCODING_QUICKLIST) {
+        subject->ptr = quicklistCreateFromListpack(server.list_max_ziplist_size,
+                                                   server.list_compress_depth,
+                                                   subject->ptr);
+        subject->encoding = CACHE_ENCODING_QUICKLIST;
+    } else {
+        cachePanic("Unsupported list conversion");
+    }
+}
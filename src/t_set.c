@@ -0,0 +1,1204 @@
+#include "cache.h"
+
+/* Sets of integers start as an intset and move to a roaring set once they
+ * outgrow set_max_intset_entries, sets with any other member are a hash
+ * table of objects. SINTER, SUNION and SDIFF of roaring sets run on the
+ * containers directly, without an object per member. */
+
+#define CACHE_OP_UNION 0
+#define CACHE_OP_DIFF 1
+#define CACHE_OP_INTER 2
+
+void sunionDiffGenericCommand(cacheClient *c, cobj **setkeys, int setnum,
+                              cobj *dstkey, int op);
+
+cobj *setTypeCreate(cobj *value) {
+    if (isObjectRepresentableAsLongLong(value, NULL) == CACHE_OK)
+        return createIntsetObject();
+    return createSetObject();
+}
+
+/* Roaring sets pay off when members share containers: a container of one
+ * member costs about 40 bytes, and every new container is inserted into a
+ * sorted array. Sets averaging fewer than SET_ROARING_MIN_DENSITY members
+ * per 65536 wide range become a hash table instead, both when they leave
+ * the intset encoding and when adds spread a roaring set out. An add only
+ * converts sets of up to SET_ROARING_MAX_CONVERT members, a bounded number
+ * of object allocations: a bigger sparse set stays roaring, still smaller
+ * than a hash table, rather than stall the server on one SADD. */
+#define SET_ROARING_MIN_DENSITY 4
+#define SET_ROARING_MAX_CONVERT 8192
+
+static int intsetIsClustered(intset *is) {
+    uint32_t j, len = intsetLen(is), containers = 0;
+    int64_t v, last = 0;
+
+    for (j = 0; j < len; j++) {
+        intsetGet(is, j, &v);
+        if (j == 0 || (v >> 16) != last) containers++;
+        last = v >> 16;
+    }
+    return (uint64_t) containers * SET_ROARING_MIN_DENSITY <= len;
+}
+
+int setTypeAdd(cobj *subject, cobj *value) {
+    long long llval;
+    if (subject->encoding == CACHE_ENCODING_HT) {
+        if (dictAdd(subject->ptr, value, NULL) == DICT_OK) {
+            incrRefCount(value);
+            return 1;
+        }
+    } else if (subject->encoding == CACHE_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value, &llval) == CACHE_OK) {
+            uint8_t success = 0;
+            subject->ptr = intsetAdd(subject->ptr, llval, &success);
+            if (success) {
+                if (intsetLen(subject->ptr) > server.set_max_intset_entries)
+                    setTypeConvert(subject, intsetIsClustered(subject->ptr)
+                                                ? CACHE_ENCODING_ROARING
+                                                : CACHE_ENCODING_HT);
+                return 1;
+            }
+        } else {
+            setTypeConvert(subject, CACHE_ENCODING_HT);
+            cacheAssertWithInfo(NULL, value, dictAdd(subject->ptr, value, NULL) == DICT_OK);
+            incrRefCount(value);
+            return 1;
+        }
+    } else if (subject->encoding == CACHE_ENCODING_ROARING) {
+        if (isObjectRepresentableAsLongLong(value, &llval) == CACHE_OK) {
+            roaring *r = subject->ptr;
+            uint32_t containers = r->len;
+            if (!roaringAdd(r, llval)) return 0;
+            /* A member opening a container of its own can leave the set
+             * too sparse to stay roaring. */
+            if (r->len > containers && roaringCard(r) <= SET_ROARING_MAX_CONVERT &&
+                (uint64_t) r->len * SET_ROARING_MIN_DENSITY > roaringCard(r))
+                setTypeConvert(subject, CACHE_ENCODING_HT);
+            return 1;
+        }
+        setTypeConvert(subject, CACHE_ENCODING_HT);
+        cacheAssertWithInfo(NULL, value, dictAdd(subject->ptr, value, NULL) == DICT_OK);
+        incrRefCount(value);
+        return 1;
+    } else {
+        cachePanic("Unknown set encoding");
+    }
+    return 0;
+}
+
+int setTypeRemove(cobj *setobj, cobj *value) {
+    long long llval;
+    if (setobj->encoding == CACHE_ENCODING_HT) {
+        if (dictDelete(setobj->ptr, value) == DICT_OK) {
+            if (htNeedsResize(setobj->ptr)) dictResize(setobj->ptr);
+            return 1;
+        }
+    } else if (setobj->encoding == CACHE_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value, &llval) == CACHE_OK) {
+            int success;
+            setobj->ptr = intsetRemove(setobj->ptr, llval, &success);
+            if (success) return 1;
+        }
+    } else if (setobj->encoding == CACHE_ENCODING_ROARING) {
+        if (isObjectRepresentableAsLongLong(value, &llval) == CACHE_OK)
+            return roaringRemove(setobj->ptr, llval);
+    } else {
+        cachePanic("Unknown set encoding");
+    }
+    return 0;
+}
+
+int setTypeIsMember(cobj *set, cobj *value) {
+    long long llval;
+    if (set->encoding == CACHE_ENCODING_HT) {
+        return dictFind((Dict *) set->ptr, value) != NULL;
+    } else if (set->encoding == CACHE_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value, &llval) == CACHE_OK)
+            return insertFind((intset *) set->ptr, llval);
+    } else if (set->encoding == CACHE_ENCODING_ROARING) {
+        if (isObjectRepresentableAsLongLong(value, &llval) == CACHE_OK)
+            return roaringContains(set->ptr, llval);
+    } else {
+        cachePanic("Unknown set encoding");
+    }
+    return 0;
+}
+
+setTypeIterator *setTypeInitIterator(cobj *subject) {
+    setTypeIterator *si = zmalloc(sizeof(setTypeIterator));
+    si->subject = subject;
+    si->encoding = subject->encoding;
+    if (si->encoding == CACHE_ENCODING_HT) {
+        si->di = dictGetIterator(subject->ptr);
+    } else if (si->encoding == CACHE_ENCODING_INTSET) {
+        si->ii = 0;
+    } else if (si->encoding == CACHE_ENCODING_ROARING) {
+        roaringInitIterator(&si->ri, subject->ptr);
+    } else {
+        cachePanic("Unknown set encoding");
+    }
+    return si;
+}
+
+void setTypeReleaseIterator(setTypeIterator *si) {
+    if (si->encoding == CACHE_ENCODING_HT)
+        dictReleaseIterator(si->di);
+    zfree(si);
+}
+
+/* Moves to the next member and returns the encoding of the set: for
+ * CACHE_ENCODING_HT the member is stored in *objele, without incrementing
+ * its refcount, for the integer encodings in *llele. Returns -1 once the
+ * set is exhausted. */
+int setTypeNext(setTypeIterator *si, cobj **objele, int64_t *llele) {
+    if (si->encoding == CACHE_ENCODING_HT) {
+        DictEntry *de = dictNext(si->di);
+        if (de == NULL) return -1;
+        *objele = dictGetKey(de);
+    } else if (si->encoding == CACHE_ENCODING_INTSET) {
+        if (!intsetGet(si->subject->ptr, si->ii++, llele))
+            return -1;
+    } else if (si->encoding == CACHE_ENCODING_ROARING) {
+        if (!roaringNext(&si->ri, llele))
+            return -1;
+    }
+    return si->encoding;
+}
+
+/* setTypeNext returning a new object the caller has to release, NULL at
+ * the end. */
+cobj *setTypeNextObject(setTypeIterator *si) {
+    int64_t intele;
+    cobj *objele;
+    int encoding;
+
+    encoding = setTypeNext(si, &objele, &intele);
+    switch (encoding) {
+        case -1:
+            return NULL;
+        case CACHE_ENCODING_INTSET:
+        case CACHE_ENCODING_ROARING:
+            return createStringObjectFromLongLong(intele);
+        case CACHE_ENCODING_HT:
+            incrRefCount(objele);
+            return objele;
+        default:
+            cachePanic("Unsupported encoding");
+    }
+    return NULL;
+}
+
+/* A random member, stored and returned like setTypeNext does. */
+int setTypeRandomElement(cobj *setobj, cobj **objele, int64_t *llele) {
+    if (setobj->encoding == CACHE_ENCODING_HT) {
+        DictEntry *de = dictGetRandomKey(setobj->ptr);
+        *objele = dictGetKey(de);
+    } else if (setobj->encoding == CACHE_ENCODING_INTSET) {
+        *llele = insertRandom(setobj->ptr);
+    } else if (setobj->encoding == CACHE_ENCODING_ROARING) {
+        *llele = roaringRandom(setobj->ptr);
+    } else {
+        cachePanic("Unknown set encoding");
+    }
+    return setobj->encoding;
+}
+
+unsigned long setTypeSize(cobj *subject) {
+    if (subject->encoding == CACHE_ENCODING_HT) {
+        return dictSize((Dict *) subject->ptr);
+    } else if (subject->encoding == CACHE_ENCODING_INTSET) {
+        return intsetLen((intset *) subject->ptr);
+    } else if (subject->encoding == CACHE_ENCODING_ROARING) {
+        return roaringCard(subject->ptr);
+    } else {
+        cachePanic("Unknown set encoding");
+    }
+}
+
+/* Converts an intset to a roaring set or a hash table, a roaring set to a
+ * hash table. */
+void setTypeConvert(cobj *setobj, int enc) {
+    setTypeIterator *si;
+    int64_t intele;
+    cacheAssertWithInfo(NULL, setobj, setobj->type == CACHE_SET &&
+                                      (setobj->encoding == CACHE_ENCODING_INTSET ||
+                                       setobj->encoding == CACHE_ENCODING_ROARING));
+
+    if (enc == CACHE_ENCODING_HT) {
+        Dict *d = dictCreate(&setDictType, NULL);
+        cobj *element;
+
+        dictExpand(d, setTypeSize(setobj));
+        si = setTypeInitIterator(setobj);
+        while (setTypeNext(si, NULL, &intele) != -1) {
+            element = createStringObjectFromLongLong(intele);
+            cacheAssertWithInfo(NULL, element, dictAdd(d, element, NULL) == DICT_OK);
+        }
+        setTypeReleaseIterator(si);
+
+        freeSetObject(setobj);
+        setobj->encoding = CACHE_ENCODING_HT;
+        setobj->ptr = d;
+    } else if (enc == CACHE_ENCODING_ROARING &&
+               setobj->encoding == CACHE_ENCODING_INTSET) {
+        roaring *r = roaringNew();
+
+        si = setTypeInitIterator(setobj);
+        while (setTypeNext(si, NULL, &intele) != -1)
+            roaringAdd(r, intele);
+        setTypeReleaseIterator(si);
+
+        freeSetObject(setobj);
+        setobj->encoding = CACHE_ENCODING_ROARING;
+        setobj->ptr = r;
+    } else {
+        cachePanic("Unsupported set conversion");
+    }
+}
+
+/* An intset copy of a roaring set, for the code that only knows the older
+ * encodings: SSCAN, and rdbSaveObject(), which has to save a roaring set
+ * as CACHE_RDB_TYPE_SET_INTSET since the RDB format has no roaring type. */
+cobj *setTypeRoaringToIntset(cobj *setobj) {
+    cobj *o = createIntsetObject();
+    roaringIterator ri;
+    int64_t intele;
+    uint8_t success;
+
+    roaringInitIterator(&ri, setobj->ptr);
+    while (roaringNext(&ri, &intele))
+        o->ptr = intsetAdd(o->ptr, intele, &success);
+    return o;
+}
+
+/* The set object holding the result of a roaring operation: an intset
+ * when it is small enough to be one, a hash table when it is too sparse
+ * for a roaring set. Takes ownership of r. */
+static cobj *setTypeFromRoaring(roaring *r) {
+    cobj *o;
+
+    if (roaringCard(r) <= server.set_max_intset_entries) {
+        roaringIterator ri;
+        int64_t intele;
+
+        o = createIntsetObject();
+        roaringInitIterator(&ri, r);
+        while (roaringNext(&ri, &intele))
+            o->ptr = intsetAdd(o->ptr, intele, NULL);
+        roaringFree(r);
+        return o;
+    }
+    if ((uint64_t) r->len * SET_ROARING_MIN_DENSITY > roaringCard(r)) {
+        roaringIterator ri;
+        int64_t intele;
+
+        o = createSetObject();
+        dictExpand(o->ptr, roaringCard(r));
+        roaringInitIterator(&ri, r);
+        while (roaringNext(&ri, &intele))
+            dictAdd(o->ptr, createStringObjectFromLongLong(intele), NULL);
+        roaringFree(r);
+        return o;
+    }
+    o = createObject(CACHE_SET, r);
+    o->encoding = CACHE_ENCODING_ROARING;
+    return o;
+}
+
+void saddCommand(cacheClient *c) {
+    cobj *set;
+    int j, added = 0;
+
+    set = lookupKeyWrite(c->db, c->argv[1]);
+    if (set == NULL) {
+        set = setTypeCreate(c->argv[2]);
+        dbAdd(c->db, c->argv[1], set);
+    } else {
+        if (set->type != CACHE_SET) {
+            addReply(c, shared.wrongtypeerr);
+            return;
+        }
+        snapshotTouchKey(c->db, c->argv[1]);
+    }
+
+    for (j = 2; j < c->argc; j++) {
+        c->argv[j] = tryObjectEncoding(c->argv[j]);
+        if (setTypeAdd(set, c->argv[j])) added++;
+    }
+    if (added) {
+        signalModifiedKey(c->db, c->argv[1]);
+        notifyKeyspaceEvent(CACHE_NOTIFY_SET, "sadd", c->argv[1], c->db->id);
+    }
+    server.dirty += added;
+    addReplyLongLong(c, added);
+}
+
+void sremCommand(cacheClient *c) {
+    cobj *set;
+    int j, deleted = 0, keyremoved = 0;
+
+    if ((set = lookupKeyWriteOrReply(c, c->argv[1], shared.czero)) == NULL ||
+        checkType(c, set, CACHE_SET))
+        return;
+    snapshotTouchKey(c->db, c->argv[1]);
+
+    for (j = 2; j < c->argc; j++) {
+        if (setTypeRemove(set, c->argv[j])) {
+            deleted++;
+            if (setTypeSize(set) == 0) {
+                dbDelete(c->db, c->argv[1]);
+                keyremoved = 1;
+                break;
+            }
+        }
+    }
+    if (deleted) {
+        signalModifiedKey(c->db, c->argv[1]);
+        notifyKeyspaceEvent(CACHE_NOTIFY_SET, "srem", c->argv[1], c->db->id);
+        if (keyremoved)
+            notifyKeyspaceEvent(CACHE_NOTIFY_GENERIC, "del", c->argv[1],
+                                c->db->id);
+        server.dirty += deleted;
+    }
+    addReplyLongLong(c, deleted);
+}
+
+void smoveCommand(cacheClient *c) {
+    cobj *srcset, *dstset, *ele;
+    srcset = lookupKeyWrite(c->db, c->argv[1]);
+    dstset = lookupKeyWrite(c->db, c->argv[2]);
+    ele = c->argv[3] = tryObjectEncoding(c->argv[3]);
+
+    /* If the source key does not exist return 0 */
+    if (srcset == NULL) {
+        addReply(c, shared.czero);
+        return;
+    }
+
+    if (checkType(c, srcset, CACHE_SET) ||
+        (dstset && checkType(c, dstset, CACHE_SET)))
+        return;
+
+    /* If srcset and dstset are equal, SMOVE is a no-op */
+    if (srcset == dstset) {
+        addReply(c, setTypeIsMember(srcset, ele) ? shared.cone : shared.czero);
+        return;
+    }
+
+    snapshotTouchKey(c->db, c->argv[1]);
+    if (dstset) snapshotTouchKey(c->db, c->argv[2]);
+
+    /* If the element cannot be removed from the src set, return 0. */
+    if (!setTypeRemove(srcset, ele)) {
+        addReply(c, shared.czero);
+        return;
+    }
+    notifyKeyspaceEvent(CACHE_NOTIFY_SET, "srem", c->argv[1], c->db->id);
+
+    /* Remove the src set from the database when empty */
+    if (setTypeSize(srcset) == 0) {
+        dbDelete(c->db, c->argv[1]);
+        notifyKeyspaceEvent(CACHE_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
+    }
+    signalModifiedKey(c->db, c->argv[1]);
+    signalModifiedKey(c->db, c->argv[2]);
+    server.dirty++;
+
+    /* Create the destination set when it doesn't exist */
+    if (!dstset) {
+        dstset = setTypeCreate(ele);
+        dbAdd(c->db, c->argv[2], dstset);
+    }
+
+    /* An extra key has changed when ele was successfully added to dstset */
+    if (setTypeAdd(dstset, ele)) {
+        server.dirty++;
+        notifyKeyspaceEvent(CACHE_NOTIFY_SET, "sadd", c->argv[2], c->db->id);
+    }
+    addReply(c, shared.cone);
+}
+
+void sismemberCommand(cacheClient *c) {
+    cobj *set;
+
+    if ((set = lookupKeyReadOrReply(c, c->argv[1], shared.czero)) == NULL ||
+        checkType(c, set, CACHE_SET))
+        return;
+
+    c->argv[2] = tryObjectEncoding(c->argv[2]);
+    if (setTypeIsMember(set, c->argv[2]))
+        addReply(c, shared.cone);
+    else
+        addReply(c, shared.czero);
+}
+
+void scardCommand(cacheClient *c) {
+    cobj *o;
+
+    if ((o = lookupKeyReadOrReply(c, c->argv[1], shared.czero)) == NULL ||
+        checkType(c, o, CACHE_SET))
+        return;
+
+    addReplyLongLong(c, setTypeSize(o));
+}
+
+void spopCommand(cacheClient *c) {
+    cobj *set, *ele, *aux;
+    int64_t llele;
+    int encoding;
+
+    if ((set = lookupKeyWriteOrReply(c, c->argv[1], shared.nullbulk)) == NULL ||
+        checkType(c, set, CACHE_SET))
+        return;
+    snapshotTouchKey(c->db, c->argv[1]);
+
+    encoding = setTypeRandomElement(set, &ele, &llele);
+    if (encoding == CACHE_ENCODING_INTSET) {
+        ele = createStringObjectFromLongLong(llele);
+        set->ptr = intsetRemove(set->ptr, llele, NULL);
+    } else if (encoding == CACHE_ENCODING_ROARING) {
+        ele = createStringObjectFromLongLong(llele);
+        roaringRemove(set->ptr, llele);
+    } else {
+        incrRefCount(ele);
+        setTypeRemove(set, ele);
+    }
+    notifyKeyspaceEvent(CACHE_NOTIFY_SET, "spop", c->argv[1], c->db->id);
+
+    /* Replicate/AOF this command as an SREM operation */
+    aux = createStringObject("SREM", 4);
+    rewriteClientCommandVector(c, 3, aux, c->argv[1], ele);
+    decrRefCount(ele);
+    decrRefCount(aux);
+
+    addReplyBulk(c, ele);
+    if (setTypeSize(set) == 0) {
+        dbDelete(c->db, c->argv[1]);
+        notifyKeyspaceEvent(CACHE_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
+    }
+    signalModifiedKey(c->db, c->argv[1]);
+    server.dirty++;
+}
+
+/* Past this count * SRANDMEMBER_SUB_STRATEGY_MUL > size the set is copied
+ * and members are removed from the copy, instead of adding random members
+ * to an empty one until it has count. */
+#define SRANDMEMBER_SUB_STRATEGY_MUL 3
+
+void srandmemberWithCountCommand(cacheClient *c) {
+    long l;
+    unsigned long count, size;
+    int uniq = 1;
+    cobj *set, *ele;
+    int64_t llele;
+    int encoding;
+
+    Dict *d;
+
+    if (getLongFromObjectOrReply(c, c->argv[2], &l, NULL) != CACHE_OK) return;
+    if (l >= 0) {
+        count = (unsigned) l;
+    } else {
+        /* A negative count means: return the same elements multiple times
+         * (i.e. don't remove the extracted element after every extraction). */
+        count = -l;
+        uniq = 0;
+    }
+
+    if ((set = lookupKeyReadOrReply(c, c->argv[1], shared.emptymultibulk)) == NULL ||
+        checkType(c, set, CACHE_SET))
+        return;
+    size = setTypeSize(set);
+
+    /* If count is zero, serve it ASAP to avoid special cases later. */
+    if (count == 0) {
+        addReply(c, shared.emptymultibulk);
+        return;
+    }
+
+    /* CASE 1: The count was negative, so the extraction method is just:
+     * "return N random elements" sampling the whole set every time. */
+    if (!uniq) {
+        addReplyMultiBulkLen(c, count);
+        while (count--) {
+            encoding = setTypeRandomElement(set, &ele, &llele);
+            if (encoding == CACHE_ENCODING_HT)
+                addReplyBulk(c, ele);
+            else
+                addReplyBulkLongLong(c, llele);
+        }
+        return;
+    }
+
+    /* CASE 2: The count is greater than the number of elements inside the
+     * set, simply return the whole set. */
+    if (count >= size) {
+        sunionDiffGenericCommand(c, c->argv + 1, 1, NULL, CACHE_OP_UNION);
+        return;
+    }
+
+    /* For CASE 3 and CASE 4 we need an auxiliary dictionary. */
+    d = dictCreate(&setDictType, NULL);
+
+    /* CASE 3: The number of elements inside the set is not greater than
+     * SRANDMEMBER_SUB_STRATEGY_MUL times the number of requested elements:
+     * copy the set and remove random elements until count is reached. */
+    if (count * SRANDMEMBER_SUB_STRATEGY_MUL > size) {
+        setTypeIterator *si;
+
+        si = setTypeInitIterator(set);
+        while ((encoding = setTypeNext(si, &ele, &llele)) != -1) {
+            int retval = DCIT_ERR;
+
+            if (encoding == CACHE_ENCODING_HT) {
+                retval = dictAdd(d, dupStringObject(ele), NULL);
+            } else {
+                retval = dictAdd(d, createStringObjectFromLongLong(llele), NULL);
+            }
+            cacheAssert(retval == DICT_OK);
+        }
+        setTypeReleaseIterator(si);
+        cacheAssert(dictSize(d) == size);
+
+        while (size > count) {
+            DictEntry *de;
+
+            de = dictGetRandomKey(d);
+            dictDelete(d, dictGetKey(de));
+            size--;
+        }
+    }
+
+    /* CASE 4: We have a big set compared to the requested number of elements:
+     * get random elements from the set and add them to the temporary set
+     * until the requested number is reached. */
+    else {
+        unsigned long added = 0;
+
+        while (added < count) {
+            encoding = setTypeRandomElement(set, &ele, &llele);
+            if (encoding == CACHE_ENCODING_HT) {
+                ele = dupStringObject(ele);
+            } else {
+                ele = createStringObjectFromLongLong(llele);
+            }
+            /* Try to add the object to the dictionary. If it already exists
+             * free it, otherwise increment the number of objects we have
+             * in the result dictionary. */
+            if (dictAdd(d, ele, NULL) == DICT_OK)
+                added++;
+            else
+                decrRefCount(ele);
+        }
+    }
+
+    /* CASE 3 & 4: send the result to the user. */
+    {
+        DictIterator *di;
+        DictEntry *de;
+
+        addReplyMultiBulkLen(c, count);
+        di = dictGetIterator(d);
+        while ((de = dictNext(di)) != NULL)
+            addReplyBulk(c, dictGetKey(de));
+        dictReleaseIterator(di);
+        dictRelease(d);
+    }
+}
+
+void srandmemberCommand(cacheClient *c) {
+    cobj *set, *ele;
+    int64_t llele;
+    int encoding;
+
+    if (c->argc == 3) {
+        srandmemberWithCountCommand(c);
+        return;
+    } else if (c->argc > 3) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+
+    if ((set = lookupKeyReadOrReply(c, c->argv[1], shared.nullbulk)) == NULL ||
+        checkType(c, set, CACHE_SET))
+        return;
+
+    encoding = setTypeRandomElement(set, &ele, &llele);
+    if (encoding == CACHE_ENCODING_HT) {
+        addReplyBulk(c, ele);
+    } else {
+        addReplyBulkLongLong(c, llele);
+    }
+}
+
+int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
+    unsigned long first = setTypeSize(*(cobj **) s1);
+    unsigned long second = setTypeSize(*(cobj **) s2);
+    return (first > second) - (first < second);
+}
+
+/* This is used by SDIFF and in this case we can receive NULL that should
+ * be handled as empty sets. */
+int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
+    cobj *o1 = *(cobj **) s1, *o2 = *(cobj **) s2;
+    unsigned long first = o1 ? setTypeSize(o1) : 0;
+    unsigned long second = o2 ? setTypeSize(o2) : 0;
+    return (second > first) - (second < first);
+}
+
+/* Scratch space of the set operations, kept between commands so that
+ * SINTER and friends do not allocate on every call. Buffers grown past
+ * SETOP_BUFFER_KEEP members are released once the command is done. */
+#define SETOP_BUFFER_KEEP 65536
+#define SETOP_BATCH 16
+
+static struct {
+    int64_t *v;
+    size_t alloc;
+} setop_buffers[3];
+
+static int64_t *setOpBuffer(int i, size_t n) {
+    if (n == 0) n = 1;
+    if (setop_buffers[i].alloc < n) {
+        zfree(setop_buffers[i].v);
+        setop_buffers[i].v = zmalloc(sizeof(int64_t) * n);
+        setop_buffers[i].alloc = n;
+    }
+    return setop_buffers[i].v;
+}
+
+static void setOpTrimBuffers(void) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (setop_buffers[i].alloc > SETOP_BUFFER_KEEP) {
+            zfree(setop_buffers[i].v);
+            setop_buffers[i].v = NULL;
+            setop_buffers[i].alloc = 0;
+        }
+    }
+}
+
+/* Decodes an intset or roaring set, sorted, into v. */
+static uint32_t setOpDecode(cobj *set, int64_t *v) {
+    if (set->encoding == CACHE_ENCODING_INTSET) {
+        intsetDecode(set->ptr, v);
+        return intsetLen(set->ptr);
+    } else {
+        roaringIterator ri;
+        uint32_t n = 0;
+
+        roaringInitIterator(&ri, set->ptr);
+        while (roaringNext(&ri, &v[n])) n++;
+        return n;
+    }
+}
+
+/* Keeps the members of the sorted run v[0..n) that are (keep = 1) or are
+ * not (keep = 0) in set and returns how many are left. Hash tables are
+ * probed SETOP_BATCH members at a time with integer objects on the stack. */
+static uint32_t setOpFilter(cobj *set, int64_t *v, uint32_t n, int keep) {
+    cobj objs[SETOP_BATCH];
+    const void *keys[SETOP_BATCH];
+    DictEntry *des[SETOP_BATCH];
+    uint32_t i, j, k = 0, batch;
+
+    if (set->encoding == CACHE_ENCODING_INTSET)
+        return intsetFilterSorted(set->ptr, v, n, keep);
+    if (set->encoding == CACHE_ENCODING_ROARING)
+        return roaringFilterSorted(set->ptr, v, n, keep);
+
+    for (i = 0; i < n; i += batch) {
+        batch = n - i < SETOP_BATCH ? n - i : SETOP_BATCH;
+        for (j = 0; j < batch; j++) {
+            objs[j].type = CACHE_STRING;
+            objs[j].encoding = CACHE_ENCODING_INT;
+            objs[j].refcount = 1;
+            objs[j].ptr = (void *) (long) v[i + j];
+            keys[j] = &objs[j];
+        }
+        dictFindBatch(set->ptr, keys, batch, des);
+        for (j = 0; j < batch; j++) {
+            v[k] = v[i + j];
+            k += (des[j] != NULL) == keep;
+        }
+    }
+    return k;
+}
+
+/* Merges the sorted runs a and b, without duplicates, into out. */
+static uint32_t setOpMerge(const int64_t *a, uint32_t na, const int64_t *b,
+                           uint32_t nb, int64_t *out) {
+    uint32_t i = 0, j = 0, k = 0;
+
+    while (i < na && j < nb) {
+        int64_t x = a[i], y = b[j];
+        out[k++] = x < y ? x : y;
+        i += x <= y;
+        j += y <= x;
+    }
+    while (i < na) out[k++] = a[i++];
+    while (j < nb) out[k++] = b[j++];
+    return k;
+}
+
+/* Keeps the members of eles[0..n), n up to SETOP_BATCH, that are in set,
+ * batching the probes of a hash table set. */
+static uint32_t setOpFilterObjects(cobj *set, cobj **eles, uint32_t n) {
+    DictEntry *des[SETOP_BATCH];
+    uint32_t j, k = 0;
+
+    if (set->encoding == CACHE_ENCODING_HT) {
+        dictFindBatch(set->ptr, (const void **) eles, n, des);
+        for (j = 0; j < n; j++) {
+            eles[k] = eles[j];
+            k += des[j] != NULL;
+        }
+        return k;
+    }
+    for (j = 0; j < n; j++) {
+        if (setTypeIsMember(set, eles[j])) eles[k++] = eles[j];
+    }
+    return k;
+}
+
+/* Stores dstset, the result of a set operation, into dstkey and replies
+ * with its size. An empty result deletes dstkey. */
+static void setOpStore(cacheClient *c, cobj *dstkey, cobj *dstset,
+                       char *event) {
+    int deleted = dbDelete(c->db, dstkey);
+    if (setTypeSize(dstset) > 0) {
+        dbAdd(c->db, dstkey, dstset);
+        addReplyLongLong(c, setTypeSize(dstset));
+        notifyKeyspaceEvent(CACHE_NOTIFY_SET, event, dstkey, c->db->id);
+    } else {
+        decrRefCount(dstset);
+        addReply(c, shared.czero);
+        if (deleted)
+            notifyKeyspaceEvent(CACHE_NOTIFY_GENERIC, "del", dstkey,
+                                c->db->id);
+    }
+    signalModifiedKey(c->db, dstkey);
+    server.dirty++;
+}
+
+/* Replies with, or stores into dstkey, the result of a set operation on
+ * roaring sets. Takes ownership of r. */
+static void setReplyOrStoreRoaring(cacheClient *c, roaring *r, cobj *dstkey,
+                                   char *event) {
+    if (!dstkey) {
+        roaringIterator ri;
+        int64_t intele;
+
+        addReplyMultiBulkLen(c, roaringCard(r));
+        roaringInitIterator(&ri, r);
+        while (roaringNext(&ri, &intele))
+            addReplyBulkLongLong(c, intele);
+        roaringFree(r);
+    } else {
+        setOpStore(c, dstkey, setTypeFromRoaring(r), event);
+    }
+}
+
+/* Same for a sorted run of integers: the destination set is built straight
+ * from v, without an object per member. */
+static void setReplyOrStoreInts(cacheClient *c, int64_t *v, uint32_t n,
+                                cobj *dstkey, char *event) {
+    uint32_t j;
+
+    if (!dstkey) {
+        addReplyMultiBulkLen(c, n);
+        for (j = 0; j < n; j++)
+            addReplyBulkLongLong(c, v[j]);
+    } else if (n <= server.set_max_intset_entries) {
+        cobj *dstset = createIntsetObject();
+        for (j = 0; j < n; j++)
+            dstset->ptr = intsetAdd(dstset->ptr, v[j], NULL);
+        setOpStore(c, dstkey, dstset, event);
+    } else {
+        roaring *r = roaringNew();
+        for (j = 0; j < n; j++)
+            roaringAdd(r, v[j]);
+        setOpStore(c, dstkey, setTypeFromRoaring(r), event);
+    }
+}
+
+/* Whether sets[0..setnum) are all roaring sets, NULL entries (missing
+ * keys) aside. */
+static int setsAreRoaring(cobj **sets, unsigned long setnum) {
+    unsigned long j;
+    for (j = 0; j < setnum; j++)
+        if (sets[j] && sets[j]->encoding != CACHE_ENCODING_ROARING) return 0;
+    return 1;
+}
+
+void sinterGenericCommand(cacheClient *c, cobj **setkeys, unsigned long setnum,
+                          cobj *dstkey) {
+    cobj **sets = zmalloc(sizeof(cobj *) * setnum);
+    cobj *eles[SETOP_BATCH], *dstset = NULL;
+    setTypeIterator *si;
+    int64_t intobj;
+    void *replylen = NULL;
+    unsigned long j, cardinality = 0;
+    uint32_t batch, n, k;
+
+    for (j = 0; j < setnum; j++) {
+        cobj *setobj = dstkey ? lookupKeyWrite(c->db, setkeys[j])
+                              : lookupKeyRead(c->db, setkeys[j]);
+        if (!setobj) {
+            zfree(sets);
+            if (dstkey) {
+                if (dbDelete(c->db, dstkey)) {
+                    signalModifiedKey(c->db, dstkey);
+                    server.dirty++;
+                }
+                addReply(c, shared.czero);
+            } else {
+                addReply(c, shared.emptymultibulk);
+            }
+            return;
+        }
+        if (checkType(c, setobj, CACHE_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+    }
+    /* Sort sets from the smallest to largest, this will improve our
+     * algorithm's performance */
+    qsort(sets, setnum, sizeof(cobj *), qsortCompareSetsByCardinality);
+
+    /* Roaring sets are intersected container by container, smallest first
+     * so that the intermediate results only shrink. */
+    if (setnum > 1 && setsAreRoaring(sets, setnum)) {
+        roaring *r = roaringAnd(sets[0]->ptr, sets[1]->ptr);
+        for (j = 2; j < setnum && roaringCard(r); j++) {
+            roaring *next = roaringAnd(r, sets[j]->ptr);
+            roaringFree(r);
+            r = next;
+        }
+        setReplyOrStoreRoaring(c, r, dstkey, "sinterstore");
+        zfree(sets);
+        return;
+    }
+
+    /* When the smallest set holds integers it is decoded once and then
+     * narrowed down by every other set in turn: merged or galloped against
+     * intsets and roaring sets, probed in batches against hash tables. */
+    if (sets[0]->encoding != CACHE_ENCODING_HT) {
+        int64_t *v = setOpBuffer(0, setTypeSize(sets[0]));
+
+        n = setOpDecode(sets[0], v);
+        for (j = 1; j < setnum && n; j++) {
+            if (sets[j] != sets[0]) n = setOpFilter(sets[j], v, n, 1);
+        }
+        setReplyOrStoreInts(c, v, n, dstkey, "sinterstore");
+        setOpTrimBuffers();
+        zfree(sets);
+        return;
+    }
+
+    /* The first thing we should output is the total number of elements...
+     * since this is a multi-bulk write, but at this stage we don't know
+     * the intersection set size, so we use a trick, append an empty object
+     * to the output list and save the pointer to later modify it with the
+     * right length */
+    if (!dstkey) {
+        replylen = addDeferredMultiBulkLength(c);
+    } else {
+        /* If we have a target key where to store the resulting set
+         * create this key with an empty set inside */
+        dstset = createIntsetObject();
+    }
+
+    /* Take the members of the first (smallest) set SETOP_BATCH at a time
+     * and drop from the batch the ones missing from any other set. */
+    si = setTypeInitIterator(sets[0]);
+    do {
+        for (batch = 0; batch < SETOP_BATCH; batch++) {
+            if (setTypeNext(si, &eles[batch], &intobj) == -1) break;
+        }
+        n = batch;
+        for (j = 1; j < setnum && n; j++) {
+            if (sets[j] != sets[0]) n = setOpFilterObjects(sets[j], eles, n);
+        }
+        for (k = 0; k < n; k++) {
+            if (!dstkey)
+                addReplyBulk(c, eles[k]);
+            else
+                setTypeAdd(dstset, eles[k]);
+        }
+        cardinality += n;
+    } while (batch == SETOP_BATCH);
+    setTypeReleaseIterator(si);
+
+    if (dstkey) {
+        setOpStore(c, dstkey, dstset, "sinterstore");
+    } else {
+        setDeferredMultiBulkLength(c, replylen, cardinality);
+    }
+    zfree(sets);
+}
+
+void sinterCommand(cacheClient *c) {
+    sinterGenericCommand(c, c->argv + 1, c->argc - 1, NULL);
+}
+
+void sinterstoreCommand(cacheClient *c) {
+    sinterGenericCommand(c, c->argv + 2, c->argc - 2, c->argv[1]);
+}
+
+/* SUNION of integer sets and SDIFF from one, on sorted runs: the union
+ * merges every set into the run built so far, the difference filters the
+ * first set by every other one. Returns 0 when the sets do not qualify. */
+static int sunionDiffIntegers(cacheClient *c, cobj **sets, int setnum,
+                              cobj *dstkey, int op) {
+    int64_t *v, *tmp, *dec, *swap;
+    size_t total = 0, largest = 0;
+    uint32_t n = 0;
+    int j;
+
+    if (op == CACHE_OP_DIFF) {
+        if (!sets[0] || sets[0]->encoding == CACHE_ENCODING_HT) return 0;
+        v = setOpBuffer(0, setTypeSize(sets[0]));
+        n = setOpDecode(sets[0], v);
+        for (j = 1; j < setnum && n; j++) {
+            if (!sets[j]) continue;
+            n = (sets[j] == sets[0]) ? 0 : setOpFilter(sets[j], v, n, 0);
+        }
+        setReplyOrStoreInts(c, v, n, dstkey, "sdiffstore");
+        setOpTrimBuffers();
+        return 1;
+    }
+
+    for (j = 0; j < setnum; j++) {
+        if (!sets[j]) continue;
+        if (sets[j]->encoding == CACHE_ENCODING_HT) return 0;
+        total += setTypeSize(sets[j]);
+        if (setTypeSize(sets[j]) > largest) largest = setTypeSize(sets[j]);
+    }
+    v = setOpBuffer(0, total);
+    tmp = setOpBuffer(1, total);
+    dec = setOpBuffer(2, largest);
+    for (j = 0; j < setnum; j++) {
+        uint32_t m;
+        if (!sets[j]) continue;
+        if (n == 0) {
+            n = setOpDecode(sets[j], v);
+            continue;
+        }
+        m = setOpDecode(sets[j], dec);
+        n = setOpMerge(v, n, dec, m, tmp);
+        swap = v;
+        v = tmp;
+        tmp = swap;
+    }
+    setReplyOrStoreInts(c, v, n, dstkey, "sunionstore");
+    setOpTrimBuffers();
+    return 1;
+}
+
+void sunionDiffGenericCommand(cacheClient *c, cobj **setkeys, int setnum,
+                              cobj *dstkey, int op) {
+    cobj **sets = zmalloc(sizeof(cobj *) * setnum);
+    setTypeIterator *si;
+    cobj *ele, *dstset = NULL;
+    int j, cardinality = 0;
+    int diff_algo = 1;
+
+    for (j = 0; j < setnum; j++) {
+        cobj *setobj = dstkey ? lookupKeyWrite(c->db, setkeys[j])
+                              : lookupKeyRead(c->db, setkeys[j]);
+        if (!setobj) {
+            sets[j] = NULL;
+            continue;
+        }
+        if (checkType(c, setobj, CACHE_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+    }
+
+    /* Unions and differences of roaring sets are done a container at a
+     * time, a missing key being an empty set. */
+    if (setnum > 1 && setsAreRoaring(sets, setnum) &&
+        (op == CACHE_OP_UNION || sets[0])) {
+        roaring *r = NULL;
+        for (j = 0; j < setnum; j++) {
+            roaring *next;
+            if (!sets[j]) continue;
+            if (!r) {
+                r = roaringOr(sets[j]->ptr, sets[j]->ptr);
+                continue;
+            }
+            next = (op == CACHE_OP_UNION) ? roaringOr(r, sets[j]->ptr)
+                                          : roaringAndNot(r, sets[j]->ptr);
+            roaringFree(r);
+            r = next;
+        }
+        if (!r) r = roaringNew();
+        setReplyOrStoreRoaring(c, r, dstkey,
+                               op == CACHE_OP_UNION ? "sunionstore" : "sdiffstore");
+        zfree(sets);
+        return;
+    }
+
+    if (sunionDiffIntegers(c, sets, setnum, dstkey, op)) {
+        zfree(sets);
+        return;
+    }
+
+    /* Select what DIFF algorithm to use.
+     *
+     * Algorithm 1 is O(N*M) where N is the size of the element first set
+     * and M the total number of sets.
+     *
+     * Algorithm 2 is O(N) where N is the total number of elements in all
+     * the sets.
+     *
+     * We compute what is the best bet with the current input here. */
+    if (op == CACHE_OP_DIFF && sets[0]) {
+        long long algo_one_work = 0, algo_two_work = 0;
+
+        for (j = 0; j < setnum; j++) {
+            if (sets[j] == NULL) continue;
+
+            algo_one_work += setTypeSize(sets[0]);
+            algo_two_work += setTypeSize(sets[j]);
+        }
+
+        /* Algorithm 1 has better constant times and performs less operations
+         * if there are elements in common. Give it some advantage. */
+        algo_one_work /= 2;
+        diff_algo = (algo_one_work <= algo_two_work) ? 1 : 2;
+
+        if (diff_algo == 1 && setnum > 1) {
+            /* With algorithm 1 it is better to order the sets to subtract
+             * by decreasing size, so that we are more likely to find
+             * duplicated elements ASAP. */
+            qsort(sets + 1, setnum - 1, sizeof(cobj *),
+                  qsortCompareSetsByRevCardinality);
+        }
+    }
+
+    /* We need a temp set object to store our union. If the dstkey
+     * is not NULL (that is, we are inside an SUNIONSTORE operation) then
+     * this set object will be the resulting object to set into the target key*/
+    dstset = createIntsetObject();
+
+    if (op == CACHE_OP_UNION) {
+        /* Union is trivial, just add every element of every set to the
+         * temporary set. */
+        for (j = 0; j < setnum; j++) {
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+
+            si = setTypeInitIterator(sets[j]);
+            while ((ele = setTypeNextObject(si)) != NULL) {
+                if (setTypeAdd(dstset, ele)) cardinality++;
+                decrRefCount(ele);
+            }
+            setTypeReleaseIterator(si);
+        }
+    } else if (op == CACHE_OP_DIFF && sets[0] && diff_algo == 1) {
+        /* DIFF Algorithm 1:
+         *
+         * We perform the diff by iterating all the elements of the first set,
+         * and only adding it to the target set if the element does not exist
+         * into all the other sets.
+         *
+         * This way we perform at max N*M operations, where N is the size of
+         * the first set, and M the number of sets. */
+        si = setTypeInitIterator(sets[0]);
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            for (j = 1; j < setnum; j++) {
+                if (!sets[j]) continue; /* no key is an empty set. */
+                if (sets[j] == sets[0]) break; /* same set! */
+                if (setTypeIsMember(sets[j], ele)) break;
+            }
+            if (j == setnum) {
+                /* There is no other set with this element. Add it. */
+                setTypeAdd(dstset, ele);
+                cardinality++;
+            }
+            decrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+    } else if (op == CACHE_OP_DIFF && sets[0] && diff_algo == 2) {
+        /* DIFF Algorithm 2:
+         *
+         * Add all the elements of the first set to the auxiliary set.
+         * Then remove all the elements of all the next sets from it.
+         *
+         * This is O(N) where N is the sum of all the elements in every
+         * set. */
+        for (j = 0; j < setnum; j++) {
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+
+            si = setTypeInitIterator(sets[j]);
+            while ((ele = setTypeNextObject(si)) != NULL) {
+                if (j == 0) {
+                    if (setTypeAdd(dstset, ele)) cardinality++;
+                } else {
+                    if (setTypeRemove(dstset, ele)) cardinality--;
+                }
+                decrRefCount(ele);
+            }
+            setTypeReleaseIterator(si);
+
+            /* Exit if result set is empty as any additional removal
+             * of elements will have no effect. */
+            if (cardinality == 0) break;
+        }
+    }
+
+    /* Output the content of the resulting set, if not in STORE mode */
+    if (!dstkey) {
+        addReplyMultiBulkLen(c, cardinality);
+        si = setTypeInitIterator(dstset);
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            addReplyBulk(c, ele);
+            decrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+        decrRefCount(dstset);
+    } else {
+        setOpStore(c, dstkey, dstset,
+                   op == CACHE_OP_UNION ? "sunionstore" : "sdiffstore");
+    }
+    zfree(sets);
+}
+
+void sunionCommand(cacheClient *c) {
+    sunionDiffGenericCommand(c, c->argv + 1, c->argc - 1, NULL, CACHE_OP_UNION);
+}
+
+void sunionstoreCommand(cacheClient *c) {
+    sunionDiffGenericCommand(c, c->argv + 2, c->argc - 2, c->argv[1], CACHE_OP_UNION);
+}
+
+void sdiffCommand(cacheClient *c) {
+    sunionDiffGenericCommand(c, c->argv + 1, c->argc - 1, NULL, CACHE_OP_DIFF);
+}
+
+void sdiffstoreCommand(cacheClient *c) {
+    sunionDiffGenericCommand(c, c->argv + 2, c->argc - 2, c->argv[1], CACHE_OP_DIFF);
+}
+
+void sscanCommand(cacheClient *c) {
+    cobj *set;
+    unsigned long cursor;
+
+    if (parseScanCursorOrReply(c, c->argv[2], &cursor) == CACHE_ERR) return;
+    if ((set = lookupKeyReadOrReply(c, c->argv[1], shared.emptyscan)) == NULL ||
+        checkType(c, set, CACHE_SET))
+        return;
+    /* Like an intset, a roaring set is returned whole, with cursor 0. */
+    if (set->encoding == CACHE_ENCODING_ROARING) {
+        cobj *copy = setTypeRoaringToIntset(set);
+        scanGenericCommand(c, copy, cursor);
+        decrRefCount(copy);
+        return;
+    }
+    scanGenericCommand(c, set, cursor);
+}
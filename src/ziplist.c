@@ -16,8 +16,8 @@
 #define ZIP_END 255
 #define ZIP_BIG_LEN 254
 
-#define ZIP_STR_MASK 0xc0;
-#define ZIP_INT_MASK 0x30;
+#define ZIP_STR_MASK 0xc0
+#define ZIP_INT_MASK 0x30
 #define ZIP_STR_06B (0 << 6)
 #define ZIP_STR_14B (1 << 6)
 #define ZIP_STR_32B (2 << 6)
@@ -92,9 +92,9 @@
   do {                                                                         \
     ZIP_DECODE_PREV_LEN_SIZE(ptr, prev_len_size);                              \
     if ((prev_len_size) == 1) {                                                \
-      (prev_len_size) = (ptr)[0];                                              \
+      (prev_len) = (ptr)[0];                                                   \
     } else if ((prev_len_size) == 5) {                                         \
-      assert(sizeof(prev_len_size) == 4);                                      \
+      assert(sizeof(prev_len) == 4);                                           \
       memcpy(&(prev_len), ((char *)(ptr)) + 1, 4);                             \
       memrev32ifbe(&prev_len);                                                 \
     }                                                                          \
@@ -108,6 +108,8 @@ typedef struct zip_list_entry {
   unsigned char *p;
 } zip_list_entry;
 
+static unsigned int zip_int_size(unsigned char encoding);
+
 static unsigned int zipPrevEncodeLength(unsigned char *p, unsigned int len) {
   if (p == NULL) {
     return (len < ZIP_BIG_LEN) ? 1 : sizeof(len) + 1;
@@ -306,7 +308,7 @@ unsigned char *zipListNew(void) {
 }
 
 static unsigned char *zipListResize(unsigned char *zl, unsigned int len) {
-  zl = zmalloc(zl, len);
+  zl = zre_alloc(zl, len);
   ZIP_LIST_BYTES(zl) = intrev32ifbe(len);
   zl[len - 1] = ZIP_END;
   return zl;
@@ -335,10 +337,10 @@ static unsigned char *__zipListCascadeUpdate(unsigned char *zl,
       extra = raw_len_size - next.prev_raw_len_size;
       zl = zipListResize(zl, cur_len + extra);
       p = zl + offset;
-      np = r + raw_len;
+      np = p + raw_len;
       no_offset = np - zl;
       if ((zl + intrev32ifbe(ZIP_LIST_TAIL_OFFSET(zl))) != np) {
-        ZIP_LIST_TAIL_OFFSET(ZL) =
+        ZIP_LIST_TAIL_OFFSET(zl) =
 
             intrev32ifbe(intrev32ifbe(ZIP_LIST_TAIL_OFFSET(zl)) + extra);
       }
@@ -413,7 +415,7 @@ static unsigned char *__zipListInsert(unsigned char *zl, unsigned char *p,
   unsigned int prev_len_size, prev_len = 0;
 
   size_t offset;
-  int next_diff = 0;
+  int next_diff = 0, force_large = 0;
   unsigned char encoding = 0;
   long long value = 123456789;
   zip_list_entry tail;
@@ -436,12 +438,21 @@ static unsigned char *__zipListInsert(unsigned char *zl, unsigned char *p,
   req_len += zipEncodeLength(NULL, encoding, s_len);
 
   next_diff = (p[0] != ZIP_END) ? zipPrevLenByteDiff(p, req_len) : 0;
+  /* Shrinking the prev_len of the next entry could make the list smaller
+   * than before the insert, so keep it 5 bytes long. */
+  if (next_diff == -4 && req_len < 4) {
+    next_diff = 0;
+    force_large = 1;
+  }
   offset = p - zl;
   zl = zipListResize(zl, cur_len + req_len + next_diff);
   p = zl + offset;
   if (p[0] != ZIP_END) {
     memmove(p + req_len, p - next_diff, cur_len - offset - 1 + next_diff);
-    zipPrevEncodeLength(p + req_len, req_len);
+    if (force_large)
+      zipPrevEncodeLengthForceLarge(p + req_len, req_len);
+    else
+      zipPrevEncodeLength(p + req_len, req_len);
     ZIP_LIST_TAIL_OFFSET(zl) =
 
         intrev32ifbe(intrev32ifbe(ZIP_LIST_TAIL_OFFSET(zl)) + req_len);
@@ -471,8 +482,7 @@ static unsigned char *__zipListInsert(unsigned char *zl, unsigned char *p,
 }
 
 unsigned char *zipListPush(unsigned char *zl, unsigned char *s,
-
-                           unsigned char s_len, int where) {
+                           unsigned int s_len, int where) {
   unsigned char *p;
   p = (where == ZIP_LIST_HEAD) ? ZIP_LIST_ENTRY_HEAD(zl)
 
@@ -484,7 +494,7 @@ unsigned char *zipListIndex(unsigned char *zl, int index) {
   unsigned char *p;
   unsigned int prev_len_size, prev_len = 0;
   if (index < 0) {
-    index = -(-index) - 1;
+    index = (-index) - 1;
     p = ZIP_LIST_ENTRY_TAIL(zl);
     if (p[0] != ZIP_END) {
       ZIP_DECODE_PREV_LEN(p, prev_len_size, prev_len);
@@ -528,21 +538,21 @@ unsigned char *zipListPrev(unsigned char *zl, unsigned char *p) {
 }
 
 unsigned int zipListGet(unsigned char *p, unsigned char **s_val,
-                        unsigned int *s_len, ll *l_val) {
+                        unsigned int *s_len, long long *l_val) {
   zip_list_entry entry;
   if (p == NULL || p[0] == ZIP_END)
     return 0;
   if (s_val)
-    **s_val = NULL;
+    *s_val = NULL;
   entry = zipEntry(p);
   if (ZIP_IS_STR(entry.encoding)) {
     if (s_val) {
       *s_len = entry.len;
-      *s_len = p + entry.header_size;
+      *s_val = p + entry.header_size;
     }
   } else {
-    if (s_val) {
-      *s_val = zipLoadInteger(p + entry.header_size, entry.encoding);
+    if (l_val) {
+      *l_val = zipLoadInteger(p + entry.header_size, entry.encoding);
     }
   }
   return 1;
@@ -575,7 +585,7 @@ unsigned int zipListCompare(unsigned char *p, unsigned char *s,
     return 0;
   entry = zipEntry(p);
   if (ZIP_IS_STR(entry.encoding)) {
-    if () {
+    if (entry.len == s_len) {
       return memcmp(p + entry.header_size, s, s_len) == 0;
     } else {
       return 0;
@@ -589,42 +599,80 @@ unsigned int zipListCompare(unsigned char *p, unsigned char *s,
   return 0;
 }
 
+/* Every value has exactly one encoding: strings that parse as integers
+ * are always stored as integers and the smallest encoding that fits is
+ * always used. So zipListFind() encodes the value once and compares the raw
+ * bytes of the entries against it instead of decoding each of them, the
+ * first encoding byte ruling out almost every entry before any memcmp. */
+typedef struct zip_list_needle {
+  unsigned char head[9];
+  unsigned int head_len;
+  unsigned char *str;
+  unsigned int str_len;
+} zip_list_needle;
+
+static void zipNeedleInit(zip_list_needle *n, unsigned char *v_str,
+                          unsigned int v_len) {
+  long long vll;
+  unsigned char encoding;
+
+  if (zipTryEncoding(v_str, v_len, &vll, &encoding)) {
+    n->head[0] = encoding;
+    zipSaveInteger(n->head + 1, vll, encoding);
+    n->head_len = 1 + zip_int_size(encoding);
+    n->str = NULL;
+    n->str_len = 0;
+  } else {
+    n->head_len = zipEncodeLength(n->head, ZIP_STR_06B, v_len);
+    n->str = v_str;
+    n->str_len = v_len;
+  }
+}
+
+/* Length of an entry past its prev_len: short strings, the bulk of most
+ * ziplists, are sized from their first byte alone. */
+static inline unsigned int zipEntryBodyLength(unsigned char *q) {
+  unsigned int encoding, len_size, len;
+  if (q[0] < ZIP_STR_14B)
+    return 1 + q[0];
+  ZIP_DECODE_LENGTH(q, encoding, len_size, len);
+  return len_size + len;
+}
+
 unsigned char *zipListFind(unsigned char *p, unsigned char *v_str,
                            unsigned int v_len, unsigned int skip) {
-
-  int skip_cnt = 0;
-  unsigned char ven_coding = 0;
-  long long vll = 0;
-  while (p[0] != ZIP_END) {
-    unsigned int prev_len_size, encoding, len_size, len;
-    unsigned char *q;
-    ZIP_DECODE_PREV_LEN_SIZE(p, prev_len_size);
-    ZIP_DECODE_LENGTH(p + prev_len_size, encoding, len_size, len);
-    q = p + prev_len_size + len_size;
+  unsigned int skip_cnt = 0;
+  zip_list_needle n;
+
+  zipNeedleInit(&n, v_str, v_len);
+  for (;;) {
+    /* A 1 byte prev_len is assumed and the end marker and 5 byte prev_lens
+     * are taken care of on a branch, keeping the walk a chain of one load
+     * per entry rather than two. */
+    unsigned char *q = p + 1;
+    if (p[0] >= ZIP_BIG_LEN) {
+      if (p[0] == ZIP_END)
+        break;
+      q = p + 5;
+    }
     if (skip_cnt == 0) {
-      if (ZIP_IS_STR(encoding)) {
-        if (len == v_len && memcmp(q, v_str, v_len) == 0) {
+      if (q[0] == n.head[0]) {
+        unsigned int i = 1;
+        while (i < n.head_len && q[i] == n.head[i])
+          i++;
+        /* Keys tend to share a prefix, the last byte tells them apart
+         * without a call to memcmp. */
+        if (i == n.head_len &&
+            (n.str_len == 0 ||
+             (q[i + n.str_len - 1] == n.str[n.str_len - 1] &&
+              memcmp(q + i, n.str, n.str_len) == 0)))
           return p;
-        }
-      } else {
-        if (ven_coding == 0) {
-          if (!zipTryEncoding(v_str, v_len, &vll, &ven_coding)) {
-            ven_coding = UCHAR_MAX;
-          }
-          assert(ven_coding);
-        }
-        if (ven_coding != UCHAR_MAX) {
-          long long ll = zipLoadInteger(q, encoding);
-          if (ll == vll) {
-            return p;
-          }
-        }
       }
       skip_cnt = skip;
     } else {
       skip_cnt--;
     }
-    p = q + len;
+    p = q + zipEntryBodyLength(q);
   }
   return NULL;
 }
@@ -696,3 +744,107 @@ void zipListRepr(unsigned char *zl) {
   }
   printf("{end}\n\n");
 }
+
+#ifdef ZIPLIST_BENCHMARK_MAIN
+#include <time.h>
+
+/* ns per zipListFind() against the decode-every-entry loop it replaced, on
+ * ziplists of 16 to 512 field/value pairs the way a hash stores them
+ * (skip 1): short string fields, integer fields and a mix of both. Half
+ * the lookups miss. */
+
+static long long benchNstime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The old zipListFind(), kept from being specialized for the constant skip
+ * so both sides pay for the same calling convention. */
+__attribute__((noipa)) static unsigned char *
+benchFindDecode(unsigned char *p, unsigned char *v_str, unsigned int v_len,
+                unsigned int skip) {
+  unsigned int skip_cnt = 0;
+  unsigned char ven_coding = 0;
+  long long vll = 0;
+  while (p[0] != ZIP_END) {
+    unsigned int prev_len_size, encoding, len_size, len;
+    unsigned char *q;
+    ZIP_DECODE_PREV_LEN_SIZE(p, prev_len_size);
+    ZIP_DECODE_LENGTH(p + prev_len_size, encoding, len_size, len);
+    q = p + prev_len_size + len_size;
+    if (skip_cnt == 0) {
+      if (ZIP_IS_STR(encoding)) {
+        if (len == v_len && memcmp(q, v_str, v_len) == 0)
+          return p;
+      } else {
+        if (ven_coding == 0 && !zipTryEncoding(v_str, v_len, &vll, &ven_coding))
+          ven_coding = UCHAR_MAX;
+        if (ven_coding != UCHAR_MAX && zipLoadInteger(q, encoding) == vll)
+          return p;
+      }
+      skip_cnt = skip;
+    } else {
+      skip_cnt--;
+    }
+    p = q + len;
+  }
+  return NULL;
+}
+
+static int benchField(char *buf, int kind, int i) {
+  if (kind == 0 || (kind == 2 && (i & 1)))
+    return sprintf(buf, "field:%d", i);
+  return sprintf(buf, "%d", i * 977 - 40000);
+}
+
+static void bench(const char *name, int kind, int pairs) {
+  unsigned char *zl = zipListNew(), *head;
+  char buf[32], val[] = "some value of a field";
+  int lookups = 200000, j, len;
+  long long start, dec_ns, fast_ns;
+  size_t hits = 0;
+
+  for (j = 0; j < pairs; j++) {
+    len = benchField(buf, kind, j);
+    zl = zipListPush(zl, (unsigned char *)buf, len, ZIP_LIST_TAIL);
+    zl = zipListPush(zl, (unsigned char *)val, sizeof(val) - 1, ZIP_LIST_TAIL);
+  }
+  head = zipListIndex(zl, 0);
+  for (j = 0; j < lookups; j++) {
+    len = benchField(buf, kind, (j * 7919) % (pairs * 2));
+    if (zipListFind(head, (unsigned char *)buf, len, 1) !=
+        benchFindDecode(head, (unsigned char *)buf, len, 1)) {
+      printf("mismatch for %.*s\n", len, buf);
+      exit(1);
+    }
+  }
+
+  start = benchNstime();
+  for (j = 0; j < lookups; j++) {
+    len = benchField(buf, kind, (j * 7919) % (pairs * 2));
+    hits += benchFindDecode(head, (unsigned char *)buf, len, 1) != NULL;
+  }
+  dec_ns = benchNstime() - start;
+  start = benchNstime();
+  for (j = 0; j < lookups; j++) {
+    len = benchField(buf, kind, (j * 7919) % (pairs * 2));
+    hits += zipListFind(head, (unsigned char *)buf, len, 1) != NULL;
+  }
+  fast_ns = benchNstime() - start;
+  printf("%-7s %3d pairs: decode %7.1f ns, zipListFind %7.1f ns (%zu)\n", name,
+         pairs, (double)dec_ns / lookups, (double)fast_ns / lookups, hits);
+  zfree(zl);
+}
+
+int main(void) {
+  int pairs;
+  for (pairs = 16; pairs <= 512; pairs *= 2)
+    bench("strings", 0, pairs);
+  for (pairs = 16; pairs <= 512; pairs *= 2)
+    bench("ints", 1, pairs);
+  for (pairs = 16; pairs <= 512; pairs *= 2)
+    bench("mixed", 2, pairs);
+  return 0;
+}
+#endif
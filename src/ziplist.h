@@ -6,7 +6,7 @@
 unsigned char *zipListNew(void);
 
 unsigned char *zipListPush(unsigned char *zl, unsigned char *s,
-                           unsigned char s_len, int where);
+                           unsigned int s_len, int where);
 
 unsigned char *zipListIndex(unsigned char *zl, int index);
 
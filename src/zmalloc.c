@@ -7,45 +7,102 @@
 #include "zmalloc.h"
 
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "config.h"
 
-static size_t used_memory = 0;
-static int zmalloc_thread_safe = 0;
+/* Memory accounting is sharded per thread. Every thread that allocates
+ * gets its own cache line in used_memory_slots and updates it with plain
+ * relaxed stores, so the main thread, bio and the I/O threads never share
+ * a counter. A slot may go negative since memory is often freed by another
+ * thread than the one that allocated it; only the sum is meaningful.
+ * Threads beyond ZMALLOC_STAT_SLOTS, and the leftovers of exited threads,
+ * go to used_memory_shared with atomic adds. */
+#define ZMALLOC_STAT_SLOTS 64
+#define ZMALLOC_CACHE_LINE 64
+
+#define ZMALLOC_SLOT_FREE 0
+#define ZMALLOC_SLOT_OWNED 1
+#define ZMALLOC_SLOT_SHARED 2
+
+typedef struct zmallocStatSlot {
+  long used;
+  int state;
+  char pad[ZMALLOC_CACHE_LINE - sizeof(long) - sizeof(int)];
+} zmallocStatSlot;
+
+static zmallocStatSlot used_memory_slots[ZMALLOC_STAT_SLOTS]
+    __attribute__((aligned(ZMALLOC_CACHE_LINE)));
+static zmallocStatSlot used_memory_shared
+    __attribute__((aligned(ZMALLOC_CACHE_LINE))) = {0, ZMALLOC_SLOT_SHARED, {0}};
+static int used_memory_slots_used = 0;
+static __thread zmallocStatSlot *used_memory_slot = NULL;
+static pthread_key_t used_memory_key;
+static pthread_once_t used_memory_key_once = PTHREAD_ONCE_INIT;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void zlibc_free(void *ptr) { free(ptr); }
 
 #define PREFIX_SIZE (sizeof(size_t))
 
-#define update_zmalloc_stat_add(__n)          \
-  do {                                        \
-    pthread_mutex_lock(&used_memory_mutex);   \
-    used_memory += (__n);                     \
-    pthread_mutex_unlock(&used_memory_mutex); \
-  } while (0)
+/* Hands the slot of an exiting thread back, keeping its balance. */
+static void zmalloc_stat_release(void *arg) {
+  zmallocStatSlot *slot = arg;
+  pthread_mutex_lock(&used_memory_mutex);
+  __atomic_fetch_add(&used_memory_shared.used,
+                     __atomic_load_n(&slot->used, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->used, 0, __ATOMIC_RELAXED);
+  slot->state = ZMALLOC_SLOT_FREE;
+  used_memory_slot = &used_memory_shared;
+  pthread_mutex_unlock(&used_memory_mutex);
+}
 
-#define update_zmalloc_stat_sub(__n)          \
-  do {                                        \
-    pthread_mutex_lock(&used_memory_mutex);   \
-    used_memory -= (__n);                     \
-    pthread_mutex_unlock(&used_memory_mutex); \
-  } while (0)
+static void zmalloc_stat_key_init(void) {
+  pthread_key_create(&used_memory_key, zmalloc_stat_release);
+}
+
+static zmallocStatSlot *zmalloc_stat_register(void) {
+  zmallocStatSlot *slot = &used_memory_shared;
+  int j;
+  pthread_once(&used_memory_key_once, zmalloc_stat_key_init);
+  pthread_mutex_lock(&used_memory_mutex);
+  for (j = 0; j < ZMALLOC_STAT_SLOTS; j++) {
+    if (used_memory_slots[j].state != ZMALLOC_SLOT_FREE) continue;
+    slot = used_memory_slots + j;
+    slot->state = ZMALLOC_SLOT_OWNED;
+    if (j >= used_memory_slots_used)
+      __atomic_store_n(&used_memory_slots_used, j + 1, __ATOMIC_RELEASE);
+    break;
+  }
+  pthread_mutex_unlock(&used_memory_mutex);
+  if (slot != &used_memory_shared) pthread_setspecific(used_memory_key, slot);
+  used_memory_slot = slot;
+  return slot;
+}
+
+static inline void zmalloc_stat_update(long n) {
+  zmallocStatSlot *slot = used_memory_slot;
+  if (slot == NULL) slot = zmalloc_stat_register();
+  if (slot->state == ZMALLOC_SLOT_OWNED)
+    __atomic_store_n(&slot->used, slot->used + n, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&slot->used, n, __ATOMIC_RELAXED);
+}
 
 #define update_zmalloc_stat_alloc(__n)                \
   do {                                                \
     size_t _n = (__n);                                \
     if (_n & (sizeof(long) - 1)) {                    \
       _n += sizeof(long) - (_n & (sizeof(long) - 1)); \
-      if (zmalloc_thread_safe) {                      \
-        update_zmalloc_stat_add(_n);                  \
-      } else {                                        \
-        used_memory += _n;                            \
-      }                                               \
     }                                                 \
+    zmalloc_stat_update((long)_n);                    \
   } while (0)
 
 #define update_zmalloc_stat_free(__n)                 \
@@ -54,13 +111,198 @@ void zlibc_free(void *ptr) { free(ptr); }
     if (_n & (sizeof(long) - 1)) {                    \
       _n += sizeof(long) - (_n & (sizeof(long) - 1)); \
     }                                                 \
-    if (zmalloc_thread_safe) {                        \
-      update_zmalloc_stat_sub(_n);                    \
-    } else {                                          \
-      used_memory -= _n;                              \
-    }                                                 \
+    zmalloc_stat_update(-(long)_n);                   \
   } while (0)
 
+/* Size-class slabs for the small allocations made on every key insert:
+ * dict entries, objects and short sds strings. Slots carry no malloc
+ * bookkeeping and objects of one size share 64k pages instead of being
+ * spread over the malloc size classes. All pages come from one address
+ * range reserved by zmalloc_slab_set_reserve(), so zfree(), zre_alloc()
+ * and zmalloc_size() recognize a slab pointer with a range check, and
+ * read its size from the header of its page. Every page keeps its own
+ * free list and count of live slots; a class allocates from its pages
+ * that have room, and a page whose last slot is freed is handed back to
+ * the system with madvise() and reused by whichever class grows next. */
+#define ZMALLOC_SLAB_MAX 128
+#define ZMALLOC_SLAB_CLASSES (ZMALLOC_SLAB_MAX / 8)
+#define ZMALLOC_SLAB_PAGE (64 * 1024)
+
+typedef struct zmallocSlabPage {
+  size_t size; /* Must come first, see zmalloc_slab_size(). */
+  unsigned int live;
+  void *free;
+  char *next;
+  struct zmallocSlabPage *prev, *succ;
+} zmallocSlabPage;
+
+typedef struct zmallocSlabClass {
+  int lock;
+  zmallocSlabPage *avail;
+  char pad[ZMALLOC_CACHE_LINE - sizeof(int) - sizeof(void *)];
+} zmallocSlabClass;
+
+static zmallocSlabClass slab_classes[ZMALLOC_SLAB_CLASSES]
+    __attribute__((aligned(ZMALLOC_CACHE_LINE)));
+static uintptr_t slab_base = 0;
+static size_t slab_size = 0, slab_pages_used = 0;
+static zmallocSlabPage *slab_empty_pages = NULL;
+static size_t slab_pages_released = 0;
+static int slab_empty_lock = 0;
+
+#define zmalloc_is_slab(p) ((uintptr_t)(p) - slab_base < slab_size)
+#define zmalloc_slab_page(p) \
+  ((zmallocSlabPage *)((uintptr_t)(p) & ~(uintptr_t)(ZMALLOC_SLAB_PAGE - 1)))
+#define zmalloc_slab_size(p) (zmalloc_slab_page(p)->size)
+#define zmalloc_slab_full(pg) \
+  ((pg)->free == NULL && (pg)->next + (pg)->size > (char *)(pg) + ZMALLOC_SLAB_PAGE)
+
+/* Reserves the address range of the slabs, pages being mapped as needed.
+ * Meant to be called once at startup, when maxmemory is known: the range
+ * is twice maxmemory, leaving room for partly used pages, or the size of
+ * physical memory when there is no limit. Until then, and once the range
+ * is used up, zmalloc_slab() falls back to zmalloc(). */
+void zmalloc_slab_set_reserve(size_t maxmemory) {
+  size_t size = maxmemory * 2;
+  void *p;
+  if (slab_size != 0) return;
+  if (maxmemory == 0)
+    size = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  size = (size + ZMALLOC_SLAB_PAGE - 1) & ~(size_t)(ZMALLOC_SLAB_PAGE - 1);
+  if (size == 0) return;
+  p = mmap(NULL, size + ZMALLOC_SLAB_PAGE, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return;
+  slab_base = ((uintptr_t)p + ZMALLOC_SLAB_PAGE - 1) &
+              ~(uintptr_t)(ZMALLOC_SLAB_PAGE - 1);
+  slab_size = size;
+}
+
+static void zmalloc_slab_lock(int *lock) {
+  while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(lock, __ATOMIC_RELAXED)) sched_yield();
+}
+
+static void zmalloc_slab_unlock(int *lock) {
+  __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+static void zmalloc_slab_link(zmallocSlabClass *c, zmallocSlabPage *pg) {
+  pg->prev = NULL;
+  pg->succ = c->avail;
+  if (c->avail) c->avail->prev = pg;
+  c->avail = pg;
+}
+
+static void zmalloc_slab_unlink(zmallocSlabClass *c, zmallocSlabPage *pg) {
+  if (pg->prev)
+    pg->prev->succ = pg->succ;
+  else
+    c->avail = pg->succ;
+  if (pg->succ) pg->succ->prev = pg->prev;
+}
+
+/* A released page first, then a fresh one from the reserved range. */
+static zmallocSlabPage *zmalloc_slab_grow(size_t size) {
+  zmallocSlabPage *pg;
+  size_t off;
+  zmalloc_slab_lock(&slab_empty_lock);
+  pg = slab_empty_pages;
+  if (pg) {
+    slab_empty_pages = pg->succ;
+    slab_pages_released--;
+  }
+  zmalloc_slab_unlock(&slab_empty_lock);
+  if (pg == NULL) {
+    off = __atomic_fetch_add(&slab_pages_used, ZMALLOC_SLAB_PAGE,
+                             __ATOMIC_RELAXED);
+    if (off >= slab_size) return NULL;
+    pg = (zmallocSlabPage *)(slab_base + off);
+    if (mprotect(pg, ZMALLOC_SLAB_PAGE, PROT_READ | PROT_WRITE) == -1)
+      return NULL;
+  }
+  pg->size = size;
+  pg->live = 0;
+  pg->free = NULL;
+  pg->next = (char *)pg + ZMALLOC_CACHE_LINE;
+  return pg;
+}
+
+/* The physical pages go back to the system; only the header is touched
+ * again, to link the page on the empty list. */
+static void zmalloc_slab_release(zmallocSlabPage *pg) {
+  madvise(pg, ZMALLOC_SLAB_PAGE, MADV_DONTNEED);
+  zmalloc_slab_lock(&slab_empty_lock);
+  pg->succ = slab_empty_pages;
+  slab_empty_pages = pg;
+  slab_pages_released++;
+  zmalloc_slab_unlock(&slab_empty_lock);
+}
+
+/* Falls back to zmalloc() above ZMALLOC_SLAB_MAX bytes, or when there is
+ * no reserved range or it is used up. */
+void *zmalloc_slab(size_t size) {
+  zmallocSlabClass *c;
+  zmallocSlabPage *pg;
+  void *ptr = NULL;
+  if (size == 0 || size > ZMALLOC_SLAB_MAX || slab_size == 0)
+    return zmalloc(size);
+  size = (size + 7) & ~(size_t)7;
+  c = slab_classes + size / 8 - 1;
+  zmalloc_slab_lock(&c->lock);
+  pg = c->avail;
+  if (pg == NULL && (pg = zmalloc_slab_grow(size)) != NULL)
+    zmalloc_slab_link(c, pg);
+  if (pg) {
+    if (pg->free) {
+      ptr = pg->free;
+      pg->free = *(void **)ptr;
+    } else {
+      ptr = pg->next;
+      pg->next += size;
+    }
+    pg->live++;
+    if (zmalloc_slab_full(pg)) zmalloc_slab_unlink(c, pg);
+  }
+  zmalloc_slab_unlock(&c->lock);
+  if (ptr == NULL) return zmalloc(size);
+  zmalloc_stat_update((long)size);
+  return ptr;
+}
+
+/* A page that empties is released unless it is the only page of its
+ * class with room, so that a class going back and forth over a page
+ * boundary does not map and release the same page on every call. */
+static void zfree_slab(void *ptr) {
+  zmallocSlabPage *pg = zmalloc_slab_page(ptr);
+  zmallocSlabClass *c = slab_classes + pg->size / 8 - 1;
+  int release = 0;
+  zmalloc_stat_update(-(long)pg->size);
+  zmalloc_slab_lock(&c->lock);
+  if (zmalloc_slab_full(pg)) zmalloc_slab_link(c, pg);
+  *(void **)ptr = pg->free;
+  pg->free = ptr;
+  if (--pg->live == 0 && (pg->prev || pg->succ)) {
+    zmalloc_slab_unlink(c, pg);
+    release = 1;
+  }
+  zmalloc_slab_unlock(&c->lock);
+  if (release) zmalloc_slab_release(pg);
+}
+
+/* Bytes of slab pages currently mapped. */
+size_t zmalloc_slab_resident(void) {
+  size_t used = __atomic_load_n(&slab_pages_used, __ATOMIC_RELAXED);
+  if (used > slab_size) used = slab_size;
+  return used - __atomic_load_n(&slab_pages_released, __ATOMIC_RELAXED) *
+                    ZMALLOC_SLAB_PAGE;
+}
+
+size_t zmalloc_size(void *ptr) {
+  if (zmalloc_is_slab(ptr)) return zmalloc_slab_size(ptr);
+  return je_malloc_usable_size(ptr);
+}
+
 static void zmalloc_default_oom(size_t size) {
   fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
           size);
@@ -89,6 +331,14 @@ void *zre_alloc(void *ptr, size_t size) {
   size_t old_size;
   void *new_ptr;
   if (ptr == NULL) return zmalloc(size);
+  if (zmalloc_is_slab(ptr)) {
+    old_size = zmalloc_slab_size(ptr);
+    if (size <= old_size) return ptr;
+    new_ptr = zmalloc(size);
+    memcpy(new_ptr, ptr, old_size);
+    zfree_slab(ptr);
+    return new_ptr;
+  }
   old_size = zmalloc_size(ptr);
   new_ptr = realloc(ptr, size);
   if (!new_ptr) zmalloc_oom_handler(size);
@@ -99,6 +349,10 @@ void *zre_alloc(void *ptr, size_t size) {
 
 void zfree(void *ptr) {
   if (ptr == NULL) return;
+  if (zmalloc_is_slab(ptr)) {
+    zfree_slab(ptr);
+    return;
+  }
   update_zmalloc_stat_free(zmalloc_size(ptr));
   free(ptr);
 }
@@ -110,19 +364,20 @@ char *z_str_dup(const char *s) {
   return p;
 }
 
+/* Sums the slots without locking. The result always includes every
+ * allocation made by the calling thread; updates of other threads are
+ * read with relaxed loads, so it may lag behind by the allocations they
+ * are doing concurrently, and is exact whenever they are quiescent. */
 size_t zmalloc_used_memory(void) {
-  size_t um;
-  if (zmalloc_thread_safe) {
-    pthread_mutex_lock(&used_memory_mutex);
-    um = used_memory;
-    pthread_mutex_unlock(&used_memory_mutex);
-  } else {
-    um = used_memory;
-  }
-  return um;
+  int j, slots = __atomic_load_n(&used_memory_slots_used, __ATOMIC_ACQUIRE);
+  long um = __atomic_load_n(&used_memory_shared.used, __ATOMIC_RELAXED);
+  for (j = 0; j < slots; j++)
+    um += __atomic_load_n(&used_memory_slots[j].used, __ATOMIC_RELAXED);
+  return um < 0 ? 0 : (size_t)um;
 }
 
-void zmalloc_enable_thread_safeness(void) { zmalloc_thread_safe = 1; }
+/* Accounting is always thread safe, kept for the callers. */
+void zmalloc_enable_thread_safeness(void) {}
 
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
   zmalloc_oom_handler = oom_handler;
@@ -197,4 +452,100 @@ size_t zmalloc_get_private_dirty(void) {
   return zmalloc_get_smap_bytes_by_field("Private_Dirty:");
 }
 
+#ifdef ZMALLOC_BENCHMARK_MAIN
+#include <sys/time.h>
+
+/* Allocation throughput with N threads allocating and freeing, the main
+ * thread polling zmalloc_used_memory() meanwhile like the maxmemory check. */
+#define ZMALLOC_BENCH_BATCH 64
+
+static long long zmalloc_bench_ops;
+static volatile int zmalloc_bench_done;
+
+static void *zmalloc_bench_thread(void *arg) {
+  void *p[ZMALLOC_BENCH_BATCH];
+  long long i;
+  int j;
+  (void)arg;
+  for (i = 0; i < zmalloc_bench_ops; i += ZMALLOC_BENCH_BATCH) {
+    for (j = 0; j < ZMALLOC_BENCH_BATCH; j++) p[j] = zmalloc(16 + j * 8);
+    for (j = 0; j < ZMALLOC_BENCH_BATCH; j++) zfree(p[j]);
+  }
+  return NULL;
+}
+
+/* The allocations of a SET of a new key: dict entry, key sds, value
+ * object and value sds, with or without the slabs. */
+static int zmalloc_bench_keys(long long keys, int slab) {
+  void *(*alloc)(size_t) = slab ? zmalloc_slab : zmalloc;
+  void **entries = malloc(sizeof(void *) * keys * 4);
+  struct timeval start, end;
+  long long j;
+  double secs;
+  size_t used, rss;
+  gettimeofday(&start, NULL);
+  for (j = 0; j < keys; j++) {
+    char key[32];
+    int len = snprintf(key, sizeof(key), "key:%012lld", j);
+    entries[j * 4] = memset(alloc(32), 0, 32);
+    entries[j * 4 + 1] = memcpy(alloc(8 + len + 1), key, len + 1);
+    entries[j * 4 + 2] = memset(alloc(16), 0, 16);
+    entries[j * 4 + 3] = memcpy(alloc(8 + 3 + 1), "xxxxxxxxxxx", 12);
+  }
+  gettimeofday(&end, NULL);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  used = zmalloc_used_memory();
+  /* The entries array itself is not part of the measurement. */
+  rss = zmalloc_get_rss() - keys * 4 * sizeof(void *);
+  printf("%s: %lld keys in %.2fs, used_memory %zu MB, rss %zu MB, "
+         "fragmentation ratio %.2f\n",
+         slab ? "slab" : "malloc", keys, secs, used >> 20, rss >> 20,
+         zmalloc_get_fragmentation_ratio(rss));
+  /* Every other key deleted, then the rest: the first half leaves the
+   * pages half full, the second one empties them. */
+  for (j = 0; j < keys * 4; j++)
+    if ((j / 4) % 2 == 0) zfree(entries[j]);
+  printf("%s: half deleted, slab pages %zu MB, rss %zu MB\n",
+         slab ? "slab" : "malloc", zmalloc_slab_resident() >> 20,
+         (zmalloc_get_rss() - keys * 4 * sizeof(void *)) >> 20);
+  for (j = 0; j < keys * 4; j++)
+    if ((j / 4) % 2 == 1) zfree(entries[j]);
+  printf("%s: all deleted, slab pages %zu MB, rss %zu MB\n",
+         slab ? "slab" : "malloc", zmalloc_slab_resident() >> 20,
+         (zmalloc_get_rss() - keys * 4 * sizeof(void *)) >> 20);
+  free(entries);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4, j;
+  pthread_t tid[ZMALLOC_STAT_SLOTS * 2];
+  size_t base = zmalloc_used_memory(), polls = 0;
+  struct timeval start, end;
+  double secs;
+  zmalloc_bench_ops = argc > 2 ? atoll(argv[2]) : 10000000;
+  if (argc > 1 && !strcmp(argv[1], "keys")) {
+    if (argc > 3 && !strcmp(argv[3], "slab")) zmalloc_slab_set_reserve(0);
+    return zmalloc_bench_keys(zmalloc_bench_ops, argc > 3 && !strcmp(argv[3], "slab"));
+  }
+  if (threads > ZMALLOC_STAT_SLOTS * 2) threads = ZMALLOC_STAT_SLOTS * 2;
+  gettimeofday(&start, NULL);
+  for (j = 0; j < threads; j++)
+    pthread_create(&tid[j], NULL, zmalloc_bench_thread, NULL);
+  for (j = 0; j < threads; j++) {
+    while (pthread_tryjoin_np(tid[j], NULL) != 0) {
+      zmalloc_used_memory();
+      polls++;
+    }
+  }
+  gettimeofday(&end, NULL);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  printf("%d threads: %.1f ns per zmalloc+zfree, %zu stat reads, "
+         "used_memory %s\n",
+         threads, secs * 1e9 / ((double)zmalloc_bench_ops * threads), polls,
+         zmalloc_used_memory() == base ? "balanced" : "LEAKED");
+  return 0;
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -9,6 +9,12 @@ void *zmalloc(size_t size);
 
 void *zcalloc(size_t size);
 
+void *zmalloc_slab(size_t size);
+
+void zmalloc_slab_set_reserve(size_t maxmemory);
+
+size_t zmalloc_slab_resident(void);
+
 void *zre_alloc(void *ptr, size_t size);
 
 void zfree(void *ptr);
@@ -31,6 +37,6 @@ size_t zmalloc_get_smap_bytes_by_field(char *field);
 
 void zlibc_free(void *ptr);
 
-#define zmalloc_size(p) je_malloc_usable_size(p)
+size_t zmalloc_size(void *ptr);
 
 #endif